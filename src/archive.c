@@ -0,0 +1,465 @@
+#include "archive.h"
+
+#include "debug.h"
+#include "fs.h"
+#include "heap.h"
+#include "parallel.h"
+#include "lz4/lz4frame.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+enum
+{
+	k_pack_max_path = 1024,
+	k_pack_initial_capacity = 64,
+};
+
+// One file on its way into an archive.
+typedef struct pack_file_t
+{
+	// Where the file was found, and the path it is stored under.
+	char* source;
+	char* path;
+	uint64_t hash;
+	fs_work_t* read;
+	const char* data;
+	size_t size;
+	// Points at data when the entry is stored raw.
+	char* stored;
+	size_t stored_size;
+	bool compressed;
+	uint64_t offset;
+	uint32_t name_offset;
+} pack_file_t;
+
+typedef struct pack_t
+{
+	heap_t* heap;
+	pack_file_t* files;
+	int count;
+	int capacity;
+	int compression_level;
+	bool failed;
+} pack_t;
+
+static const char* skip_path_prefix(const char* path)
+{
+	while (true)
+	{
+		if (path[0] == '.' && (path[1] == '/' || path[1] == '\\'))
+		{
+			path += 2;
+		}
+		else if (path[0] == '/' || path[0] == '\\')
+		{
+			path += 1;
+		}
+		else
+		{
+			return path;
+		}
+	}
+}
+
+static char normalize_path_char(char c)
+{
+	return c == '\\' ? '/' : c;
+}
+
+uint64_t archive_hash_path(const char* path)
+{
+	// FNV-1a, 64-bit.
+	uint64_t hash = 0xcbf29ce484222325ull;
+	for (const char* c = skip_path_prefix(path); *c; ++c)
+	{
+		hash ^= (uint8_t)normalize_path_char(*c);
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+static bool path_equal(const char* stored, const char* path)
+{
+	path = skip_path_prefix(path);
+	while (*stored && normalize_path_char(*path) == *stored)
+	{
+		++stored;
+		++path;
+	}
+	return *stored == 0 && *path == 0;
+}
+
+bool archive_is_valid(const void* data, size_t size)
+{
+	const archive_header_t* header = data;
+	if (size < sizeof(archive_header_t) || header->magic != k_archive_magic || header->version != k_archive_version)
+	{
+		return false;
+	}
+	if (header->entry_count == 0)
+	{
+		return true;
+	}
+	// The table is read in place, so it must be aligned for its 64-bit fields.
+	if (header->entries_offset % sizeof(uint64_t) != 0 ||
+		header->entries_offset > size || (size - header->entries_offset) / sizeof(archive_entry_t) < header->entry_count ||
+		header->strings_offset > size || size - header->strings_offset < header->strings_size ||
+		header->strings_size == 0 || ((const char*)data)[header->strings_offset + header->strings_size - 1] != 0)
+	{
+		return false;
+	}
+
+	const archive_entry_t* entries = (const archive_entry_t*)((const char*)data + header->entries_offset);
+	for (uint32_t i = 0; i < header->entry_count; ++i)
+	{
+		if (entries[i].offset > size || size - entries[i].offset < entries[i].stored_size ||
+			entries[i].name_offset >= header->strings_size ||
+			(i > 0 && entries[i - 1].hash > entries[i].hash))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+const archive_entry_t* archive_find(const void* data, const char* path)
+{
+	const archive_header_t* header = data;
+	const archive_entry_t* entries = (const archive_entry_t*)((const char*)data + header->entries_offset);
+	uint64_t hash = archive_hash_path(path);
+
+	// Lower bound on the hash, then check names in case two paths share it.
+	uint32_t low = 0;
+	uint32_t high = header->entry_count;
+	while (low < high)
+	{
+		uint32_t mid = low + (high - low) / 2;
+		if (entries[mid].hash < hash)
+		{
+			low = mid + 1;
+		}
+		else
+		{
+			high = mid;
+		}
+	}
+	for (uint32_t i = low; i < header->entry_count && entries[i].hash == hash; ++i)
+	{
+		if (path_equal(archive_entry_name(data, &entries[i]), path))
+		{
+			return &entries[i];
+		}
+	}
+	return NULL;
+}
+
+const char* archive_entry_name(const void* data, const archive_entry_t* entry)
+{
+	const archive_header_t* header = data;
+	return (const char*)data + header->strings_offset + entry->name_offset;
+}
+
+static void pack_add_file(pack_t* pack, const char* path)
+{
+	if (pack->count == pack->capacity)
+	{
+		int capacity = pack->capacity ? pack->capacity * 2 : k_pack_initial_capacity;
+		pack_file_t* files = heap_alloc(pack->heap, capacity * sizeof(pack_file_t), 8);
+		if (pack->files)
+		{
+			memcpy(files, pack->files, pack->count * sizeof(pack_file_t));
+			heap_free(pack->heap, pack->files);
+		}
+		pack->files = files;
+		pack->capacity = capacity;
+	}
+
+	pack_file_t* file = &pack->files[pack->count++];
+	memset(file, 0, sizeof(*file));
+	file->source = heap_alloc(pack->heap, strlen(path) + 1, 8);
+	memcpy(file->source, path, strlen(path) + 1);
+	const char* stored_path = skip_path_prefix(path);
+	size_t length = strlen(stored_path);
+	file->path = heap_alloc(pack->heap, length + 1, 8);
+	for (size_t i = 0; i <= length; ++i)
+	{
+		file->path[i] = normalize_path_char(stored_path[i]);
+	}
+	file->hash = archive_hash_path(file->path);
+}
+
+#if defined(_WIN32)
+
+static void pack_add_directory(pack_t* pack, const char* directory)
+{
+	char pattern[k_pack_max_path];
+	snprintf(pattern, sizeof(pattern), "%s/*", directory);
+	wchar_t wide_pattern[k_pack_max_path];
+	if (MultiByteToWideChar(CP_UTF8, 0, pattern, -1, wide_pattern, k_pack_max_path) <= 0)
+	{
+		pack->failed = true;
+		return;
+	}
+
+	WIN32_FIND_DATAW find_data;
+	HANDLE find = FindFirstFileW(wide_pattern, &find_data);
+	if (find == INVALID_HANDLE_VALUE)
+	{
+		debug_print(k_print_error, "Unable to read directory %s\n", directory);
+		pack->failed = true;
+		return;
+	}
+	do
+	{
+		char name[k_pack_max_path];
+		WideCharToMultiByte(CP_UTF8, 0, find_data.cFileName, -1, name, sizeof(name), NULL, NULL);
+		if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+		{
+			continue;
+		}
+		char path[k_pack_max_path];
+		snprintf(path, sizeof(path), "%s/%s", directory, name);
+		if (find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+		{
+			pack_add_directory(pack, path);
+		}
+		else
+		{
+			pack_add_file(pack, path);
+		}
+	} while (FindNextFileW(find, &find_data));
+	FindClose(find);
+}
+
+#else
+
+static void pack_add_directory(pack_t* pack, const char* directory)
+{
+	DIR* dir = opendir(directory);
+	if (dir == NULL)
+	{
+		debug_print(k_print_error, "Unable to read directory %s\n", directory);
+		pack->failed = true;
+		return;
+	}
+	struct dirent* item;
+	while ((item = readdir(dir)) != NULL)
+	{
+		if (strcmp(item->d_name, ".") == 0 || strcmp(item->d_name, "..") == 0)
+		{
+			continue;
+		}
+		char path[k_pack_max_path];
+		snprintf(path, sizeof(path), "%s/%s", directory, item->d_name);
+		struct stat st;
+		if (stat(path, &st) != 0)
+		{
+			continue;
+		}
+		if (S_ISDIR(st.st_mode))
+		{
+			pack_add_directory(pack, path);
+		}
+		else if (S_ISREG(st.st_mode))
+		{
+			pack_add_file(pack, path);
+		}
+	}
+	closedir(dir);
+}
+
+#endif
+
+// Compresses files [begin, end), keeping each one raw unless it shrinks by at least an eighth.
+static void pack_compress(void* user, int begin, int end)
+{
+	pack_t* pack = user;
+	for (int i = begin; i < end; ++i)
+	{
+		pack_file_t* file = &pack->files[i];
+		file->stored = (char*)file->data;
+		file->stored_size = file->size;
+		file->compressed = false;
+		if (pack->compression_level <= k_fs_compression_none || file->size == 0)
+		{
+			continue;
+		}
+
+		// Independent blocks with a known content size, so whole-entry reads decode blocks in
+		// parallel like fs_write's files. Unlike those there is no seek table: entries are
+		// only ever decoded whole.
+		LZ4F_preferences_t prefs;
+		memset(&prefs, 0, sizeof(prefs));
+		prefs.frameInfo.blockSizeID = LZ4F_max64KB;
+		prefs.frameInfo.blockMode = LZ4F_blockIndependent;
+		prefs.frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+		prefs.frameInfo.blockChecksumFlag = LZ4F_blockChecksumEnabled;
+		prefs.frameInfo.contentSize = file->size;
+		prefs.compressionLevel = pack->compression_level;
+
+		size_t capacity = LZ4F_compressFrameBound(file->size, &prefs);
+		char* compressed = heap_alloc(pack->heap, capacity, 8);
+		size_t size = LZ4F_compressFrame(compressed, capacity, file->data, file->size, &prefs);
+		if (!LZ4F_isError(size) && size <= file->size - file->size / 8)
+		{
+			file->stored = compressed;
+			file->stored_size = size;
+			file->compressed = true;
+		}
+		else
+		{
+			heap_free(pack->heap, compressed);
+		}
+	}
+}
+
+static int pack_file_compare(const void* a, const void* b)
+{
+	const pack_file_t* file_a = a;
+	const pack_file_t* file_b = b;
+	if (file_a->hash != file_b->hash)
+	{
+		return file_a->hash < file_b->hash ? -1 : 1;
+	}
+	return strcmp(file_a->path, file_b->path);
+}
+
+static uint64_t align_up(uint64_t value)
+{
+	return (value + k_archive_alignment - 1) & ~(uint64_t)(k_archive_alignment - 1);
+}
+
+// Lays out and writes the archive. Returns false if the write failed.
+static bool pack_write(pack_t* pack, fs_t* fs, const char* output_path)
+{
+	qsort(pack->files, pack->count, sizeof(pack_file_t), pack_file_compare);
+
+	uint64_t strings_size = 0;
+	for (int i = 0; i < pack->count; ++i)
+	{
+		pack->files[i].name_offset = (uint32_t)strings_size;
+		strings_size += strlen(pack->files[i].path) + 1;
+	}
+
+	archive_header_t header;
+	memset(&header, 0, sizeof(header));
+	header.magic = k_archive_magic;
+	header.version = k_archive_version;
+	header.entry_count = (uint32_t)pack->count;
+	header.strings_size = (uint32_t)strings_size;
+	header.entries_offset = sizeof(archive_header_t);
+	header.strings_offset = header.entries_offset + pack->count * sizeof(archive_entry_t);
+
+	uint64_t size = align_up(header.strings_offset + strings_size);
+	for (int i = 0; i < pack->count; ++i)
+	{
+		pack->files[i].offset = size;
+		size = align_up(size + pack->files[i].stored_size);
+	}
+
+	char* buffer = heap_alloc(pack->heap, size, k_archive_alignment);
+	memset(buffer, 0, size);
+	memcpy(buffer, &header, sizeof(header));
+	archive_entry_t* entries = (archive_entry_t*)(buffer + header.entries_offset);
+	for (int i = 0; i < pack->count; ++i)
+	{
+		pack_file_t* file = &pack->files[i];
+		entries[i].hash = file->hash;
+		entries[i].offset = file->offset;
+		entries[i].stored_size = file->stored_size;
+		entries[i].size = file->size;
+		entries[i].name_offset = file->name_offset;
+		entries[i].flags = file->compressed ? k_archive_entry_compressed : 0;
+		memcpy(buffer + header.strings_offset + file->name_offset, file->path, strlen(file->path) + 1);
+		memcpy(buffer + file->offset, file->stored, file->stored_size);
+	}
+
+	fs_work_t* work = fs_write(fs, output_path, buffer, size, false);
+	bool written = fs_work_get_result(work) == 0;
+	fs_work_destroy(work);
+	heap_free(pack->heap, buffer);
+	if (!written)
+	{
+		debug_print(k_print_error, "Unable to write archive %s\n", output_path);
+		return false;
+	}
+
+	uint64_t input_size = 0;
+	int compressed_count = 0;
+	for (int i = 0; i < pack->count; ++i)
+	{
+		input_size += pack->files[i].size;
+		compressed_count += pack->files[i].compressed ? 1 : 0;
+	}
+	debug_print(k_print_info, "Packed %d files (%d compressed), %llu bytes into %s, %llu bytes\n",
+		pack->count, compressed_count, (unsigned long long)input_size, output_path, (unsigned long long)size);
+	return true;
+}
+
+bool archive_pack(heap_t* heap, fs_t* fs, const char* output_path, const char* const* directories, int directory_count, int compression_level)
+{
+	pack_t pack;
+	memset(&pack, 0, sizeof(pack));
+	pack.heap = heap;
+	pack.compression_level = compression_level;
+	for (int i = 0; i < directory_count; ++i)
+	{
+		pack_add_directory(&pack, directories[i]);
+	}
+
+	// Queue every read up front so the file system overlaps them.
+	for (int i = 0; i < pack.count; ++i)
+	{
+		pack.files[i].read = fs_read(fs, pack.files[i].source, heap, false, false);
+	}
+	for (int i = 0; i < pack.count; ++i)
+	{
+		pack_file_t* file = &pack.files[i];
+		if (fs_work_get_result(file->read) != 0)
+		{
+			debug_print(k_print_error, "Unable to read %s\n", file->source);
+			pack.failed = true;
+		}
+		file->data = fs_work_get_buffer(file->read);
+		file->size = fs_work_get_size(file->read);
+	}
+
+	if (!pack.failed)
+	{
+		parallel_t* pool = parallel_create(heap, 0);
+		parallel_for(pool, 0, pack.count, 1, pack_compress, &pack);
+		parallel_destroy(pool);
+		pack.failed = !pack_write(&pack, fs, output_path);
+	}
+
+	for (int i = 0; i < pack.count; ++i)
+	{
+		pack_file_t* file = &pack.files[i];
+		if (file->stored && file->stored != file->data)
+		{
+			heap_free(heap, file->stored);
+		}
+		if (file->data)
+		{
+			heap_free(heap, (void*)file->data);
+		}
+		fs_work_destroy(file->read);
+		heap_free(heap, file->source);
+		heap_free(heap, file->path);
+	}
+	if (pack.files)
+	{
+		heap_free(heap, pack.files);
+	}
+	return !pack.failed;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Packed asset archive.
+// One file holding many assets: a header, a table of contents sorted by path hash, the path
+// strings, then the data of each entry starting on a 4 KB boundary. Entries are stored raw or
+// as an LZ4 frame of independent blocks, without the seek table of fs_write's compressed
+// files. Archives are mapped, not read: the table is searched in place and entry data is
+// decoded or copied straight out of the mapping.
+// All values are little-endian.
+
+typedef struct fs_t fs_t;
+typedef struct heap_t heap_t;
+
+enum
+{
+	k_archive_magic = 0x52414147, // "GAAR"
+	k_archive_version = 1,
+	// Entry data starts on page boundaries so mapped entries never share a page.
+	k_archive_alignment = 4096,
+};
+
+typedef enum archive_entry_flags_t
+{
+	// Data is an LZ4 frame; size is the decompressed size.
+	k_archive_entry_compressed = 1 << 0,
+} archive_entry_flags_t;
+
+typedef struct archive_header_t
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t entry_count;
+	uint32_t strings_size;
+	uint64_t entries_offset;
+	uint64_t strings_offset;
+} archive_header_t;
+
+typedef struct archive_entry_t
+{
+	// archive_hash_path of the entry's path; entries are sorted by this.
+	uint64_t hash;
+	uint64_t offset;
+	uint64_t stored_size;
+	uint64_t size;
+	// Offset of the NUL-terminated path in the string table.
+	uint32_t name_offset;
+	uint32_t flags;
+} archive_entry_t;
+
+// Hash a path as it is stored in an archive.
+// Backslashes count as forward slashes and leading "./" and "/" are ignored, so
+// "./LuaGame\main.lua" and "LuaGame/main.lua" hash the same. Paths are case sensitive.
+uint64_t archive_hash_path(const char* path);
+
+// Check that a mapped archive's header, table and entries all lie inside it.
+bool archive_is_valid(const void* data, size_t size);
+
+// Find the entry for a path in a valid archive.
+// Returns NULL if the archive does not contain it.
+const archive_entry_t* archive_find(const void* data, const char* path);
+
+// Get the stored path of an entry.
+const char* archive_entry_name(const void* data, const archive_entry_t* entry);
+
+// Build an archive at output_path from every file under the given directories.
+// Each file is stored under its path as reached from the working directory, e.g.
+// packing "shaders" stores "shaders/triangle.vert.spv", so fs_read of the same path
+// resolves into the archive once it is mounted.
+// Entries are compressed at compression_level (see fs_compression_level_t) and kept raw
+// when that does not save at least an eighth.
+// Returns false if any file could not be read or the archive could not be written.
+bool archive_pack(heap_t* heap, fs_t* fs, const char* output_path, const char* const* directories, int directory_count, int compression_level);
@@ -1,29 +1,385 @@
 #include "atomic.h"
 
+#if defined(_WIN32)
+
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
+#include <intrin.h>
+
+int atomic_increment(int* address)
+{
+	return InterlockedIncrement((volatile LONG*)address) - 1;
+}
+
+int atomic_decrement(int* address)
+{
+	return InterlockedDecrement((volatile LONG*)address) + 1;
+}
+
+int atomic_add(int* address, int value)
+{
+	return InterlockedExchangeAdd((volatile LONG*)address, value);
+}
+
+int atomic_swap(int* address, int value)
+{
+	return InterlockedExchange((volatile LONG*)address, value);
+}
+
+int atomic_compare_and_exchange(int* dest, int compare, int exchange)
+{
+	return InterlockedCompareExchange((volatile LONG*)dest, exchange, compare);
+}
+
+int atomic_load(int* address)
+{
+	return ReadAcquire((const volatile LONG*)address);
+}
+
+void atomic_store(int* address, int value)
+{
+	WriteRelease((volatile LONG*)address, value);
+}
+
+int atomic_load_relaxed(int* address)
+{
+	return ReadNoFence((const volatile LONG*)address);
+}
+
+int atomic_load_acquire(int* address)
+{
+	return ReadAcquire((const volatile LONG*)address);
+}
+
+void atomic_store_relaxed(int* address, int value)
+{
+	WriteNoFence((volatile LONG*)address, value);
+}
+
+void atomic_store_release(int* address, int value)
+{
+	WriteRelease((volatile LONG*)address, value);
+}
+
+int64_t atomic_increment64(int64_t* address)
+{
+	return InterlockedIncrement64(address) - 1;
+}
+
+int64_t atomic_decrement64(int64_t* address)
+{
+	return InterlockedDecrement64(address) + 1;
+}
+
+int64_t atomic_add64(int64_t* address, int64_t value)
+{
+	return InterlockedExchangeAdd64(address, value);
+}
+
+int64_t atomic_swap64(int64_t* address, int64_t value)
+{
+	return InterlockedExchange64(address, value);
+}
+
+int64_t atomic_compare_and_exchange64(int64_t* dest, int64_t compare, int64_t exchange)
+{
+	return InterlockedCompareExchange64(dest, exchange, compare);
+}
+
+int64_t atomic_load64_relaxed(int64_t* address)
+{
+	return ReadNoFence64(address);
+}
+
+int64_t atomic_load64_acquire(int64_t* address)
+{
+	return ReadAcquire64(address);
+}
+
+void atomic_store64_relaxed(int64_t* address, int64_t value)
+{
+	WriteNoFence64(address, value);
+}
+
+void atomic_store64_release(int64_t* address, int64_t value)
+{
+	WriteRelease64(address, value);
+}
+
+void* atomic_add_ptr(void** address, intptr_t bytes)
+{
+#if defined(_WIN64)
+	return (void*)InterlockedExchangeAdd64((volatile LONG64*)address, bytes);
+#else
+	return (void*)InterlockedExchangeAdd((volatile LONG*)address, bytes);
+#endif
+}
+
+void* atomic_swap_ptr(void** address, void* value)
+{
+	return InterlockedExchangePointer(address, value);
+}
+
+void* atomic_compare_and_exchange_ptr(void** dest, void* compare, void* exchange)
+{
+	return InterlockedCompareExchangePointer(dest, exchange, compare);
+}
+
+void* atomic_load_ptr_relaxed(void** address)
+{
+	return ReadPointerNoFence(address);
+}
+
+void* atomic_load_ptr_acquire(void** address)
+{
+	return ReadPointerAcquire(address);
+}
+
+void atomic_store_ptr_relaxed(void** address, void* value)
+{
+	WritePointerNoFence(address, value);
+}
+
+void atomic_store_ptr_release(void** address, void* value)
+{
+	WritePointerRelease(address, value);
+}
+
+bool atomic_compare_and_exchange_pair(atomic_pair_t* dest, atomic_pair_t* compare, atomic_pair_t exchange)
+{
+	return InterlockedCompareExchange128((volatile LONG64*)dest, (LONG64)exchange.hi, (LONG64)exchange.lo, (LONG64*)compare) != 0;
+}
+
+void atomic_fence_acquire()
+{
+#if defined(_M_X64) || defined(_M_IX86)
+	// x86 never reorders loads with later loads or stores; only stop the compiler.
+	_ReadWriteBarrier();
+#else
+	MemoryBarrier();
+#endif
+}
+
+void atomic_fence_release()
+{
+#if defined(_M_X64) || defined(_M_IX86)
+	_ReadWriteBarrier();
+#else
+	MemoryBarrier();
+#endif
+}
+
+void atomic_fence_seq_cst()
+{
+	MemoryBarrier();
+}
+
+void atomic_fence_signal()
+{
+	_ReadWriteBarrier();
+}
+
+void cpu_pause()
+{
+	YieldProcessor();
+}
+
+#else
+
+#include <stdatomic.h>
+
+// The engine's names collide with the C11 generic macros.
+#undef atomic_load
+#undef atomic_store
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 int atomic_increment(int* address)
 {
-	return InterlockedIncrement(address) - 1;
+	return atomic_fetch_add_explicit((_Atomic int*)address, 1, memory_order_seq_cst);
 }
 
 int atomic_decrement(int* address)
 {
-	return InterlockedDecrement(address) + 1;
+	return atomic_fetch_sub_explicit((_Atomic int*)address, 1, memory_order_seq_cst);
+}
+
+int atomic_add(int* address, int value)
+{
+	return atomic_fetch_add_explicit((_Atomic int*)address, value, memory_order_seq_cst);
+}
+
+int atomic_swap(int* address, int value)
+{
+	return atomic_exchange_explicit((_Atomic int*)address, value, memory_order_seq_cst);
 }
 
 int atomic_compare_and_exchange(int* dest, int compare, int exchange)
 {
-	return InterlockedCompareExchange(dest, exchange, compare);
+	atomic_compare_exchange_strong_explicit((_Atomic int*)dest, &compare, exchange, memory_order_seq_cst, memory_order_seq_cst);
+	return compare;
 }
 
 int atomic_load(int* address)
 {
-	return *(volatile int*)address;
+	return atomic_load_explicit((_Atomic int*)address, memory_order_acquire);
 }
 
 void atomic_store(int* address, int value)
 {
-	*(volatile int*)address = value;
+	atomic_store_explicit((_Atomic int*)address, value, memory_order_release);
+}
+
+int atomic_load_relaxed(int* address)
+{
+	return atomic_load_explicit((_Atomic int*)address, memory_order_relaxed);
+}
+
+int atomic_load_acquire(int* address)
+{
+	return atomic_load_explicit((_Atomic int*)address, memory_order_acquire);
 }
+
+void atomic_store_relaxed(int* address, int value)
+{
+	atomic_store_explicit((_Atomic int*)address, value, memory_order_relaxed);
+}
+
+void atomic_store_release(int* address, int value)
+{
+	atomic_store_explicit((_Atomic int*)address, value, memory_order_release);
+}
+
+int64_t atomic_increment64(int64_t* address)
+{
+	return atomic_fetch_add_explicit((_Atomic int64_t*)address, 1, memory_order_seq_cst);
+}
+
+int64_t atomic_decrement64(int64_t* address)
+{
+	return atomic_fetch_sub_explicit((_Atomic int64_t*)address, 1, memory_order_seq_cst);
+}
+
+int64_t atomic_add64(int64_t* address, int64_t value)
+{
+	return atomic_fetch_add_explicit((_Atomic int64_t*)address, value, memory_order_seq_cst);
+}
+
+int64_t atomic_swap64(int64_t* address, int64_t value)
+{
+	return atomic_exchange_explicit((_Atomic int64_t*)address, value, memory_order_seq_cst);
+}
+
+int64_t atomic_compare_and_exchange64(int64_t* dest, int64_t compare, int64_t exchange)
+{
+	atomic_compare_exchange_strong_explicit((_Atomic int64_t*)dest, &compare, exchange, memory_order_seq_cst, memory_order_seq_cst);
+	return compare;
+}
+
+int64_t atomic_load64_relaxed(int64_t* address)
+{
+	return atomic_load_explicit((_Atomic int64_t*)address, memory_order_relaxed);
+}
+
+int64_t atomic_load64_acquire(int64_t* address)
+{
+	return atomic_load_explicit((_Atomic int64_t*)address, memory_order_acquire);
+}
+
+void atomic_store64_relaxed(int64_t* address, int64_t value)
+{
+	atomic_store_explicit((_Atomic int64_t*)address, value, memory_order_relaxed);
+}
+
+void atomic_store64_release(int64_t* address, int64_t value)
+{
+	atomic_store_explicit((_Atomic int64_t*)address, value, memory_order_release);
+}
+
+void* atomic_add_ptr(void** address, intptr_t bytes)
+{
+	return (void*)atomic_fetch_add_explicit((_Atomic intptr_t*)address, bytes, memory_order_seq_cst);
+}
+
+void* atomic_swap_ptr(void** address, void* value)
+{
+	return atomic_exchange_explicit((void* _Atomic*)address, value, memory_order_seq_cst);
+}
+
+void* atomic_compare_and_exchange_ptr(void** dest, void* compare, void* exchange)
+{
+	atomic_compare_exchange_strong_explicit((void* _Atomic*)dest, &compare, exchange, memory_order_seq_cst, memory_order_seq_cst);
+	return compare;
+}
+
+void* atomic_load_ptr_relaxed(void** address)
+{
+	return atomic_load_explicit((void* _Atomic*)address, memory_order_relaxed);
+}
+
+void* atomic_load_ptr_acquire(void** address)
+{
+	return atomic_load_explicit((void* _Atomic*)address, memory_order_acquire);
+}
+
+void atomic_store_ptr_relaxed(void** address, void* value)
+{
+	atomic_store_explicit((void* _Atomic*)address, value, memory_order_relaxed);
+}
+
+void atomic_store_ptr_release(void** address, void* value)
+{
+	atomic_store_explicit((void* _Atomic*)address, value, memory_order_release);
+}
+
+bool atomic_compare_and_exchange_pair(atomic_pair_t* dest, atomic_pair_t* compare, atomic_pair_t exchange)
+{
+	unsigned __int128 expected = ((unsigned __int128)compare->hi << 64) | compare->lo;
+	unsigned __int128 desired = ((unsigned __int128)exchange.hi << 64) | exchange.lo;
+#if defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_16)
+	// The target has a 16-byte compare and swap (x86-64 with -mcx16), so this is inlined as
+	// a single lock cmpxchg16b with no libatomic call.
+	unsigned __int128 previous = __sync_val_compare_and_swap((unsigned __int128*)dest, expected, desired);
+	bool result = previous == expected;
+	expected = previous;
+#else
+	// No inline 16-byte compare and swap: libatomic provides it; link with -latomic.
+	bool result = atomic_compare_exchange_strong_explicit((_Atomic unsigned __int128*)dest, &expected, desired, memory_order_seq_cst, memory_order_seq_cst);
+#endif
+	compare->lo = (uint64_t)expected;
+	compare->hi = (uint64_t)(expected >> 64);
+	return result;
+}
+
+void atomic_fence_acquire()
+{
+	atomic_thread_fence(memory_order_acquire);
+}
+
+void atomic_fence_release()
+{
+	atomic_thread_fence(memory_order_release);
+}
+
+void atomic_fence_seq_cst()
+{
+	atomic_thread_fence(memory_order_seq_cst);
+}
+
+void atomic_fence_signal()
+{
+	atomic_signal_fence(memory_order_seq_cst);
+}
+
+void cpu_pause()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	_mm_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+#endif
@@ -1,6 +1,33 @@
 #pragma once
 
-// Atomic operations on 32-bit integers.
+#include <stdbool.h>
+#include <stdint.h>
+
+// Atomic operations on 32-bit, 64-bit, and pointer-sized integers.
+//
+// Unless a name says otherwise, read-modify-write operations are sequentially
+// consistent (a full barrier). Loads and stores come in _relaxed, _acquire, and
+// _release flavors with C11 memory order semantics:
+//   relaxed: atomic, but no ordering with surrounding memory operations.
+//   acquire: later reads and writes cannot move before the load.
+//   release: earlier reads and writes cannot move after the store.
+// A release store paired with an acquire load of the same address publishes
+// everything written before the store to the thread that observes it.
+//
+// Do not include <stdatomic.h> alongside this header; its macros share names
+// with atomic_load and atomic_store.
+
+// Double-width value for atomic_compare_and_exchange_pair().
+// Must be 16-byte aligned. Typically a pointer plus a version tag.
+#if defined(_MSC_VER)
+typedef struct __declspec(align(16)) atomic_pair_t
+#else
+typedef struct __attribute__((aligned(16))) atomic_pair_t
+#endif
+{
+	uint64_t lo;
+	uint64_t hi;
+} atomic_pair_t;
 
 // Increment a number atomically.
 // Returns the old value of the number.
@@ -14,6 +41,16 @@ int atomic_increment(int* address);
 //   int old_value = *address; (*address)--; return old_value;
 int atomic_decrement(int* address);
 
+// Add to a number atomically.
+// Returns the old value of the number.
+//   int old_value = *address; *address += value; return old_value;
+int atomic_add(int* address, int value);
+
+// Replace a number atomically.
+// Returns the old value of the number.
+//   int old_value = *address; *address = value; return old_value;
+int atomic_swap(int* address, int value);
+
 // Compare two numbers atomically and assign if equal.
 // Returns the old value of the number.
 // Performs the following operation atomically:
@@ -22,8 +59,61 @@ int atomic_compare_and_exchange(int* dest, int compare, int exchange);
 
 // Reads an integer from an address.
 // All writes that occurred before the last atomic_store to this address are flushed.
+// Same as atomic_load_acquire().
 int atomic_load(int* address);
 
 // Writes an integer.
 // Paired with an atomic_load, can guarantee ordering and visibility.
+// Same as atomic_store_release().
 void atomic_store(int* address, int value);
+
+// Reads an integer with the named memory order.
+int atomic_load_relaxed(int* address);
+int atomic_load_acquire(int* address);
+
+// Writes an integer with the named memory order.
+void atomic_store_relaxed(int* address, int value);
+void atomic_store_release(int* address, int value);
+
+// 64-bit variants of the operations above.
+// Returns the old value of the number where applicable.
+int64_t atomic_increment64(int64_t* address);
+int64_t atomic_decrement64(int64_t* address);
+int64_t atomic_add64(int64_t* address, int64_t value);
+int64_t atomic_swap64(int64_t* address, int64_t value);
+int64_t atomic_compare_and_exchange64(int64_t* dest, int64_t compare, int64_t exchange);
+int64_t atomic_load64_relaxed(int64_t* address);
+int64_t atomic_load64_acquire(int64_t* address);
+void atomic_store64_relaxed(int64_t* address, int64_t value);
+void atomic_store64_release(int64_t* address, int64_t value);
+
+// Pointer variants of the operations above.
+// atomic_add_ptr offsets the pointer by a number of bytes and returns the old pointer.
+void* atomic_add_ptr(void** address, intptr_t bytes);
+void* atomic_swap_ptr(void** address, void* value);
+void* atomic_compare_and_exchange_ptr(void** dest, void* compare, void* exchange);
+void* atomic_load_ptr_relaxed(void** address);
+void* atomic_load_ptr_acquire(void** address);
+void atomic_store_ptr_relaxed(void** address, void* value);
+void atomic_store_ptr_release(void** address, void* value);
+
+// Compare two 128-bit values atomically and assign if equal.
+// Returns true if the exchange happened.
+// On failure, compare is updated with the current value of dest.
+// GCC and Clang on x86-64 need -mcx16 to inline cmpxchg16b. Built without it, the exchange
+// goes through libatomic, which must be linked with -latomic and may not be lock-free.
+bool atomic_compare_and_exchange_pair(atomic_pair_t* dest, atomic_pair_t* compare, atomic_pair_t exchange);
+
+// Memory fences with the named ordering.
+// Use to order relaxed operations without making them acquire/release.
+void atomic_fence_acquire();
+void atomic_fence_release();
+void atomic_fence_seq_cst();
+
+// Fence against a signal handler interrupting the calling thread.
+// Orders memory operations only as seen from the same thread, so it stops just the compiler.
+void atomic_fence_signal();
+
+// Hint to the CPU that the calling thread is in a spin-wait loop.
+// Saves power and frees pipeline resources for a sibling hyperthread.
+void cpu_pause();
@@ -0,0 +1,340 @@
+#include "blob_store.h"
+
+#include "debug.h"
+#include "fs.h"
+#include "heap.h"
+#include "mutex.h"
+#include "lz4/xxhash.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/stat.h>
+#endif
+
+enum
+{
+	k_blob_max_path = 1024,
+	k_blob_initial_capacity = 64,
+};
+
+// What the store knows about one hash. Entries are never removed, only emptied.
+typedef struct blob_entry_t
+{
+	// Zero marks an empty slot; blob_store_hash never returns it.
+	uint64_t hash;
+	// The blob is known to be on disk.
+	bool stored;
+	// Queued write of the blob, held until its result is known.
+	fs_work_t* write;
+	// Zero until the loaded contents have been checked, then 1 if they match the hash, -1 if not.
+	int verified;
+	// Read of the blob through the file system, which owns the shared buffer.
+	fs_work_t* load;
+} blob_entry_t;
+
+typedef struct blob_store_t
+{
+	heap_t* heap;
+	fs_t* fs;
+	char* directory;
+	int compression_level;
+	mutex_t* mutex;
+	// Open addressed table of entries, probed linearly from the hash.
+	blob_entry_t* entries;
+	int capacity;
+	int count;
+	blob_store_stats_t stats;
+} blob_store_t;
+
+static void blob_path(blob_store_t* store, uint64_t hash, char* path, size_t path_size)
+{
+	snprintf(path, path_size, "%s/%016llx", store->directory, (unsigned long long)hash);
+}
+
+#if defined(_WIN32)
+
+static bool blob_exists(const char* path)
+{
+	wchar_t wide_path[k_blob_max_path];
+	if (MultiByteToWideChar(CP_UTF8, 0, path, -1, wide_path, k_blob_max_path) <= 0)
+	{
+		return false;
+	}
+	DWORD attributes = GetFileAttributesW(wide_path);
+	return attributes != INVALID_FILE_ATTRIBUTES && !(attributes & FILE_ATTRIBUTE_DIRECTORY);
+}
+
+static bool create_directory(const char* path)
+{
+	wchar_t wide_path[k_blob_max_path];
+	if (MultiByteToWideChar(CP_UTF8, 0, path, -1, wide_path, k_blob_max_path) <= 0)
+	{
+		return false;
+	}
+	return CreateDirectoryW(wide_path, NULL) || GetLastError() == ERROR_ALREADY_EXISTS;
+}
+
+#else
+
+static bool blob_exists(const char* path)
+{
+	struct stat info;
+	return stat(path, &info) == 0 && S_ISREG(info.st_mode);
+}
+
+static bool create_directory(const char* path)
+{
+	struct stat info;
+	return mkdir(path, 0755) == 0 || (stat(path, &info) == 0 && S_ISDIR(info.st_mode));
+}
+
+#endif
+
+static blob_entry_t* entry_find(blob_store_t* store, uint64_t hash)
+{
+	int mask = store->capacity - 1;
+	for (int i = (int)(hash & mask); ; i = (i + 1) & mask)
+	{
+		if (store->entries[i].hash == hash || store->entries[i].hash == 0)
+		{
+			return &store->entries[i];
+		}
+	}
+}
+
+// Entries move when the table grows, so pointers to them are only good under the mutex.
+static blob_entry_t* entry_get(blob_store_t* store, uint64_t hash)
+{
+	blob_entry_t* entry = entry_find(store, hash);
+	if (entry->hash)
+	{
+		return entry;
+	}
+
+	if ((store->count + 1) * 4 > store->capacity * 3)
+	{
+		blob_entry_t* old_entries = store->entries;
+		int old_capacity = store->capacity;
+		store->capacity *= 2;
+		store->entries = heap_alloc(store->heap, store->capacity * sizeof(blob_entry_t), 8);
+		memset(store->entries, 0, store->capacity * sizeof(blob_entry_t));
+		for (int i = 0; i < old_capacity; ++i)
+		{
+			if (old_entries[i].hash)
+			{
+				*entry_find(store, old_entries[i].hash) = old_entries[i];
+			}
+		}
+		heap_free(store->heap, old_entries);
+		entry = entry_find(store, hash);
+	}
+
+	entry->hash = hash;
+	store->count++;
+	return entry;
+}
+
+// Record the result of the entry's write once it has completed. Called with the mutex held.
+static void entry_settle_write(blob_entry_t* entry)
+{
+	if (entry->write == NULL || !fs_work_is_done(entry->write))
+	{
+		return;
+	}
+	entry->stored = fs_work_get_result(entry->write) == 0;
+	if (!entry->stored)
+	{
+		debug_print(k_print_error, "Unable to write blob %016llx\n", (unsigned long long)entry->hash);
+	}
+	fs_work_destroy(entry->write);
+	entry->write = NULL;
+}
+
+// Queue the read of a blob unless it is resident or already being read. Called with the mutex held.
+static fs_work_t* entry_load(blob_store_t* store, blob_entry_t* entry, bool* shared)
+{
+	*shared = entry->load != NULL;
+	if (*shared)
+	{
+		store->stats.shared_load_count++;
+		return entry->load;
+	}
+
+	char path[k_blob_max_path];
+	blob_path(store, entry->hash, path, sizeof(path));
+	entry->load = fs_read_cached(store->fs, path, store->compression_level != k_fs_compression_none);
+	entry->verified = 0;
+	store->stats.load_count++;
+	return entry->load;
+}
+
+blob_store_t* blob_store_create(heap_t* heap, fs_t* fs, const char* directory, int compression_level)
+{
+	if (!create_directory(directory))
+	{
+		debug_print(k_print_error, "Unable to create blob store directory %s\n", directory);
+		return NULL;
+	}
+
+	blob_store_t* store = heap_alloc(heap, sizeof(blob_store_t), 8);
+	memset(store, 0, sizeof(*store));
+	store->heap = heap;
+	store->fs = fs;
+	size_t directory_size = strlen(directory) + 1;
+	store->directory = heap_alloc(heap, directory_size, 8);
+	memcpy(store->directory, directory, directory_size);
+	store->compression_level = compression_level;
+	store->mutex = mutex_create_named("blob_store");
+	store->capacity = k_blob_initial_capacity;
+	store->entries = heap_alloc(heap, store->capacity * sizeof(blob_entry_t), 8);
+	memset(store->entries, 0, store->capacity * sizeof(blob_entry_t));
+	return store;
+}
+
+void blob_store_destroy(blob_store_t* store)
+{
+	for (int i = 0; i < store->capacity; ++i)
+	{
+		fs_work_destroy(store->entries[i].load);
+		fs_work_destroy(store->entries[i].write);
+	}
+	mutex_destroy(store->mutex);
+	heap_free(store->heap, store->entries);
+	heap_free(store->heap, store->directory);
+	heap_free(store->heap, store);
+}
+
+uint64_t blob_store_hash(const void* data, size_t size)
+{
+	uint64_t hash = XXH64(data, size, 0);
+	return hash ? hash : 1;
+}
+
+fs_work_t* blob_store_put(blob_store_t* store, const void* data, size_t size, uint64_t* hash)
+{
+	*hash = blob_store_hash(data, size);
+	char path[k_blob_max_path];
+	blob_path(store, *hash, path, sizeof(path));
+
+	mutex_lock(store->mutex);
+	blob_entry_t* entry = entry_get(store, *hash);
+	entry_settle_write(entry);
+	// A blob written by an earlier run is found on disk once and remembered from then on.
+	entry->stored = entry->stored || (entry->write == NULL && blob_exists(path));
+	if (entry->stored || entry->write)
+	{
+		// Later puts of the same content share the write in flight, and see its result.
+		fs_work_t* pending = entry->write;
+		if (pending)
+		{
+			fs_work_retain(pending);
+		}
+		store->stats.duplicate_write_count++;
+		store->stats.bytes_saved += size;
+		mutex_unlock(store->mutex);
+		return pending;
+	}
+
+	// A read from before the blob existed has failed; drop it so the next get reads the new file.
+	fs_work_t* load = entry->load;
+	entry->load = NULL;
+	entry->verified = 0;
+	fs_work_t* write = fs_write_ex(store->fs, path, data, size, store->compression_level);
+	fs_work_retain(write);
+	entry->write = write;
+	store->stats.write_count++;
+	mutex_unlock(store->mutex);
+
+	fs_work_destroy(load);
+	return write;
+}
+
+void blob_store_prefetch(blob_store_t* store, uint64_t hash)
+{
+	bool shared;
+	mutex_lock(store->mutex);
+	entry_load(store, entry_get(store, hash), &shared);
+	mutex_unlock(store->mutex);
+}
+
+fs_view_t* blob_store_get(blob_store_t* store, uint64_t hash)
+{
+	bool shared;
+	mutex_lock(store->mutex);
+	fs_work_t* load = entry_load(store, entry_get(store, hash), &shared);
+	// Each reader holds its own reference, so the entry can drop the work while it waits.
+	fs_work_retain(load);
+	mutex_unlock(store->mutex);
+
+	fs_work_wait(load);
+	fs_view_t* view = fs_work_get_result(load) == 0 ? fs_work_get_view(load) : NULL;
+	if (view == NULL)
+	{
+		// Forget the failed read, so a get after the blob has been put reads it again.
+		mutex_lock(store->mutex);
+		blob_entry_t* entry = entry_find(store, hash);
+		bool current = entry->load == load;
+		if (current)
+		{
+			entry->load = NULL;
+		}
+		mutex_unlock(store->mutex);
+		if (current)
+		{
+			fs_work_destroy(load);
+		}
+		fs_work_destroy(load);
+		debug_print(k_print_error, "Blob %016llx is missing\n", (unsigned long long)hash);
+		return NULL;
+	}
+	fs_work_destroy(load);
+
+	mutex_lock(store->mutex);
+	int verified = entry_find(store, hash)->verified;
+	if (shared)
+	{
+		store->stats.bytes_saved += fs_view_get_size(view);
+	}
+	mutex_unlock(store->mutex);
+
+	if (verified == 0)
+	{
+		// Racing readers may both check; they reach the same answer.
+		verified = blob_store_hash(fs_view_get_data(view), fs_view_get_size(view)) == hash ? 1 : -1;
+		mutex_lock(store->mutex);
+		entry_find(store, hash)->verified = verified;
+		mutex_unlock(store->mutex);
+	}
+	if (verified < 0)
+	{
+		debug_print(k_print_error, "Blob %016llx is corrupt\n", (unsigned long long)hash);
+		fs_view_release(view);
+		return NULL;
+	}
+	return view;
+}
+
+void blob_store_evict(blob_store_t* store, uint64_t hash)
+{
+	mutex_lock(store->mutex);
+	blob_entry_t* entry = entry_find(store, hash);
+	fs_work_t* load = entry->load;
+	entry->load = NULL;
+	entry->verified = 0;
+	mutex_unlock(store->mutex);
+
+	fs_work_destroy(load);
+}
+
+void blob_store_get_stats(blob_store_t* store, blob_store_stats_t* stats)
+{
+	mutex_lock(store->mutex);
+	*stats = store->stats;
+	mutex_unlock(store->mutex);
+}
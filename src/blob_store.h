@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Content-addressed blob store on top of the file system.
+// A blob is stored once under the XXH64 hash of its contents, in a file named after the hash
+// in the store's directory. Storing content that is already there writes nothing, and every
+// reader of a hash shares one resident buffer, so duplicated data costs neither disk I/O nor
+// memory more than once.
+
+typedef struct blob_store_t blob_store_t;
+
+typedef struct fs_t fs_t;
+typedef struct fs_view_t fs_view_t;
+typedef struct fs_work_t fs_work_t;
+typedef struct heap_t heap_t;
+
+// Counters of a blob store. See blob_store_get_stats().
+typedef struct blob_store_stats_t
+{
+	// Puts that wrote a blob, and puts of content the store already had.
+	uint64_t write_count;
+	uint64_t duplicate_write_count;
+	// Gets that read a blob, and gets that shared one already resident or being read.
+	uint64_t load_count;
+	uint64_t shared_load_count;
+	// Bytes not written and not read thanks to deduplication.
+	uint64_t bytes_saved;
+} blob_store_stats_t;
+
+// Create a blob store in a directory, creating the directory if needed.
+// Blobs are written at compression_level (see fs_compression_level_t); a directory must
+// always be opened with the same choice of compressed or not.
+blob_store_t* blob_store_create(heap_t* heap, fs_t* fs, const char* directory, int compression_level);
+
+// Destroy a blob store, dropping its references to resident blobs.
+void blob_store_destroy(blob_store_t* store);
+
+// Hash content the way the store does.
+uint64_t blob_store_hash(const void* data, size_t size);
+
+// Store a blob and return its hash through hash.
+// Returns the queued write, which reads data until it completes, or NULL if the store already
+// has the content and nothing needs to be written. A put of content whose write is still in
+// flight returns that write, so its result is seen by every put. Destroy the returned work.
+// A blob can be read once its write has completed.
+fs_work_t* blob_store_put(blob_store_t* store, const void* data, size_t size, uint64_t* hash);
+
+// Start reading a blob into memory without waiting for it.
+void blob_store_prefetch(blob_store_t* store, uint64_t hash);
+
+// Get the contents of a blob, reading it if it is not resident yet, and wait for them.
+// All readers of a hash share one buffer, which is null terminated and checked against the
+// hash when first read. Release the view with fs_view_release.
+// Returns NULL if the blob is missing or corrupt.
+fs_view_t* blob_store_get(blob_store_t* store, uint64_t hash);
+
+// Drop the store's reference to a resident blob.
+// Its memory is freed once every view of it has been released; the next get reads it again.
+void blob_store_evict(blob_store_t* store, uint64_t hash);
+
+// Read the counters of a blob store.
+void blob_store_get_stats(blob_store_t* store, blob_store_stats_t* stats);
@@ -0,0 +1,123 @@
+#include "compression_bench.h"
+
+#include "debug.h"
+#include "fs.h"
+#include "heap.h"
+#include "thread.h"
+#include "timer.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+enum
+{
+	k_data_size = 64 * 1024 * 1024,
+	k_repeats = 3,
+};
+
+static const char* k_bench_path = "compression_bench.lz4";
+
+// Text-like data that compresses about 2:1 with the fast level, with some incompressible runs.
+static void fill_data(char* data, size_t size)
+{
+	static const char* k_words[] = { "entity ", "transform ", "mesh ", "render ", "frame ", "queue ", "thread ", "heap " };
+	uint32_t state = 12345;
+	size_t offset = 0;
+	while (offset < size)
+	{
+		state = state * 1664525 + 1013904223;
+		if ((state >> 24) < 8)
+		{
+			// A short random run.
+			for (int i = 0; i < 64 && offset < size; ++i)
+			{
+				state = state * 1664525 + 1013904223;
+				data[offset++] = (char)(state >> 24);
+			}
+		}
+		else
+		{
+			const char* word = k_words[(state >> 16) % 8];
+			for (const char* c = word; *c && offset < size; ++c)
+			{
+				data[offset++] = *c;
+			}
+		}
+	}
+}
+
+static double to_mb_per_s(uint64_t ticks)
+{
+	uint32_t ms = timer_ticks_to_ms(ticks);
+	return ms ? (double)k_data_size / (1024.0 * 1024.0) / (ms / 1000.0) : 0.0;
+}
+
+// Best-of-k_repeats write and read times at one level and thread count.
+static void bench_level(heap_t* heap, int thread_count, int level, const char* data)
+{
+	fs_t* fs = fs_create_ex(heap, 16, thread_count);
+	uint64_t best_write = UINT64_MAX;
+	uint64_t best_read = UINT64_MAX;
+	size_t compressed_size = 0;
+	bool valid = true;
+	for (int r = 0; r < k_repeats; ++r)
+	{
+		uint64_t t0 = timer_get_ticks();
+		fs_work_t* write_work = fs_write_ex(fs, k_bench_path, data, k_data_size, level);
+		fs_work_wait(write_work);
+		uint64_t t1 = timer_get_ticks();
+		fs_work_destroy(write_work);
+
+		fs_work_t* read_work = fs_read(fs, k_bench_path, heap, false, true);
+		fs_work_wait(read_work);
+		uint64_t t2 = timer_get_ticks();
+		valid = valid && fs_work_get_result(read_work) == 0 && fs_work_get_size(read_work) == k_data_size &&
+			memcmp(fs_work_get_buffer(read_work), data, k_data_size) == 0;
+		heap_free(heap, fs_work_get_buffer(read_work));
+		fs_work_destroy(read_work);
+
+		fs_work_t* raw_work = fs_read(fs, k_bench_path, heap, false, false);
+		compressed_size = fs_work_get_size(raw_work);
+		heap_free(heap, fs_work_get_buffer(raw_work));
+		fs_work_destroy(raw_work);
+
+		best_write = (t1 - t0) < best_write ? (t1 - t0) : best_write;
+		best_read = (t2 - t1) < best_read ? (t2 - t1) : best_read;
+	}
+	fs_destroy(fs);
+
+	debug_print(k_print_info, "  level=%2d threads=%2d write=%8.1f MB/s read=%8.1f MB/s ratio=%5.2f%s\n",
+		level, thread_count, to_mb_per_s(best_write), to_mb_per_s(best_read),
+		compressed_size ? (double)k_data_size / compressed_size : 0.0, valid ? "" : " MISMATCH");
+}
+
+void compression_bench_run()
+{
+	heap_t* heap = heap_create(2 * 1024 * 1024);
+	char* data = heap_alloc(heap, k_data_size, 64);
+	fill_data(data, k_data_size);
+
+	// Compression threads are pinned to the bulk CPUs, so more threads than those only contend.
+	int cpu_count = thread_get_role_cpu_count(k_thread_role_compression);
+	static const int k_levels[] = { k_fs_compression_fast, 4, k_fs_compression_hc };
+	debug_print(k_print_info, "Compressed write/read of %d MB (file cache warm, best of %d):\n",
+		k_data_size / (1024 * 1024), k_repeats);
+	for (int l = 0; l < (int)(sizeof(k_levels) / sizeof(k_levels[0])); ++l)
+	{
+		for (int thread_count = 1; ; thread_count *= 2)
+		{
+			// Always finish with the default, one thread per bulk CPU.
+			thread_count = thread_count < cpu_count ? thread_count : cpu_count;
+			bench_level(heap, thread_count, k_levels[l], data);
+			if (thread_count == cpu_count)
+			{
+				break;
+			}
+		}
+	}
+
+	remove(k_bench_path);
+	heap_free(heap, data);
+	heap_destroy(heap);
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+// Compressed file throughput benchmark.
+// Writes and reads back a large file through the file system at several
+// compression levels and compression thread counts, and prints MB/s and ratio.
+
+// Run all compression benchmarks.
+void compression_bench_run();
@@ -3,12 +3,27 @@
 #include <stdarg.h>
 #include <stdio.h>
 
+static uint32_t s_mask = 0xffffffff;
+static debug_crash_callback_t s_crash_callback = NULL;
+static void* s_crash_data = NULL;
+// Set by the first crash, so a crash in the callback does not call it again.
+static volatile int s_crashed = 0;
+
+static void crash_callback_run()
+{
+	if (s_crash_callback && !s_crashed)
+	{
+		s_crashed = 1;
+		s_crash_callback(s_crash_data);
+	}
+}
+
+#if defined(_WIN32)
+
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 #include <DbgHelp.h>
 
-static uint32_t s_mask = 0xffffffff;
-
 static LONG debug_exception_handler(LPEXCEPTION_POINTERS info)
 {
 	// XXX: MS uses 0xE06D7363 to indicate C++ language exception.
@@ -40,6 +55,8 @@ static LONG debug_exception_handler(LPEXCEPTION_POINTERS info)
 		CloseHandle(file);
 	}
 
+	crash_callback_run();
+
 	return EXCEPTION_EXECUTE_HANDLER;
 }
 
@@ -48,6 +65,61 @@ void debug_install_exception_handler()
 	AddVectoredExceptionHandler(TRUE, debug_exception_handler);
 }
 
+#else
+
+#include <execinfo.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+
+enum
+{
+	// The handler runs on its own stack on the main thread, so it also works when that overflowed.
+	k_signal_stack_size = 256 * 1024,
+};
+
+static char s_signal_stack[k_signal_stack_size];
+
+static void debug_signal_handler(int signal)
+{
+	// Only async-signal-safe calls from here on.
+	static const char k_message[] = "Caught fatal signal!\n";
+	ssize_t result = write(STDERR_FILENO, k_message, sizeof(k_message) - 1);
+	(void)result;
+
+	crash_callback_run();
+
+	// The handler was reset, so this ends the process as the signal would have.
+	raise(signal);
+}
+
+void debug_install_exception_handler()
+{
+	stack_t stack = { 0 };
+	stack.ss_sp = s_signal_stack;
+	stack.ss_size = sizeof(s_signal_stack);
+	sigaltstack(&stack, NULL);
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = debug_signal_handler;
+	action.sa_flags = SA_ONSTACK | SA_RESETHAND;
+	sigemptyset(&action.sa_mask);
+	static const int k_signals[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT };
+	for (int i = 0; i < (int)(sizeof(k_signals) / sizeof(k_signals[0])); ++i)
+	{
+		sigaction(k_signals[i], &action, NULL);
+	}
+}
+
+#endif
+
+void debug_set_crash_callback(debug_crash_callback_t callback, void* data)
+{
+	s_crash_callback = callback;
+	s_crash_data = data;
+}
+
 void debug_set_print_mask(uint32_t mask)
 {
 	s_mask = mask;
@@ -66,15 +138,28 @@ void debug_print(uint32_t type, _Printf_format_string_ const char* format, ...)
 	vsnprintf(buffer, sizeof(buffer), format, args);
 	va_end(args);
 
+#if defined(_WIN32)
 	OutputDebugStringA(buffer);
 
 	DWORD bytes = (DWORD)strlen(buffer);
 	DWORD written = 0;
 	HANDLE out = GetStdHandle(STD_OUTPUT_HANDLE);
 	WriteConsoleA(out, buffer, bytes, &written, NULL);
+#else
+	fputs(buffer, stdout);
+	fflush(stdout);
+#endif
 }
 
 int debug_backtrace(void** stack, int stack_capacity)
 {
+#if defined(_WIN32)
 	return CaptureStackBackTrace(1, stack_capacity, stack, NULL);
+#else
+	void* frames[64];
+	int count = backtrace(frames, stack_capacity + 1 < 64 ? stack_capacity + 1 : 64);
+	count = count > 0 ? count - 1 : 0;
+	memcpy(stack, frames + 1, count * sizeof(void*));
+	return count;
+#endif
 }
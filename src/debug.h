@@ -4,6 +4,10 @@
 
 // Debugging Support
 
+#if !defined(_MSC_VER)
+#define _Printf_format_string_
+#endif
+
 // Flags for debug_print().
 typedef enum debug_print_t
 {
@@ -13,9 +17,18 @@ typedef enum debug_print_t
 } debug_print_t;
 
 // Install unhandled exception handler.
-// When unhandled exceptions are caught, will log an error and capture a memory dump.
+// When unhandled exceptions are caught, will log an error, capture a memory dump on Windows and
+// call the crash callback. On other platforms, fatal signals are caught instead.
 void debug_install_exception_handler();
 
+// Function called by the exception handler to save state before the process dies.
+// It runs on the crashing thread, which may hold any lock, so it must not take locks or
+// allocate.
+typedef void (*debug_crash_callback_t)(void* data);
+
+// Set the function called when the process crashes; NULL to call none.
+void debug_set_crash_callback(debug_crash_callback_t callback, void* data);
+
 // Set mask of which types of prints will actually fire.
 // See the debug_print().
 void debug_set_print_mask(uint32_t mask);
@@ -0,0 +1,234 @@
+#include "dictionary.h"
+
+#include "debug.h"
+#include "fs.h"
+#include "heap.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum
+{
+	// Sequences of this many bytes are what the dictionary is scored on; LZ4's minimum match is 4.
+	k_gram_size = 8,
+	k_table_bits = 20,
+	k_table_size = 1 << k_table_bits,
+	// Size of each piece of the corpus copied into the dictionary.
+	k_segment_size = 256,
+};
+
+typedef struct segment_t
+{
+	size_t offset;
+	uint64_t score;
+} segment_t;
+
+static uint32_t gram_hash(const char* data)
+{
+	uint64_t value;
+	memcpy(&value, data, sizeof(value));
+	return (uint32_t)((value * 0x9E3779B97F4A7C15ull) >> (64 - k_table_bits));
+}
+
+// Only sequences found in at least two samples say anything about files not yet seen.
+static uint64_t gram_score(const uint32_t* counts, const char* data)
+{
+	uint32_t count = counts[gram_hash(data)];
+	return count >= 2 ? count : 0;
+}
+
+static int compare_segments(const void* a, const void* b)
+{
+	const segment_t* x = a;
+	const segment_t* y = b;
+	return x->score < y->score ? -1 : x->score > y->score ? 1 : 0;
+}
+
+size_t dictionary_train(heap_t* heap, const void* const* samples, const size_t* sample_sizes, int sample_count, void* dictionary, size_t capacity)
+{
+	capacity = capacity < k_fs_max_dictionary_size ? capacity : k_fs_max_dictionary_size;
+	size_t total = 0;
+	for (int i = 0; i < sample_count; ++i)
+	{
+		total += sample_sizes[i];
+	}
+
+	// The corpus is the samples back to back.
+	char* corpus = heap_alloc(heap, total + 1, 8);
+	size_t offset = 0;
+	for (int i = 0; i < sample_count; ++i)
+	{
+		memcpy(corpus + offset, samples[i], sample_sizes[i]);
+		offset += sample_sizes[i];
+	}
+	if (total <= capacity || capacity < k_segment_size)
+	{
+		// Too little to choose from: the whole corpus fits, or only its end does.
+		size_t size = total < capacity ? total : capacity;
+		memcpy(dictionary, corpus + total - size, size);
+		heap_free(heap, corpus);
+		return size;
+	}
+
+	// Count the samples each sequence appears in.
+	uint32_t* counts = heap_alloc(heap, k_table_size * sizeof(uint32_t), 8);
+	int32_t* last_sample = heap_alloc(heap, k_table_size * sizeof(int32_t), 8);
+	memset(counts, 0, k_table_size * sizeof(uint32_t));
+	memset(last_sample, 0xff, k_table_size * sizeof(int32_t));
+	offset = 0;
+	for (int i = 0; i < sample_count; ++i)
+	{
+		for (size_t p = 0; p + k_gram_size <= sample_sizes[i]; ++p)
+		{
+			uint32_t hash = gram_hash(corpus + offset + p);
+			if (last_sample[hash] != i)
+			{
+				last_sample[hash] = i;
+				counts[hash]++;
+			}
+		}
+		offset += sample_sizes[i];
+	}
+
+	// Split the corpus into one epoch per segment and take the best segment of each, so the
+	// dictionary covers the whole corpus rather than the single most repetitive file.
+	// Sequences already taken stop counting, so later segments add something new.
+	int segment_count = (int)(capacity / k_segment_size);
+	size_t epoch_size = total / segment_count;
+	segment_t* segments = heap_alloc(heap, segment_count * sizeof(segment_t), 8);
+	int chosen = 0;
+	for (int e = 0; e < segment_count; ++e)
+	{
+		size_t begin = (size_t)e * epoch_size;
+		size_t end = e == segment_count - 1 ? total : begin + epoch_size;
+		end = end > begin + k_segment_size ? end : begin + k_segment_size;
+		end = end < total ? end : total;
+		if (end - begin < k_segment_size)
+		{
+			break;
+		}
+
+		// Slide a segment-sized window over the epoch, scoring the sequences starting in it.
+		size_t window = k_segment_size - k_gram_size + 1;
+		uint64_t score = 0;
+		for (size_t p = begin; p < begin + window; ++p)
+		{
+			score += gram_score(counts, corpus + p);
+		}
+		segment_t best = { begin, score };
+		for (size_t p = begin + 1; p + k_segment_size <= end; ++p)
+		{
+			score += gram_score(counts, corpus + p + window - 1);
+			score -= gram_score(counts, corpus + p - 1);
+			if (score > best.score)
+			{
+				best.offset = p;
+				best.score = score;
+			}
+		}
+		if (best.score == 0)
+		{
+			continue;
+		}
+
+		for (size_t p = best.offset; p < best.offset + window; ++p)
+		{
+			counts[gram_hash(corpus + p)] = 0;
+		}
+		segments[chosen++] = best;
+	}
+
+	qsort(segments, chosen, sizeof(segment_t), compare_segments);
+	char* output = dictionary;
+	for (int i = 0; i < chosen; ++i)
+	{
+		memcpy(output + (size_t)i * k_segment_size, corpus + segments[i].offset, k_segment_size);
+	}
+
+	heap_free(heap, segments);
+	heap_free(heap, last_sample);
+	heap_free(heap, counts);
+	heap_free(heap, corpus);
+	return (size_t)chosen * k_segment_size;
+}
+
+bool dictionary_train_files(heap_t* heap, fs_t* fs, const char* output_path, const char* const* paths, int path_count)
+{
+	fs_work_t** reads = heap_alloc(heap, path_count * sizeof(fs_work_t*), 8);
+	const void** samples = heap_alloc(heap, path_count * sizeof(void*), 8);
+	size_t* sample_sizes = heap_alloc(heap, path_count * sizeof(size_t), 8);
+	for (int i = 0; i < path_count; ++i)
+	{
+		reads[i] = fs_read(fs, paths[i], heap, false, false);
+	}
+	fs_work_wait_all(reads, path_count);
+
+	bool ok = true;
+	int sample_count = 0;
+	for (int i = 0; i < path_count; ++i)
+	{
+		if (fs_work_get_result(reads[i]) != 0)
+		{
+			debug_print(k_print_error, "Unable to read %s\n", paths[i]);
+			ok = false;
+			continue;
+		}
+		samples[sample_count] = fs_work_get_buffer(reads[i]);
+		sample_sizes[sample_count++] = fs_work_get_size(reads[i]);
+	}
+
+	char* dictionary = heap_alloc(heap, k_fs_max_dictionary_size, 8);
+	size_t size = ok ? dictionary_train(heap, samples, sample_sizes, sample_count, dictionary, k_fs_max_dictionary_size) : 0;
+	if (size)
+	{
+		fs_work_t* write = fs_write(fs, output_path, dictionary, size, false);
+		ok = fs_work_get_result(write) == 0;
+		fs_work_destroy(write);
+		if (ok)
+		{
+			uint32_t id = fs_dictionary_register(fs, dictionary, size);
+			debug_print(k_print_info, "Trained %llu byte dictionary %08x from %d files into %s\n",
+				(unsigned long long)size, id, sample_count, output_path);
+		}
+		else
+		{
+			debug_print(k_print_error, "Unable to write %s\n", output_path);
+		}
+	}
+	else
+	{
+		ok = false;
+	}
+
+	for (int i = 0; i < path_count; ++i)
+	{
+		if (fs_work_get_result(reads[i]) == 0)
+		{
+			heap_free(heap, fs_work_get_buffer(reads[i]));
+		}
+		fs_work_destroy(reads[i]);
+	}
+	heap_free(heap, dictionary);
+	heap_free(heap, sample_sizes);
+	heap_free(heap, samples);
+	heap_free(heap, reads);
+	return ok;
+}
+
+uint32_t dictionary_load(heap_t* heap, fs_t* fs, const char* path)
+{
+	fs_work_t* read = fs_read(fs, path, heap, false, false);
+	uint32_t id = 0;
+	if (fs_work_get_result(read) == 0)
+	{
+		id = fs_dictionary_register(fs, fs_work_get_buffer(read), fs_work_get_size(read));
+		heap_free(heap, fs_work_get_buffer(read));
+	}
+	else
+	{
+		debug_print(k_print_warning, "Unable to read dictionary %s\n", path);
+	}
+	fs_work_destroy(read);
+	return id;
+}
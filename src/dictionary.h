@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Compression dictionary training.
+// Small files compress poorly on their own because LZ4 starts each one with nothing to match
+// against. A dictionary built from a corpus of similar files gives every file that history up
+// front. Register one with fs_dictionary_register and write with fs_write_with_dictionary.
+
+typedef struct fs_t fs_t;
+typedef struct heap_t heap_t;
+
+// Build a dictionary of at most capacity bytes from sample files.
+// Capacity is capped at k_fs_max_dictionary_size (see fs.h), all of history LZ4 can use.
+// Picks the segments whose 8-byte sequences recur across the most samples and puts the most
+// useful last, where they stay in LZ4's reach longest as a block is compressed.
+// Returns the size of the dictionary written, which is 0 if there were no samples.
+size_t dictionary_train(heap_t* heap, const void* const* samples, const size_t* sample_sizes, int sample_count, void* dictionary, size_t capacity);
+
+// Train a dictionary on files and write it to output_path.
+// Prints the dictionary ID it will be registered under. Returns false if a file could not be
+// read or the dictionary could not be written.
+bool dictionary_train_files(heap_t* heap, fs_t* fs, const char* output_path, const char* const* paths, int path_count);
+
+// Read a dictionary file and register it with the file system.
+// Returns the dictionary ID, or 0 on failure.
+uint32_t dictionary_load(heap_t* heap, fs_t* fs, const char* path);
@@ -1,30 +1,79 @@
 #include "event.h"
 
-#define WIN32_LEAN_AND_MEAN
-#include <windows.h>
+#include "atomic.h"
+#include "futex.h"
+
+#include <stdlib.h>
+
+// Manual-reset futex event:
+//   0 = not signaled, 1 = signaled, 2 = not signaled and threads may be sleeping.
+// Signaling an event nobody sleeps on never enters the kernel.
+typedef struct event_t
+{
+	int state;
+	event_stats_t stats;
+} event_t;
 
 event_t* event_create()
 {
-	HANDLE evt = CreateEvent(NULL, TRUE, FALSE, NULL);
-	return (event_t*)evt;
+	return calloc(1, sizeof(event_t));
 }
 
 void event_destroy(event_t* event)
 {
-	CloseHandle(event);
+	free(event);
 }
 
 void event_signal(event_t* event)
 {
-	SetEvent(event);
+	if (atomic_swap(&event->state, 1) == 2)
+	{
+		futex_wake_all(&event->state);
+	}
 }
 
 void event_wait(event_t* event)
 {
-	WaitForSingleObject(event, INFINITE);
+	if (atomic_load_acquire(&event->state) == 1)
+	{
+		return;
+	}
+
+	atomic_increment64((int64_t*)&event->stats.contended_count);
+
+	for (int i = 0; i < k_futex_spin_count; ++i)
+	{
+		cpu_pause();
+		if (atomic_load_acquire(&event->state) == 1)
+		{
+			return;
+		}
+	}
+
+	while (true)
+	{
+		int state = atomic_load_acquire(&event->state);
+		if (state == 1)
+		{
+			break;
+		}
+		if (state == 0 && atomic_compare_and_exchange(&event->state, 0, 2) != 0)
+		{
+			continue;
+		}
+		atomic_increment64((int64_t*)&event->stats.sleep_count);
+		futex_wait(&event->state, 2);
+	}
 }
 
 bool event_is_raised(event_t* event)
 {
-	return WaitForSingleObject(event, 0) == WAIT_OBJECT_0;
+	return atomic_load_acquire(&event->state) == 1;
+}
+
+bool event_get_stats(event_t* event, event_stats_t* stats)
+{
+	stats->contended_count = (uint64_t)atomic_load64_relaxed((int64_t*)&event->stats.contended_count);
+	stats->sleep_count = (uint64_t)atomic_load64_relaxed((int64_t*)&event->stats.sleep_count);
+	return true;
 }
@@ -1,12 +1,22 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 
 // Event thread synchronization
 
 // Handle to an event.
 typedef struct event_t event_t;
 
+// Contention counters for an event. See event_get_stats().
+typedef struct event_stats_t
+{
+	// Number of waits that found the event not yet signaled.
+	uint64_t contended_count;
+	// Number of times a thread went to sleep in the kernel waiting for the event.
+	uint64_t sleep_count;
+} event_stats_t;
+
 // Creates a new event.
 event_t* event_create();
 
@@ -22,3 +32,7 @@ void event_wait(event_t* event);
 
 // Determines if an event is signaled.
 bool event_is_raised(event_t* event);
+
+// Reads the contention counters of an event.
+// Returns false if the platform backend does not track contention.
+bool event_get_stats(event_t* event, event_stats_t* stats);
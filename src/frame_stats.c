@@ -0,0 +1,425 @@
+#include "frame_stats.h"
+
+#include "debug.h"
+#include "fs.h"
+#include "heap.h"
+#include "timer.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum
+{
+	// Values below 2 * k_sub_buckets are kept exactly; above, each power of two is split into
+	// k_sub_buckets buckets, for a relative error under 1%.
+	k_sub_bucket_bits = 7,
+	k_sub_buckets = 1 << k_sub_bucket_bits,
+	// Covers values below 2^32 microseconds, over an hour.
+	k_histogram_size = (32 - k_sub_bucket_bits + 1) * k_sub_buckets,
+	// Frames in the rolling window; its percentiles are printed each time this many go by.
+	k_window_frames = 600,
+	k_max_scopes = 64,
+	// Scopes named when a frame goes over budget.
+	k_hitch_scopes = 3,
+	// Frames over budget are reported at most this often; the ones in between are counted.
+	k_hitch_report_interval_ms = 1000,
+	k_csv_capacity = 16 * 1024,
+};
+
+typedef struct histogram_t
+{
+	uint32_t counts[k_histogram_size];
+	uint64_t count;
+	uint64_t max;
+} histogram_t;
+
+typedef struct frame_scope_t
+{
+	uint32_t name;
+	const char* name_string;
+	histogram_t histogram;
+	// Frames over budget this scope was the largest part of.
+	uint64_t hitch_count;
+	// Hardware events counted in the scope over all frames, if the trace counts them.
+	uint64_t counters[k_perf_counter_count];
+} frame_scope_t;
+
+typedef struct frame_stats_t
+{
+	heap_t* heap;
+	trace_t* trace;
+	uint64_t budget_us;
+	// Start of the current frame, or 0 before the first frame_stats_frame_end.
+	uint64_t frame_start;
+	uint64_t frame_count;
+	uint64_t over_budget_count;
+	// When the last frame over budget was reported, and how many went unreported since.
+	uint64_t last_report;
+	uint64_t unreported_count;
+	histogram_t total;
+	// The last k_window_frames frame times, oldest at window_next once full, and their histogram.
+	histogram_t window;
+	uint32_t window_us[k_window_frames];
+	int window_count;
+	int window_next;
+	frame_scope_t* scopes[k_max_scopes];
+	int scope_count;
+	trace_scope_time_t times[k_max_scopes];
+} frame_stats_t;
+
+static int floor_log2(uint64_t value)
+{
+	int log = 0;
+	while (value >>= 1)
+	{
+		log++;
+	}
+	return log;
+}
+
+static int histogram_index(uint64_t value)
+{
+	value = value < 0xffffffffull ? value : 0xffffffffull;
+	int shift = floor_log2(value) - k_sub_bucket_bits;
+	shift = shift > 0 ? shift : 0;
+	return shift * k_sub_buckets + (int)(value >> shift);
+}
+
+// The highest value that falls in a bucket, so percentiles never flatter a budget.
+static uint64_t histogram_value(int index)
+{
+	int shift = index / k_sub_buckets - 1;
+	if (shift <= 0)
+	{
+		return (uint64_t)index;
+	}
+	uint64_t low = (uint64_t)(index - shift * k_sub_buckets) << shift;
+	return low + ((uint64_t)1 << shift) - 1;
+}
+
+static void histogram_add(histogram_t* histogram, uint64_t value)
+{
+	histogram->counts[histogram_index(value)]++;
+	histogram->count++;
+	histogram->max = value > histogram->max ? value : histogram->max;
+}
+
+// Remove a value added before. The max is left as it is.
+static void histogram_remove(histogram_t* histogram, uint64_t value)
+{
+	histogram->counts[histogram_index(value)]--;
+	histogram->count--;
+}
+
+static uint64_t histogram_percentile(const histogram_t* histogram, double percentile, uint64_t max)
+{
+	uint64_t target = (uint64_t)(percentile * histogram->count + 0.999999);
+	target = target > 0 ? target : 1;
+	uint64_t seen = 0;
+	for (int i = 0; i < k_histogram_size; ++i)
+	{
+		seen += histogram->counts[i];
+		if (seen >= target)
+		{
+			uint64_t value = histogram_value(i);
+			return value < max ? value : max;
+		}
+	}
+	return max;
+}
+
+static void histogram_get_percentiles(const histogram_t* histogram, uint64_t max, frame_stats_percentiles_t* percentiles)
+{
+	memset(percentiles, 0, sizeof(*percentiles));
+	percentiles->count = histogram->count;
+	if (histogram->count == 0)
+	{
+		return;
+	}
+	percentiles->p50_ms = histogram_percentile(histogram, 0.50, max) / 1000.0;
+	percentiles->p95_ms = histogram_percentile(histogram, 0.95, max) / 1000.0;
+	percentiles->p99_ms = histogram_percentile(histogram, 0.99, max) / 1000.0;
+	percentiles->max_ms = max / 1000.0;
+}
+
+frame_stats_t* frame_stats_create(heap_t* heap, trace_t* trace, double budget_ms)
+{
+	frame_stats_t* stats = heap_alloc(heap, sizeof(frame_stats_t), 8);
+	memset(stats, 0, sizeof(*stats));
+	stats->heap = heap;
+	stats->trace = trace;
+	stats->budget_us = (uint64_t)(budget_ms * 1000.0);
+	return stats;
+}
+
+void frame_stats_destroy(frame_stats_t* stats)
+{
+	for (int i = 0; i < stats->scope_count; ++i)
+	{
+		heap_free(stats->heap, stats->scopes[i]);
+	}
+	heap_free(stats->heap, stats);
+}
+
+static frame_scope_t* scope_find(frame_stats_t* stats, uint32_t name)
+{
+	for (int i = 0; i < stats->scope_count; ++i)
+	{
+		if (stats->scopes[i]->name == name)
+		{
+			return stats->scopes[i];
+		}
+	}
+	if (stats->scope_count == k_max_scopes)
+	{
+		return NULL;
+	}
+	frame_scope_t* scope = heap_alloc(stats->heap, sizeof(frame_scope_t), 8);
+	memset(scope, 0, sizeof(*scope));
+	scope->name = name;
+	scope->name_string = trace_get_name(stats->trace, name);
+	scope->name_string = scope->name_string ? scope->name_string : "?";
+	stats->scopes[stats->scope_count++] = scope;
+	return scope;
+}
+
+// Find the scopes that ran furthest over their usual time in a frame over budget, counting
+// the hitch against the worst of them. They are named in a warning unless one was printed
+// less than k_hitch_report_interval_ms ago.
+static void report_hitch(frame_stats_t* stats, uint64_t frame_us, int time_count, uint64_t now)
+{
+	bool print = stats->last_report == 0 || timer_ticks_to_ms(now - stats->last_report) >= k_hitch_report_interval_ms;
+	if (print)
+	{
+		if (stats->unreported_count > 0)
+		{
+			debug_print(k_print_warning, "Frame %llu took %.2f ms, over the %.2f ms budget, as did %llu frames since the last report\n",
+				(unsigned long long)stats->frame_count, frame_us / 1000.0, stats->budget_us / 1000.0,
+				(unsigned long long)stats->unreported_count);
+		}
+		else
+		{
+			debug_print(k_print_warning, "Frame %llu took %.2f ms, over the %.2f ms budget\n",
+				(unsigned long long)stats->frame_count, frame_us / 1000.0, stats->budget_us / 1000.0);
+		}
+		stats->last_report = now;
+		stats->unreported_count = 0;
+	}
+	else
+	{
+		stats->unreported_count++;
+	}
+
+	bool reported[k_max_scopes] = { 0 };
+	for (int n = 0; n < k_hitch_scopes; ++n)
+	{
+		int worst = -1;
+		double worst_excess = 0.0;
+		double worst_p50 = 0.0;
+		for (int i = 0; i < time_count; ++i)
+		{
+			frame_scope_t* scope = scope_find(stats, stats->times[i].name);
+			if (reported[i] || scope == NULL)
+			{
+				continue;
+			}
+			double p50 = (double)histogram_percentile(&scope->histogram, 0.50, scope->histogram.max);
+			double excess = stats->times[i].us - p50;
+			if (excess > worst_excess)
+			{
+				worst = i;
+				worst_excess = excess;
+				worst_p50 = p50;
+			}
+		}
+		if (worst < 0)
+		{
+			break;
+		}
+		reported[worst] = true;
+		frame_scope_t* scope = scope_find(stats, stats->times[worst].name);
+		if (n == 0)
+		{
+			scope->hitch_count++;
+		}
+		if (!print)
+		{
+			break;
+		}
+		debug_print(k_print_warning, "  %-32s %8.2f ms (p50 %.2f ms)\n",
+			scope->name_string, stats->times[worst].us / 1000.0, worst_p50 / 1000.0);
+	}
+}
+
+bool frame_stats_frame_end(frame_stats_t* stats)
+{
+	uint64_t now = timer_get_ticks();
+	int time_count = trace_scope_times(stats->trace, stats->times, k_max_scopes);
+	if (stats->frame_start == 0)
+	{
+		// The first call only starts the clock; scopes recorded before it are dropped.
+		stats->frame_start = now;
+		return false;
+	}
+
+	uint64_t frame_us = timer_ticks_to_us(now - stats->frame_start);
+	stats->frame_start = now;
+	stats->frame_count++;
+	histogram_add(&stats->total, frame_us);
+
+	if (stats->window_count == k_window_frames)
+	{
+		histogram_remove(&stats->window, stats->window_us[stats->window_next]);
+	}
+	else
+	{
+		stats->window_count++;
+	}
+	stats->window_us[stats->window_next] = frame_us < 0xffffffffull ? (uint32_t)frame_us : 0xffffffffu;
+	stats->window_next = (stats->window_next + 1) % k_window_frames;
+	histogram_add(&stats->window, frame_us);
+
+	for (int i = 0; i < time_count; ++i)
+	{
+		frame_scope_t* scope = scope_find(stats, stats->times[i].name);
+		if (scope != NULL)
+		{
+			histogram_add(&scope->histogram, (uint64_t)(stats->times[i].us + 0.5));
+			for (int c = 0; c < k_perf_counter_count; ++c)
+			{
+				scope->counters[c] += stats->times[i].counters[c];
+			}
+		}
+	}
+
+	bool over_budget = frame_us > stats->budget_us;
+	if (over_budget)
+	{
+		stats->over_budget_count++;
+		report_hitch(stats, frame_us, time_count, now);
+	}
+
+	if (stats->frame_count % k_window_frames == 0)
+	{
+		frame_stats_percentiles_t window;
+		frame_stats_get_window(stats, &window);
+		debug_print(k_print_info, "Last %llu frames: p50 %.2f ms p95 %.2f ms p99 %.2f ms max %.2f ms\n",
+			(unsigned long long)window.count, window.p50_ms, window.p95_ms, window.p99_ms, window.max_ms);
+	}
+	return over_budget;
+}
+
+void frame_stats_get_window(frame_stats_t* stats, frame_stats_percentiles_t* percentiles)
+{
+	// The histogram cannot forget its max, so take it from the frames themselves.
+	uint64_t max = 0;
+	for (int i = 0; i < stats->window_count; ++i)
+	{
+		max = stats->window_us[i] > max ? stats->window_us[i] : max;
+	}
+	histogram_get_percentiles(&stats->window, max, percentiles);
+}
+
+void frame_stats_get_total(frame_stats_t* stats, frame_stats_percentiles_t* percentiles)
+{
+	histogram_get_percentiles(&stats->total, stats->total.max, percentiles);
+}
+
+typedef struct summary_row_t
+{
+	const char* name;
+	frame_stats_percentiles_t percentiles;
+	uint64_t hitches;
+	// Instructions per cycle and misses per thousand instructions, where instructions were
+	// counted: high miss rates and low IPC mark memory bound code.
+	bool counted;
+	double ipc;
+	double l1d_mpki;
+	double llc_mpki;
+	double branch_mpki;
+} summary_row_t;
+
+static void summary_row_set_counters(summary_row_t* row, const uint64_t counters[k_perf_counter_count])
+{
+	double cycles = (double)counters[k_perf_counter_cycles];
+	double instructions = (double)counters[k_perf_counter_instructions];
+	row->counted = instructions > 0;
+	if (row->counted == false)
+	{
+		return;
+	}
+	row->ipc = cycles > 0 ? instructions / cycles : 0.0;
+	row->l1d_mpki = counters[k_perf_counter_l1d_misses] * 1000.0 / instructions;
+	row->llc_mpki = counters[k_perf_counter_llc_misses] * 1000.0 / instructions;
+	row->branch_mpki = counters[k_perf_counter_branch_misses] * 1000.0 / instructions;
+}
+
+static int compare_rows_p99(const void* a, const void* b)
+{
+	const summary_row_t* x = a;
+	const summary_row_t* y = b;
+	return x->percentiles.p99_ms > y->percentiles.p99_ms ? -1 : x->percentiles.p99_ms < y->percentiles.p99_ms ? 1 : 0;
+}
+
+bool frame_stats_write_summary(frame_stats_t* stats, fs_t* fs, const char* path)
+{
+	// Whole frames first, then scopes from the slowest p99 down.
+	bool counted = false;
+	summary_row_t rows[1 + k_max_scopes];
+	memset(rows, 0, sizeof(rows));
+	rows[0].name = "frame";
+	frame_stats_get_total(stats, &rows[0].percentiles);
+	rows[0].hitches = stats->over_budget_count;
+	for (int i = 0; i < stats->scope_count; ++i)
+	{
+		frame_scope_t* scope = stats->scopes[i];
+		rows[1 + i].name = scope->name_string;
+		histogram_get_percentiles(&scope->histogram, scope->histogram.max, &rows[1 + i].percentiles);
+		rows[1 + i].hitches = scope->hitch_count;
+		summary_row_set_counters(&rows[1 + i], scope->counters);
+		counted |= rows[1 + i].counted;
+	}
+	qsort(rows + 1, stats->scope_count, sizeof(summary_row_t), compare_rows_p99);
+
+	char* csv = heap_alloc(stats->heap, k_csv_capacity, 8);
+	int csv_size = snprintf(csv, k_csv_capacity, "scope,count,p50_ms,p95_ms,p99_ms,max_ms,hitches,ipc,l1d_mpki,llc_mpki,branch_mpki\n");
+
+	debug_print(k_print_info, "Frame times (budget %.2f ms; hitches are frames over it, or for scopes, the frames they were most behind):\n",
+		stats->budget_us / 1000.0);
+	debug_print(k_print_info, "  %-32s %10s %9s %9s %9s %9s %8s%s\n", "scope", "count", "p50 ms", "p95 ms", "p99 ms", "max ms", "hitches",
+		counted ? "      ipc  l1d mpki  llc mpki  br mpki" : "");
+	for (int i = 0; i < 1 + stats->scope_count; ++i)
+	{
+		const summary_row_t* row = &rows[i];
+		// Counter columns are left empty for rows without counts.
+		char counters[64] = "";
+		char csv_counters[64] = ",,,";
+		if (row->counted)
+		{
+			snprintf(counters, sizeof(counters), " %8.2f %9.2f %9.2f %8.2f", row->ipc, row->l1d_mpki, row->llc_mpki, row->branch_mpki);
+			snprintf(csv_counters, sizeof(csv_counters), "%.3f,%.3f,%.3f,%.3f", row->ipc, row->l1d_mpki, row->llc_mpki, row->branch_mpki);
+		}
+		debug_print(k_print_info, "  %-32s %10llu %9.2f %9.2f %9.2f %9.2f %8llu%s\n",
+			row->name, (unsigned long long)row->percentiles.count, row->percentiles.p50_ms, row->percentiles.p95_ms,
+			row->percentiles.p99_ms, row->percentiles.max_ms, (unsigned long long)row->hitches, counters);
+		if (csv_size < k_csv_capacity)
+		{
+			csv_size += snprintf(csv + csv_size, k_csv_capacity - csv_size, "%s,%llu,%.3f,%.3f,%.3f,%.3f,%llu,%s\n",
+				row->name, (unsigned long long)row->percentiles.count, row->percentiles.p50_ms, row->percentiles.p95_ms,
+				row->percentiles.p99_ms, row->percentiles.max_ms, (unsigned long long)row->hitches, csv_counters);
+		}
+	}
+
+	csv_size = csv_size < k_csv_capacity ? csv_size : k_csv_capacity - 1;
+	fs_work_t* work = fs_write(fs, path, csv, csv_size, false);
+	bool ok = fs_work_get_result(work) == 0;
+	fs_work_destroy(work);
+	if (!ok)
+	{
+		debug_print(k_print_error, "Unable to write %s\n", path);
+	}
+	heap_free(stats->heap, csv);
+	return ok;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Frame time statistics.
+// Tracks how long frames take, and how long the trace scopes recorded on the frame's thread
+// take within them, in HDR histograms: log-linear buckets that keep every value to within
+// 1% from microseconds up to an hour, in fixed space. Reports percentiles over a rolling
+// window of recent frames, names the scopes behind frames over budget, and summarizes the
+// whole run at the end so frame budgets can be tracked from build to build.
+
+typedef struct frame_stats_t frame_stats_t;
+
+typedef struct fs_t fs_t;
+typedef struct heap_t heap_t;
+typedef struct trace_t trace_t;
+
+// Percentiles of a set of frame or scope times, in milliseconds.
+typedef struct frame_stats_percentiles_t
+{
+	uint64_t count;
+	double p50_ms;
+	double p95_ms;
+	double p99_ms;
+	double max_ms;
+} frame_stats_percentiles_t;
+
+// Create frame statistics with a frame budget in milliseconds.
+// Scope times come from trace_scope_times, so they need the trace to be recording; trace may
+// be NULL to track frame times only.
+frame_stats_t* frame_stats_create(heap_t* heap, trace_t* trace, double budget_ms);
+
+// Destroy frame statistics.
+void frame_stats_destroy(frame_stats_t* stats);
+
+// Mark the end of a frame, on the thread that runs frames.
+// The frame's time is measured from the previous call. Prints the window's percentiles every
+// window, and a warning naming the slowest scopes of a frame over budget, at most once a
+// second; frames over budget in between are counted in the next warning and the summary.
+// Returns true if the frame was over budget.
+bool frame_stats_frame_end(frame_stats_t* stats);
+
+// Percentiles of the frame times in the rolling window of recent frames.
+void frame_stats_get_window(frame_stats_t* stats, frame_stats_percentiles_t* percentiles);
+
+// Percentiles of all frame times since creation.
+void frame_stats_get_total(frame_stats_t* stats, frame_stats_percentiles_t* percentiles);
+
+// Print the frame and scope percentiles since creation and write them to path as CSV, one row
+// per scope after one for whole frames. Where the trace counts hardware events, scopes also
+// get instructions per cycle and L1 data, last level cache and branch misses per thousand
+// instructions. Returns false if the file could not be written.
+bool frame_stats_write_summary(frame_stats_t* stats, fs_t* fs, const char* path);
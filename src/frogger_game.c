@@ -171,8 +171,8 @@ void frogger_game_update(frogger_game_t* game)
 
 static void load_resources(frogger_game_t* game)
 {
-	game->vertex_shader_work = fs_read(game->fs, "shaders/triangle.vert.spv", game->heap, false, false);
-	game->fragment_shader_work = fs_read(game->fs, "shaders/triangle.frag.spv", game->heap, false, false);
+	game->vertex_shader_work = fs_read_cached(game->fs, "shaders/triangle.vert.spv", false);
+	game->fragment_shader_work = fs_read_cached(game->fs, "shaders/triangle.frag.spv", false);
 	game->cube_shader = (gpu_shader_info_t)
 	{
 		.vertex_shader_data = fs_work_get_buffer(game->vertex_shader_work),
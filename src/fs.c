@@ -1,33 +1,276 @@
 #include "fs.h"
 
-#include "event.h"
+#include "archive.h"
+#include "atomic.h"
+#include "futex.h"
 #include "heap.h"
+#include "mutex.h"
 #include "queue.h"
+#include "semaphore.h"
 #include "thread.h"
+#include "trace.h"
+#include "uring.h"
 #include "lz4/lz4.h"
+#define LZ4F_STATIC_LINKING_ONLY
+#include "lz4/lz4frame.h"
+#define LZ4_HC_STATIC_LINKING_ONLY
+#include "lz4/lz4hc.h"
+#include "lz4/xxhash.h"
 #include "debug.h"
 #include "stdio.h"
 
+#include <limits.h>
 #include <string.h>
 
+#if defined(_WIN32)
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+#if defined(_WIN32)
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#if !defined(MADV_POPULATE_READ)
+#define MADV_POPULATE_READ 22
+#endif
+#endif
+#endif
+
+enum
+{
+	// Blocking file threads. Windows keeps one so operations complete in submission order.
+	// Other platforms use several when io_uring is unavailable, so slow reads overlap.
+#if defined(_WIN32)
+	k_fs_file_thread_count = 1,
+#else
+	k_fs_file_thread_count = 4,
+#endif
+	// Minimum io_uring submission entries: one per in-flight operation plus one for the wake read.
+	k_fs_uring_min_entries = 64,
+	// Transfers larger than this are split so each result fits in an int.
+	k_fs_max_io_size = 1 << 30,
+	// Read buffers per stream: one being read, one being decoded, one spare.
+	k_fs_stream_slots = 3,
+	k_fs_stream_default_chunk_size = 256 * 1024,
+	// Large enough to hold an LZ4 frame header, so the format is known from the first chunk.
+	k_fs_stream_min_chunk_size = 4096,
+	// Compressed files use small independent blocks so a range read decodes little beyond the range.
+	k_fs_frame_block_size = 64 * 1024,
+	// The seek table is an LZ4 skippable frame, which other LZ4 decoders pass over:
+	// skippable magic, frame size, compressed size of each block, block count, block size, seek magic.
+	k_fs_seek_skippable_magic = 0x184D2A5E,
+	k_fs_seek_magic = 0x314B5346, // "FSK1"
+	k_fs_seek_footer_size = 12,
+	// Compression threads; the default is one per logical CPU.
+	k_fs_max_compression_threads = 32,
+	// Smaller jobs are not worth waking other compression threads for.
+	k_fs_parallel_min_blocks = 4,
+	k_fs_max_archives = 8,
+	k_fs_max_dictionaries = 8,
+	// Anti-starvation: every k_fs_normal_turn-th file operation started prefers normal work over
+	// critical work, and every k_fs_background_turn-th prefers background work over both.
+	k_fs_normal_turn = 4,
+	k_fs_background_turn = 16,
+	// Hash buckets of the read cache; a power of two.
+	k_fs_cache_buckets = 256,
+};
+
+// A file held by the read cache. Entries are keyed by path, by whether the file was
+// decompressed, and by its modification time and size when it was read, so a file that
+// changed on disk misses.
+typedef struct fs_cache_entry_t
+{
+	struct fs_cache_entry_t* hash_next;
+	// Least recently used list; the head is the most recently used entry.
+	struct fs_cache_entry_t* lru_prev;
+	struct fs_cache_entry_t* lru_next;
+	uint64_t hash;
+	uint64_t mtime;
+	uint64_t file_size;
+	bool use_compression;
+	// The cache's reference to the decoded contents.
+	struct fs_view_t* view;
+	char path[];
+} fs_cache_entry_t;
+
+// A registered compression dictionary.
+typedef struct fs_dictionary_t
+{
+	uint32_t id;
+	char* data;
+	size_t size;
+	// Stream with the dictionary loaded, copied for each block compressed with the fast level.
+	LZ4_stream_t* stream;
+	// The same for higher levels, too large to copy; attached to each compression thread's own
+	// stream instead.
+	LZ4_streamHC_t* stream_hc;
+} fs_dictionary_t;
 
 typedef struct fs_t
 {
 	heap_t* heap;
-	queue_t* file_queue;
-	thread_t* file_thread;
+	// Work waiting for a file thread: a FIFO list per priority class, so queued work can be
+	// unlinked when cancelled. file_ready counts queued work, plus stale counts left by
+	// cancellations and one per file thread at shutdown.
+	mutex_t* file_mutex;
+	semaphore_t* file_ready;
+	struct fs_work_t* file_heads[k_fs_priority_count];
+	struct fs_work_t* file_tails[k_fs_priority_count];
+	int file_start_count;
+	bool file_quit;
+	thread_t* file_threads[k_fs_file_thread_count];
+	int file_thread_count;
 	queue_t* compression_queue;
-	thread_t* compression_thread;
+	thread_t* compression_threads[k_fs_max_compression_threads];
+	int compression_thread_count;
+	// Mounted archives, searched newest first.
+	fs_view_t* archives[k_fs_max_archives];
+	int archive_count;
+	// Registered dictionaries. Entries never move or change once counted, so readers only load
+	// the count; registration appends under dictionary_mutex and then publishes it.
+	mutex_t* dictionary_mutex;
+	fs_dictionary_t dictionaries[k_fs_max_dictionaries];
+	int dictionary_count;
+	// Read cache of fs_read_cached. Disabled while cache_capacity is zero.
+	mutex_t* cache_mutex;
+	size_t cache_capacity;
+	size_t cache_size;
+	int cache_entry_count;
+	uint64_t cache_hit_count;
+	uint64_t cache_miss_count;
+	uint64_t cache_eviction_count;
+	fs_cache_entry_t* cache_buckets[k_fs_cache_buckets];
+	fs_cache_entry_t* cache_lru_head;
+	fs_cache_entry_t* cache_lru_tail;
+	// Bumped on every completion so fs_work_wait_any can sleep on all of its work at once.
+	int completion_count;
+	int completion_waiters;
+	// Trace the file and compression threads record into, or NULL.
+	trace_t* trace;
+	// Bumped as work is created; the difference from completion_count is the work in flight.
+	int issue_count;
+#if defined(__linux__)
+	// When set, a single thread drives all file operations through the ring.
+	uring_t* uring;
+	// Producers bump this eventfd after queueing work so the ring thread wakes.
+	int wake_fd;
+	uint64_t wake_value;
+	int quit;
+	// Streams waiting for the decoder to hand back a read buffer. Ring thread only.
+	struct fs_work_t* stalled_streams;
+#endif
 } fs_t;
 
 typedef enum fs_work_op_t
 {
 	k_fs_work_op_read,
 	k_fs_work_op_write,
+	k_fs_work_op_map,
+	k_fs_work_op_stream,
+	k_fs_work_op_read_range,
 } fs_work_op_t;
 
+// Compressed data layout, detected from the first bytes of a file.
+typedef enum fs_stream_format_t
+{
+	k_fs_stream_format_unknown,
+	k_fs_stream_format_frame,
+	// "%d\n" size header and one LZ4 block, as written by older builds. Cannot be decoded
+	// incrementally, so it is gathered whole and delivered at the end.
+	k_fs_stream_format_legacy,
+} fs_stream_format_t;
+
+// State of a streaming read. The reader fills slots in order and queues each one for the
+// decoder; the decoder drains them in the same order and hands them back through free_slots.
+typedef struct fs_stream_t
+{
+	fs_chunk_fn_t fn;
+	void* user;
+	size_t chunk_size;
+	char* slots[k_fs_stream_slots];
+	size_t slot_sizes[k_fs_stream_slots];
+	semaphore_t* free_slots;
+	// Reader side.
+	int read_count;
+	int read_slot;
+	// Decoder side.
+	int decode_count;
+	fs_stream_format_t format;
+	LZ4F_dctx* dctx;
+	size_t frame_hint;
+	char* output;
+	char* legacy_buffer;
+	size_t legacy_size;
+	size_t legacy_capacity;
+	// Set once the frame header has been parsed and its dictionary found.
+	bool header_read;
+	const struct fs_dictionary_t* dictionary;
+	// Filled chunks queued for the decoder; the thread that raises it from zero queues the work.
+	int pending;
+	// Blocking backend: set while the reader waits for a slot outside the file queue; guarded
+	// by file_mutex.
+	bool parked;
+	// Set once the consumer stops the stream or decoding fails.
+	int cancelled;
+} fs_stream_t;
+
+typedef struct fs_view_t
+{
+	heap_t* heap;
+	void* address;
+	size_t size;
+	int ref_count;
+	// Set for an archive entry stored raw: the view is a slice of the archive's mapping.
+	struct fs_view_t* parent;
+	// Set for an archive entry that was decompressed: address is a heap copy.
+	bool owns_buffer;
+} fs_view_t;
+
+// Progress of a work item through the io_uring backend.
+typedef enum fs_work_step_t
+{
+	k_fs_work_step_open,
+	k_fs_work_step_transfer,
+	k_fs_work_step_close,
+	k_fs_work_step_prefetch,
+} fs_work_step_t;
+
+// A compression or decompression split into frame blocks that run on several compression threads.
+typedef struct fs_block_job_t
+{
+	bool (*run_block)(fs_work_t* work, int index);
+	int block_count;
+	// Next block to claim.
+	int next;
+	// Threads that have not finished claiming; the last one out completes the work.
+	int remaining;
+	int failed;
+	size_t block_size;
+	size_t content_size;
+	// Frame being written, or decoded file.
+	char* output;
+	size_t header_size;
+	// Compression: blocks land stride bytes apart and are packed once all are done.
+	size_t stride;
+	size_t table_size;
+	uint32_t* sizes;
+	uint32_t content_checksum;
+	// Decompression: where each block starts in the compressed data.
+	const char** sources;
+	size_t checksum_size;
+	const struct fs_dictionary_t* dictionary;
+} fs_block_job_t;
+
 typedef struct fs_work_t
 {
 	fs_t* fs;
@@ -36,73 +279,391 @@ typedef struct fs_work_t
 	char path[1024];
 	bool null_terminate;
 	bool use_compression;
+	// Writes only: add to the end of the file instead of replacing it.
+	bool append;
 	void* buffer;
 	size_t size;
 	void* temp_buffer;
 	size_t temp_size;
-	event_t* done;
+	// Completion state: 0 pending, 1 done, 2 pending with threads asleep in fs_work_wait.
+	int done;
+	// References from fs_work_retain; the work is freed when the last is dropped.
+	int ref_count;
+	// Completion callback. Registration and completion each bump callback_arm; whichever
+	// brings it to two dispatches the callback.
+	fs_work_callback_t callback;
+	void* callback_user;
+	fs_callback_queue_t* callback_queue;
+	int callback_arm;
+	struct fs_work_t* next_callback;
+	fs_priority_t priority;
+	// Dictionary a write compresses with.
+	const fs_dictionary_t* dictionary;
+	// Set while the work waits in a file queue; guarded by file_mutex.
+	bool queued;
+	struct fs_work_t* queue_prev;
+	struct fs_work_t* queue_next;
 	int result;
+	fs_work_step_t step;
+	int fd;
+#if defined(_WIN32)
+	// Open file of a stream between its turns on a file thread.
+	HANDLE handle;
+#endif
+	size_t offset;
+	fs_view_t* view;
+	fs_map_hint_t hint;
+	// Requested range of fs_read_range, in decompressed bytes.
+	size_t range_offset;
+	size_t range_size;
+	fs_stream_t* stream;
+	struct fs_work_t* next_stalled;
+	int compression_level;
+	fs_block_job_t* blocks;
+	// Set when the path resolved into a mounted archive.
+	fs_view_t* archive;
+	const archive_entry_t* entry;
+	// Set for fs_read_cached: the result is returned in a view rather than a caller buffer.
+	bool cached;
+	// Set when the result should also be kept in the cache, under the file version it was read at.
+	bool cache_keep;
+	uint64_t cache_mtime;
+	uint64_t cache_file_size;
 } fs_work_t;
 
 static int file_thread_func(void* user);
 static int compression_thread_func(void* user);
+static void file_queue_push(fs_t* fs, fs_work_t* work);
+static fs_work_t* file_queue_pop(fs_t* fs, bool wait);
+static void stream_finish(fs_work_t* work);
+static bool file_get_version(const char* path, uint64_t* mtime, uint64_t* size);
+static void cache_flush(fs_t* fs);
+static const fs_dictionary_t* dictionary_find(fs_t* fs, uint32_t id);
+static void cache_publish(fs_work_t* work);
+static void work_complete(fs_work_t* work);
+static fs_work_t* write_create(fs_t* fs, const char* path, const void* buffer, size_t size, int compression_level, uint32_t dictionary_id, bool append);
+#if defined(__linux__)
+static bool uring_backend_create(fs_t* fs, int queue_capacity);
+static void uring_backend_destroy(fs_t* fs);
+#endif
+
+// Priority of work queued by this thread.
+static THREAD_LOCAL fs_priority_t s_fs_priority = k_fs_priority_normal;
+
+// High level compression stream of a compression thread, made on its first block with a
+// dictionary and reset for each one after.
+static THREAD_LOCAL LZ4_streamHC_t* s_fs_stream_hc = NULL;
 
 fs_t* fs_create(heap_t* heap, int queue_capacity)
 {
+	return fs_create_ex(heap, queue_capacity, 0);
+}
+
+fs_t* fs_create_ex(heap_t* heap, int queue_capacity, int compression_thread_count)
+{
+	if (compression_thread_count <= 0)
+	{
+		// One per CPU compression threads are pinned to; more would only take turns on them.
+		compression_thread_count = thread_get_role_cpu_count(k_thread_role_compression);
+	}
+	compression_thread_count = compression_thread_count < k_fs_max_compression_threads ? compression_thread_count : k_fs_max_compression_threads;
+
 	fs_t* fs = heap_alloc(heap, sizeof(fs_t), 8);
 	fs->heap = heap;
-	fs->file_queue = queue_create(heap, queue_capacity);
-	fs->file_thread = thread_create(file_thread_func, fs);
+	fs->file_mutex = mutex_create_named("fs file queue");
+	fs->file_ready = semaphore_create(0, INT_MAX);
+	memset(fs->file_heads, 0, sizeof(fs->file_heads));
+	memset(fs->file_tails, 0, sizeof(fs->file_tails));
+	fs->file_start_count = 0;
+	fs->file_quit = false;
+	fs->file_thread_count = 0;
 	fs->compression_queue = queue_create(heap, queue_capacity);
-	fs->compression_thread = thread_create(compression_thread_func, fs);
+	fs->archive_count = 0;
+	fs->dictionary_mutex = mutex_create_named("fs dictionaries");
+	fs->dictionary_count = 0;
+	fs->completion_count = 0;
+	fs->issue_count = 0;
+	fs->trace = NULL;
+	fs->completion_waiters = 0;
+	fs->cache_mutex = mutex_create_named("fs cache");
+	fs->cache_capacity = 0;
+	fs->cache_size = 0;
+	fs->cache_entry_count = 0;
+	fs->cache_hit_count = 0;
+	fs->cache_miss_count = 0;
+	fs->cache_eviction_count = 0;
+	memset(fs->cache_buckets, 0, sizeof(fs->cache_buckets));
+	fs->cache_lru_head = NULL;
+	fs->cache_lru_tail = NULL;
+
+	// Threads read the fields above as soon as they start, so they are started last.
+#if defined(__linux__)
+	if (!uring_backend_create(fs, queue_capacity))
+#endif
+	{
+		thread_desc_t file_desc = thread_desc_for_role(k_thread_role_io, "fs file");
+		for (int i = 0; i < k_fs_file_thread_count; ++i)
+		{
+			fs->file_threads[fs->file_thread_count++] = thread_create_ex(file_thread_func, fs, &file_desc);
+		}
+	}
+	thread_desc_t compression_desc = thread_desc_for_role(k_thread_role_compression, "fs compression");
+	fs->compression_thread_count = compression_thread_count;
+	for (int i = 0; i < compression_thread_count; ++i)
+	{
+		fs->compression_threads[i] = thread_create_ex(compression_thread_func, fs, &compression_desc);
+	}
 	return fs;
 }
 
 void fs_destroy(fs_t* fs)
 {
-	queue_push(fs->file_queue, NULL);
-	thread_destroy(fs->file_thread);
-	queue_destroy(fs->file_queue);
-	queue_push(fs->compression_queue, NULL);
-	thread_destroy(fs->compression_thread);
+#if defined(__linux__)
+	if (fs->uring)
+	{
+		uring_backend_destroy(fs);
+	}
+#endif
+	// File threads finish the queued work before they see the quit flag.
+	mutex_lock(fs->file_mutex);
+	fs->file_quit = true;
+	mutex_unlock(fs->file_mutex);
+	for (int i = 0; i < fs->file_thread_count; ++i)
+	{
+		semaphore_release(fs->file_ready);
+	}
+	for (int i = 0; i < fs->file_thread_count; ++i)
+	{
+		thread_destroy(fs->file_threads[i]);
+	}
+	semaphore_destroy(fs->file_ready);
+	mutex_destroy(fs->file_mutex);
+	for (int i = 0; i < fs->compression_thread_count; ++i)
+	{
+		queue_push(fs->compression_queue, NULL);
+	}
+	for (int i = 0; i < fs->compression_thread_count; ++i)
+	{
+		thread_destroy(fs->compression_threads[i]);
+	}
 	queue_destroy(fs->compression_queue);
+	for (int i = 0; i < fs->archive_count; ++i)
+	{
+		fs_view_release(fs->archives[i]);
+	}
+	cache_flush(fs);
+	mutex_destroy(fs->cache_mutex);
+	for (int i = 0; i < fs->dictionary_count; ++i)
+	{
+		heap_free(fs->heap, fs->dictionaries[i].stream);
+		heap_free(fs->heap, fs->dictionaries[i].stream_hc);
+		heap_free(fs->heap, fs->dictionaries[i].data);
+	}
+	mutex_destroy(fs->dictionary_mutex);
 	heap_free(fs->heap, fs);
 }
 
-fs_work_t* fs_read(fs_t* fs, const char* path, heap_t* heap, bool null_terminate, bool use_compression)
+bool fs_mount(fs_t* fs, const char* path)
+{
+	if (fs->archive_count == k_fs_max_archives)
+	{
+		debug_print(k_print_error, "Unable to mount %s: too many archives\n", path);
+		return false;
+	}
+
+	fs_work_t* work = fs_map(fs, path, k_fs_map_hint_normal);
+	fs_view_t* view = fs_work_get_view(work);
+	fs_work_destroy(work);
+	if (view == NULL)
+	{
+		debug_print(k_print_warning, "Unable to mount %s\n", path);
+		return false;
+	}
+	if (!archive_is_valid(view->address, view->size))
+	{
+		debug_print(k_print_error, "Unable to mount %s: not a valid archive\n", path);
+		fs_view_release(view);
+		return false;
+	}
+	fs->archives[fs->archive_count++] = view;
+	// Cached archive entries may now be shadowed.
+	cache_flush(fs);
+	return true;
+}
+
+uint32_t fs_dictionary_register(fs_t* fs, const void* data, size_t size)
+{
+	if (size > k_fs_max_dictionary_size)
+	{
+		data = (const char*)data + size - k_fs_max_dictionary_size;
+		size = k_fs_max_dictionary_size;
+	}
+	if (size == 0)
+	{
+		return 0;
+	}
+	uint32_t id = XXH32(data, size, 0);
+	// Zero means "no dictionary" in a frame header.
+	id = id ? id : 1;
+
+	mutex_lock(fs->dictionary_mutex);
+	if (dictionary_find(fs, id))
+	{
+		mutex_unlock(fs->dictionary_mutex);
+		return id;
+	}
+	if (fs->dictionary_count == k_fs_max_dictionaries)
+	{
+		mutex_unlock(fs->dictionary_mutex);
+		debug_print(k_print_error, "Unable to register compression dictionary: too many dictionaries\n");
+		return 0;
+	}
+
+	fs_dictionary_t* dictionary = &fs->dictionaries[fs->dictionary_count];
+	dictionary->id = id;
+	dictionary->size = size;
+	dictionary->data = heap_alloc(fs->heap, size, 8);
+	memcpy(dictionary->data, data, size);
+	dictionary->stream = LZ4_initStream(heap_alloc(fs->heap, sizeof(LZ4_stream_t), 8), sizeof(LZ4_stream_t));
+	LZ4_loadDict(dictionary->stream, dictionary->data, (int)size);
+	dictionary->stream_hc = LZ4_initStreamHC(heap_alloc(fs->heap, sizeof(LZ4_streamHC_t), 8), sizeof(LZ4_streamHC_t));
+	if (dictionary->stream_hc)
+	{
+		LZ4_loadDictHC(dictionary->stream_hc, dictionary->data, (int)size);
+	}
+	// Compression threads may be searching the list; the entry is complete before it is counted.
+	atomic_store_release(&fs->dictionary_count, fs->dictionary_count + 1);
+	mutex_unlock(fs->dictionary_mutex);
+	return id;
+}
+
+static const fs_dictionary_t* dictionary_find(fs_t* fs, uint32_t id)
+{
+	int count = atomic_load_acquire(&fs->dictionary_count);
+	for (int i = 0; i < count; ++i)
+	{
+		if (fs->dictionaries[i].id == id)
+		{
+			return &fs->dictionaries[i];
+		}
+	}
+	return NULL;
+}
+
+// Finds the dictionary a frame was compressed with. Returns false, after reporting it, if the
+// frame names a dictionary that is not registered.
+static bool dictionary_for_frame(fs_work_t* work, const LZ4F_frameInfo_t* info, const fs_dictionary_t** dictionary)
+{
+	*dictionary = info->dictID ? dictionary_find(work->fs, info->dictID) : NULL;
+	if (info->dictID && *dictionary == NULL)
+	{
+		debug_print(k_print_error, "Unable to decompress %s: compression dictionary %08x is not registered\n", work->path, info->dictID);
+		return false;
+	}
+	return true;
+}
+
+// Points work at the entry for its path in the newest mounted archive that has one.
+static bool archive_resolve(fs_t* fs, fs_work_t* work)
+{
+	for (int i = fs->archive_count - 1; i >= 0; --i)
+	{
+		const archive_entry_t* entry = archive_find(fs->archives[i]->address, work->path);
+		if (entry)
+		{
+			work->archive = fs->archives[i];
+			work->entry = entry;
+			// The entry records whether it is compressed; the caller's flag does not apply.
+			work->use_compression = false;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Allocate work with every field at its default, counted as issued.
+// Constructors set only what differs for their operation.
+static fs_work_t* work_create(fs_t* fs, fs_work_op_t op, const char* path, heap_t* heap)
 {
 	fs_work_t* work = heap_alloc(fs->heap, sizeof(fs_work_t), 8);
+	memset(work, 0, sizeof(*work));
 	work->fs = fs;
 	work->heap = heap;
-	work->op = k_fs_work_op_read;
-	strcpy_s(work->path, sizeof(work->path), path);
-	work->buffer = NULL;
-	work->size = 0;
-	work->temp_buffer = NULL;
-	work->temp_size = 0;
-	work->done = event_create();
-	work->result = 0;
+	work->op = op;
+	work->ref_count = 1;
+	snprintf(work->path, sizeof(work->path), "%s", path);
+	work->priority = s_fs_priority;
+	work->hint = k_fs_map_hint_normal;
+	work->compression_level = k_fs_compression_none;
+	atomic_increment(&fs->issue_count);
+	return work;
+}
+
+fs_work_t* fs_read(fs_t* fs, const char* path, heap_t* heap, bool null_terminate, bool use_compression)
+{
+	fs_work_t* work = work_create(fs, k_fs_work_op_read, path, heap);
 	work->null_terminate = null_terminate;
 	work->use_compression = use_compression;
-	queue_push(fs->file_queue, work);
+	work->compression_level = use_compression ? k_fs_compression_fast : k_fs_compression_none;
+	if (archive_resolve(fs, work))
+	{
+		queue_push(fs->compression_queue, work);
+	}
+	else
+	{
+		file_queue_push(fs, work);
+	}
 	return work;
 }
 
 fs_work_t* fs_write(fs_t* fs, const char* path, const void* buffer, size_t size, bool use_compression)
 {
-	fs_work_t* work = heap_alloc(fs->heap, sizeof(fs_work_t), 8);
-	work->fs = fs;
-	work->heap = fs->heap;
-	work->op = k_fs_work_op_write;
-	strcpy_s(work->path, sizeof(work->path), path);
+	return fs_write_ex(fs, path, buffer, size, use_compression ? k_fs_compression_fast : k_fs_compression_none);
+}
+
+fs_work_t* fs_write_ex(fs_t* fs, const char* path, const void* buffer, size_t size, int compression_level)
+{
+	return fs_write_with_dictionary(fs, path, buffer, size, compression_level, 0);
+}
+
+fs_work_t* fs_write_with_dictionary(fs_t* fs, const char* path, const void* buffer, size_t size, int compression_level, uint32_t dictionary_id)
+{
+	return write_create(fs, path, buffer, size, compression_level, dictionary_id, false);
+}
+
+fs_work_t* fs_append(fs_t* fs, const char* path, const void* buffer, size_t size)
+{
+	return write_create(fs, path, buffer, size, k_fs_compression_none, 0, true);
+}
+
+static fs_work_t* write_create(fs_t* fs, const char* path, const void* buffer, size_t size, int compression_level, uint32_t dictionary_id, bool append)
+{
+	bool use_compression = compression_level > k_fs_compression_none;
+	fs_work_t* work = work_create(fs, k_fs_work_op_write, path, fs->heap);
+	work->append = append;
 	work->buffer = (void*)buffer;
 	work->size = size;
-	work->temp_buffer = NULL;
-	work->temp_size = 0;
-	work->done = event_create();
-	work->result = 0;
-	work->null_terminate = false;
 	work->use_compression = use_compression;
+	work->compression_level = compression_level < k_fs_compression_hc_max ? compression_level : k_fs_compression_hc_max;
+
+	if (dictionary_id)
+	{
+		work->dictionary = use_compression ? dictionary_find(fs, dictionary_id) : NULL;
+		if (work->dictionary == NULL)
+		{
+			if (!use_compression)
+			{
+				debug_print(k_print_error, "Unable to write %s: a compression dictionary needs a compression level\n", path);
+			}
+			else
+			{
+				debug_print(k_print_error, "Unable to write %s: compression dictionary %08x is not registered\n", path, dictionary_id);
+			}
+			work->result = -1;
+			work_complete(work);
+			return work;
+		}
+	}
 
 	if (use_compression)
 	{
@@ -111,181 +672,2665 @@ fs_work_t* fs_write(fs_t* fs, const char* path, const void* buffer, size_t size,
 	}
 	else
 	{
-		queue_push(fs->file_queue, work);
+		file_queue_push(fs, work);
 	}
 
 	return work;
 }
 
-bool fs_work_is_done(fs_work_t* work)
+fs_work_t* fs_map(fs_t* fs, const char* path, fs_map_hint_t hint)
 {
-	return work ? event_is_raised(work->done) : true;
+	fs_work_t* work = work_create(fs, k_fs_work_op_map, path, fs->heap);
+	work->hint = hint;
+	if (archive_resolve(fs, work))
+	{
+		queue_push(fs->compression_queue, work);
+	}
+	else
+	{
+		file_queue_push(fs, work);
+	}
+	return work;
 }
 
-void fs_work_wait(fs_work_t* work)
+fs_work_t* fs_read_range(fs_t* fs, const char* path, heap_t* heap, size_t offset, size_t size, bool use_compression)
+{
+	// The file is mapped rather than read, so only the pages under the covering blocks are touched.
+	fs_work_t* work = work_create(fs, k_fs_work_op_read_range, path, heap);
+	work->range_offset = offset;
+	work->range_size = size;
+	work->use_compression = use_compression;
+	work->compression_level = use_compression ? k_fs_compression_fast : k_fs_compression_none;
+	file_queue_push(fs, work);
+	return work;
+}
+
+fs_work_t* fs_read_stream(fs_t* fs, const char* path, size_t chunk_size, bool use_compression, fs_chunk_fn_t fn, void* user)
 {
-	if (work)
+	if (chunk_size == 0)
+	{
+		chunk_size = k_fs_stream_default_chunk_size;
+	}
+	chunk_size = chunk_size < k_fs_stream_min_chunk_size ? k_fs_stream_min_chunk_size : chunk_size;
+	chunk_size = chunk_size > k_fs_max_io_size ? k_fs_max_io_size : chunk_size;
+
+	fs_stream_t* stream = heap_alloc(fs->heap, sizeof(fs_stream_t), 8);
+	memset(stream, 0, sizeof(*stream));
+	stream->fn = fn;
+	stream->user = user;
+	stream->chunk_size = chunk_size;
+	for (int i = 0; i < k_fs_stream_slots; ++i)
 	{
-		event_wait(work->done);
+		stream->slots[i] = heap_alloc(fs->heap, chunk_size, 8);
 	}
+	stream->free_slots = semaphore_create(k_fs_stream_slots, k_fs_stream_slots);
+	stream->output = use_compression ? heap_alloc(fs->heap, chunk_size, 8) : NULL;
+
+	fs_work_t* work = work_create(fs, k_fs_work_op_stream, path, fs->heap);
+	work->use_compression = use_compression;
+	work->stream = stream;
+	work->compression_level = use_compression ? k_fs_compression_fast : k_fs_compression_none;
+	file_queue_push(fs, work);
+	return work;
 }
 
-int fs_work_get_result(fs_work_t* work)
+fs_view_t* fs_work_get_view(fs_work_t* work)
 {
 	fs_work_wait(work);
-	return work ? work->result : -1;
+	if (work == NULL || work->view == NULL)
+	{
+		return NULL;
+	}
+	fs_view_acquire(work->view);
+	return work->view;
 }
 
-void* fs_work_get_buffer(fs_work_t* work)
+const void* fs_view_get_data(fs_view_t* view)
 {
-	fs_work_wait(work);
-	return work ? work->buffer : NULL;
+	return view->address;
 }
 
-size_t fs_work_get_size(fs_work_t* work)
+size_t fs_view_get_size(fs_view_t* view)
 {
-	fs_work_wait(work);
-	return work ? work->size : 0;
+	return view->size;
 }
 
-void fs_work_destroy(fs_work_t* work)
+void fs_view_acquire(fs_view_t* view)
+{
+	atomic_increment(&view->ref_count);
+}
+
+static void view_unmap(fs_view_t* view);
+
+void fs_view_release(fs_view_t* view)
 {
-	if (work)
+	if (atomic_decrement(&view->ref_count) == 1)
 	{
-		event_wait(work->done);
-		event_destroy(work->done);
-		if (work->use_compression)
+		if (view->parent)
 		{
-			heap_free(work->heap, work->temp_buffer);
+			fs_view_release(view->parent);
 		}
-		heap_free(work->heap, work);
+		else if (view->owns_buffer)
+		{
+			heap_free(view->heap, view->address);
+		}
+		else
+		{
+			view_unmap(view);
+		}
+		heap_free(view->heap, view);
 	}
 }
 
-static void file_read(fs_work_t* work)
+// Wraps a mapping in a view holding one reference, and points the work at it.
+static void view_create(fs_work_t* work, void* address, size_t size)
 {
-	wchar_t wide_path[1024];
-	if (MultiByteToWideChar(CP_UTF8, 0, work->path, -1, wide_path, sizeof(wide_path)) <= 0)
+	fs_view_t* view = heap_alloc(work->fs->heap, sizeof(fs_view_t), 8);
+	view->heap = work->fs->heap;
+	view->address = address;
+	view->size = size;
+	view->ref_count = 1;
+	view->parent = NULL;
+	view->owns_buffer = false;
+	work->view = view;
+	work->buffer = address;
+	work->size = size;
+}
+
+// Cache lists are only touched with cache_mutex held.
+static void cache_lru_unlink(fs_t* fs, fs_cache_entry_t* entry)
+{
+	if (entry->lru_prev)
 	{
-		work->result = -1;
-		event_signal(work->done);
-		return;
+		entry->lru_prev->lru_next = entry->lru_next;
 	}
-
-	HANDLE handle = CreateFile(wide_path, GENERIC_READ, FILE_SHARE_READ, NULL,
-		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-	if (handle == INVALID_HANDLE_VALUE)
+	else
 	{
-		work->result = GetLastError();
-		event_signal(work->done);
-		return;
+		fs->cache_lru_head = entry->lru_next;
 	}
-
-	if (!GetFileSizeEx(handle, (PLARGE_INTEGER)&work->size))
+	if (entry->lru_next)
 	{
-		work->result = GetLastError();
-		CloseHandle(handle);
-		event_signal(work->done);
-		return;
+		entry->lru_next->lru_prev = entry->lru_prev;
 	}
-
-	work->buffer = heap_alloc(work->heap, work->null_terminate ? work->size + 1 : work->size, 8);
-
-	DWORD bytes_read = 0;
-	if (!ReadFile(handle, work->buffer, (DWORD)work->size, &bytes_read, NULL))
+	else
 	{
-		work->result = GetLastError();
-		CloseHandle(handle);
-		event_signal(work->done);
-		return;
+		fs->cache_lru_tail = entry->lru_prev;
 	}
+}
 
-	work->size = bytes_read;
-	if (work->null_terminate)
+static void cache_lru_push(fs_t* fs, fs_cache_entry_t* entry)
+{
+	entry->lru_prev = NULL;
+	entry->lru_next = fs->cache_lru_head;
+	if (fs->cache_lru_head)
 	{
-		((char*)work->buffer)[bytes_read] = 0;
+		fs->cache_lru_head->lru_prev = entry;
 	}
+	else
+	{
+		fs->cache_lru_tail = entry;
+	}
+	fs->cache_lru_head = entry;
+}
 
-	CloseHandle(handle);
+// Drops the cache's reference to an entry. Readers still holding the view keep the buffer alive.
+static void cache_remove(fs_t* fs, fs_cache_entry_t* entry)
+{
+	fs_cache_entry_t** link = &fs->cache_buckets[entry->hash & (k_fs_cache_buckets - 1)];
+	while (*link != entry)
+	{
+		link = &(*link)->hash_next;
+	}
+	*link = entry->hash_next;
+	cache_lru_unlink(fs, entry);
+	fs->cache_size -= entry->view->size;
+	fs->cache_entry_count--;
+	fs_view_release(entry->view);
+	heap_free(fs->heap, entry);
+}
 
-	if (work->use_compression)
+// Evicts least recently used entries until the cache holds at most size bytes.
+static void cache_evict(fs_t* fs, size_t size)
+{
+	while (fs->cache_size > size || (size == 0 && fs->cache_lru_tail))
 	{
-		// HOMEWORK 2: Queue file read work on decompression queue!
-		queue_push(work->fs->compression_queue, work);
+		cache_remove(fs, fs->cache_lru_tail);
+		fs->cache_eviction_count++;
 	}
-	else
+}
+
+static void cache_flush(fs_t* fs)
+{
+	mutex_lock(fs->cache_mutex);
+	while (fs->cache_lru_tail)
 	{
-		event_signal(work->done);
+		cache_remove(fs, fs->cache_lru_tail);
 	}
+	mutex_unlock(fs->cache_mutex);
 }
 
-static void file_write(fs_work_t* work)
+// Completes an fs_read_cached read: the buffer moves into a view that the work and the cache share.
+// Files larger than the whole cache are returned but not kept.
+static void cache_publish(fs_work_t* work)
 {
-	wchar_t wide_path[1024];
-	if (MultiByteToWideChar(CP_UTF8, 0, work->path, -1, wide_path, sizeof(wide_path)) <= 0)
+	if (!work->cached || work->result != 0)
 	{
-		work->result = -1;
-		event_signal(work->done);
 		return;
 	}
-
-	HANDLE handle = CreateFile(wide_path, GENERIC_WRITE, FILE_SHARE_WRITE, NULL,
-		CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
-	if (handle == INVALID_HANDLE_VALUE)
+	view_create(work, work->buffer, work->size);
+	work->view->owns_buffer = true;
+	if (!work->cache_keep)
 	{
-		work->result = GetLastError();
-		event_signal(work->done);
 		return;
 	}
 
-	void* buffer = (work->use_compression ? work->temp_buffer : work->buffer);
-	size_t size = (work->use_compression ? work->temp_size : work->size);
-
-	DWORD bytes_written = 0;
-	if (!WriteFile(handle, buffer, (DWORD)size, &bytes_written, NULL))
+	fs_t* fs = work->fs;
+	uint64_t hash = archive_hash_path(work->path);
+	size_t path_size = strlen(work->path) + 1;
+	mutex_lock(fs->cache_mutex);
+	if (work->size > fs->cache_capacity)
 	{
-		work->result = GetLastError();
-		CloseHandle(handle);
-		event_signal(work->done);
+		mutex_unlock(fs->cache_mutex);
 		return;
 	}
-
-	if (work->use_compression)
+	fs_cache_entry_t* entry = fs->cache_buckets[hash & (k_fs_cache_buckets - 1)];
+	while (entry && (entry->hash != hash || strcmp(entry->path, work->path) != 0))
 	{
-		work->temp_size = bytes_written;
+		entry = entry->hash_next;
 	}
-	else
+	if (entry && entry->mtime == work->cache_mtime && entry->file_size == work->cache_file_size && entry->use_compression == work->use_compression)
 	{
-		work->size = bytes_written;
+		// Another reader of the same version got here first.
+		mutex_unlock(fs->cache_mutex);
+		return;
 	}
-
-	CloseHandle(handle);
-
-	event_signal(work->done);
+	if (entry)
+	{
+		cache_remove(fs, entry);
+	}
+	if (fs->cache_size + work->size > fs->cache_capacity)
+	{
+		cache_evict(fs, fs->cache_capacity - work->size);
+	}
+	entry = heap_alloc(fs->heap, sizeof(fs_cache_entry_t) + path_size, 8);
+	entry->hash = hash;
+	entry->mtime = work->cache_mtime;
+	entry->file_size = work->cache_file_size;
+	entry->use_compression = work->use_compression;
+	entry->view = work->view;
+	fs_view_acquire(entry->view);
+	memcpy(entry->path, work->path, path_size);
+	entry->hash_next = fs->cache_buckets[hash & (k_fs_cache_buckets - 1)];
+	fs->cache_buckets[hash & (k_fs_cache_buckets - 1)] = entry;
+	cache_lru_push(fs, entry);
+	fs->cache_size += work->size;
+	fs->cache_entry_count++;
+	mutex_unlock(fs->cache_mutex);
 }
 
-static int file_thread_func(void* user)
+// Reads one byte per page so the call returns only once every page is resident.
+static void view_touch_pages(fs_view_t* view)
 {
-	fs_t* fs = user;
-	while (true)
+	volatile const char* bytes = view->address;
+	for (size_t offset = 0; offset < view->size; offset += 4096)
 	{
-		fs_work_t* work = queue_pop(fs->file_queue);
-		if (work == NULL)
+		(void)bytes[offset];
+	}
+}
+
+fs_work_t* fs_read_cached(fs_t* fs, const char* path, bool use_compression)
+{
+	fs_work_t* work = work_create(fs, k_fs_work_op_read, path, fs->heap);
+	work->null_terminate = true;
+	work->use_compression = use_compression;
+	work->compression_level = use_compression ? k_fs_compression_fast : k_fs_compression_none;
+	work->cached = true;
+
+	// Archive entries cannot change while mounted, so they are versioned by the archive alone.
+	bool in_archive = archive_resolve(fs, work);
+	uint64_t mtime = 0;
+	uint64_t file_size = 0;
+	if (fs->cache_capacity > 0 && (in_archive || file_get_version(work->path, &mtime, &file_size)))
+	{
+		uint64_t hash = archive_hash_path(work->path);
+		mutex_lock(fs->cache_mutex);
+		fs_cache_entry_t* entry = fs->cache_buckets[hash & (k_fs_cache_buckets - 1)];
+		while (entry && (entry->hash != hash || strcmp(entry->path, work->path) != 0))
+		{
+			entry = entry->hash_next;
+		}
+		if (entry && entry->mtime == mtime && entry->file_size == file_size && entry->use_compression == work->use_compression)
+		{
+			cache_lru_unlink(fs, entry);
+			cache_lru_push(fs, entry);
+			fs_view_acquire(entry->view);
+			work->view = entry->view;
+			fs->cache_hit_count++;
+			mutex_unlock(fs->cache_mutex);
+
+			work->buffer = work->view->address;
+			work->size = work->view->size;
+			work->use_compression = false;
+			work_complete(work);
+			return work;
+		}
+		fs->cache_miss_count++;
+		mutex_unlock(fs->cache_mutex);
+
+		work->cache_keep = true;
+		work->cache_mtime = mtime;
+		work->cache_file_size = file_size;
+	}
+
+	if (in_archive)
+	{
+		queue_push(fs->compression_queue, work);
+	}
+	else
+	{
+		file_queue_push(fs, work);
+	}
+	return work;
+}
+
+void fs_cache_configure(fs_t* fs, size_t capacity)
+{
+	mutex_lock(fs->cache_mutex);
+	fs->cache_capacity = capacity;
+	cache_evict(fs, capacity);
+	mutex_unlock(fs->cache_mutex);
+}
+
+void fs_set_trace(fs_t* fs, trace_t* trace)
+{
+	atomic_store_ptr_release((void**)&fs->trace, trace);
+}
+
+// The trace to record into, which fs_set_trace may change while the threads run.
+static trace_t* fs_get_trace(fs_t* fs)
+{
+	return atomic_load_ptr_acquire((void**)&fs->trace);
+}
+
+void fs_emit_counters(fs_t* fs, trace_t* trace)
+{
+	trace_counter_series(trace, "fs", "in_flight", atomic_load_acquire(&fs->issue_count) - atomic_load_acquire(&fs->completion_count));
+	fs_cache_stats_t stats;
+	fs_cache_get_stats(fs, &stats);
+	trace_counter_series(trace, "fs cache", "bytes", (int64_t)stats.size);
+}
+
+void fs_cache_get_stats(fs_t* fs, fs_cache_stats_t* stats)
+{
+	mutex_lock(fs->cache_mutex);
+	stats->hit_count = fs->cache_hit_count;
+	stats->miss_count = fs->cache_miss_count;
+	stats->eviction_count = fs->cache_eviction_count;
+	stats->size = fs->cache_size;
+	stats->capacity = fs->cache_capacity;
+	stats->entry_count = fs->cache_entry_count;
+	mutex_unlock(fs->cache_mutex);
+}
+
+typedef struct fs_callback_queue_t
+{
+	heap_t* heap;
+	// Completed work whose callbacks have not run, newest first.
+	fs_work_t* head;
+} fs_callback_queue_t;
+
+fs_callback_queue_t* fs_callback_queue_create(heap_t* heap)
+{
+	fs_callback_queue_t* queue = heap_alloc(heap, sizeof(fs_callback_queue_t), 8);
+	queue->heap = heap;
+	queue->head = NULL;
+	return queue;
+}
+
+void fs_callback_queue_destroy(fs_callback_queue_t* queue)
+{
+	fs_callback_queue_run(queue);
+	heap_free(queue->heap, queue);
+}
+
+int fs_callback_queue_run(fs_callback_queue_t* queue)
+{
+	fs_work_t* list = atomic_swap_ptr((void**)&queue->head, NULL);
+
+	// Reverse so callbacks run in completion order.
+	fs_work_t* ordered = NULL;
+	while (list)
+	{
+		fs_work_t* next = list->next_callback;
+		list->next_callback = ordered;
+		ordered = list;
+		list = next;
+	}
+
+	int count = 0;
+	while (ordered)
+	{
+		fs_work_t* next = ordered->next_callback;
+		ordered->callback(ordered, ordered->callback_user);
+		ordered = next;
+		++count;
+	}
+	return count;
+}
+
+static void callback_dispatch(fs_work_t* work)
+{
+	fs_callback_queue_t* queue = work->callback_queue;
+	if (queue == NULL)
+	{
+		work->callback(work, work->callback_user);
+		return;
+	}
+	fs_work_t* head;
+	do
+	{
+		head = atomic_load_ptr_acquire((void**)&queue->head);
+		work->next_callback = head;
+	} while (atomic_compare_and_exchange_ptr((void**)&queue->head, head, work) != head);
+}
+
+void fs_work_set_callback(fs_work_t* work, fs_work_callback_t callback, void* user, fs_callback_queue_t* queue)
+{
+	work->callback = callback;
+	work->callback_user = user;
+	work->callback_queue = queue;
+	if (atomic_increment(&work->callback_arm) == 1)
+	{
+		// Completing; wait for it to be marked done so the callback sees the result.
+		fs_work_wait(work);
+		callback_dispatch(work);
+	}
+}
+
+// Marks work complete, wakes its waiters and dispatches its callback.
+// The work may be destroyed as soon as it is marked, so everything needed afterwards is read first.
+static void work_complete(fs_work_t* work)
+{
+	fs_t* fs = work->fs;
+	bool dispatch = atomic_increment(&work->callback_arm) == 1;
+	if (atomic_swap(&work->done, 1) == 2)
+	{
+		futex_wake_all(&work->done);
+	}
+
+	atomic_increment(&fs->completion_count);
+	atomic_fence_seq_cst();
+	if (atomic_load_relaxed(&fs->completion_waiters) > 0)
+	{
+		futex_wake_all(&fs->completion_count);
+	}
+
+	if (dispatch)
+	{
+		// Work with a callback belongs to the callback, so it is still alive here.
+		callback_dispatch(work);
+	}
+}
+
+bool fs_work_is_done(fs_work_t* work)
+{
+	return work ? atomic_load_acquire(&work->done) == 1 : true;
+}
+
+void fs_work_wait(fs_work_t* work)
+{
+	if (work == NULL || atomic_load_acquire(&work->done) == 1)
+	{
+		return;
+	}
+
+	for (int i = 0; i < k_futex_spin_count; ++i)
+	{
+		cpu_pause();
+		if (atomic_load_acquire(&work->done) == 1)
+		{
+			return;
+		}
+	}
+
+	while (true)
+	{
+		int state = atomic_load_acquire(&work->done);
+		if (state == 1)
+		{
+			break;
+		}
+		if (state == 0 && atomic_compare_and_exchange(&work->done, 0, 2) != 0)
+		{
+			continue;
+		}
+		futex_wait(&work->done, 2);
+	}
+}
+
+void fs_work_wait_all(fs_work_t** works, int count)
+{
+	for (int i = 0; i < count; ++i)
+	{
+		fs_work_wait(works[i]);
+	}
+}
+
+// Returns the index of the first complete work, or -1 if none is.
+static int work_find_done(fs_work_t** works, int count, bool* any)
+{
+	for (int i = 0; i < count; ++i)
+	{
+		if (works[i])
+		{
+			*any = true;
+			if (atomic_load_acquire(&works[i]->done) == 1)
+			{
+				return i;
+			}
+		}
+	}
+	return -1;
+}
+
+int fs_work_wait_any(fs_work_t** works, int count)
+{
+	bool any = false;
+	int index = work_find_done(works, count, &any);
+	if (index >= 0 || !any)
+	{
+		return index;
+	}
+
+	// Sleep on the file system's completion count rather than on each work: every completion
+	// bumps it, so a completion after the scan makes the wait return at once.
+	fs_t* fs = NULL;
+	for (int i = 0; fs == NULL; ++i)
+	{
+		fs = works[i] ? works[i]->fs : NULL;
+	}
+	atomic_increment(&fs->completion_waiters);
+	atomic_fence_seq_cst();
+	while (true)
+	{
+		int completion_count = atomic_load_acquire(&fs->completion_count);
+		index = work_find_done(works, count, &any);
+		if (index >= 0)
+		{
+			break;
+		}
+		futex_wait(&fs->completion_count, completion_count);
+	}
+	atomic_decrement(&fs->completion_waiters);
+	return index;
+}
+
+int fs_work_get_result(fs_work_t* work)
+{
+	fs_work_wait(work);
+	return work ? work->result : -1;
+}
+
+void* fs_work_get_buffer(fs_work_t* work)
+{
+	fs_work_wait(work);
+	return work ? work->buffer : NULL;
+}
+
+size_t fs_work_get_size(fs_work_t* work)
+{
+	fs_work_wait(work);
+	return work ? work->size : 0;
+}
+
+void fs_work_retain(fs_work_t* work)
+{
+	atomic_increment(&work->ref_count);
+}
+
+void fs_work_destroy(fs_work_t* work)
+{
+	if (work == NULL)
+	{
+		return;
+	}
+	// Every owner waits, so dropping a reference still means the work has completed.
+	fs_work_wait(work);
+	if (atomic_decrement(&work->ref_count) == 1)
+	{
+		if (work->use_compression)
+		{
+			heap_free(work->heap, work->temp_buffer);
+		}
+		if (work->view)
+		{
+			fs_view_release(work->view);
+		}
+		else if (work->cached && work->buffer && !(work->use_compression && work->buffer == work->temp_buffer))
+		{
+			// A failed cached read; the caller never owns its buffer.
+			heap_free(work->heap, work->buffer);
+		}
+		heap_free(work->heap, work);
+	}
+}
+
+// Wakes the io_uring thread so it picks up new work or resumes stalled streams.
+static void fs_wake_file_thread(fs_t* fs)
+{
+#if defined(__linux__)
+	if (fs->uring)
+	{
+		eventfd_write(fs->wake_fd, 1);
+	}
+#endif
+}
+
+static void file_queue_push(fs_t* fs, fs_work_t* work)
+{
+	mutex_lock(fs->file_mutex);
+	work->queue_prev = fs->file_tails[work->priority];
+	work->queue_next = NULL;
+	if (work->queue_prev)
+	{
+		work->queue_prev->queue_next = work;
+	}
+	else
+	{
+		fs->file_heads[work->priority] = work;
+	}
+	fs->file_tails[work->priority] = work;
+	work->queued = true;
+	mutex_unlock(fs->file_mutex);
+
+	semaphore_release(fs->file_ready);
+	fs_wake_file_thread(fs);
+}
+
+// Removes work from its file queue. Caller holds file_mutex.
+static void file_queue_unlink(fs_t* fs, fs_work_t* work)
+{
+	if (work->queue_prev)
+	{
+		work->queue_prev->queue_next = work->queue_next;
+	}
+	else
+	{
+		fs->file_heads[work->priority] = work->queue_next;
+	}
+	if (work->queue_next)
+	{
+		work->queue_next->queue_prev = work->queue_prev;
+	}
+	else
+	{
+		fs->file_tails[work->priority] = work->queue_prev;
+	}
+	work->queued = false;
+}
+
+// Takes the next work to start, highest priority first except on anti-starvation turns.
+// With wait set, blocks until there is work; returns NULL at shutdown, or when not waiting
+// and nothing is queued.
+static fs_work_t* file_queue_pop(fs_t* fs, bool wait)
+{
+	while (true)
+	{
+		if (wait)
+		{
+			semaphore_acquire(fs->file_ready);
+		}
+		else if (!semaphore_try_acquire(fs->file_ready))
+		{
+			return NULL;
+		}
+
+		mutex_lock(fs->file_mutex);
+		int turn = ++fs->file_start_count;
+		fs_priority_t first = k_fs_priority_critical;
+		if (turn % k_fs_background_turn == 0)
+		{
+			first = k_fs_priority_background;
+		}
+		else if (turn % k_fs_normal_turn == 0)
+		{
+			first = k_fs_priority_normal;
+		}
+		fs_work_t* work = fs->file_heads[first];
+		for (int priority = 0; work == NULL && priority < k_fs_priority_count; ++priority)
+		{
+			work = fs->file_heads[priority];
+		}
+		if (work)
+		{
+			file_queue_unlink(fs, work);
+		}
+		bool quit = fs->file_quit;
+		mutex_unlock(fs->file_mutex);
+
+		// No work for this count means it was left by a cancellation, or is a shutdown count.
+		if (work || quit)
+		{
+			return work;
+		}
+	}
+}
+
+fs_priority_t fs_set_thread_priority(fs_priority_t priority)
+{
+	fs_priority_t previous = s_fs_priority;
+	s_fs_priority = priority;
+	return previous;
+}
+
+bool fs_work_cancel(fs_work_t* work)
+{
+	fs_t* fs = work->fs;
+	mutex_lock(fs->file_mutex);
+	// A stream queued again between its chunks has started, so it runs on.
+	bool queued = work->queued && !(work->stream && work->step != k_fs_work_step_open);
+	if (queued)
+	{
+		file_queue_unlink(fs, work);
+	}
+	mutex_unlock(fs->file_mutex);
+	if (!queued)
+	{
+		return false;
+	}
+
+	work->result = k_fs_result_cancelled;
+	if (work->stream)
+	{
+		// Frees the stream's buffers and completes the work without calling its consumer.
+		stream_finish(work);
+	}
+	else
+	{
+		work_complete(work);
+	}
+	return true;
+}
+
+static bool stream_try_acquire_slot(fs_stream_t* stream)
+{
+	if (!semaphore_try_acquire(stream->free_slots))
+	{
+		return false;
+	}
+	stream->read_slot = stream->read_count++ % k_fs_stream_slots;
+	return true;
+}
+
+// Blocking backend: claims the next read buffer of a stream, or parks the stream while the
+// decoder holds all of them. Returns false if parked; stream_return_slot queues it again.
+static bool stream_claim_slot(fs_work_t* work)
+{
+	fs_stream_t* stream = work->stream;
+	if (stream_try_acquire_slot(stream))
+	{
+		return true;
+	}
+	// Tried again under the lock the decoder takes to unpark, so a slot returned in between is
+	// not missed.
+	mutex_lock(work->fs->file_mutex);
+	bool acquired = stream_try_acquire_slot(stream);
+	stream->parked = !acquired;
+	mutex_unlock(work->fs->file_mutex);
+	return acquired;
+}
+
+// Hands a decoded read buffer back to the reader: wakes the ring to resume the stream, or
+// queues a stream parked on the blocking backend.
+static void stream_return_slot(fs_work_t* work)
+{
+	fs_t* fs = work->fs;
+	fs_stream_t* stream = work->stream;
+	semaphore_release(stream->free_slots);
+#if defined(__linux__)
+	if (fs->uring)
+	{
+		fs_wake_file_thread(fs);
+		return;
+	}
+#endif
+	mutex_lock(fs->file_mutex);
+	bool parked = stream->parked;
+	stream->parked = false;
+	mutex_unlock(fs->file_mutex);
+	if (parked)
+	{
+		file_queue_push(fs, work);
+	}
+}
+
+// Queues a filled read buffer for the decoder. A zero size ends the stream.
+static void stream_push_chunk(fs_work_t* work, size_t size)
+{
+	work->stream->slot_sizes[work->stream->read_slot] = size;
+	if (atomic_increment(&work->stream->pending) == 0)
+	{
+		queue_push(work->fs->compression_queue, work);
+	}
+}
+
+static bool stream_is_cancelled(fs_stream_t* stream)
+{
+	return atomic_load_acquire(&stream->cancelled) != 0;
+}
+
+// Hands decoded bytes to the consumer.
+static void stream_deliver(fs_work_t* work, const void* data, size_t size)
+{
+	fs_stream_t* stream = work->stream;
+	if (size == 0 || stream_is_cancelled(stream))
+	{
+		return;
+	}
+	if (!stream->fn(stream->user, data, size, work->size))
+	{
+		atomic_store_release(&stream->cancelled, 1);
+	}
+	work->size += size;
+}
+
+static void stream_fail(fs_work_t* work, const char* message)
+{
+	debug_print(k_print_error, "%s: %s\n", message, work->path);
+	work->result = -1;
+	atomic_store_release(&work->stream->cancelled, 1);
+}
+
+// Buffers a chunk of a legacy file; the whole file is needed before it can be decoded.
+static void stream_gather_legacy(fs_work_t* work, const char* data, size_t size)
+{
+	fs_stream_t* stream = work->stream;
+	if (stream->legacy_size + size > stream->legacy_capacity)
+	{
+		size_t capacity = stream->legacy_capacity ? stream->legacy_capacity * 2 : stream->chunk_size * 4;
+		while (capacity < stream->legacy_size + size)
+		{
+			capacity *= 2;
+		}
+		char* buffer = heap_alloc(work->heap, capacity, 8);
+		if (stream->legacy_buffer)
+		{
+			memcpy(buffer, stream->legacy_buffer, stream->legacy_size);
+			heap_free(work->heap, stream->legacy_buffer);
+		}
+		stream->legacy_buffer = buffer;
+		stream->legacy_capacity = capacity;
+	}
+	memcpy(stream->legacy_buffer + stream->legacy_size, data, size);
+	stream->legacy_size += size;
+}
+
+static void stream_decode_legacy(fs_work_t* work)
+{
+	fs_stream_t* stream = work->stream;
+	// The header is ASCII digits and a newline; make sure atoi stops inside the buffer.
+	char header[16] = { 0 };
+	memcpy(header, stream->legacy_buffer, stream->legacy_size < sizeof(header) - 1 ? stream->legacy_size : sizeof(header) - 1);
+	int decompressed_size = atoi(header);
+	int metadata_len = snprintf(NULL, 0, "%d\n", decompressed_size);
+	if (decompressed_size <= 0 || (size_t)metadata_len > stream->legacy_size)
+	{
+		stream_fail(work, "There was an issue decompressing a file");
+		return;
+	}
+
+	char* decompressed = heap_alloc(work->heap, decompressed_size, 8);
+	int bytes = LZ4_decompress_safe(stream->legacy_buffer + metadata_len, decompressed,
+		(int)stream->legacy_size - metadata_len, decompressed_size);
+	if (bytes < 0)
+	{
+		stream_fail(work, "There was an issue decompressing a file");
+	}
+	for (int offset = 0; offset < bytes; offset += (int)stream->chunk_size)
+	{
+		size_t size = (size_t)(bytes - offset) < stream->chunk_size ? (size_t)(bytes - offset) : stream->chunk_size;
+		stream_deliver(work, decompressed + offset, size);
+	}
+	heap_free(work->heap, decompressed);
+}
+
+static void stream_decode_frame(fs_work_t* work, const char* data, size_t size)
+{
+	fs_stream_t* stream = work->stream;
+	if (!stream->header_read)
+	{
+		// The first chunk always holds the whole header; it names the dictionary the blocks need.
+		LZ4F_frameInfo_t info;
+		size_t header_size = size;
+		size_t hint = LZ4F_getFrameInfo(stream->dctx, &info, data, &header_size);
+		if (LZ4F_isError(hint))
+		{
+			stream_fail(work, "There was an issue decompressing a file");
+			return;
+		}
+		if (!dictionary_for_frame(work, &info, &stream->dictionary))
+		{
+			stream_fail(work, "Compressed file needs a dictionary");
+			return;
+		}
+		stream->header_read = true;
+		stream->frame_hint = hint;
+		data += header_size;
+		size -= header_size;
+	}
+	const fs_dictionary_t* dictionary = stream->dictionary;
+	while (size > 0 && !stream_is_cancelled(stream))
+	{
+		size_t out_size = stream->chunk_size;
+		size_t in_size = size;
+		size_t hint = LZ4F_decompress_usingDict(stream->dctx, stream->output, &out_size, data, &in_size,
+			dictionary ? dictionary->data : NULL, dictionary ? dictionary->size : 0, NULL);
+		if (LZ4F_isError(hint))
+		{
+			stream_fail(work, "There was an issue decompressing a file");
+			return;
+		}
+		stream->frame_hint = hint;
+		stream_deliver(work, stream->output, out_size);
+		data += in_size;
+		size -= in_size;
+	}
+}
+
+// Completes a stream once the reader's end marker reaches the decoder.
+static void stream_finish(fs_work_t* work)
+{
+	fs_stream_t* stream = work->stream;
+	if (stream->format == k_fs_stream_format_legacy && work->result == 0 && !stream_is_cancelled(stream))
+	{
+		stream_decode_legacy(work);
+	}
+	else if (stream->format == k_fs_stream_format_frame && work->result == 0 && !stream_is_cancelled(stream) && stream->frame_hint != 0)
+	{
+		stream_fail(work, "Compressed file is truncated");
+	}
+
+	if (stream->dctx)
+	{
+		LZ4F_freeDecompressionContext(stream->dctx);
+	}
+	for (int i = 0; i < k_fs_stream_slots; ++i)
+	{
+		heap_free(work->heap, stream->slots[i]);
+	}
+	if (stream->output)
+	{
+		heap_free(work->heap, stream->output);
+	}
+	if (stream->legacy_buffer)
+	{
+		heap_free(work->heap, stream->legacy_buffer);
+	}
+	semaphore_destroy(stream->free_slots);
+	heap_free(work->heap, stream);
+	work->stream = NULL;
+
+	work_complete(work);
+}
+
+// Decodes the oldest filled read buffer of a stream and returns it to the reader.
+// Returns true once the end marker has been reached and the stream is gone.
+static bool stream_decode_chunk(fs_work_t* work)
+{
+	fs_stream_t* stream = work->stream;
+	int slot = stream->decode_count++ % k_fs_stream_slots;
+	const char* data = stream->slots[slot];
+	size_t size = stream->slot_sizes[slot];
+	if (size == 0)
+	{
+		stream_finish(work);
+		return true;
+	}
+
+	if (!work->use_compression)
+	{
+		stream_deliver(work, data, size);
+	}
+	else
+	{
+		if (stream->format == k_fs_stream_format_unknown)
+		{
+			uint32_t magic = 0;
+			memcpy(&magic, data, size < sizeof(magic) ? size : sizeof(magic));
+			stream->format = magic == LZ4F_MAGICNUMBER ? k_fs_stream_format_frame : k_fs_stream_format_legacy;
+			if (stream->format == k_fs_stream_format_frame && LZ4F_isError(LZ4F_createDecompressionContext(&stream->dctx, LZ4F_VERSION)))
+			{
+				stream_fail(work, "Out of memory for decompression");
+			}
+		}
+		// Once cancelled, chunks are still drained so the reader can finish.
+		if (!stream_is_cancelled(stream))
+		{
+			if (stream->format == k_fs_stream_format_frame)
+			{
+				stream_decode_frame(work, data, size);
+			}
+			else
+			{
+				stream_gather_legacy(work, data, size);
+			}
+		}
+	}
+
+	stream_return_slot(work);
+	return false;
+}
+
+// Hands a successfully read file to the decompressor, or completes it.
+static void file_read_done(fs_work_t* work)
+{
+	if (work->use_compression)
+	{
+		// HOMEWORK 2: Queue file read work on decompression queue!
+		queue_push(work->fs->compression_queue, work);
+	}
+	else
+	{
+		cache_publish(work);
+		work_complete(work);
+	}
+}
+
+// Completes a mapping, or hands it to the decoder when it serves a range read.
+static void file_map_done(fs_work_t* work)
+{
+	if (work->op == k_fs_work_op_read_range && work->result == 0)
+	{
+		queue_push(work->fs->compression_queue, work);
+	}
+	else
+	{
+		work_complete(work);
+	}
+}
+
+#if defined(_WIN32)
+
+static bool file_get_version(const char* path, uint64_t* mtime, uint64_t* size)
+{
+	wchar_t wide_path[1024];
+	WIN32_FILE_ATTRIBUTE_DATA data;
+	if (MultiByteToWideChar(CP_UTF8, 0, path, -1, wide_path, sizeof(wide_path) / sizeof(wide_path[0])) <= 0 ||
+		!GetFileAttributesExW(wide_path, GetFileExInfoStandard, &data))
+	{
+		return false;
+	}
+	*mtime = ((uint64_t)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime;
+	*size = ((uint64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+	return true;
+}
+
+static void file_read(fs_work_t* work)
+{
+	wchar_t wide_path[1024];
+	if (MultiByteToWideChar(CP_UTF8, 0, work->path, -1, wide_path, sizeof(wide_path)) <= 0)
+	{
+		work->result = -1;
+		work_complete(work);
+		return;
+	}
+
+	HANDLE handle = CreateFile(wide_path, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (handle == INVALID_HANDLE_VALUE)
+	{
+		work->result = GetLastError();
+		work_complete(work);
+		return;
+	}
+
+	if (!GetFileSizeEx(handle, (PLARGE_INTEGER)&work->size))
+	{
+		work->result = GetLastError();
+		CloseHandle(handle);
+		work_complete(work);
+		return;
+	}
+
+	work->buffer = heap_alloc(work->heap, work->null_terminate ? work->size + 1 : work->size, 8);
+
+	DWORD bytes_read = 0;
+	if (!ReadFile(handle, work->buffer, (DWORD)work->size, &bytes_read, NULL))
+	{
+		work->result = GetLastError();
+		CloseHandle(handle);
+		work_complete(work);
+		return;
+	}
+
+	work->size = bytes_read;
+	if (work->null_terminate)
+	{
+		((char*)work->buffer)[bytes_read] = 0;
+	}
+
+	CloseHandle(handle);
+
+	file_read_done(work);
+}
+
+static void file_write(fs_work_t* work)
+{
+	wchar_t wide_path[1024];
+	if (MultiByteToWideChar(CP_UTF8, 0, work->path, -1, wide_path, sizeof(wide_path)) <= 0)
+	{
+		work->result = -1;
+		work_complete(work);
+		return;
+	}
+
+	HANDLE handle = work->append ?
+		CreateFile(wide_path, FILE_APPEND_DATA, FILE_SHARE_WRITE, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL) :
+		CreateFile(wide_path, GENERIC_WRITE, FILE_SHARE_WRITE, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (handle == INVALID_HANDLE_VALUE)
+	{
+		work->result = GetLastError();
+		work_complete(work);
+		return;
+	}
+
+	void* buffer = (work->use_compression ? work->temp_buffer : work->buffer);
+	size_t size = (work->use_compression ? work->temp_size : work->size);
+
+	DWORD bytes_written = 0;
+	if (!WriteFile(handle, buffer, (DWORD)size, &bytes_written, NULL))
+	{
+		work->result = GetLastError();
+		CloseHandle(handle);
+		work_complete(work);
+		return;
+	}
+
+	if (work->use_compression)
+	{
+		work->temp_size = bytes_written;
+	}
+	else
+	{
+		work->size = bytes_written;
+	}
+
+	CloseHandle(handle);
+
+	work_complete(work);
+}
+
+static void file_map(fs_work_t* work)
+{
+	wchar_t wide_path[1024];
+	if (MultiByteToWideChar(CP_UTF8, 0, work->path, -1, wide_path, sizeof(wide_path)) <= 0)
+	{
+		work->result = -1;
+		work_complete(work);
+		return;
+	}
+
+	DWORD flags = work->hint == k_fs_map_hint_sequential ? FILE_FLAG_SEQUENTIAL_SCAN : FILE_ATTRIBUTE_NORMAL;
+	HANDLE handle = CreateFile(wide_path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, flags, NULL);
+	if (handle == INVALID_HANDLE_VALUE)
+	{
+		work->result = GetLastError();
+		work_complete(work);
+		return;
+	}
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(handle, &size))
+	{
+		work->result = GetLastError();
+		CloseHandle(handle);
+		work_complete(work);
+		return;
+	}
+
+	// Empty files cannot be mapped; they get an empty view.
+	void* address = NULL;
+	if (size.QuadPart > 0)
+	{
+		HANDLE mapping = CreateFileMapping(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mapping == NULL)
+		{
+			work->result = GetLastError();
+			CloseHandle(handle);
+			work_complete(work);
+			return;
+		}
+		// The view keeps the mapping object alive after its handle is closed.
+		address = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		if (address == NULL)
+		{
+			work->result = GetLastError();
+		}
+		CloseHandle(mapping);
+	}
+	CloseHandle(handle);
+
+	if (work->result == 0)
+	{
+		view_create(work, address, (size_t)size.QuadPart);
+		if (work->hint == k_fs_map_hint_willneed && address)
+		{
+			// Issue one large read for the whole range, then wait for it by touching each page.
+			WIN32_MEMORY_RANGE_ENTRY range = { .VirtualAddress = address, .NumberOfBytes = (size_t)size.QuadPart };
+			PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+			view_touch_pages(work->view);
+		}
+	}
+
+	file_map_done(work);
+}
+
+static void view_unmap(fs_view_t* view)
+{
+	if (view->address)
+	{
+		UnmapViewOfFile(view->address);
+	}
+}
+
+// Reads one chunk per turn and queues the stream again behind the other work, so a long
+// stream never holds the file thread from critical reads.
+static void file_read_stream(fs_work_t* work)
+{
+	fs_stream_t* stream = work->stream;
+	if (!stream_claim_slot(work))
+	{
+		return;
+	}
+
+	if (work->step == k_fs_work_step_open)
+	{
+		wchar_t wide_path[1024];
+		if (MultiByteToWideChar(CP_UTF8, 0, work->path, -1, wide_path, sizeof(wide_path)) <= 0)
+		{
+			work->result = -1;
+			stream_push_chunk(work, 0);
+			return;
+		}
+
+		work->handle = CreateFile(wide_path, GENERIC_READ, FILE_SHARE_READ, NULL,
+			OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		if (work->handle == INVALID_HANDLE_VALUE)
+		{
+			work->result = GetLastError();
+			stream_push_chunk(work, 0);
+			return;
+		}
+		work->step = k_fs_work_step_transfer;
+	}
+
+	DWORD bytes_read = 0;
+	if (!stream_is_cancelled(stream) && !ReadFile(work->handle, stream->slots[stream->read_slot], (DWORD)stream->chunk_size, &bytes_read, NULL))
+	{
+		work->result = GetLastError();
+		bytes_read = 0;
+	}
+	if (bytes_read > 0)
+	{
+		stream_push_chunk(work, bytes_read);
+		file_queue_push(work->fs, work);
+		return;
+	}
+
+	CloseHandle(work->handle);
+	stream_push_chunk(work, 0);
+}
+
+#else
+
+static bool file_get_version(const char* path, uint64_t* mtime, uint64_t* size)
+{
+	struct stat st;
+	if (stat(path, &st) != 0)
+	{
+		return false;
+	}
+	*mtime = (uint64_t)st.st_mtim.tv_sec * 1000000000ull + (uint64_t)st.st_mtim.tv_nsec;
+	*size = (uint64_t)st.st_size;
+	return true;
+}
+
+static void file_read(fs_work_t* work)
+{
+	int fd = open(work->path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		work->result = errno;
+		work_complete(work);
+		return;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+	{
+		work->result = errno;
+		close(fd);
+		work_complete(work);
+		return;
+	}
+
+	work->size = (size_t)st.st_size;
+	work->buffer = heap_alloc(work->heap, work->null_terminate ? work->size + 1 : work->size, 8);
+
+	size_t offset = 0;
+	while (offset < work->size)
+	{
+		size_t chunk = work->size - offset < k_fs_max_io_size ? work->size - offset : k_fs_max_io_size;
+		ssize_t bytes_read = pread(fd, (char*)work->buffer + offset, chunk, (off_t)offset);
+		if (bytes_read < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (bytes_read < 0)
+		{
+			work->result = errno;
+			close(fd);
+			work_complete(work);
+			return;
+		}
+		if (bytes_read == 0)
+		{
+			break;
+		}
+		offset += (size_t)bytes_read;
+	}
+
+	work->size = offset;
+	if (work->null_terminate)
+	{
+		((char*)work->buffer)[offset] = 0;
+	}
+
+	close(fd);
+
+	file_read_done(work);
+}
+
+static void file_write(fs_work_t* work)
+{
+	int fd = open(work->path, O_WRONLY | O_CREAT | O_CLOEXEC | (work->append ? O_APPEND : O_TRUNC), 0644);
+	if (fd < 0)
+	{
+		work->result = errno;
+		work_complete(work);
+		return;
+	}
+
+	const char* buffer = (work->use_compression ? work->temp_buffer : work->buffer);
+	size_t size = (work->use_compression ? work->temp_size : work->size);
+
+	size_t offset = 0;
+	while (offset < size)
+	{
+		size_t chunk = size - offset < k_fs_max_io_size ? size - offset : k_fs_max_io_size;
+		// pwrite ignores O_APPEND on some systems, so appends go through the file position.
+		ssize_t bytes_written = work->append ? write(fd, buffer + offset, chunk) : pwrite(fd, buffer + offset, chunk, (off_t)offset);
+		if (bytes_written < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (bytes_written < 0)
+		{
+			work->result = errno;
+			close(fd);
+			work_complete(work);
+			return;
+		}
+		offset += (size_t)bytes_written;
+	}
+
+	if (work->use_compression)
+	{
+		work->temp_size = offset;
+	}
+	else
+	{
+		work->size = offset;
+	}
+
+	close(fd);
+
+	work_complete(work);
+}
+
+// Maps an open file into a view for work. Returns zero or an errno.
+static int view_map_fd(fs_work_t* work, int fd)
+{
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+	{
+		return errno;
+	}
+
+	// Empty files cannot be mapped; they get an empty view.
+	void* address = NULL;
+	if (st.st_size > 0)
+	{
+		address = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (address == MAP_FAILED)
+		{
+			return errno;
+		}
+		if (work->hint == k_fs_map_hint_sequential)
+		{
+			madvise(address, (size_t)st.st_size, MADV_SEQUENTIAL);
+		}
+	}
+	view_create(work, address, (size_t)st.st_size);
+	return 0;
+}
+
+// Blocks until every page of the view is resident.
+static void view_prefetch(fs_view_t* view)
+{
+	if (view->address == NULL)
+	{
+		return;
+	}
+#if defined(__linux__)
+	// Faults the whole range in with large reads (Linux 5.14+).
+	if (madvise(view->address, view->size, MADV_POPULATE_READ) == 0)
+	{
+		return;
+	}
+#endif
+	madvise(view->address, view->size, MADV_WILLNEED);
+	view_touch_pages(view);
+}
+
+static void file_map(fs_work_t* work)
+{
+	int fd = open(work->path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		work->result = errno;
+		work_complete(work);
+		return;
+	}
+
+	// The mapping holds its own reference to the file, so the descriptor can go right away.
+	work->result = view_map_fd(work, fd);
+	close(fd);
+
+	if (work->result == 0 && work->hint == k_fs_map_hint_willneed)
+	{
+		view_prefetch(work->view);
+	}
+
+	file_map_done(work);
+}
+
+static void view_unmap(fs_view_t* view)
+{
+	if (view->address)
+	{
+		munmap(view->address, view->size);
+	}
+}
+
+// Reads one chunk per turn and queues the stream again behind the other work, so a long
+// stream never holds a file thread from critical reads.
+static void file_read_stream(fs_work_t* work)
+{
+	fs_stream_t* stream = work->stream;
+	if (!stream_claim_slot(work))
+	{
+		return;
+	}
+
+	if (work->step == k_fs_work_step_open)
+	{
+		work->fd = open(work->path, O_RDONLY | O_CLOEXEC);
+		if (work->fd < 0)
+		{
+			work->result = errno;
+			stream_push_chunk(work, 0);
+			return;
+		}
+#if defined(POSIX_FADV_SEQUENTIAL)
+		posix_fadvise(work->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+		work->step = k_fs_work_step_transfer;
+	}
+
+	ssize_t bytes_read = 0;
+	if (!stream_is_cancelled(stream))
+	{
+		do
+		{
+			bytes_read = read(work->fd, stream->slots[stream->read_slot], stream->chunk_size);
+		} while (bytes_read < 0 && errno == EINTR);
+		if (bytes_read < 0)
+		{
+			work->result = errno;
+		}
+	}
+	if (bytes_read > 0)
+	{
+		stream_push_chunk(work, (size_t)bytes_read);
+		file_queue_push(work->fs, work);
+		return;
+	}
+
+	close(work->fd);
+	stream_push_chunk(work, 0);
+}
+
+#endif
+
+#if defined(__linux__)
+
+// The ring owns every operation from open to close, so many files are in flight at once and
+// completions are reaped in batches on one thread instead of one blocking call per step.
+
+static void uring_prep_wake(fs_t* fs)
+{
+	struct io_uring_sqe* sqe = uring_get_sqe(fs->uring);
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fs->wake_fd;
+	sqe->addr = (uintptr_t)&fs->wake_value;
+	sqe->len = sizeof(fs->wake_value);
+	sqe->user_data = 0;
+}
+
+static void uring_prep_open(fs_t* fs, fs_work_t* work)
+{
+	struct io_uring_sqe* sqe = uring_get_sqe(fs->uring);
+	sqe->opcode = IORING_OP_OPENAT;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (uintptr_t)work->path;
+	if (work->op != k_fs_work_op_write)
+	{
+		sqe->open_flags = O_RDONLY | O_CLOEXEC;
+	}
+	else
+	{
+		// With O_APPEND the kernel puts each write at the end, whatever its offset.
+		sqe->open_flags = O_WRONLY | O_CREAT | O_CLOEXEC | (work->append ? O_APPEND : O_TRUNC);
+		sqe->len = 0644;
+	}
+	sqe->user_data = (uintptr_t)work;
+	work->step = k_fs_work_step_open;
+}
+
+static void uring_prep_transfer(fs_t* fs, fs_work_t* work, char* buffer, size_t size)
+{
+	size_t chunk = size - work->offset < k_fs_max_io_size ? size - work->offset : k_fs_max_io_size;
+	struct io_uring_sqe* sqe = uring_get_sqe(fs->uring);
+	sqe->opcode = work->op == k_fs_work_op_read ? IORING_OP_READ : IORING_OP_WRITE;
+	sqe->fd = work->fd;
+	sqe->addr = (uintptr_t)(buffer + work->offset);
+	sqe->len = (unsigned)chunk;
+	sqe->off = work->offset;
+	sqe->user_data = (uintptr_t)work;
+	work->step = k_fs_work_step_transfer;
+}
+
+static void uring_prep_close(fs_t* fs, fs_work_t* work)
+{
+	struct io_uring_sqe* sqe = uring_get_sqe(fs->uring);
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->fd = work->fd;
+	sqe->user_data = (uintptr_t)work;
+	work->step = k_fs_work_step_close;
+}
+
+// Asks the kernel to fault in the whole view. MADV_POPULATE_READ blocks in an io_uring
+// worker until the pages are resident, so the completion arrives once the prefetch is done.
+static void uring_prep_prefetch(fs_t* fs, fs_work_t* work)
+{
+	struct io_uring_sqe* sqe = uring_get_sqe(fs->uring);
+	sqe->opcode = IORING_OP_MADVISE;
+	sqe->addr = (uintptr_t)work->view->address;
+	sqe->len = (unsigned)work->view->size;
+	sqe->fadvise_advice = MADV_POPULATE_READ;
+	sqe->user_data = (uintptr_t)work;
+	work->step = k_fs_work_step_prefetch;
+}
+
+static char* uring_work_buffer(fs_work_t* work, size_t* size)
+{
+	if (work->op == k_fs_work_op_write && work->use_compression)
+	{
+		*size = work->temp_size;
+		return work->temp_buffer;
+	}
+	*size = work->size;
+	return work->buffer;
+}
+
+static void uring_work_complete(fs_work_t* work)
+{
+	if (work->op == k_fs_work_op_read)
+	{
+		work->size = work->offset;
+		if (work->null_terminate && work->buffer)
+		{
+			((char*)work->buffer)[work->offset] = 0;
+		}
+		if (work->result == 0)
+		{
+			file_read_done(work);
+			return;
+		}
+	}
+	else if (work->use_compression)
+	{
+		work->temp_size = work->offset;
+	}
+	else
+	{
+		work->size = work->offset;
+	}
+	work_complete(work);
+}
+
+static void uring_prep_stream_read(fs_t* fs, fs_work_t* work)
+{
+	struct io_uring_sqe* sqe = uring_get_sqe(fs->uring);
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = work->fd;
+	sqe->addr = (uintptr_t)work->stream->slots[work->stream->read_slot];
+	sqe->len = (unsigned)work->stream->chunk_size;
+	sqe->off = work->offset;
+	sqe->user_data = (uintptr_t)work;
+	work->step = k_fs_work_step_transfer;
+}
+
+// Starts the next read of a stream that holds a free slot, or closes it if the consumer is done.
+static void uring_stream_continue(fs_t* fs, fs_work_t* work)
+{
+	if (stream_is_cancelled(work->stream))
+	{
+		uring_prep_close(fs, work);
+	}
+	else
+	{
+		uring_prep_stream_read(fs, work);
+	}
+}
+
+// Streams move read -> queue to decoder -> next read. A stream whose slots are all with the
+// decoder parks on the stalled list instead of blocking the ring; the decoder wakes the ring
+// whenever it returns a slot.
+static bool uring_stream_advance(fs_t* fs, fs_work_t* work, int result)
+{
+	switch (work->step)
+	{
+	case k_fs_work_step_open:
+		stream_try_acquire_slot(work->stream);
+		if (result < 0)
+		{
+			work->result = -result;
+			stream_push_chunk(work, 0);
+			return false;
+		}
+		work->fd = result;
+		uring_prep_stream_read(fs, work);
+		return true;
+	case k_fs_work_step_transfer:
+		if (result <= 0)
+		{
+			// End of file or error: close first, then send the end marker in the slot still held.
+			work->result = result < 0 ? -result : 0;
+			uring_prep_close(fs, work);
+			return true;
+		}
+		work->offset += (size_t)result;
+		stream_push_chunk(work, (size_t)result);
+		if (stream_try_acquire_slot(work->stream))
+		{
+			uring_stream_continue(fs, work);
+		}
+		else
+		{
+			work->next_stalled = fs->stalled_streams;
+			fs->stalled_streams = work;
+		}
+		return true;
+	case k_fs_work_step_close:
+		stream_push_chunk(work, 0);
+		return false;
+	default:
+		return false;
+	}
+}
+
+// Moves a work item to its next step given the result of its last operation.
+// Returns false once the work is complete and has nothing in flight.
+static bool uring_work_advance(fs_t* fs, fs_work_t* work, int result)
+{
+	if (work->op == k_fs_work_op_stream)
+	{
+		return uring_stream_advance(fs, work, result);
+	}
+
+	size_t size;
+	switch (work->step)
+	{
+	case k_fs_work_step_open:
+		if (result < 0)
+		{
+			work->result = -result;
+			uring_work_complete(work);
+			return false;
+		}
+		work->fd = result;
+		if (work->op == k_fs_work_op_map || work->op == k_fs_work_op_read_range)
+		{
+			// Mapping is a page table update, not I/O, so it happens here; only the prefetch goes to the ring.
+			work->result = view_map_fd(work, work->fd);
+			close(work->fd);
+			work->fd = -1;
+			// The ring's madvise length is 32 bits, so huge files only get the asynchronous readahead hint.
+			if (work->result == 0 && work->hint == k_fs_map_hint_willneed && work->view->address)
+			{
+				if (work->view->size <= UINT32_MAX)
+				{
+					uring_prep_prefetch(fs, work);
+					return true;
+				}
+				madvise(work->view->address, work->view->size, MADV_WILLNEED);
+			}
+			file_map_done(work);
+			return false;
+		}
+		if (work->op == k_fs_work_op_read)
+		{
+			// fstat on an open descriptor does no I/O, so it is not worth a round trip through the ring.
+			struct stat st;
+			if (fstat(work->fd, &st) != 0)
+			{
+				work->result = errno;
+				uring_prep_close(fs, work);
+				return true;
+			}
+			work->size = (size_t)st.st_size;
+			work->buffer = heap_alloc(work->heap, work->null_terminate ? work->size + 1 : work->size, 8);
+		}
+		break;
+	case k_fs_work_step_transfer:
+		if (result < 0)
+		{
+			work->result = -result;
+			uring_prep_close(fs, work);
+			return true;
+		}
+		work->offset += (size_t)result;
+		if (result == 0)
+		{
+			// The file shrank under us; keep what was read.
+			uring_prep_close(fs, work);
+			return true;
+		}
+		break;
+	case k_fs_work_step_close:
+		uring_work_complete(work);
+		return false;
+	case k_fs_work_step_prefetch:
+		// Kernels without MADV_POPULATE_READ fail the prefetch; the mapping itself is still good.
+		if (result < 0)
+		{
+			madvise(work->view->address, work->view->size, MADV_WILLNEED);
+		}
+		file_map_done(work);
+		return false;
+	}
+
+	char* buffer = uring_work_buffer(work, &size);
+	if (work->offset < size)
+	{
+		uring_prep_transfer(fs, work, buffer, size);
+	}
+	else
+	{
+		uring_prep_close(fs, work);
+	}
+	return true;
+}
+
+static int uring_thread_func(void* user)
+{
+	fs_t* fs = user;
+	// One submission entry stays reserved for the wake read.
+	int max_in_flight = (int)uring_get_capacity(fs->uring) - 1;
+	int in_flight = 0;
+
+	uring_prep_wake(fs);
+	while (true)
+	{
+		// Start as much queued work as the ring has room for; the rest waits in the queue.
+		while (in_flight < max_in_flight)
+		{
+			fs_work_t* work = file_queue_pop(fs, false);
+			if (work == NULL)
+			{
+				break;
+			}
+			work->fd = -1;
+			work->offset = 0;
+			uring_prep_open(fs, work);
+			in_flight++;
+		}
+
+		// Resume streams whose decoder has handed a slot back.
+		fs_work_t** link = &fs->stalled_streams;
+		while (*link)
+		{
+			fs_work_t* work = *link;
+			if (stream_try_acquire_slot(work->stream))
+			{
+				*link = work->next_stalled;
+				uring_stream_continue(fs, work);
+			}
+			else
+			{
+				link = &work->next_stalled;
+			}
+		}
+
+		if (in_flight == 0 && atomic_load_acquire(&fs->quit))
+		{
+			break;
+		}
+
+		// The wake read is always pending, so this sleeps until I/O completes or work arrives.
+		int result = uring_submit(fs->uring, 1);
+		if (result < 0)
+		{
+			debug_print(k_print_error, "io_uring submit failed (errno %d)\n", -result);
+		}
+
+		// TRACE_SCOPE evaluates its trace twice, so it is loaded once here.
+		trace_t* trace = fs_get_trace(fs);
+		TRACE_SCOPE(trace, "fs uring completions")
+		{
+			struct io_uring_cqe* cqe;
+			while ((cqe = uring_peek_cqe(fs->uring)) != NULL)
+			{
+				fs_work_t* work = (fs_work_t*)(uintptr_t)cqe->user_data;
+				int res = cqe->res;
+				uring_cqe_seen(fs->uring);
+				if (work == NULL)
+				{
+					uring_prep_wake(fs);
+				}
+				else if (!uring_work_advance(fs, work, res))
+				{
+					in_flight--;
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+static bool uring_backend_create(fs_t* fs, int queue_capacity)
+{
+	fs->uring = NULL;
+	fs->wake_fd = -1;
+	fs->quit = 0;
+	fs->stalled_streams = NULL;
+
+	unsigned entries = queue_capacity > k_fs_uring_min_entries ? (unsigned)queue_capacity : k_fs_uring_min_entries;
+	uring_t* ring = uring_create(fs->heap, entries);
+	if (ring == NULL)
+	{
+		return false;
+	}
+
+	static const uint8_t k_required_ops[] = { IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE };
+	if (!uring_supports_ops(ring, k_required_ops, sizeof(k_required_ops)))
+	{
+		debug_print(k_print_info, "io_uring lacks file operations; using blocking file threads\n");
+		uring_destroy(ring);
+		return false;
+	}
+
+	fs->wake_fd = eventfd(0, EFD_CLOEXEC);
+	if (fs->wake_fd < 0)
+	{
+		uring_destroy(ring);
+		return false;
+	}
+
+	fs->uring = ring;
+	thread_desc_t desc = thread_desc_for_role(k_thread_role_io, "fs uring");
+	fs->file_threads[0] = thread_create_ex(uring_thread_func, fs, &desc);
+	return true;
+}
+
+static void uring_backend_destroy(fs_t* fs)
+{
+	atomic_store_release(&fs->quit, 1);
+	eventfd_write(fs->wake_fd, 1);
+	thread_destroy(fs->file_threads[0]);
+	close(fs->wake_fd);
+	uring_destroy(fs->uring);
+	fs->uring = NULL;
+}
+
+#endif
+
+static int file_thread_func(void* user)
+{
+	fs_t* fs = user;
+	while (true)
+	{
+		fs_work_t* work = file_queue_pop(fs, true);
+		if (work == NULL)
+		{
+			break;
+		}
+
+		// Loaded once, so each push and its pop go to the same trace.
+		trace_t* trace = fs_get_trace(fs);
+		switch (work->op)
+		{
+		case k_fs_work_op_read:
+			TRACE_PUSH(trace, "fs read");
+			file_read(work);
+			TRACE_POP(trace);
+			break;
+		case k_fs_work_op_write:
+			TRACE_PUSH(trace, "fs write");
+			file_write(work);
+			TRACE_POP(trace);
+			break;
+		case k_fs_work_op_map:
+		case k_fs_work_op_read_range:
+			TRACE_PUSH(trace, "fs map");
+			file_map(work);
+			TRACE_POP(trace);
+			break;
+		case k_fs_work_op_stream:
+			TRACE_PUSH(trace, "fs stream");
+			file_read_stream(work);
+			TRACE_POP(trace);
+			break;
+		}
+	}
+	return 0;
+}
+
+// Decodes a whole file written in the LZ4 frame format.
+static bool decompress_frame(fs_work_t* work)
+{
+	LZ4F_dctx* dctx;
+	if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION)))
+	{
+		return false;
+	}
+
+	LZ4F_frameInfo_t info;
+	size_t src_size = work->temp_size;
+	size_t result = LZ4F_getFrameInfo(dctx, &info, work->temp_buffer, &src_size);
+	if (LZ4F_isError(result))
+	{
+		LZ4F_freeDecompressionContext(dctx);
+		return false;
+	}
+
+	const fs_dictionary_t* dictionary;
+	if (!dictionary_for_frame(work, &info, &dictionary))
+	{
+		LZ4F_freeDecompressionContext(dctx);
+		return false;
+	}
+
+	// Our frames always record their size, so zero means an empty file.
+	size_t decompressed_size = (size_t)info.contentSize;
+	char* decompressed_buffer = heap_alloc(work->heap, decompressed_size + 1, 8);
+	size_t dst_size = decompressed_size;
+	size_t remaining = work->temp_size - src_size;
+	result = LZ4F_decompress_usingDict(dctx, decompressed_buffer, &dst_size, (char*)work->temp_buffer + src_size, &remaining,
+		dictionary ? dictionary->data : NULL, dictionary ? dictionary->size : 0, NULL);
+	LZ4F_freeDecompressionContext(dctx);
+	if (result != 0 || dst_size != decompressed_size)
+	{
+		heap_free(work->heap, decompressed_buffer);
+		return false;
+	}
+
+	work->buffer = decompressed_buffer;
+	work->size = decompressed_size;
+	if (work->null_terminate)
+	{
+		((char*)work->buffer)[decompressed_size] = 0;
+	}
+	return true;
+}
+
+// Decodes a whole file in the original "<size>\n<lz4 block>" format.
+static bool decompress_legacy(fs_work_t* work)
+{
+	if (work->temp_size == 0)
+	{
+		return false;
+	}
+	int decompressed_size = atoi(work->temp_buffer); // Stops at the newline
+	int metadata_len = snprintf(NULL, 0, "%d\n", decompressed_size);
+	if (decompressed_size <= 0 || (size_t)metadata_len > work->temp_size)
+	{
+		return false;
+	}
+
+	char* compressed_buffer = (char*)work->temp_buffer + metadata_len;
+	char* decompressed_buffer = heap_alloc(work->heap, decompressed_size + (work->null_terminate ? 1 : 0), 8);
+
+	int bytes_written = LZ4_decompress_safe(compressed_buffer, decompressed_buffer, (int)work->temp_size - metadata_len, decompressed_size);
+	if (bytes_written <= 0)
+	{
+		heap_free(work->heap, decompressed_buffer);
+		return false;
+	}
+
+	work->buffer = decompressed_buffer;
+	work->size = bytes_written;
+	if (work->null_terminate)
+	{
+		((char*)work->buffer)[bytes_written] = 0;
+	}
+	return true;
+}
+
+// Seek table values are little-endian, like the rest of the LZ4 frame.
+static uint32_t read_u32(const char* data)
+{
+	uint32_t value;
+	memcpy(&value, data, sizeof(value));
+	return value;
+}
+
+static void write_u32(char* data, uint32_t value)
+{
+	memcpy(data, &value, sizeof(value));
+}
+
+// Splits work into blocks and offers it to the other compression threads. Every thread that
+// pops the work, including this one, claims blocks until none remain.
+static void block_job_start(fs_work_t* work, fs_block_job_t* job)
+{
+	fs_t* fs = work->fs;
+	int helpers = fs->compression_thread_count < job->block_count ? fs->compression_thread_count : job->block_count;
+	helpers = job->block_count >= k_fs_parallel_min_blocks ? helpers - 1 : 0;
+
+	job->next = 0;
+	job->failed = 0;
+	job->remaining = helpers + 1;
+	work->blocks = job;
+	for (int i = 0; i < helpers; ++i)
+	{
+		// Never block on our own queue; a full queue just means fewer helpers.
+		if (!queue_try_push(fs->compression_queue, work))
 		{
-			break;
+			atomic_decrement(&job->remaining);
 		}
+	}
+}
 
-		switch (work->op)
+// Runs blocks of a split job until none are left.
+// Returns true on the thread that finished the last block, which then completes the work.
+static bool block_job_run(fs_work_t* work)
+{
+	fs_block_job_t* job = work->blocks;
+	int index;
+	while ((index = atomic_increment(&job->next)) < job->block_count)
+	{
+		if (!job->run_block(work, index))
 		{
-		case k_fs_work_op_read:
-			file_read(work);
-			break;
-		case k_fs_work_op_write:
-			file_write(work);
+			atomic_store_release(&job->failed, 1);
+		}
+	}
+	return atomic_decrement(&job->remaining) == 1;
+}
+
+static void block_job_destroy(fs_work_t* work)
+{
+	heap_free(work->fs->heap, work->blocks);
+	work->blocks = NULL;
+}
+
+// Uncompressed length of a block; only the last one is short.
+static size_t block_length(fs_block_job_t* job, int index)
+{
+	size_t begin = (size_t)index * job->block_size;
+	return job->content_size - begin < job->block_size ? job->content_size - begin : job->block_size;
+}
+
+// Compresses one frame block into its slot of the output: size word, payload, checksum.
+static bool compress_block(fs_work_t* work, int index)
+{
+	fs_block_job_t* job = work->blocks;
+	const char* src = (const char*)work->buffer + (size_t)index * job->block_size;
+	int size = (int)block_length(job, index);
+	char* dest = job->output + job->header_size + (size_t)index * job->stride;
+	char* payload = dest + sizeof(uint32_t);
+
+	// A block that does not shrink is stored as is, flagged by the size word's high bit.
+	int bytes;
+	const fs_dictionary_t* dictionary = work->dictionary;
+	if (dictionary && work->compression_level > k_fs_compression_fast)
+	{
+		// Blocks only run on compression threads, which free their stream when they exit.
+		if (s_fs_stream_hc == NULL)
+		{
+			s_fs_stream_hc = LZ4_initStreamHC(heap_alloc(work->fs->heap, sizeof(LZ4_streamHC_t), 8), sizeof(LZ4_streamHC_t));
+		}
+		// Each block starts over, referring to the prepared dictionary rather than loading it.
+		// Out of memory, the block is stored as is.
+		bytes = 0;
+		if (s_fs_stream_hc && dictionary->stream_hc)
+		{
+			LZ4_resetStreamHC_fast(s_fs_stream_hc, work->compression_level);
+			LZ4_attach_HC_dictionary(s_fs_stream_hc, dictionary->stream_hc);
+			bytes = LZ4_compress_HC_continue(s_fs_stream_hc, src, payload, size, size - 1);
+		}
+	}
+	else if (dictionary)
+	{
+		// Blocks stay independent: each starts from a copy of the stream with only the dictionary loaded.
+		LZ4_stream_t stream;
+		memcpy(&stream, dictionary->stream, sizeof(stream));
+		bytes = LZ4_compress_fast_continue(&stream, src, payload, size, size - 1, 1);
+	}
+	else
+	{
+		bytes = work->compression_level > k_fs_compression_fast ?
+			LZ4_compress_HC(src, payload, size, size - 1, work->compression_level) :
+			LZ4_compress_default(src, payload, size, size - 1);
+	}
+	uint32_t header = (uint32_t)bytes;
+	if (bytes <= 0)
+	{
+		memcpy(payload, src, size);
+		bytes = size;
+		header = (uint32_t)size | 0x80000000;
+	}
+	write_u32(dest, header);
+	write_u32(payload + bytes, XXH32(payload, bytes, 0));
+	job->sizes[index] = (uint32_t)bytes;
+	return true;
+}
+
+// Verifies and decodes one frame block of length bytes into dest.
+// Returns false if the block runs past limit, fails its checksum, or does not decode to length bytes.
+static bool decompress_block(const char* block, const char* limit, size_t checksum_size, char* dest, size_t length, const fs_dictionary_t* dictionary)
+{
+	if (limit - block < (ptrdiff_t)sizeof(uint32_t))
+	{
+		return false;
+	}
+	uint32_t header = read_u32(block);
+	size_t size = header & 0x7FFFFFFF;
+	const char* payload = block + sizeof(uint32_t);
+	if ((size_t)(limit - payload) < size + checksum_size)
+	{
+		return false;
+	}
+	if (checksum_size && XXH32(payload, size, 0) != read_u32(payload + size))
+	{
+		return false;
+	}
+	if (header & 0x80000000)
+	{
+		if (size != length)
+		{
+			return false;
+		}
+		memcpy(dest, payload, length);
+		return true;
+	}
+	if (dictionary)
+	{
+		return LZ4_decompress_safe_usingDict(payload, dest, (int)size, (int)length, dictionary->data, (int)dictionary->size) == (int)length;
+	}
+	return LZ4_decompress_safe(payload, dest, (int)size, (int)length) == (int)length;
+}
+
+static bool decompress_job_block(fs_work_t* work, int index)
+{
+	fs_block_job_t* job = work->blocks;
+	const char* limit = (const char*)work->temp_buffer + work->temp_size;
+	return decompress_block(job->sources[index], limit, job->checksum_size,
+		job->output + (size_t)index * job->block_size, block_length(job, index), job->dictionary);
+}
+
+// Block size in bytes for an LZ4 frame block size ID.
+static size_t frame_block_size(LZ4F_blockSizeID_t id)
+{
+	return id >= LZ4F_max64KB && id <= LZ4F_max4MB ? (size_t)64 * 1024 << (2 * (id - LZ4F_max64KB)) : 64 * 1024;
+}
+
+// Starts compressing a write into an LZ4 frame of independent, checksummed blocks followed by
+// a seek table. Blocks are compressed into fixed-stride slots of the output and packed at the end.
+static bool compress_begin(fs_work_t* work)
+{
+	LZ4F_preferences_t prefs;
+	memset(&prefs, 0, sizeof(prefs));
+	prefs.frameInfo.blockSizeID = LZ4F_max64KB;
+	prefs.frameInfo.blockMode = LZ4F_blockIndependent;
+	prefs.frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+	prefs.frameInfo.blockChecksumFlag = LZ4F_blockChecksumEnabled;
+	prefs.frameInfo.contentSize = work->size;
+	prefs.frameInfo.dictID = work->dictionary ? work->dictionary->id : 0;
+
+	int block_count = (int)((work->size + k_fs_frame_block_size - 1) / k_fs_frame_block_size);
+	fs_block_job_t* job = heap_alloc(work->fs->heap, sizeof(fs_block_job_t) + block_count * sizeof(uint32_t), 8);
+	memset(job, 0, sizeof(*job));
+	job->run_block = compress_block;
+	job->block_count = block_count;
+	job->block_size = k_fs_frame_block_size;
+	job->content_size = work->size;
+	job->sizes = (uint32_t*)(job + 1);
+	job->stride = sizeof(uint32_t) + k_fs_frame_block_size + LZ4F_BLOCK_CHECKSUM_SIZE;
+	job->table_size = 8 + block_count * sizeof(uint32_t) + k_fs_seek_footer_size;
+
+	// Worst case: every block stored uncompressed, then the end mark and content checksum.
+	size_t capacity = LZ4F_HEADER_SIZE_MAX + block_count * job->stride + 8 + job->table_size;
+	job->output = heap_alloc(work->heap, capacity, 8);
+
+	LZ4F_cctx* cctx;
+	if (LZ4F_isError(LZ4F_createCompressionContext(&cctx, LZ4F_VERSION)))
+	{
+		heap_free(work->heap, job->output);
+		heap_free(work->fs->heap, job);
+		return false;
+	}
+	job->header_size = LZ4F_compressBegin(cctx, job->output, capacity, &prefs);
+	LZ4F_freeCompressionContext(cctx);
+	if (LZ4F_isError(job->header_size))
+	{
+		heap_free(work->heap, job->output);
+		heap_free(work->fs->heap, job);
+		return false;
+	}
+
+	block_job_start(work, job);
+	// Hashing the whole input is serial, so do it while the helpers compress.
+	job->content_checksum = XXH32(work->buffer, work->size, 0);
+	return true;
+}
+
+// Packs compressed blocks together and appends the frame end and the seek table.
+static void compress_finish(fs_work_t* work)
+{
+	fs_block_job_t* job = work->blocks;
+	char* output = job->output;
+	size_t written = job->header_size;
+	for (int i = 0; i < job->block_count; ++i)
+	{
+		// Blocks only ever move towards the front, so each move reads data not yet overwritten.
+		size_t size = sizeof(uint32_t) + job->sizes[i] + LZ4F_BLOCK_CHECKSUM_SIZE;
+		memmove(output + written, output + job->header_size + (size_t)i * job->stride, size);
+		written += size;
+	}
+	write_u32(output + written, 0);
+	write_u32(output + written + 4, job->content_checksum);
+	written += 8;
+
+	char* table = output + written;
+	write_u32(table, k_fs_seek_skippable_magic);
+	write_u32(table + 4, (uint32_t)(job->table_size - 8));
+	for (int i = 0; i < job->block_count; ++i)
+	{
+		write_u32(table + 8 + i * sizeof(uint32_t), job->sizes[i]);
+	}
+	char* footer = table + job->table_size - k_fs_seek_footer_size;
+	write_u32(footer, (uint32_t)job->block_count);
+	write_u32(footer + 4, k_fs_frame_block_size);
+	write_u32(footer + 8, k_fs_seek_magic);
+
+	work->temp_buffer = output;
+	work->temp_size = written + job->table_size;
+	block_job_destroy(work);
+}
+
+// Runs a compressed write. Returns true once the compressed data is ready on this thread.
+static bool compress_work(fs_work_t* work)
+{
+	if (work->blocks == NULL && !compress_begin(work))
+	{
+		debug_print(k_print_error, "There was an issue compressing a file\n");
+		return true;
+	}
+	if (!block_job_run(work))
+	{
+		return false;
+	}
+	compress_finish(work);
+	return true;
+}
+
+// Starts decoding a frame of independent blocks in parallel.
+// Returns false for anything else (small files, linked blocks, unknown size, old formats),
+// which decodes serially.
+static bool decompress_begin(fs_work_t* work)
+{
+	const char* data = work->temp_buffer;
+	size_t size = work->temp_size;
+	if (work->fs->compression_thread_count < 2 || size < sizeof(uint32_t) || read_u32(data) != LZ4F_MAGICNUMBER)
+	{
+		return false;
+	}
+
+	LZ4F_dctx* dctx;
+	if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION)))
+	{
+		return false;
+	}
+	LZ4F_frameInfo_t info;
+	size_t header_size = size;
+	size_t result = LZ4F_getFrameInfo(dctx, &info, data, &header_size);
+	LZ4F_freeDecompressionContext(dctx);
+	size_t block_size = frame_block_size(info.blockSizeID);
+	// A missing dictionary is reported by the serial decoder.
+	const fs_dictionary_t* dictionary = info.dictID ? dictionary_find(work->fs, info.dictID) : NULL;
+	if (LZ4F_isError(result) || info.blockMode != LZ4F_blockIndependent || info.contentSize == 0 ||
+		info.contentSize / block_size >= INT32_MAX || (info.dictID && dictionary == NULL))
+	{
+		return false;
+	}
+	int block_count = (int)((info.contentSize + block_size - 1) / block_size);
+	if (block_count < k_fs_parallel_min_blocks)
+	{
+		return false;
+	}
+
+	// Block offsets come from walking the size words; a damaged walk falls back to the serial decoder.
+	fs_block_job_t* job = heap_alloc(work->fs->heap, sizeof(fs_block_job_t) + block_count * sizeof(const char*), 8);
+	memset(job, 0, sizeof(*job));
+	job->run_block = decompress_job_block;
+	job->block_count = block_count;
+	job->block_size = block_size;
+	job->content_size = (size_t)info.contentSize;
+	job->checksum_size = info.blockChecksumFlag ? LZ4F_BLOCK_CHECKSUM_SIZE : 0;
+	job->dictionary = dictionary;
+	job->sources = (const char**)(job + 1);
+	const char* block = data + header_size;
+	for (int i = 0; i < block_count; ++i)
+	{
+		if ((size_t)(data + size - block) < sizeof(uint32_t))
+		{
+			heap_free(work->fs->heap, job);
+			return false;
+		}
+		job->sources[i] = block;
+		size_t skip = sizeof(uint32_t) + (read_u32(block) & 0x7FFFFFFF) + job->checksum_size;
+		if ((size_t)(data + size - block) < skip)
+		{
+			heap_free(work->fs->heap, job);
+			return false;
+		}
+		block += skip;
+	}
+
+	job->output = heap_alloc(work->heap, job->content_size + 1, 8);
+	block_job_start(work, job);
+	return true;
+}
+
+// Publishes the decoded file, or reports a damaged one.
+// Every block checksum has been checked, so the content checksum is not recomputed serially.
+static void decompress_finish(fs_work_t* work)
+{
+	fs_block_job_t* job = work->blocks;
+	if (atomic_load_acquire(&job->failed))
+	{
+		debug_print(k_print_error, "There was an issue decompressing a file\n");
+		heap_free(work->heap, job->output);
+		work->result = -1;
+	}
+	else
+	{
+		work->buffer = job->output;
+		work->size = job->content_size;
+		if (work->null_terminate)
+		{
+			((char*)work->buffer)[work->size] = 0;
+		}
+	}
+	block_job_destroy(work);
+}
+
+// Runs a compressed read. Returns true once the work is complete on this thread.
+static bool decompress_work(fs_work_t* work)
+{
+	if (work->blocks == NULL)
+	{
+		work->temp_buffer = work->buffer;
+		work->temp_size = work->size;
+		if (!decompress_begin(work))
+		{
+			uint32_t magic = 0;
+			memcpy(&magic, work->temp_buffer, work->temp_size < sizeof(magic) ? work->temp_size : sizeof(magic));
+			bool decoded = magic == LZ4F_MAGICNUMBER ? decompress_frame(work) : decompress_legacy(work);
+			if (!decoded)
+			{
+				// Includes checksum mismatches, so damaged files are reported rather than returned.
+				debug_print(k_print_error, "There was an issue decompressing a file\n");
+				work->result = -1;
+			}
+			return true;
+		}
+	}
+	if (!block_job_run(work))
+	{
+		return false;
+	}
+	decompress_finish(work);
+	return true;
+}
+
+// Finds the seek table at the end of a compressed file.
+// Returns its block count, or zero if the file has none.
+static uint32_t seek_table_find(const char* data, size_t size, const char** table, uint32_t* block_size)
+{
+	if (size < 8 + k_fs_seek_footer_size)
+	{
+		return 0;
+	}
+	const char* footer = data + size - k_fs_seek_footer_size;
+	if (read_u32(footer + 8) != k_fs_seek_magic)
+	{
+		return 0;
+	}
+	uint32_t block_count = read_u32(footer);
+	size_t entries_size = (size_t)block_count * sizeof(uint32_t);
+	if (entries_size > size - 8 - k_fs_seek_footer_size)
+	{
+		return 0;
+	}
+	const char* header = footer - entries_size - 8;
+	if (read_u32(header) != k_fs_seek_skippable_magic || read_u32(header + 4) != entries_size + k_fs_seek_footer_size)
+	{
+		return 0;
+	}
+	*table = header + 8;
+	*block_size = read_u32(footer + 4);
+	return *block_size ? block_count : 0;
+}
+
+// Decodes the blocks that cover the requested range of a compressed file with a seek table.
+// Returns false if the file is corrupt.
+static bool decompress_blocks(fs_work_t* work, const char* data, size_t file_size, const char* table, uint32_t block_count, uint32_t block_size)
+{
+	LZ4F_dctx* dctx;
+	if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION)))
+	{
+		return false;
+	}
+	LZ4F_frameInfo_t info;
+	size_t header_size = file_size;
+	size_t result = LZ4F_getFrameInfo(dctx, &info, data, &header_size);
+	LZ4F_freeDecompressionContext(dctx);
+	const fs_dictionary_t* dictionary;
+	if (LZ4F_isError(result) || info.blockMode != LZ4F_blockIndependent || info.contentSize == 0 ||
+		info.contentSize > (unsigned long long)block_count * block_size || !dictionary_for_frame(work, &info, &dictionary))
+	{
+		return false;
+	}
+
+	size_t content_size = (size_t)info.contentSize;
+	size_t begin = work->range_offset < content_size ? work->range_offset : content_size;
+	size_t end = content_size - begin < work->range_size ? content_size : begin + work->range_size;
+	work->buffer = NULL;
+	work->size = end - begin;
+	if (begin == end)
+	{
+		return true;
+	}
+
+	size_t checksum_size = info.blockChecksumFlag ? LZ4F_BLOCK_CHECKSUM_SIZE : 0;
+	const char* blocks_end = table - 8;
+	const char* block = data + header_size;
+	size_t first = begin / block_size;
+	size_t last = (end - 1) / block_size;
+	for (size_t i = 0; i < first; ++i)
+	{
+		block += sizeof(uint32_t) + read_u32(table + i * sizeof(uint32_t)) + checksum_size;
+	}
+
+	char* output = heap_alloc(work->heap, work->size, 8);
+	char* scratch = NULL;
+	bool ok = true;
+	for (size_t i = first; i <= last && ok; ++i)
+	{
+		uint32_t compressed_size = read_u32(table + i * sizeof(uint32_t));
+		if (block >= blocks_end || (read_u32(block) & 0x7FFFFFFF) != compressed_size)
+		{
+			ok = false;
 			break;
 		}
+
+		// Part of this block that falls inside the range.
+		size_t block_begin = i * block_size;
+		size_t length = content_size - block_begin < block_size ? content_size - block_begin : block_size;
+		size_t copy_begin = (begin > block_begin ? begin : block_begin) - block_begin;
+		size_t copy_end = (end < block_begin + length ? end : block_begin + length) - block_begin;
+		char* dest = output + block_begin + copy_begin - begin;
+
+		if (copy_begin == 0 && copy_end == length)
+		{
+			ok = decompress_block(block, blocks_end, checksum_size, dest, length, dictionary);
+		}
+		else
+		{
+			// Partial blocks at either end of the range decode into scratch first.
+			scratch = scratch ? scratch : heap_alloc(work->heap, block_size, 8);
+			ok = decompress_block(block, blocks_end, checksum_size, scratch, length, dictionary);
+			if (ok)
+			{
+				memcpy(dest, scratch + copy_begin, copy_end - copy_begin);
+			}
+		}
+		block += sizeof(uint32_t) + compressed_size + checksum_size;
 	}
-	return 0;
+
+	if (scratch)
+	{
+		heap_free(work->heap, scratch);
+	}
+	if (!ok)
+	{
+		heap_free(work->heap, output);
+		work->size = 0;
+		return false;
+	}
+	work->buffer = output;
+	return true;
+}
+
+// Copies the requested range out of a buffer into a new allocation.
+static void range_copy(fs_work_t* work, const char* data, size_t data_size)
+{
+	size_t begin = work->range_offset < data_size ? work->range_offset : data_size;
+	size_t end = data_size - begin < work->range_size ? data_size : begin + work->range_size;
+	work->size = end - begin;
+	work->buffer = NULL;
+	if (work->size)
+	{
+		work->buffer = heap_alloc(work->heap, work->size, 8);
+		memcpy(work->buffer, data + begin, work->size);
+	}
+}
+
+// Fills a range read from its mapped file, then drops the mapping.
+static void range_decode(fs_work_t* work)
+{
+	const char* data = fs_view_get_data(work->view);
+	size_t file_size = fs_view_get_size(work->view);
+	// The mapping set these to the whole file; they now describe the range.
+	work->buffer = NULL;
+	work->size = 0;
+
+	const char* table = NULL;
+	uint32_t block_size = 0;
+	uint32_t block_count = work->use_compression ? seek_table_find(data, file_size, &table, &block_size) : 0;
+	if (!work->use_compression)
+	{
+		range_copy(work, data, file_size);
+	}
+	else if (block_count)
+	{
+		if (!decompress_blocks(work, data, file_size, table, block_count, block_size))
+		{
+			debug_print(k_print_error, "There was an issue decompressing a file\n");
+			work->result = -1;
+		}
+	}
+	else
+	{
+		// Files written before seek tables existed are decoded in full.
+		uint32_t magic = 0;
+		memcpy(&magic, data, file_size < sizeof(magic) ? file_size : sizeof(magic));
+		work->temp_buffer = (void*)data;
+		work->temp_size = file_size;
+		bool decoded = magic == LZ4F_MAGICNUMBER ? decompress_frame(work) : decompress_legacy(work);
+		work->temp_buffer = NULL;
+		work->temp_size = 0;
+		if (decoded)
+		{
+			char* decompressed = work->buffer;
+			size_t decompressed_size = work->size;
+			range_copy(work, decompressed, decompressed_size);
+			heap_free(work->heap, decompressed);
+		}
+		else
+		{
+			debug_print(k_print_error, "There was an issue decompressing a file\n");
+			work->buffer = NULL;
+			work->size = 0;
+			work->result = -1;
+		}
+	}
+
+	fs_view_release(work->view);
+	work->view = NULL;
+	work_complete(work);
+}
+
+// Serves a read or map from a mounted archive. Nothing touches the disk except page faults
+// on the archive's mapping; raw entries mapped with fs_map are not even copied.
+static void archive_work_run(fs_work_t* work)
+{
+	const archive_entry_t* entry = work->entry;
+	char* data = (char*)work->archive->address + entry->offset;
+	if (entry->flags & k_archive_entry_compressed)
+	{
+		if (work->blocks == NULL)
+		{
+			work->buffer = data;
+			work->size = (size_t)entry->stored_size;
+		}
+		if (!decompress_work(work))
+		{
+			return;
+		}
+		// The compressed input was the archive itself, which the work does not own.
+		work->temp_buffer = NULL;
+		work->temp_size = 0;
+		if (work->result != 0)
+		{
+			work->buffer = NULL;
+			work->size = 0;
+		}
+		else if (work->op == k_fs_work_op_map)
+		{
+			view_create(work, work->buffer, work->size);
+			work->view->owns_buffer = true;
+		}
+	}
+	else if (work->op == k_fs_work_op_map)
+	{
+		view_create(work, data, (size_t)entry->stored_size);
+		work->view->parent = work->archive;
+		fs_view_acquire(work->archive);
+		if (work->hint == k_fs_map_hint_willneed)
+		{
+			view_touch_pages(work->view);
+		}
+	}
+	else
+	{
+		work->size = (size_t)entry->stored_size;
+		work->buffer = heap_alloc(work->heap, work->size + 1, 8);
+		memcpy(work->buffer, data, work->size);
+		if (work->null_terminate)
+		{
+			((char*)work->buffer)[work->size] = 0;
+		}
+	}
+	if (work->op == k_fs_work_op_read)
+	{
+		cache_publish(work);
+	}
+	work_complete(work);
 }
 
 static int compression_thread_func(void* user)
@@ -298,62 +3343,57 @@ static int compression_thread_func(void* user)
 		{
 			break;
 		}
+		trace_t* trace = fs_get_trace(fs);
+		if (work->entry)
+		{
+			TRACE_PUSH(trace, "fs archive read");
+			archive_work_run(work);
+			TRACE_POP(trace);
+			continue;
+		}
 
 		switch (work->op)
 		{
 		case k_fs_work_op_read:
+			TRACE_PUSH(trace, "fs decompress");
+			if (decompress_work(work))
 			{
-				work->temp_buffer = work->buffer;
-				work->temp_size = work->size;
-
-				int decompressed_size = atoi(work->temp_buffer); // Stops at the newline
-				int metadata_len = snprintf(NULL, 0, "%d\n", decompressed_size);
-
-				char* compressed_buffer = (char*)work->temp_buffer + metadata_len;
-				char* decompressed_buffer = heap_alloc(work->heap, decompressed_size + (work->null_terminate ? 1 : 0), 8);
-
-				int bytes_written = LZ4_decompress_safe(compressed_buffer, decompressed_buffer, (int)work->temp_size - metadata_len, decompressed_size);
-				if (bytes_written > 0)
-				{
-					work->buffer = decompressed_buffer;
-					work->size = bytes_written;
-					if (work->null_terminate)
-					{
-						((char*)work->buffer)[bytes_written] = 0;
-					}
-				}
-				else
-				{
-					debug_print(k_print_error, "There was an issue decompressing a file\n");
-				}
-
-				event_signal(work->done);
-				break;
+				cache_publish(work);
+				work_complete(work);
 			}
+			TRACE_POP(trace);
+			break;
 		case k_fs_work_op_write:
+			TRACE_PUSH(trace, "fs compress");
+			if (compress_work(work))
 			{
-				int metadata_len = snprintf(NULL, 0, "%d\n", (int)work->size);
-
-				int compressed_max_size = LZ4_compressBound((int)work->size);
-				char* compressed_buffer = heap_alloc(work->heap, compressed_max_size + metadata_len, 8);
-
-				snprintf(compressed_buffer, metadata_len + 1, "%d\n", (int)work->size);
-
-				int bytes_written = LZ4_compress_default(work->buffer, compressed_buffer + metadata_len, (int)work->size, compressed_max_size);
-				if (bytes_written > 0)
-				{
-					work->temp_buffer = compressed_buffer;
-					work->temp_size = bytes_written + metadata_len;
-				}
-				else
+				file_queue_push(fs, work);
+			}
+			TRACE_POP(trace);
+			break;
+		case k_fs_work_op_map:
+			// Mapped files are never compressed.
+			work_complete(work);
+			break;
+		case k_fs_work_op_stream:
+			{
+				// Chunks of one stream must decode in order, so one thread at a time drains them.
+				fs_stream_t* stream = work->stream;
+				TRACE_PUSH(trace, "fs stream decode");
+				while (!stream_decode_chunk(work) && atomic_decrement(&stream->pending) != 1)
 				{
-					debug_print(k_print_error, "There was an issue compressing a file\n");
 				}
-
-				queue_push(fs->file_queue, work);
+				TRACE_POP(trace);
 				break;
 			}
+		case k_fs_work_op_read_range:
+			TRACE_PUSH(trace, "fs range decode");
+			range_decode(work);
+			TRACE_POP(trace);
+			break;
 		}
 	}
+	heap_free(fs->heap, s_fs_stream_hc);
+	s_fs_stream_hc = NULL;
 	return 0;
 }
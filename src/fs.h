@@ -1,6 +1,8 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 // Asynchronous read/write file system.
 
@@ -10,16 +12,81 @@ typedef struct fs_t fs_t;
 // Handle to file work.
 typedef struct fs_work_t fs_work_t;
 
+// Handle to a read-only memory-mapped view of a file.
+typedef struct fs_view_t fs_view_t;
+
+// Expected access pattern for a mapped file.
+typedef enum fs_map_hint_t
+{
+	// No hint; pages fault in on first touch.
+	k_fs_map_hint_normal,
+	// Read front to back once; the OS reads further ahead.
+	k_fs_map_hint_sequential,
+	// Needed right away; the work completes once the whole file has been prefetched.
+	k_fs_map_hint_willneed,
+} fs_map_hint_t;
+
+// Compression levels for fs_write_ex.
+// Levels above k_fs_compression_fast use LZ4HC: much slower to write, smaller files,
+// and just as fast to read. Meant for offline builds rather than runtime saves.
+typedef enum fs_compression_level_t
+{
+	k_fs_compression_none = 0,
+	k_fs_compression_fast = 1,
+	k_fs_compression_hc = 9,
+	k_fs_compression_hc_max = 12,
+} fs_compression_level_t;
+
+// Priority classes of file work. Each class has its own queue; a file thread starts the
+// oldest work of the highest class, except that normal and background work periodically get
+// a turn first so they are never starved.
+typedef enum fs_priority_t
+{
+	// Something is about to wait on it, such as a load the game is blocked on.
+	k_fs_priority_critical,
+	k_fs_priority_normal,
+	// Saves, trace dumps and prefetching that nothing waits on.
+	k_fs_priority_background,
+	k_fs_priority_count,
+} fs_priority_t;
+
+enum
+{
+	// fs_work_get_result of work cancelled with fs_work_cancel.
+	k_fs_result_cancelled = -2,
+	// LZ4 only ever looks back this far, so only the end of a longer dictionary is kept.
+	k_fs_max_dictionary_size = 64 * 1024,
+};
+
 typedef struct heap_t heap_t;
+typedef struct trace_t trace_t;
 
 // Create a new file system.
 // Provided heap will be used to allocate space for queue and work buffers.
 // Provided queue size defines number of in-flight file operations.
+// Compression runs on one thread per logical CPU set aside for compression by
+// thread_desc_for_role; large files are split into blocks that are compressed and
+// decompressed on all of them at once.
 fs_t* fs_create(heap_t* heap, int queue_capacity);
 
+// Create a new file system with a given number of compression threads (zero for the default).
+fs_t* fs_create_ex(heap_t* heap, int queue_capacity, int compression_thread_count);
+
 // Destroy a previously created file system.
 void fs_destroy(fs_t* fs);
 
+// Set the priority of file work queued by the calling thread from now on.
+// The default is k_fs_priority_normal. Returns the previous priority, so it can be restored.
+fs_priority_t fs_set_thread_priority(fs_priority_t priority);
+
+// Mount a packed archive (see archive.h).
+// From then on fs_read, fs_read_cached and fs_map of any path the archive contains are served
+// from it, decompressing whole entries as needed, instead of from loose files. fs_read_range
+// and fs_read_stream always read loose files. Later mounts take precedence.
+// Mount before queueing work; mounting is not synchronized with reads in flight.
+// Returns false if the archive is missing or invalid.
+bool fs_mount(fs_t* fs, const char* path);
+
 // Queue a file read.
 // File at the specified path will be read in full.
 // Memory for the file will be allocated out of the provided heap.
@@ -27,17 +94,168 @@ void fs_destroy(fs_t* fs);
 // Returns a work object.
 fs_work_t* fs_read(fs_t* fs, const char* path, heap_t* heap, bool null_terminate, bool use_compression);
 
+// Queue a read of a file through the read cache.
+// The file is read and decompressed once; later reads of the same version of it, while it
+// stays cached, complete immediately and share the same buffer. A file whose modification
+// time or size changed since it was cached is read again.
+// The buffer is always null terminated and belongs to the work: do not free it. It stays
+// valid until fs_work_destroy, or for as long as a view from fs_work_get_view is held.
+// Without a cache (see fs_cache_configure) the file is simply read into a fresh buffer.
+// Returns a work object.
+fs_work_t* fs_read_cached(fs_t* fs, const char* path, bool use_compression);
+
+// Set the byte budget of the read cache used by fs_read_cached.
+// Least recently used files are evicted to stay within it. Zero, the default, disables the
+// cache and drops everything in it.
+void fs_cache_configure(fs_t* fs, size_t capacity);
+
+// Counters of the read cache. See fs_cache_get_stats().
+typedef struct fs_cache_stats_t
+{
+	// Reads served from the cache, and reads that had to go to the file.
+	uint64_t hit_count;
+	uint64_t miss_count;
+	// Files dropped to stay within the budget.
+	uint64_t eviction_count;
+	// Bytes held, and the budget.
+	size_t size;
+	size_t capacity;
+	int entry_count;
+} fs_cache_stats_t;
+
+// Read the counters of the read cache.
+void fs_cache_get_stats(fs_t* fs, fs_cache_stats_t* stats);
+
+// Have the file and compression threads record what they work on into a trace.
+// May be changed while work runs; a NULL trace stops recording. A trace must outlive the
+// file system it was set on, or be cleared with the file system idle.
+void fs_set_trace(fs_t* fs, trace_t* trace);
+
+// Records the work in flight and the bytes held by the read cache as trace counters.
+// Intended to be called once per frame.
+void fs_emit_counters(fs_t* fs, trace_t* trace);
+
 // Queue a file write.
 // File at the specified path will be written in full.
+// Compressed files are LZ4 frames of independent, checksummed blocks followed by a seek table,
+// so fs_read_range can decode parts of them.
 // Returns a work object.
 fs_work_t* fs_write(fs_t* fs, const char* path, const void* buffer, size_t size, bool use_compression);
 
+// Queue a file write at a compression level from fs_compression_level_t (or any LZ4HC level in between).
+// Returns a work object.
+fs_work_t* fs_write_ex(fs_t* fs, const char* path, const void* buffer, size_t size, int compression_level);
+
+// Queue an uncompressed write to the end of a file, creating the file if needed.
+// Appends queued together may land in any order; to keep a file's appends in order, queue
+// each one after the previous has completed.
+// Returns a work object.
+fs_work_t* fs_append(fs_t* fs, const char* path, const void* buffer, size_t size);
+
+// Register a compression dictionary (see dictionary.h) and return its ID.
+// Only the last k_fs_max_dictionary_size bytes of a larger dictionary are used. The ID is a
+// hash of the contents, so the same dictionary registered in another run gets the same ID.
+// Compressed files record the ID of the dictionary they were written with, and reading one
+// needs it registered. Safe to call while other work runs; register before queueing work
+// that uses it. Returns 0 on failure.
+uint32_t fs_dictionary_register(fs_t* fs, const void* data, size_t size);
+
+// Queue a compressed file write that uses a registered dictionary.
+// Small files that resemble the dictionary's training samples compress far better than alone.
+// Returns a work object.
+fs_work_t* fs_write_with_dictionary(fs_t* fs, const char* path, const void* buffer, size_t size, int compression_level, uint32_t dictionary_id);
+
+// Queue a read of size bytes starting at offset.
+// For compressed files offset and size are in decompressed bytes, and only the blocks that
+// cover the range are decompressed; files without a seek table are decoded in full.
+// The range is clamped to the end of the file; fs_work_get_size returns the bytes read.
+// Memory for the range will be allocated out of the provided heap.
+// It is the calls responsibility to free the memory allocated!
+// Returns a work object.
+fs_work_t* fs_read_range(fs_t* fs, const char* path, heap_t* heap, size_t offset, size_t size, bool use_compression);
+
+// Called with each chunk of a streamed read, in file order, on a file system thread.
+// data is only valid for the duration of the call; offset is its position in the (decompressed) file.
+// Return false to stop the stream early.
+typedef bool (*fs_chunk_fn_t)(void* user, const void* data, size_t size, size_t offset);
+
+// Queue a streaming file read.
+// The file is read chunk_size bytes at a time (zero picks a default) and each chunk,
+// decompressed when use_compression is set, is passed to fn as soon as it is ready.
+// Decompressing or consuming one chunk overlaps reading the next, so a consumer can start
+// work before the file has been fully read. Nothing is allocated from a caller heap.
+// The work completes after the last call to fn; fs_work_get_size returns the bytes delivered.
+// Returns a work object.
+fs_work_t* fs_read_stream(fs_t* fs, const char* path, size_t chunk_size, bool use_compression, fs_chunk_fn_t fn, void* user);
+
+// Queue a read-only memory mapping of a file.
+// Nothing is allocated from a heap and nothing is copied: the view aliases the OS file cache.
+// fs_work_get_buffer and fs_work_get_size return the mapped address and the file size.
+// The work holds a reference to the view, which fs_work_destroy releases.
+// Returns a work object.
+fs_work_t* fs_map(fs_t* fs, const char* path, fs_map_hint_t hint);
+
+// Get the view mapped by fs_map work and add a reference to it, so it can outlive the work.
+// Returns NULL if the mapping failed.
+fs_view_t* fs_work_get_view(fs_work_t* work);
+
+// Get the address of a mapped view.
+const void* fs_view_get_data(fs_view_t* view);
+
+// Get the size of a mapped view.
+size_t fs_view_get_size(fs_view_t* view);
+
+// Add a reference to a mapped view.
+void fs_view_acquire(fs_view_t* view);
+
+// Drop a reference to a mapped view.
+// The file is unmapped when the last reference is released.
+void fs_view_release(fs_view_t* view);
+
 // If true, the file work is complete.
 bool fs_work_is_done(fs_work_t* work);
 
 // Block for the file work to complete.
 void fs_work_wait(fs_work_t* work);
 
+// Block until all of count work items are complete. NULL entries are skipped.
+void fs_work_wait_all(fs_work_t** works, int count);
+
+// Block until any of count work items is complete and return its index.
+// NULL entries are skipped, so a loader can clear each slot as it handles it and call again.
+// All work must come from the same file system. Returns -1 if every entry is NULL.
+int fs_work_wait_any(fs_work_t** works, int count);
+
+// Called once a work item completes.
+typedef void (*fs_work_callback_t)(fs_work_t* work, void* user);
+
+// Handle to a queue of completion callbacks, run by whichever thread drains it.
+typedef struct fs_callback_queue_t fs_callback_queue_t;
+
+// Create a callback queue.
+fs_callback_queue_t* fs_callback_queue_create(heap_t* heap);
+
+// Destroy a callback queue, running any callbacks still in it.
+void fs_callback_queue_destroy(fs_callback_queue_t* queue);
+
+// Run the callbacks queued so far, in completion order, on the calling thread.
+// Meant for a main loop or a job; never blocks. Returns the number run.
+int fs_callback_queue_run(fs_callback_queue_t* queue);
+
+// Set a callback to run when the work completes, or right away if it already has.
+// With a queue, the callback is added to it on completion and runs in fs_callback_queue_run.
+// Without one it runs on the file system thread that completed the work, so it must be short.
+// Set at most one callback per work item. From then on the callback owns the work: it may
+// destroy it, and nothing else may before the callback has run.
+void fs_work_set_callback(fs_work_t* work, fs_work_callback_t callback, void* user, fs_callback_queue_t* queue);
+
+// Cancel work that is still queued for a file thread.
+// The work completes at once with result k_fs_result_cancelled, so anything waiting on it
+// returns; it must still be destroyed. Work that has started, or is being compressed or
+// decompressed, runs to completion.
+// Returns true if the work was cancelled.
+bool fs_work_cancel(fs_work_t* work);
+
 // Get the error code for the file work.
 // A value of zero generally indicates success.
 int fs_work_get_result(fs_work_t* work);
@@ -48,5 +266,9 @@ void* fs_work_get_buffer(fs_work_t* work);
 // Get the size associated with the file operation.
 size_t fs_work_get_size(fs_work_t* work);
 
-// Free a file work object.
+// Add a reference to a file work object, so it can be shared by several owners.
+// Each reference is dropped with fs_work_destroy.
+void fs_work_retain(fs_work_t* work);
+
+// Wait for a file work object and drop a reference to it, freeing it with the last one.
 void fs_work_destroy(fs_work_t* work);
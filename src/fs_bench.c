@@ -0,0 +1,231 @@
+#include "fs_bench.h"
+
+#include "debug.h"
+#include "fs.h"
+#include "heap.h"
+#include "timer.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum
+{
+	k_min_size = 4 * 1024,
+	// Each case moves about this much data, in between depth and k_max_requests requests.
+	k_case_bytes = 256 * 1024 * 1024,
+	k_max_requests = 1024,
+	// Cases keep at most this much in flight, so the largest files run one at a time.
+	k_max_in_flight_bytes = 1024 * 1024 * 1024,
+	k_max_depth = 16,
+	// The data repeats with this period: far beyond the LZ4 window, so it does not inflate the ratio.
+	k_pattern_size = 1024 * 1024,
+	k_csv_capacity = 64 * 1024,
+};
+
+typedef enum bench_op_t
+{
+	k_bench_write,
+	k_bench_read,
+	k_bench_compressed_write,
+	k_bench_compressed_read,
+	k_bench_op_count,
+} bench_op_t;
+
+static const char* k_op_names[k_bench_op_count] = { "write", "read", "compressed_write", "compressed_read" };
+static const int k_depths[] = { 1, 4, 16 };
+
+typedef struct bench_result_t
+{
+	int requests;
+	double mb_per_s;
+	double p50_us;
+	double p99_us;
+	// Uncompressed over compressed size; zero for uncompressed operations.
+	double ratio;
+	bool valid;
+} bench_result_t;
+
+// Text-like data with short random runs, about 2:1 with the fast level.
+static void fill_data(char* data, size_t size)
+{
+	static const char* k_words[] = { "asset ", "shader ", "texture ", "level ", "entity ", "script ", "sound ", "mesh " };
+	uint32_t state = 67890;
+	size_t pattern_size = size < k_pattern_size ? size : k_pattern_size;
+	size_t offset = 0;
+	while (offset < pattern_size)
+	{
+		state = state * 1664525 + 1013904223;
+		if ((state >> 24) < 8)
+		{
+			for (int i = 0; i < 64 && offset < pattern_size; ++i)
+			{
+				state = state * 1664525 + 1013904223;
+				data[offset++] = (char)(state >> 24);
+			}
+		}
+		else
+		{
+			for (const char* c = k_words[(state >> 16) % 8]; *c && offset < pattern_size; ++c)
+			{
+				data[offset++] = *c;
+			}
+		}
+	}
+	for (; offset < size; offset += pattern_size)
+	{
+		memcpy(data + offset, data, size - offset < pattern_size ? size - offset : pattern_size);
+	}
+}
+
+static void bench_path(char* path, size_t path_size, int index)
+{
+	snprintf(path, path_size, "fs_bench_%d.dat", index);
+}
+
+static int compare_ticks(const void* a, const void* b)
+{
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return x < y ? -1 : x > y ? 1 : 0;
+}
+
+// Issues requests of one operation, keeping depth of them in flight, and times each one.
+// Each slot works on its own file; reads use the files the matching write case left behind.
+static bench_result_t bench_case(fs_t* fs, heap_t* heap, bench_op_t op, const char* data, size_t size, int depth)
+{
+	bool write = op == k_bench_write || op == k_bench_compressed_write;
+	bool compressed = op == k_bench_compressed_write || op == k_bench_compressed_read;
+
+	bench_result_t result = { 0 };
+	result.valid = true;
+	result.requests = (int)(k_case_bytes / size);
+	result.requests = result.requests < depth ? depth : result.requests;
+	result.requests = result.requests > k_max_requests ? k_max_requests : result.requests;
+
+	uint64_t* latencies = heap_alloc(heap, result.requests * sizeof(uint64_t), 8);
+	fs_work_t* slots[k_max_depth] = { 0 };
+	uint64_t starts[k_max_depth];
+	char path[64];
+	int issued = 0;
+	int completed = 0;
+
+	uint64_t begin = timer_get_ticks();
+	uint64_t now = begin;
+	while (completed < result.requests)
+	{
+		for (int s = 0; s < depth && issued < result.requests; ++s)
+		{
+			if (slots[s] == NULL)
+			{
+				bench_path(path, sizeof(path), s);
+				starts[s] = timer_get_ticks();
+				slots[s] = write ?
+					fs_write_ex(fs, path, data, size, compressed ? k_fs_compression_fast : k_fs_compression_none) :
+					fs_read(fs, path, heap, false, compressed);
+				issued++;
+			}
+		}
+
+		// Stamp everything that finished together, so no request is charged for the others' handling.
+		fs_work_wait_any(slots, depth);
+		now = timer_get_ticks();
+		for (int s = 0; s < depth; ++s)
+		{
+			if (slots[s] && fs_work_is_done(slots[s]))
+			{
+				latencies[completed++] = now - starts[s];
+				result.valid = result.valid && fs_work_get_result(slots[s]) == 0 && (write || fs_work_get_size(slots[s]) == size);
+				if (!write)
+				{
+					heap_free(heap, fs_work_get_buffer(slots[s]));
+				}
+				fs_work_destroy(slots[s]);
+				slots[s] = NULL;
+			}
+		}
+	}
+
+	uint64_t elapsed_us = timer_ticks_to_us(now - begin);
+	result.mb_per_s = elapsed_us ? (double)size * result.requests / (1024.0 * 1024.0) / (elapsed_us / 1000000.0) : 0.0;
+	qsort(latencies, result.requests, sizeof(uint64_t), compare_ticks);
+	result.p50_us = (double)timer_ticks_to_us(latencies[result.requests / 2]);
+	result.p99_us = (double)timer_ticks_to_us(latencies[(result.requests * 99) / 100 < result.requests ? (result.requests * 99) / 100 : result.requests - 1]);
+	heap_free(heap, latencies);
+
+	if (op == k_bench_compressed_write)
+	{
+		bench_path(path, sizeof(path), 0);
+		fs_work_t* map_work = fs_map(fs, path, k_fs_map_hint_normal);
+		size_t stored_size = fs_work_get_size(map_work);
+		fs_work_destroy(map_work);
+		result.ratio = stored_size ? (double)size / stored_size : 0.0;
+	}
+	return result;
+}
+
+void fs_bench_run(const char* csv_path, size_t max_size)
+{
+	heap_t* heap = heap_create(2 * 1024 * 1024);
+	fs_t* fs = fs_create(heap, 64);
+	char* data = heap_alloc(heap, max_size, 64);
+	fill_data(data, max_size);
+
+	char* csv = heap_alloc(heap, k_csv_capacity, 8);
+	int csv_size = snprintf(csv, k_csv_capacity, "op,size,depth,requests,mb_per_s,p50_us,p99_us,ratio,valid\n");
+
+	debug_print(k_print_info, "File system read/write (file cache warm):\n");
+	for (size_t size = k_min_size; size <= max_size; size *= 4)
+	{
+		for (int d = 0; d < (int)(sizeof(k_depths) / sizeof(k_depths[0])); ++d)
+		{
+			int depth = k_depths[d];
+			if (depth > 1 && (size_t)depth * size > k_max_in_flight_bytes)
+			{
+				break;
+			}
+			// Writes come first so the reads after them find their files.
+			double ratio = 0.0;
+			for (int op = 0; op < k_bench_op_count; ++op)
+			{
+				bench_result_t result = bench_case(fs, heap, op, data, size, depth);
+				ratio = op == k_bench_compressed_write ? result.ratio : ratio;
+				result.ratio = op >= k_bench_compressed_write ? ratio : 0.0;
+
+				debug_print(k_print_info, "  %-16s size=%10zu depth=%2d requests=%4d %8.1f MB/s p50=%9.1f us p99=%9.1f us ratio=%5.2f%s\n",
+					k_op_names[op], size, depth, result.requests, result.mb_per_s, result.p50_us, result.p99_us,
+					result.ratio, result.valid ? "" : " FAILED");
+				if (csv_size < k_csv_capacity)
+				{
+					csv_size += snprintf(csv + csv_size, k_csv_capacity - csv_size, "%s,%zu,%d,%d,%.1f,%.1f,%.1f,%.3f,%d\n",
+						k_op_names[op], size, depth, result.requests, result.mb_per_s, result.p50_us, result.p99_us,
+						result.ratio, result.valid ? 1 : 0);
+				}
+			}
+		}
+	}
+
+	csv_size = csv_size < k_csv_capacity ? csv_size : k_csv_capacity - 1;
+	fs_work_t* csv_work = fs_write(fs, csv_path, csv, csv_size, false);
+	if (fs_work_get_result(csv_work) == 0)
+	{
+		debug_print(k_print_info, "Results written to %s\n", csv_path);
+	}
+	else
+	{
+		debug_print(k_print_error, "Unable to write %s\n", csv_path);
+	}
+	fs_work_destroy(csv_work);
+
+	fs_destroy(fs);
+	char path[64];
+	for (int i = 0; i < k_max_depth; ++i)
+	{
+		bench_path(path, sizeof(path), i);
+		remove(path);
+	}
+	heap_free(heap, csv);
+	heap_free(heap, data);
+	heap_destroy(heap);
+}
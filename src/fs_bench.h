@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stddef.h>
+
+// File system throughput and latency benchmark.
+// Runs read, write, compressed read and compressed write through fs_t across file sizes
+// and numbers of requests in flight, and reports MB/s, p50/p99 per-request latency and,
+// for compressed operations, compression ratio. Results are printed and written as CSV,
+// one row per case, so runs can be compared to catch regressions.
+
+// Run all file system benchmarks on files up to max_size bytes, writing results to csv_path.
+void fs_bench_run(const char* csv_path, size_t max_size);
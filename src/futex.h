@@ -0,0 +1,22 @@
+#pragma once
+
+// Address-based thread synchronization.
+// A thread can sleep until the integer at an address changes.
+// Building block for the light-weight mutex, event, and semaphore.
+
+// Number of times a contended primitive retries in user space before
+// sleeping in the kernel.
+enum
+{
+	k_futex_spin_count = 128,
+};
+
+// Put the calling thread to sleep while *address equals expected.
+// May return spuriously. Callers must re-check their wait condition.
+void futex_wait(int* address, int expected);
+
+// Wake at most count threads sleeping on address.
+void futex_wake(int* address, int count);
+
+// Wake all threads sleeping on address.
+void futex_wake_all(int* address);
@@ -6,10 +6,18 @@
 
 #include <stddef.h>
 #include <stdio.h>
+#include <string.h>
 
+#if defined(_WIN32)
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 #include <dbghelp.h>
+#else
+#include <execinfo.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#define __max(a, b) ((a) > (b) ? (a) : (b))
+#endif
 
 #define FUNCTION_NAME_LENGTH 64
 #define MAX_STACK_DEPTH 16
@@ -18,6 +26,7 @@ typedef struct arena_t
 {
 	pool_t pool;
 	struct arena_t* next;
+	size_t size;
 } arena_t;
 
 typedef struct heap_t
@@ -28,6 +37,23 @@ typedef struct heap_t
 	mutex_t* mutex;
 } heap_t;
 
+#if defined(_WIN32)
+// Allocates committed, zeroed pages from the OS.
+static void* heap_os_alloc(size_t size)
+{
+	return VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+}
+
+static void heap_os_free(void* address, size_t size)
+{
+	VirtualFree(address, 0, MEM_RELEASE);
+}
+
+static void capture_backtrace(void** stack)
+{
+	CaptureStackBackTrace(2, MAX_STACK_DEPTH, stack, NULL);
+}
+
 void print_backtrace(DWORD64* stack)
 {
 	char* fn_name = VirtualAlloc(NULL, FUNCTION_NAME_LENGTH * sizeof(char),
@@ -74,11 +100,39 @@ void print_backtrace(DWORD64* stack)
 
 	VirtualFree(fn_name, 0, MEM_RELEASE);
 }
+#else
+static void* heap_os_alloc(size_t size)
+{
+	void* address = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return address == MAP_FAILED ? NULL : address;
+}
+
+static void heap_os_free(void* address, size_t size)
+{
+	munmap(address, size);
+}
+
+static void capture_backtrace(void** stack)
+{
+	memset(stack, 0, MAX_STACK_DEPTH * sizeof(void*));
+	debug_backtrace(stack, MAX_STACK_DEPTH);
+}
+
+void print_backtrace(void** stack)
+{
+	int depth = 0;
+	while (depth < MAX_STACK_DEPTH && stack[depth])
+	{
+		++depth;
+	}
+	fflush(stdout);
+	backtrace_symbols_fd(stack, depth, STDOUT_FILENO);
+}
+#endif
 
 heap_t* heap_create(size_t grow_increment)
 {
-	heap_t* heap = VirtualAlloc(NULL, sizeof(heap_t) + tlsf_size(),
-		MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	heap_t* heap = heap_os_alloc(sizeof(heap_t) + tlsf_size());
 	if (!heap)
 	{
 		debug_print(
@@ -87,7 +141,7 @@ heap_t* heap_create(size_t grow_increment)
 		return NULL;
 	}
 
-	heap->mutex = mutex_create();
+	heap->mutex = mutex_create_named("heap");
 	heap->grow_increment = grow_increment;
 	heap->tlsf = tlsf_create(heap + 1);
 	heap->arena = NULL;
@@ -107,16 +161,16 @@ void* heap_alloc(heap_t* heap, size_t size, size_t alignment)
 		size_t arena_size =
 			__max(heap->grow_increment, padded_size * 2) +
 			sizeof(arena_t);
-		arena_t* arena = VirtualAlloc(NULL,
-			arena_size + tlsf_pool_overhead(),
-			MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+		arena_t* arena = heap_os_alloc(arena_size + tlsf_pool_overhead());
 		if (!arena)
 		{
 			debug_print(
 				k_print_error,
 				"OUT OF MEMORY!\n");
+			mutex_unlock(heap->mutex);
 			return NULL;
 		}
+		arena->size = arena_size + tlsf_pool_overhead();
 
 		arena->pool = tlsf_add_pool(heap->tlsf, arena + 1, arena_size);
 
@@ -129,7 +183,7 @@ void* heap_alloc(heap_t* heap, size_t size, size_t alignment)
 	if (address)
 	{
 		void* stack = (void*)((char*)address + padded_size);
-		CaptureStackBackTrace(2, MAX_STACK_DEPTH, stack, NULL);
+		capture_backtrace(stack);
 	}
 	
 	mutex_unlock(heap->mutex);
@@ -167,11 +221,11 @@ void heap_destroy(heap_t* heap)
 	{
 		arena_t* next = arena->next;
 		tlsf_walk_pool(arena->pool, memory_leak_walker, NULL);
-		VirtualFree(arena, 0, MEM_RELEASE);
+		heap_os_free(arena, arena->size);
 		arena = next;
 	}
 
 	mutex_destroy(heap->mutex);
 
-	VirtualFree(heap, 0, MEM_RELEASE);
+	heap_os_free(heap, sizeof(heap_t) + tlsf_size());
 }
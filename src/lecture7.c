@@ -1,117 +1,232 @@
+#include "lecture7.h"
+
 #include "atomic.h"
 #include "debug.h"
 #include "event.h"
 #include "mutex.h"
-#include "semaphore.h"
 #include "thread.h"
+#include "timer.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+enum
+{
+	k_iterations = 1000000,
+	k_max_threads = 8,
+	k_cache_line_size = 64,
+};
 
-#include <windows.h>
+// A counter on its own cache line, so per-thread counters do not false-share.
+typedef struct padded_counter_t
+{
+	int64_t value;
+	char padding[k_cache_line_size - sizeof(int64_t)];
+} padded_counter_t;
 
 typedef struct thread_data_t
 {
-	int* counter;
+	int64_t* counter;
 	mutex_t* mutex;
 	event_t* start;
+	int ready;
 } thread_data_t;
 
-static int no_synchronization_func(void* user)
+typedef struct thread_args_t
 {
-	thread_data_t* thread_data = user;
-	event_wait(thread_data->start);
+	thread_data_t* shared;
+	int64_t* counter;
+} thread_args_t;
 
-	DWORD t0 = timeGetTime();
+static int64_t* wait_for_start(thread_args_t* args)
+{
+	atomic_increment(&args->shared->ready);
+	event_wait(args->shared->start);
+	return args->counter;
+}
 
-	for (int i = 0; i < 100000; ++i)
+static int no_synchronization_func(void* user)
+{
+	volatile int64_t* counter = wait_for_start(user);
+	for (int i = 0; i < k_iterations; ++i)
 	{
-		*thread_data->counter = *thread_data->counter + 1;
+		*counter = *counter + 1;
 	}
-
-	return timeGetTime() - t0;
+	return 0;
 }
 
-static int atomic_load_store_func(void* user)
+static int load_store_relaxed_func(void* user)
 {
-	thread_data_t* thread_data = user;
-	event_wait(thread_data->start);
-
-	DWORD t0 = timeGetTime();
-
-	for (int i = 0; i < 100000; ++i)
+	int64_t* counter = wait_for_start(user);
+	for (int i = 0; i < k_iterations; ++i)
 	{
-		atomic_store(thread_data->counter, atomic_load(thread_data->counter) + 1);
+		atomic_store64_relaxed(counter, atomic_load64_relaxed(counter) + 1);
 	}
+	return 0;
+}
 
-	return timeGetTime() - t0;
+static int load_acquire_store_release_func(void* user)
+{
+	int64_t* counter = wait_for_start(user);
+	for (int i = 0; i < k_iterations; ++i)
+	{
+		atomic_store64_release(counter, atomic_load64_acquire(counter) + 1);
+	}
+	return 0;
 }
 
-static int atomic_increment_func(void* user)
+static int fetch_add_func(void* user)
 {
-	thread_data_t* thread_data = user;
-	event_wait(thread_data->start);
+	int64_t* counter = wait_for_start(user);
+	for (int i = 0; i < k_iterations; ++i)
+	{
+		atomic_add64(counter, 1);
+	}
+	return 0;
+}
 
-	DWORD t0 = timeGetTime();
+static int swap_func(void* user)
+{
+	int64_t* counter = wait_for_start(user);
+	for (int i = 0; i < k_iterations; ++i)
+	{
+		atomic_swap64(counter, i);
+	}
+	return 0;
+}
 
-	for (int i = 0; i < 100000; ++i)
+static int compare_and_exchange_loop_func(void* user)
+{
+	int64_t* counter = wait_for_start(user);
+	for (int i = 0; i < k_iterations; ++i)
 	{
-		atomic_increment(thread_data->counter);
+		int64_t old = atomic_load64_relaxed(counter);
+		int64_t seen;
+		while ((seen = atomic_compare_and_exchange64(counter, old, old + 1)) != old)
+		{
+			old = seen;
+			cpu_pause();
+		}
 	}
+	return 0;
+}
 
-	return timeGetTime() - t0;
+static int compare_and_exchange_pair_func(void* user)
+{
+	atomic_pair_t* pair = (atomic_pair_t*)wait_for_start(user);
+	for (int i = 0; i < k_iterations; ++i)
+	{
+		// Versioned counter: the pattern used for ABA-safe tagged pointers.
+		atomic_pair_t old = *pair;
+		atomic_pair_t next;
+		do
+		{
+			next.lo = old.lo + 1;
+			next.hi = old.hi + 1;
+		} while (!atomic_compare_and_exchange_pair(pair, &old, next));
+	}
+	return 0;
 }
 
 static int mutex_func(void* user)
 {
-	thread_data_t* thread_data = user;
-	event_wait(thread_data->start);
-
-	DWORD t0 = timeGetTime();
-
-	for (int i = 0; i < 100000; ++i)
+	thread_args_t* args = user;
+	int64_t* counter = wait_for_start(args);
+	for (int i = 0; i < k_iterations; ++i)
 	{
-		mutex_lock(thread_data->mutex);
-		*thread_data->counter = *thread_data->counter + 1;
-		mutex_unlock(thread_data->mutex);
+		mutex_lock(args->shared->mutex);
+		*counter = *counter + 1;
+		mutex_unlock(args->shared->mutex);
 	}
-
-	return timeGetTime() - t0;
+	return 0;
 }
 
-static void run_timed_test(int (*thread_func)(void*), const char* name)
+// Runs a test on thread_count threads.
+// If shared is true all threads hit one counter; otherwise each thread has its own cache line.
+static void run_timed_test(int (*thread_func)(void*), const char* name, int thread_count, bool shared)
 {
-	int counter = 0;
+	static padded_counter_t s_counters[k_max_threads + 1];
+	static atomic_pair_t s_pair;
+	for (int i = 0; i < k_max_threads + 1; ++i)
+	{
+		s_counters[i].value = 0;
+	}
+	s_pair.lo = s_pair.hi = 0;
+	bool is_pair = thread_func == compare_and_exchange_pair_func;
+
 	thread_data_t thread_data =
 	{
-		.counter = &counter,
 		.mutex = mutex_create(),
 		.start = event_create(),
+		.ready = 0,
 	};
 
-	// Create threads.
-	thread_t* threads[8];
-	for (int i = 0; i < _countof(threads); ++i)
+	thread_args_t args[k_max_threads];
+	thread_t* threads[k_max_threads];
+	for (int i = 0; i < thread_count; ++i)
 	{
-		threads[i] = thread_create(thread_func, &thread_data);
+		args[i].shared = &thread_data;
+		args[i].counter = is_pair ? (int64_t*)&s_pair : shared ? &s_counters[0].value : &s_counters[i + 1].value;
+		threads[i] = thread_create(thread_func, &args[i]);
 	}
 
-	// Go!
+	// Go once every thread is parked on the start event.
+	while (atomic_load(&thread_data.ready) < thread_count)
+	{
+		thread_sleep(0);
+	}
+	uint64_t t0 = timer_get_ticks();
 	event_signal(thread_data.start);
-
-	// Wait for threads to be done.
-	int duration = 0;
-	for (int i = 0; i < _countof(threads); ++i)
+	for (int i = 0; i < thread_count; ++i)
 	{
-		duration += thread_destroy(threads[i]);
+		thread_destroy(threads[i]);
 	}
+	uint64_t elapsed = timer_get_ticks() - t0;
+
 	mutex_destroy(thread_data.mutex);
 	event_destroy(thread_data.start);
 
-	debug_print(k_print_warning, "%s duration=%dms, counter=%d\n", name, duration, counter);
+	int64_t total = (int64_t)s_pair.lo;
+	for (int i = 0; i < k_max_threads + 1; ++i)
+	{
+		total += s_counters[i].value;
+	}
+
+	double seconds = (double)timer_ticks_to_us(elapsed) / 1000000.0;
+	double mops = (double)k_iterations * thread_count / (seconds > 0.0 ? seconds : 1e-9) / 1000000.0;
+	debug_print(k_print_warning, "  %-28s %-7s threads=%d %9.1f Mops/s counter=%lld\n",
+		name, shared ? "shared" : "private", thread_count, mops, (long long)total);
 }
 
 void lecture7_thread_test()
 {
-	run_timed_test(no_synchronization_func, "no_synchronization");
-	run_timed_test(atomic_load_store_func, "atomic_load_store");
-	run_timed_test(atomic_increment_func, "atomic_increment");
-	run_timed_test(mutex_func, "mutex");
+	struct
+	{
+		int (*func)(void*);
+		const char* name;
+	} tests[] =
+	{
+		{ no_synchronization_func, "no_synchronization" },
+		{ load_store_relaxed_func, "load_store_relaxed" },
+		{ load_acquire_store_release_func, "load_acquire_store_release" },
+		{ fetch_add_func, "fetch_add64" },
+		{ swap_func, "swap64" },
+		{ compare_and_exchange_loop_func, "cas64_loop" },
+		{ compare_and_exchange_pair_func, "cas128_loop" },
+		{ mutex_func, "mutex" },
+	};
+
+	for (int t = 0; t < (int)(sizeof(tests) / sizeof(tests[0])); ++t)
+	{
+		debug_print(k_print_warning, "%s:\n", tests[t].name);
+		for (int thread_count = 1; thread_count <= k_max_threads; thread_count *= 2)
+		{
+			run_timed_test(tests[t].func, tests[t].name, thread_count, true);
+		}
+		// There is only one 128-bit pair, so it has no private variant.
+		if (tests[t].func != compare_and_exchange_pair_func)
+		{
+			run_timed_test(tests[t].func, tests[t].name, k_max_threads, false);
+		}
+	}
 }
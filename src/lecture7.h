@@ -0,0 +1,8 @@
+#pragma once
+
+// Atomic operation throughput microbenchmark.
+// Runs each atomic flavor on 1 to 8 threads hammering one shared counter,
+// then on per-thread counters, and prints operations per second.
+
+// Run the atomic throughput benchmark.
+void lecture7_thread_test();
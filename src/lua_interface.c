@@ -75,7 +75,23 @@ bool handle_lua_error(lua_State* L, int result)
 // Lua file search & start
 void run_lua_file(lua_State* L, const char* path)
 {
-    if (handle_lua_error(L, luaL_dofile(L, path)))
+    // Load through the file system so scripts packed into a mounted archive are found there.
+    lua_project_t* lp = get_project_from_state(L);
+    fs_work_t* work = fs_read_cached(lp->fs, path, false);
+    if (fs_work_get_result(work) != 0)
+    {
+        printf("Unable to read [%s]\n", path);
+        fs_work_destroy(work);
+        return;
+    }
+
+    int result = luaL_loadbuffer(L, fs_work_get_buffer(work), fs_work_get_size(work), path);
+    fs_work_destroy(work);
+    if (result == LUA_OK)
+    {
+        result = lua_pcall(L, 0, LUA_MULTRET, 0);
+    }
+    if (handle_lua_error(L, result))
     {
         lua_pop(L, lua_gettop(L));
     }
@@ -350,8 +366,8 @@ void lua_project_destroy(lua_project_t* lp)
 // Rendering system
 static void load_resources(lua_project_t* lp)
 {
-    lp->vertex_shader_work = fs_read(lp->fs, "shaders/triangle.vert.spv", lp->heap, false, false);
-    lp->fragment_shader_work = fs_read(lp->fs, "shaders/triangle.frag.spv", lp->heap, false, false);
+    lp->vertex_shader_work = fs_read_cached(lp->fs, "shaders/triangle.vert.spv", false);
+    lp->fragment_shader_work = fs_read_cached(lp->fs, "shaders/triangle.frag.spv", false);
     lp->cube_shader = (gpu_shader_info_t)
     {
         .vertex_shader_data = fs_work_get_buffer(lp->vertex_shader_work),
@@ -1,15 +1,39 @@
+#include "archive.h"
+#include "compression_bench.h"
+#include "fs_bench.h"
 #include "debug.h"
+#include "dictionary.h"
+#include "frame_stats.h"
 #include "fs.h"
 #include "heap.h"
+#include "lecture7.h"
+#include "mutex.h"
+#include "parallel_bench.h"
 #include "render.h"
+#include "sync_bench.h"
+#include "thread.h"
 //#include "simple_game.h"
 //#include "frogger_game.h"
 #include "timer.h"
+#include "trace.h"
 #include "wm.h"
 #include "lua_interface.h"
 
 #include "cpp_test.h"
 
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum
+{
+	// How far back flight recorder dumps reach.
+	k_flight_recorder_seconds = 5,
+	// Frames are paced by vsync, so a 60 Hz frame takes 16.67 ms; allow a millisecond over that.
+	k_default_frame_budget_us = 1000 * 1000 / 60 + 1000,
+};
+
 int main(int argc, const char* argv[])
 {
 	debug_set_print_mask(k_print_info | k_print_warning | k_print_error);
@@ -17,24 +41,203 @@ int main(int argc, const char* argv[])
 
 	timer_startup();
 
+	bool lock_profile = false;
+	const char* trace_path = NULL;
+	double frame_budget_ms = k_default_frame_budget_us / 1000.0;
+	bool flight_recorder = false;
+	bool hardware_counters = false;
+	int sample_hz = 0;
+	const char* archive_path = NULL;
+	const char* dictionary_path = NULL;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--sync-bench") == 0)
+		{
+			sync_bench_run();
+			return 0;
+		}
+		else if (strcmp(argv[i], "--atomic-bench") == 0)
+		{
+			lecture7_thread_test();
+			return 0;
+		}
+		else if (strcmp(argv[i], "--parallel-bench") == 0)
+		{
+			parallel_bench_run();
+			return 0;
+		}
+		else if (strcmp(argv[i], "--compression-bench") == 0)
+		{
+			compression_bench_run();
+			return 0;
+		}
+		else if (strcmp(argv[i], "--fs-bench") == 0)
+		{
+			// Optional CSV output path; files go up to 1 GB.
+			const char* csv_path = i + 1 < argc && strncmp(argv[i + 1], "--", 2) != 0 ? argv[i + 1] : "fs_bench.csv";
+			fs_bench_run(csv_path, 1024 * 1024 * 1024);
+			return 0;
+		}
+		else if (strcmp(argv[i], "--pack") == 0 && i + 2 < argc)
+		{
+			// --pack <archive> <directory>...: every following argument is a directory to pack.
+			heap_t* pack_heap = heap_create(2 * 1024 * 1024);
+			fs_t* pack_fs = fs_create(pack_heap, 16);
+			bool packed = archive_pack(pack_heap, pack_fs, argv[i + 1], argv + i + 2, argc - i - 2, k_fs_compression_hc);
+			fs_destroy(pack_fs);
+			heap_destroy(pack_heap);
+			return packed ? 0 : 1;
+		}
+		else if (strcmp(argv[i], "--train-dictionary") == 0 && i + 2 < argc)
+		{
+			// --train-dictionary <dictionary> <file>...: every following argument is a sample file.
+			heap_t* train_heap = heap_create(2 * 1024 * 1024);
+			fs_t* train_fs = fs_create(train_heap, 16);
+			bool trained = dictionary_train_files(train_heap, train_fs, argv[i + 1], argv + i + 2, argc - i - 2);
+			fs_destroy(train_fs);
+			heap_destroy(train_heap);
+			return trained ? 0 : 1;
+		}
+		else if (strcmp(argv[i], "--trace-convert") == 0 && i + 2 < argc)
+		{
+			// --trace-convert <capture> <output>: JSON if the output ends in .json, collapsed stacks of
+			// the samples if it ends in .folded, Perfetto otherwise.
+			const char* output_path = argv[i + 2];
+			size_t length = strlen(output_path);
+			trace_format_t format = length >= 5 && strcmp(output_path + length - 5, ".json") == 0 ? k_trace_format_chrome_json :
+				length >= 7 && strcmp(output_path + length - 7, ".folded") == 0 ? k_trace_format_collapsed : k_trace_format_perfetto;
+			heap_t* convert_heap = heap_create(2 * 1024 * 1024);
+			fs_t* convert_fs = fs_create(convert_heap, 4);
+			bool converted = trace_convert(convert_heap, convert_fs, argv[i + 1], output_path, format);
+			fs_destroy(convert_fs);
+			heap_destroy(convert_heap);
+			return converted ? 0 : 1;
+		}
+		else if (strcmp(argv[i], "--dictionary") == 0 && i + 1 < argc)
+		{
+			dictionary_path = argv[++i];
+		}
+		else if (strcmp(argv[i], "--archive") == 0 && i + 1 < argc)
+		{
+			archive_path = argv[++i];
+		}
+		else if (strcmp(argv[i], "--lock-profile") == 0)
+		{
+			lock_profile = true;
+		}
+		else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+		{
+			trace_path = argv[++i];
+		}
+		else if (strcmp(argv[i], "--frame-budget") == 0 && i + 1 < argc)
+		{
+			frame_budget_ms = atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--flight-recorder") == 0 && i + 1 < argc)
+		{
+			// --flight-recorder <budget_ms>: dump the last seconds of the trace when a frame takes
+			// longer than the budget or the process crashes.
+			frame_budget_ms = atof(argv[++i]);
+			flight_recorder = true;
+		}
+		else if (strcmp(argv[i], "--hardware-counters") == 0)
+		{
+			hardware_counters = true;
+		}
+		else if (strcmp(argv[i], "--sample") == 0 && i + 1 < argc)
+		{
+			// --sample <hz>: sample the stacks of all traced threads into the trace.
+			sample_hz = atoi(argv[++i]);
+		}
+	}
+
+	// Keep bulk io and compression threads off the cores the frame runs on.
+	thread_desc_t main_desc = thread_desc_for_role(k_thread_role_main, "main");
+	thread_set_current(&main_desc);
+
 	cpp_test_function(42);
 
 	heap_t* heap = heap_create(2 * 1024 * 1024);
+
+	// Enable before the engine starts so nearly all acquisitions are counted.
+	mutex_profiler_enable(heap, lock_profile);
 	fs_t* fs = fs_create(heap, 8);
+	// Shaders and scripts are reloaded with each game; keep them decoded in memory.
+	fs_cache_configure(fs, 16 * 1024 * 1024);
+	if (dictionary_path)
+	{
+		dictionary_load(heap, fs, dictionary_path);
+	}
+	if (archive_path)
+	{
+		fs_mount(fs, archive_path);
+	}
 	wm_window_t* window = wm_create(heap);
 	render_t* render = render_create(heap, window);
 
+	// Always recording, so frame statistics can break frames down by trace scope.
+	trace_t* trace = trace_create(heap, 64 * 1024);
+	trace_flight_recorder_start(trace);
+	if (trace_path)
+	{
+		trace_capture_start(trace, trace_path);
+	}
+	if (flight_recorder)
+	{
+		trace_dump_on_crash(trace, "ga2022-crash.trace", k_flight_recorder_seconds);
+	}
+	if (hardware_counters && !trace_enable_hardware_counters(trace))
+	{
+		debug_print(k_print_warning, "Hardware counters are not available on this system\n");
+	}
+	if (sample_hz > 0 && !trace_sampler_start(trace, sample_hz))
+	{
+		debug_print(k_print_warning, "Stack sampling is not available on this system\n");
+	}
+	render_set_trace(render, trace);
+	fs_set_trace(fs, trace);
+	frame_stats_t* frame_stats = frame_stats_create(heap, trace, frame_budget_ms);
+
 	//simple_game_t* game = simple_game_create(heap, fs, window, render, argc, argv);
 	//frogger_game_t* game = frogger_game_create(heap, fs, window, render);
 	lua_project_t* lp = lua_project_create("./LuaGame", heap, fs, window, render);
 
+	uint64_t last_dump = 0;
+	int hitch_count = 0;
 	while (!wm_pump(window))
 	{
 		//simple_game_update(game);
 		//frogger_game_update(game);
-		lua_project_update(lp);
+		TRACE_SCOPE(trace, "lua_project_update")
+		{
+			lua_project_update(lp);
+		}
+
+		mutex_profiler_emit_counters(trace);
+		fs_emit_counters(fs, trace);
+
+		// Dump the seconds leading up to a slow frame, unless the last dump already has them.
+		uint64_t now = timer_get_ticks();
+		if (frame_stats_frame_end(frame_stats) && flight_recorder &&
+			(hitch_count == 0 || timer_ticks_to_ms(now - last_dump) > k_flight_recorder_seconds * 1000))
+		{
+			char path[64];
+			snprintf(path, sizeof(path), "ga2022-hitch-%d.trace", hitch_count++);
+			debug_print(k_print_warning, "Writing the trace before the frame to %s\n", path);
+			trace_dump(trace, path, k_flight_recorder_seconds);
+			last_dump = now;
+		}
 	}
 
+	frame_stats_write_summary(frame_stats, fs, "ga2022-frame-stats.csv");
+	// Destroyed mutexes leave the profiler, so print while the engine's are still alive.
+	if (lock_profile)
+	{
+		mutex_profiler_print_summary();
+	}
+	frame_stats_destroy(frame_stats);
+	trace_capture_stop(trace);
+
 	/* XXX: Shutdown render before the game. Render uses game resources. */
 	render_destroy(render);
 
@@ -44,6 +247,10 @@ int main(int argc, const char* argv[])
 
 	wm_destroy(window);
 	fs_destroy(fs);
+
+	// The render and file system threads record into the trace until they are shut down.
+	trace_destroy(trace);
+
 	heap_destroy(heap);
 
 	return 0;
@@ -1,24 +1,389 @@
 #include "mutex.h"
 
+#include "atomic.h"
+#include "debug.h"
+#include "futex.h"
+#include "heap.h"
+#include "timer.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined(_WIN32)
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
+#include <intrin.h>
+#define RETURN_ADDRESS() _ReturnAddress()
+#define THREAD_LOCAL __declspec(thread)
+#else
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#define RETURN_ADDRESS() __builtin_return_address(0)
+#define THREAD_LOCAL __thread
+#endif
+
+typedef struct mutex_t
+{
+	// Futex lock with three states (see Drepper, "Futexes Are Tricky"):
+	//   0 = unlocked, 1 = locked, 2 = locked and other threads may be sleeping.
+	// An uncontended lock or unlock is a single atomic operation.
+	// Counters are only written by the owning thread, so they cost no atomics.
+	int state;
+	int owner;
+	mutex_stats_t stats;
+	int recursion;
+
+	// Profiler state. Written only while the mutex is held.
+	mutex_profile_t profile;
+	// Callsite of the current holder, read by threads that wait for it.
+	void* volatile holder_callsite;
+	mutex_profile_t emitted;
+
+	struct mutex_t* prev;
+	struct mutex_t* next;
+} mutex_t;
+
+// The profiler needs to find every mutex, but mutexes are created without any
+// owning context, so the registry is process-wide.
+static volatile bool s_profiler_enabled = false;
+static heap_t* s_profiler_heap = NULL;
+static mutex_t* s_registry = NULL;
+
+#if defined(_WIN32)
+static SRWLOCK s_registry_lock = SRWLOCK_INIT;
+static void registry_lock() { AcquireSRWLockExclusive(&s_registry_lock); }
+static void registry_unlock() { ReleaseSRWLockExclusive(&s_registry_lock); }
+#else
+static pthread_mutex_t s_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static void registry_lock() { pthread_mutex_lock(&s_registry_lock); }
+static void registry_unlock() { pthread_mutex_unlock(&s_registry_lock); }
+#endif
+
+static void profile_acquired(mutex_t* mutex, void* callsite, bool contended, uint64_t wait_ticks, void* blocker);
+static void profile_released(mutex_t* mutex);
 
 mutex_t* mutex_create()
 {
-	return (mutex_t*)CreateMutex(NULL, FALSE, NULL);
+	return mutex_create_named(NULL);
+}
+
+mutex_t* mutex_create_named(const char* name)
+{
+	// XXX: Not allocated from a heap_t. The heap itself is protected by a mutex.
+	mutex_t* mutex = calloc(1, sizeof(mutex_t));
+	mutex->profile.name = name;
+
+	registry_lock();
+	mutex->next = s_registry;
+	if (s_registry)
+	{
+		s_registry->prev = mutex;
+	}
+	s_registry = mutex;
+	registry_unlock();
+
+	return mutex;
 }
 
 void mutex_destroy(mutex_t* mutex)
 {
-	CloseHandle(mutex);
+	registry_lock();
+	if (mutex->prev)
+	{
+		mutex->prev->next = mutex->next;
+	}
+	else
+	{
+		s_registry = mutex->next;
+	}
+	if (mutex->next)
+	{
+		mutex->next->prev = mutex->prev;
+	}
+	registry_unlock();
+
+	free(mutex);
+}
+
+// Never zero, which marks an unowned mutex.
+static int get_thread_id()
+{
+	static THREAD_LOCAL int s_tid = 0;
+	if (!s_tid)
+	{
+#if defined(_WIN32)
+		s_tid = (int)GetCurrentThreadId();
+#else
+		s_tid = (int)syscall(SYS_gettid);
+#endif
+	}
+	return s_tid;
 }
 
 void mutex_lock(mutex_t* mutex)
 {
-	WaitForSingleObject(mutex, INFINITE);
+	void* callsite = RETURN_ADDRESS();
+	int tid = get_thread_id();
+	if (atomic_load_relaxed(&mutex->owner) == tid)
+	{
+		mutex->recursion++;
+		mutex->stats.lock_count++;
+		if (s_profiler_enabled)
+		{
+			mutex->profile.lock_count++;
+		}
+		return;
+	}
+
+	bool contended = false;
+	bool slept = false;
+	void* blocker = NULL;
+	uint64_t t0 = 0;
+	int c = atomic_compare_and_exchange(&mutex->state, 0, 1);
+	if (c != 0)
+	{
+		contended = true;
+		if (s_profiler_enabled)
+		{
+			blocker = mutex->holder_callsite;
+			t0 = timer_get_ticks();
+		}
+
+		// Spin briefly; most critical sections in the engine are short.
+		for (int i = 0; i < k_futex_spin_count && c != 0; ++i)
+		{
+			cpu_pause();
+			if (atomic_load_relaxed(&mutex->state) == 0)
+			{
+				c = atomic_compare_and_exchange(&mutex->state, 0, 1);
+			}
+		}
+
+		if (c != 0)
+		{
+			// Mark the mutex as having sleepers so the owner knows to wake us.
+			if (c != 2)
+			{
+				c = atomic_swap(&mutex->state, 2);
+			}
+			while (c != 0)
+			{
+				slept = true;
+				futex_wait(&mutex->state, 2);
+				c = atomic_swap(&mutex->state, 2);
+			}
+		}
+	}
+
+	atomic_store_relaxed(&mutex->owner, tid);
+	mutex->recursion = 1;
+	mutex->stats.lock_count++;
+	mutex->stats.contended_count += contended;
+	mutex->stats.sleep_count += slept;
+
+	if (s_profiler_enabled)
+	{
+		profile_acquired(mutex, callsite, contended, contended ? timer_get_ticks() - t0 : 0, blocker);
+	}
 }
 
 void mutex_unlock(mutex_t* mutex)
 {
-	ReleaseMutex(mutex);
+	if (--mutex->recursion > 0)
+	{
+		return;
+	}
+
+	profile_released(mutex);
+	atomic_store_relaxed(&mutex->owner, 0);
+	if (atomic_swap(&mutex->state, 0) == 2)
+	{
+		futex_wake(&mutex->state, 1);
+	}
+}
+
+bool mutex_get_stats(mutex_t* mutex, mutex_stats_t* stats)
+{
+	// Read without locking so sampling does not perturb the counters.
+	// Values may be slightly stale if another thread holds the mutex.
+	*stats = mutex->stats;
+	return true;
+}
+
+// Finds the profile of a callsite, claiming a free slot for a new one. Once every slot is
+// taken, further callsites share the other bucket.
+static mutex_callsite_t* profile_callsite(mutex_profile_t* profile, void* address)
+{
+	for (int i = 0; i < k_mutex_profile_max_callsites; ++i)
+	{
+		if (profile->callsites[i].address == address || profile->callsites[i].address == NULL)
+		{
+			profile->callsites[i].address = address;
+			return &profile->callsites[i];
+		}
+	}
+	return &profile->other;
+}
+
+// The uncontended path only counts the lock and stores the callsite; the callsite table is
+// searched only when a thread had to wait.
+static void profile_acquired(mutex_t* mutex, void* callsite, bool contended, uint64_t wait_ticks, void* blocker)
+{
+	mutex_profile_t* profile = &mutex->profile;
+	profile->lock_count++;
+	if (contended)
+	{
+		profile->contended_count++;
+		profile->wait_ticks += wait_ticks;
+		if (wait_ticks > profile->max_wait_ticks)
+		{
+			profile->max_wait_ticks = wait_ticks;
+		}
+		profile_callsite(profile, callsite)->contended_count++;
+		if (blocker)
+		{
+			mutex_callsite_t* holder = profile_callsite(profile, blocker);
+			holder->blocked_count++;
+			holder->blocked_ticks += wait_ticks;
+		}
+	}
+	mutex->holder_callsite = callsite;
+}
+
+static void profile_released(mutex_t* mutex)
+{
+	mutex->holder_callsite = NULL;
+}
+
+void mutex_profiler_enable(heap_t* heap, bool enable)
+{
+	s_profiler_heap = heap;
+	s_profiler_enabled = enable;
+}
+
+void mutex_profiler_foreach(void (*function)(const mutex_profile_t* profile, void* user), void* user)
+{
+	registry_lock();
+	for (mutex_t* mutex = s_registry; mutex; mutex = mutex->next)
+	{
+		// Snapshot without taking the mutex; the profiled thread may be waiting on us otherwise.
+		mutex_profile_t profile = mutex->profile;
+		function(&profile, user);
+	}
+	registry_unlock();
+}
+
+void mutex_profiler_emit_counters(trace_t* trace)
+{
+	if (!s_profiler_enabled)
+	{
+		return;
+	}
+
+	registry_lock();
+	for (mutex_t* mutex = s_registry; mutex; mutex = mutex->next)
+	{
+		// Counter names must outlive the trace capture, so only named mutexes are emitted.
+		if (!mutex->profile.name)
+		{
+			continue;
+		}
+		mutex_profile_t now = mutex->profile;
+		trace_counter_series(trace, now.name, "locks", (int64_t)(now.lock_count - mutex->emitted.lock_count));
+		trace_counter_series(trace, now.name, "contended", (int64_t)(now.contended_count - mutex->emitted.contended_count));
+		trace_counter_series(trace, now.name, "wait_us", (int64_t)timer_ticks_to_us(now.wait_ticks - mutex->emitted.wait_ticks));
+		mutex->emitted = now;
+	}
+	registry_unlock();
+}
+
+static int compare_profile_wait(const void* a, const void* b)
+{
+	const mutex_profile_t* pa = a;
+	const mutex_profile_t* pb = b;
+	if (pa->wait_ticks != pb->wait_ticks)
+	{
+		return pa->wait_ticks < pb->wait_ticks ? 1 : -1;
+	}
+	return pa->lock_count < pb->lock_count ? 1 : (pa->lock_count > pb->lock_count ? -1 : 0);
+}
+
+void mutex_profiler_print_summary()
+{
+	if (s_profiler_heap == NULL)
+	{
+		debug_print(k_print_warning, "Mutex profiler summary requested before mutex_profiler_enable\n");
+		return;
+	}
+
+	registry_lock();
+	int count = 0;
+	for (mutex_t* mutex = s_registry; mutex; mutex = mutex->next)
+	{
+		count++;
+	}
+	mutex_profile_t* profiles = heap_alloc(s_profiler_heap, (count ? count : 1) * sizeof(mutex_profile_t), 8);
+	int index = 0;
+	for (mutex_t* mutex = s_registry; mutex; mutex = mutex->next)
+	{
+		profiles[index++] = mutex->profile;
+	}
+	registry_unlock();
+
+	qsort(profiles, count, sizeof(mutex_profile_t), compare_profile_wait);
+
+	debug_print(k_print_info, "Mutex contention (%d mutexes):\n", count);
+	debug_print(k_print_info, "  %-24s %12s %10s %7s %10s %10s  %s\n",
+		"name", "locks", "contended", "rate", "wait ms", "max us", "worst holder");
+	for (int i = 0; i < count; ++i)
+	{
+		mutex_profile_t* profile = &profiles[i];
+		if (!profile->lock_count)
+		{
+			continue;
+		}
+
+		const mutex_callsite_t* worst = NULL;
+		for (int c = 0; c < k_mutex_profile_max_callsites; ++c)
+		{
+			if (profile->callsites[c].blocked_count && (!worst || profile->callsites[c].blocked_ticks > worst->blocked_ticks))
+			{
+				worst = &profile->callsites[c];
+			}
+		}
+		if (profile->other.blocked_count && (!worst || profile->other.blocked_ticks > worst->blocked_ticks))
+		{
+			worst = &profile->other;
+		}
+
+		char holder[32];
+		if (worst == &profile->other)
+		{
+			snprintf(holder, sizeof(holder), "(other)");
+		}
+		else
+		{
+			snprintf(holder, sizeof(holder), "%p", worst ? worst->address : NULL);
+		}
+		debug_print(k_print_info, "  %-24s %12llu %10llu %6.2f%% %10.3f %10llu  %s\n",
+			profile->name ? profile->name : "(unnamed)",
+			(unsigned long long)profile->lock_count,
+			(unsigned long long)profile->contended_count,
+			100.0 * (double)profile->contended_count / (double)profile->lock_count,
+			(double)timer_ticks_to_us(profile->wait_ticks) / 1000.0,
+			(unsigned long long)timer_ticks_to_us(profile->max_wait_ticks),
+			holder);
+		if (profile->other.contended_count || profile->other.blocked_count)
+		{
+			debug_print(k_print_info, "  %-24s other callsites: waited %llu times, held while others waited %llu times for %.3f ms\n",
+				"",
+				(unsigned long long)profile->other.contended_count,
+				(unsigned long long)profile->other.blocked_count,
+				(double)timer_ticks_to_us(profile->other.blocked_ticks) / 1000.0);
+		}
+	}
+
+	heap_free(s_profiler_heap, profiles);
 }
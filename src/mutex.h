@@ -1,13 +1,70 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct heap_t heap_t;
+
 // Recursive mutex thread synchronization
 
 // Handle to a mutex.
 typedef struct mutex_t mutex_t;
 
+typedef struct trace_t trace_t;
+
+// Contention counters for a mutex. See mutex_get_stats().
+typedef struct mutex_stats_t
+{
+	// Number of times the mutex was acquired, including recursive locks.
+	uint64_t lock_count;
+	// Number of acquisitions that found the mutex held by another thread.
+	uint64_t contended_count;
+	// Number of times a thread went to sleep in the kernel waiting for the mutex.
+	uint64_t sleep_count;
+} mutex_stats_t;
+
+enum
+{
+	k_mutex_profile_max_callsites = 4,
+};
+
+// Profiler data for one code location that locked a mutex while it was contended.
+typedef struct mutex_callsite_t
+{
+	// Return address of the mutex_lock() call; NULL for the other bucket.
+	void* address;
+	// Number of times this callsite had to wait for the mutex.
+	uint64_t contended_count;
+	// Number of times another thread waited while this callsite held the mutex.
+	uint64_t blocked_count;
+	// Total ticks other threads waited while this callsite held the mutex.
+	uint64_t blocked_ticks;
+} mutex_callsite_t;
+
+// Contention profile of a mutex. See mutex_profiler_enable().
+typedef struct mutex_profile_t
+{
+	const char* name;
+	// Number of acquisitions, including recursive locks.
+	uint64_t lock_count;
+	// Number of acquisitions that had to wait for another thread.
+	uint64_t contended_count;
+	// Total and longest time spent waiting to acquire, in timer ticks.
+	uint64_t wait_ticks;
+	uint64_t max_wait_ticks;
+	// Callsites that waited for the mutex or held it while others waited, tracked up to
+	// k_mutex_profile_max_callsites. The rest are summed in other.
+	mutex_callsite_t callsites[k_mutex_profile_max_callsites];
+	mutex_callsite_t other;
+} mutex_profile_t;
+
 // Creates a new mutex.
 mutex_t* mutex_create();
 
+// Creates a new mutex with a name that identifies it in profiler output.
+// The name string must outlive the mutex.
+mutex_t* mutex_create_named(const char* name);
+
 // Destroys a previously created mutex.
 void mutex_destroy(mutex_t* mutex);
 
@@ -18,3 +75,26 @@ void mutex_lock(mutex_t* mutex);
 
 // Unlocks a mutex.
 void mutex_unlock(mutex_t* mutex);
+
+// Reads the contention counters of a mutex.
+// Returns false if the platform backend does not track contention.
+bool mutex_get_stats(mutex_t* mutex, mutex_stats_t* stats);
+
+// Enables or disables the process-wide mutex contention profiler.
+// While enabled, every lock stores its callsite as the holder's, and every contended lock is
+// timed and charged to its own callsite and the holder's. Disabled by default; when disabled
+// locking costs one extra branch. The profiler allocates its reports from heap, which must
+// stay alive while it is in use.
+void mutex_profiler_enable(heap_t* heap, bool enable);
+
+// Calls a function with a snapshot of the profile of every live mutex.
+void mutex_profiler_foreach(void (*function)(const mutex_profile_t* profile, void* user), void* user);
+
+// Records the contention of every live mutex since the previous call as trace counters.
+// Intended to be called once per frame.
+void mutex_profiler_emit_counters(trace_t* trace);
+
+// Prints a table of the contention of every live mutex, worst first.
+// Mutexes that were destroyed are not listed, so print before shutting systems down.
+// Prints nothing unless mutex_profiler_enable has been called.
+void mutex_profiler_print_summary();
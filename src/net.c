@@ -1,11 +1,13 @@
 #include "net.h"
 
+#include "atomic.h"
 #include "debug.h"
 #include "heap.h"
 #include "mutex.h"
 #include "queue.h"
 #include "thread.h"
 #include "timer.h"
+#include "trace.h"
 
 #include <stdbool.h>
 
@@ -95,6 +97,13 @@ typedef struct net_t
 	SOCKET sock;
 	thread_t* recv_thread;
 
+	// Bytes through the socket since the last net_emit_counters.
+	int bytes_sent;
+	int bytes_received;
+
+	// Trace net_update records into, or NULL.
+	trace_t* trace;
+
 	mutex_t* connections_mutex;
 	connection_t connections[3];
 
@@ -122,7 +131,7 @@ net_t* net_create(heap_t* heap, ecs_t* ecs)
 	WSAStartup(MAKEWORD(2, 2), &data);
 
 	net->sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-	net->connections_mutex = mutex_create();
+	net->connections_mutex = mutex_create_named("net connections");
 
 	struct sockaddr_in address;
 	address.sin_family = AF_INET;
@@ -134,7 +143,8 @@ net_t* net_create(heap_t* heap, ecs_t* ecs)
 	getsockname(net->sock, (struct sockaddr*)&address, &address_len);
 	debug_print(k_print_info, "Net bound port %d\n", ntohs(address.sin_port));
 
-	net->recv_thread = thread_create(recv_thread_func, net);
+	thread_desc_t desc = thread_desc_for_role(k_thread_role_net, "net recv");
+	net->recv_thread = thread_create_ex(recv_thread_func, net, &desc);
 
 	return net;
 }
@@ -151,18 +161,40 @@ void net_destroy(net_t* net)
 
 void net_update(net_t* net)
 {
+	TRACE_PUSH(net->trace, "net_update");
 	timeout_old_connections(net);
-	snapshot_entities(net);
+	TRACE_SCOPE(net->trace, "net snapshot")
+	{
+		snapshot_entities(net);
+	}
 	for (int i = 0; i < _countof(net->connections); ++i)
 	{
 		connection_t* c = &net->connections[i];
 		if (c->address.port)
 		{
-			packet_send(c);
-			packet_recv(c);
+			TRACE_SCOPE(net->trace, "net packet send")
+			{
+				packet_send(c);
+			}
+			TRACE_SCOPE(net->trace, "net packet recv")
+			{
+				packet_recv(c);
+			}
 		}
 	}
 	net->sequence++;
+	TRACE_POP(net->trace);
+}
+
+void net_set_trace(net_t* net, trace_t* trace)
+{
+	net->trace = trace;
+}
+
+void net_emit_counters(net_t* net, trace_t* trace)
+{
+	trace_counter_series(trace, "net bytes", "sent", atomic_swap(&net->bytes_sent, 0));
+	trace_counter_series(trace, "net bytes", "received", atomic_swap(&net->bytes_received, 0));
 }
 
 void net_connect(net_t* net, const net_address_t* address)
@@ -299,6 +331,7 @@ static int send_thread_func(void* user)
 		{
 			break;
 		}
+		atomic_add(&connection->net->bytes_sent, bytes);
 	}
 
 	return 0;
@@ -333,7 +366,8 @@ static connection_t* find_or_create_connection(net_t* net, const net_address_t*
 				c->last_recv_ms = timer_ticks_to_ms(timer_get_ticks());
 				c->send_queue = queue_create(net->heap, 3);
 				c->recv_queue = queue_create(net->heap, 3);
-				c->send_thread = thread_create(send_thread_func, c);
+				thread_desc_t desc = thread_desc_for_role(k_thread_role_net, "net send");
+				c->send_thread = thread_create_ex(send_thread_func, c, &desc);
 
 				result = c;
 				break;
@@ -366,6 +400,7 @@ static int recv_thread_func(void* user)
 		}
 
 		packet->size = bytes;
+		atomic_add(&net->bytes_received, bytes);
 
 		net_address_t net_addr;
 		net_addr.port = ntohs(address.sin_port);
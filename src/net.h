@@ -8,6 +8,7 @@
 typedef struct net_t net_t;
 
 typedef struct heap_t heap_t;
+typedef struct trace_t trace_t;
 
 typedef struct net_address_t
 {
@@ -22,6 +23,13 @@ void net_destroy(net_t* net);
 
 void net_update(net_t* net);
 
+// Have net_update record its work into a trace; NULL stops recording.
+void net_set_trace(net_t* net, trace_t* trace);
+
+// Records the bytes sent and received since the last call as trace counters.
+// Intended to be called once per frame.
+void net_emit_counters(net_t* net, trace_t* trace);
+
 void net_connect(net_t* net, const net_address_t* address);
 void net_disconnect_all(net_t* net);
 
@@ -0,0 +1,291 @@
+#include "parallel.h"
+
+#include "atomic.h"
+#include "futex.h"
+#include "heap.h"
+#include "mutex.h"
+#include "semaphore.h"
+#include "thread.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+enum
+{
+	// Partials are padded to a cache line so threads do not false-share them.
+	k_partial_alignment = 64,
+	k_max_threads = 64,
+};
+
+// One loop in flight. Lives in the pool so late wakes never touch a dead stack frame.
+typedef struct parallel_job_t
+{
+	parallel_for_fn_t for_fn;
+	parallel_map_fn_t map_fn;
+	void* user;
+	char* partials;
+	size_t partial_stride;
+	int end;
+	int grain;
+	int participants;
+	// Next index not yet claimed by any thread.
+	int next;
+	// Woken workers that have not finished; the caller sleeps on this.
+	int remaining;
+} parallel_job_t;
+
+typedef struct parallel_t
+{
+	heap_t* heap;
+	thread_t** threads;
+	int thread_count;
+	semaphore_t* wake;
+	mutex_t* submit_mutex;
+	parallel_job_t job;
+	int quit;
+} parallel_t;
+
+typedef struct worker_t
+{
+	parallel_t* pool;
+	int slot;
+} worker_t;
+
+// Non-zero while this thread is running a chunk; nested loops then run inline.
+static THREAD_LOCAL int s_parallel_depth;
+
+static int worker_thread_func(void* user);
+
+parallel_t* parallel_create(heap_t* heap, int thread_count)
+{
+	if (thread_count <= 0)
+	{
+		thread_count = thread_get_cpu_count() - 1;
+	}
+	if (thread_count > k_max_threads)
+	{
+		thread_count = k_max_threads;
+	}
+
+	parallel_t* pool = heap_alloc(heap, sizeof(parallel_t), 8);
+	memset(pool, 0, sizeof(*pool));
+	pool->heap = heap;
+	pool->thread_count = thread_count;
+	pool->wake = semaphore_create(0, thread_count > 0 ? thread_count : 1);
+	pool->submit_mutex = mutex_create_named("parallel submit");
+	pool->threads = heap_alloc(heap, sizeof(thread_t*) * (thread_count > 0 ? thread_count : 1), 8);
+	for (int i = 0; i < thread_count; ++i)
+	{
+		// Slot 0 belongs to the calling thread.
+		worker_t* worker = heap_alloc(heap, sizeof(worker_t), 8);
+		worker->pool = pool;
+		worker->slot = i + 1;
+		thread_desc_t desc = thread_desc_for_role(k_thread_role_default, "parallel");
+		pool->threads[i] = thread_create_ex(worker_thread_func, worker, &desc);
+	}
+	return pool;
+}
+
+void parallel_destroy(parallel_t* pool)
+{
+	atomic_store_release(&pool->quit, 1);
+	for (int i = 0; i < pool->thread_count; ++i)
+	{
+		semaphore_release(pool->wake);
+	}
+	for (int i = 0; i < pool->thread_count; ++i)
+	{
+		thread_destroy(pool->threads[i]);
+	}
+	semaphore_destroy(pool->wake);
+	mutex_destroy(pool->submit_mutex);
+	heap_free(pool->heap, pool->threads);
+	heap_free(pool->heap, pool);
+}
+
+int parallel_get_thread_count(parallel_t* pool)
+{
+	return pool ? pool->thread_count : 0;
+}
+
+// Claims the next chunk. Chunks are half the remaining work split across participants,
+// but never smaller than the grain (guided scheduling).
+static bool claim_chunk(parallel_job_t* job, int* begin, int* end)
+{
+	int next = atomic_load_relaxed(&job->next);
+	while (next < job->end)
+	{
+		int remaining = job->end - next;
+		int size = remaining / (job->participants * 2);
+		if (size < job->grain)
+		{
+			size = job->grain;
+		}
+		if (size > remaining)
+		{
+			size = remaining;
+		}
+		int seen = atomic_compare_and_exchange(&job->next, next, next + size);
+		if (seen == next)
+		{
+			*begin = next;
+			*end = next + size;
+			return true;
+		}
+		next = seen;
+	}
+	return false;
+}
+
+static void run_chunks(parallel_job_t* job, int slot)
+{
+	s_parallel_depth++;
+	int begin;
+	int end;
+	while (claim_chunk(job, &begin, &end))
+	{
+		if (job->for_fn)
+		{
+			job->for_fn(job->user, begin, end);
+		}
+		else
+		{
+			job->map_fn(job->user, begin, end, job->partials + slot * job->partial_stride);
+		}
+	}
+	s_parallel_depth--;
+}
+
+static int worker_thread_func(void* user)
+{
+	worker_t* worker = user;
+	parallel_t* pool = worker->pool;
+	while (true)
+	{
+		semaphore_acquire(pool->wake);
+		if (atomic_load_acquire(&pool->quit))
+		{
+			break;
+		}
+		run_chunks(&pool->job, worker->slot);
+		if (atomic_decrement(&pool->job.remaining) == 1)
+		{
+			futex_wake_all(&pool->job.remaining);
+		}
+	}
+	heap_free(pool->heap, worker);
+	return 0;
+}
+
+// Runs the job set up in pool->job across the calling thread and enough workers to cover it.
+static void run_job(parallel_t* pool, int begin, int end, int grain)
+{
+	parallel_job_t* job = &pool->job;
+	int chunk_count = (int)(((int64_t)end - begin + grain - 1) / grain);
+	int helpers = chunk_count - 1 < pool->thread_count ? chunk_count - 1 : pool->thread_count;
+
+	job->end = end;
+	job->grain = grain;
+	job->participants = helpers + 1;
+	job->next = begin;
+	job->remaining = helpers;
+
+	// Releasing the semaphore publishes the job fields to the workers it wakes.
+	for (int i = 0; i < helpers; ++i)
+	{
+		semaphore_release(pool->wake);
+	}
+
+	run_chunks(job, 0);
+
+	int remaining;
+	for (int spin = 0; spin < k_futex_spin_count && atomic_load_acquire(&job->remaining) != 0; ++spin)
+	{
+		cpu_pause();
+	}
+	while ((remaining = atomic_load_acquire(&job->remaining)) != 0)
+	{
+		futex_wait(&job->remaining, remaining);
+	}
+}
+
+static bool should_run_inline(parallel_t* pool, int begin, int end, int grain)
+{
+	return pool == NULL || pool->thread_count == 0 || end - begin <= grain || s_parallel_depth > 0;
+}
+
+void parallel_for(parallel_t* pool, int begin, int end, int grain, parallel_for_fn_t fn, void* user)
+{
+	if (end <= begin)
+	{
+		return;
+	}
+	if (grain < 1)
+	{
+		grain = 1;
+	}
+	if (should_run_inline(pool, begin, end, grain))
+	{
+		fn(user, begin, end);
+		return;
+	}
+
+	mutex_lock(pool->submit_mutex);
+	pool->job.for_fn = fn;
+	pool->job.map_fn = NULL;
+	pool->job.user = user;
+	pool->job.partials = NULL;
+	pool->job.partial_stride = 0;
+	run_job(pool, begin, end, grain);
+	mutex_unlock(pool->submit_mutex);
+}
+
+void parallel_reduce(parallel_t* pool, int begin, int end, int grain,
+	size_t result_size, const void* identity,
+	parallel_map_fn_t map, parallel_combine_fn_t combine, void* user, void* result)
+{
+	memcpy(result, identity, result_size);
+	if (end <= begin)
+	{
+		return;
+	}
+	if (grain < 1)
+	{
+		grain = 1;
+	}
+	if (should_run_inline(pool, begin, end, grain))
+	{
+		map(user, begin, end, result);
+		return;
+	}
+
+	size_t stride = (result_size + k_partial_alignment - 1) & ~(size_t)(k_partial_alignment - 1);
+	int slot_count = pool->thread_count + 1;
+	char* partials = heap_alloc(pool->heap, stride * slot_count, k_partial_alignment);
+	for (int i = 0; i < slot_count; ++i)
+	{
+		memcpy(partials + i * stride, identity, result_size);
+	}
+
+	mutex_lock(pool->submit_mutex);
+	pool->job.for_fn = NULL;
+	pool->job.map_fn = map;
+	pool->job.user = user;
+	pool->job.partials = partials;
+	pool->job.partial_stride = stride;
+	run_job(pool, begin, end, grain);
+	mutex_unlock(pool->submit_mutex);
+
+	// Slots of workers that were not woken still hold the identity, which combines harmlessly.
+	for (int i = 0; i < slot_count; ++i)
+	{
+		combine(user, result, partials + i * stride);
+	}
+	heap_free(pool->heap, partials);
+}
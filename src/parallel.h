@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stddef.h>
+
+// Data-parallel loop helpers.
+// A parallel_t owns a pool of worker threads. parallel_for and parallel_reduce split an
+// index range into chunks, and the calling thread and the workers take chunks until none remain.
+// Chunks start large and shrink as the range drains, so uneven per-item cost still balances
+// without paying for many tiny chunks up front.
+
+typedef struct heap_t heap_t;
+
+// Handle to a worker pool.
+typedef struct parallel_t parallel_t;
+
+// Loop body: processes indices [begin, end).
+typedef void (*parallel_for_fn_t)(void* user, int begin, int end);
+
+// Reduce body: folds indices [begin, end) into partial.
+// partial is private to the calling thread and starts as a copy of the identity.
+typedef void (*parallel_map_fn_t)(void* user, int begin, int end, void* partial);
+
+// Reduce combiner: folds partial into accumulator.
+typedef void (*parallel_combine_fn_t)(void* user, void* accumulator, const void* partial);
+
+// Creates a worker pool.
+// A thread_count of zero creates one worker per logical CPU, minus one for the calling thread.
+parallel_t* parallel_create(heap_t* heap, int thread_count);
+
+// Stops and destroys a worker pool.
+void parallel_destroy(parallel_t* pool);
+
+// Returns the number of worker threads, not counting the calling thread.
+int parallel_get_thread_count(parallel_t* pool);
+
+// Calls fn over [begin, end) in chunks of at least grain indices and waits for all to finish.
+// Runs fn inline on the calling thread, with no synchronization, when pool is NULL, when the
+// range is no larger than grain, or when called from inside another parallel loop.
+void parallel_for(parallel_t* pool, int begin, int end, int grain, parallel_for_fn_t fn, void* user);
+
+// Maps [begin, end) in chunks of at least grain indices and combines the partial results.
+// identity and result point to result_size bytes. result receives the combination of all partials.
+// The order in which partials are combined is not fixed, so combine must be associative and
+// commutative. For floating point sums, results can differ in the last bits between runs.
+// Falls back to a single inline map call under the same conditions as parallel_for.
+void parallel_reduce(parallel_t* pool, int begin, int end, int grain,
+	size_t result_size, const void* identity,
+	parallel_map_fn_t map, parallel_combine_fn_t combine, void* user, void* result);
@@ -0,0 +1,173 @@
+#include "parallel_bench.h"
+
+#include "debug.h"
+#include "heap.h"
+#include "parallel.h"
+#include "timer.h"
+
+#include <math.h>
+#include <stdint.h>
+
+enum
+{
+	k_min_size = 64,
+	k_max_size = 4 * 1024 * 1024,
+	k_repeats = 5,
+	// Small enough that every size in the sweep is dispatched to the pool.
+	k_bench_grain = 32,
+};
+
+typedef struct kernel_data_t
+{
+	const float* input;
+	float* output;
+	int heavy_iterations;
+} kernel_data_t;
+
+static void light_kernel(void* user, int begin, int end)
+{
+	kernel_data_t* data = user;
+	for (int i = begin; i < end; ++i)
+	{
+		data->output[i] = data->input[i] * 1.5f + 0.25f;
+	}
+}
+
+static void heavy_kernel(void* user, int begin, int end)
+{
+	kernel_data_t* data = user;
+	for (int i = begin; i < end; ++i)
+	{
+		float x = data->input[i];
+		for (int k = 0; k < data->heavy_iterations; ++k)
+		{
+			x = sqrtf(x * x + 1.0f) * 0.5f;
+		}
+		data->output[i] = x;
+	}
+}
+
+static void sum_map(void* user, int begin, int end, void* partial)
+{
+	kernel_data_t* data = user;
+	double sum = 0.0;
+	for (int i = begin; i < end; ++i)
+	{
+		sum += data->input[i];
+	}
+	*(double*)partial += sum;
+}
+
+static void sum_combine(void* user, void* accumulator, const void* partial)
+{
+	*(double*)accumulator += *(const double*)partial;
+}
+
+// Small sizes are repeated so every sample covers k_max_size elements of work.
+static int batch_count(int size)
+{
+	return k_max_size / size;
+}
+
+// Best-of-k_repeats time for one call at one size, in microseconds.
+static double time_for(parallel_t* pool, int size, parallel_for_fn_t fn, kernel_data_t* data)
+{
+	uint64_t best = UINT64_MAX;
+	int batch = batch_count(size);
+	for (int r = 0; r < k_repeats; ++r)
+	{
+		uint64_t t0 = timer_get_ticks();
+		for (int b = 0; b < batch; ++b)
+		{
+			parallel_for(pool, 0, size, k_bench_grain, fn, data);
+		}
+		uint64_t elapsed = timer_get_ticks() - t0;
+		best = elapsed < best ? elapsed : best;
+	}
+	return (double)timer_ticks_to_us(best) / batch;
+}
+
+static double time_reduce(parallel_t* pool, int size, kernel_data_t* data, double* result)
+{
+	uint64_t best = UINT64_MAX;
+	int batch = batch_count(size);
+	double identity = 0.0;
+	for (int r = 0; r < k_repeats; ++r)
+	{
+		uint64_t t0 = timer_get_ticks();
+		for (int b = 0; b < batch; ++b)
+		{
+			parallel_reduce(pool, 0, size, k_bench_grain, sizeof(double), &identity, sum_map, sum_combine, data, result);
+		}
+		uint64_t elapsed = timer_get_ticks() - t0;
+		best = elapsed < best ? elapsed : best;
+	}
+	return (double)timer_ticks_to_us(best) / batch;
+}
+
+// Passing a NULL pool runs the serial baseline through the same entry point.
+static void bench_kernel(parallel_t* pool, const char* name, parallel_for_fn_t fn, kernel_data_t* data)
+{
+	debug_print(k_print_info, "%s:\n", name);
+	int crossover = 0;
+	for (int size = k_min_size; size <= k_max_size; size *= 4)
+	{
+		double serial = time_for(NULL, size, fn, data);
+		double parallel = time_for(pool, size, fn, data);
+		double speedup = parallel > 0.0 ? serial / parallel : 0.0;
+		// Require a clear margin so timer noise is not reported as a win.
+		if (crossover == 0 && speedup > 1.1)
+		{
+			crossover = size;
+		}
+		debug_print(k_print_info, "  size=%8d serial=%10.2f us parallel=%10.2f us speedup=%5.2fx\n",
+			size, serial, parallel, speedup);
+	}
+	if (parallel_get_thread_count(pool) == 0)
+	{
+		debug_print(k_print_info, "  no worker threads; both columns ran inline\n");
+	}
+	else if (crossover)
+	{
+		debug_print(k_print_info, "  parallel wins from %d elements\n", crossover);
+	}
+	else
+	{
+		debug_print(k_print_info, "  parallel never wins on this machine\n");
+	}
+}
+
+void parallel_bench_run()
+{
+	heap_t* heap = heap_create(2 * 1024 * 1024);
+	parallel_t* pool = parallel_create(heap, 0);
+	debug_print(k_print_info, "Parallel loops with %d workers + caller, grain %d:\n",
+		parallel_get_thread_count(pool), k_bench_grain);
+
+	float* input = heap_alloc(heap, sizeof(float) * k_max_size, 64);
+	float* output = heap_alloc(heap, sizeof(float) * k_max_size, 64);
+	for (int i = 0; i < k_max_size; ++i)
+	{
+		input[i] = (float)(i % 1000) * 0.001f;
+	}
+	kernel_data_t data = { .input = input, .output = output, .heavy_iterations = 8 };
+
+	bench_kernel(pool, "parallel_for light (1 mul-add per element)", light_kernel, &data);
+	bench_kernel(pool, "parallel_for heavy (8 sqrt per element)", heavy_kernel, &data);
+
+	debug_print(k_print_info, "parallel_reduce sum:\n");
+	for (int size = k_min_size; size <= k_max_size; size *= 4)
+	{
+		double serial_sum;
+		double parallel_sum;
+		double serial = time_reduce(NULL, size, &data, &serial_sum);
+		double parallel = time_reduce(pool, size, &data, &parallel_sum);
+		debug_print(k_print_info, "  size=%8d serial=%10.2f us parallel=%10.2f us sum=%.1f/%.1f\n",
+			size, serial, parallel, serial_sum, parallel_sum);
+	}
+
+	heap_free(heap, output);
+	heap_free(heap, input);
+	parallel_destroy(pool);
+	heap_destroy(heap);
+}
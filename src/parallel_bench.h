@@ -0,0 +1,8 @@
+#pragma once
+
+// parallel_for and parallel_reduce microbenchmark.
+// Times a light and a heavy per-element kernel serially and on the worker pool
+// across range sizes, and prints the size at which going parallel starts to pay.
+
+// Run all parallel loop benchmarks.
+void parallel_bench_run();
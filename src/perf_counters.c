@@ -0,0 +1,135 @@
+#include "perf_counters.h"
+
+#include "heap.h"
+
+#include <string.h>
+
+static const char* k_counter_names[k_perf_counter_count] =
+{
+	"cycles",
+	"instructions",
+	"l1d_misses",
+	"llc_misses",
+	"branch_misses",
+};
+
+const char* perf_counter_get_name(perf_counter_t counter)
+{
+	return k_counter_names[counter];
+}
+
+#if defined(__linux__)
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+typedef struct perf_event_t
+{
+	uint32_t type;
+	uint64_t config;
+} perf_event_t;
+
+static const perf_event_t k_events[k_perf_counter_count] =
+{
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	{ PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+};
+
+typedef struct perf_counters_t
+{
+	heap_t* heap;
+	// All counters are one group, so they count over exactly the same time and read together.
+	int group_fd;
+	int fds[k_perf_counter_count];
+	// Where each counter's value is in a group read, or -1 if it could not be opened.
+	int slots[k_perf_counter_count];
+	int slot_count;
+} perf_counters_t;
+
+perf_counters_t* perf_counters_create(heap_t* heap)
+{
+	perf_counters_t* counters = heap_alloc(heap, sizeof(perf_counters_t), 8);
+	counters->heap = heap;
+	counters->group_fd = -1;
+	counters->slot_count = 0;
+	for (int i = 0; i < k_perf_counter_count; ++i)
+	{
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = k_events[i].type;
+		attr.config = k_events[i].config;
+		attr.read_format = PERF_FORMAT_GROUP;
+		// The group starts when the leader is enabled, below.
+		attr.disabled = counters->group_fd < 0;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, counters->group_fd, PERF_FLAG_FD_CLOEXEC);
+		counters->fds[i] = fd;
+		counters->slots[i] = fd >= 0 ? counters->slot_count++ : -1;
+		if (fd >= 0 && counters->group_fd < 0)
+		{
+			counters->group_fd = fd;
+		}
+	}
+
+	if (counters->group_fd < 0)
+	{
+		heap_free(heap, counters);
+		return NULL;
+	}
+	ioctl(counters->group_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+	ioctl(counters->group_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	return counters;
+}
+
+void perf_counters_destroy(perf_counters_t* counters)
+{
+	if (counters == NULL)
+	{
+		return;
+	}
+	for (int i = 0; i < k_perf_counter_count; ++i)
+	{
+		if (counters->fds[i] >= 0)
+		{
+			close(counters->fds[i]);
+		}
+	}
+	heap_free(counters->heap, counters);
+}
+
+void perf_counters_read(perf_counters_t* counters, uint64_t values[k_perf_counter_count])
+{
+	// A group read is the count of counters followed by their values.
+	uint64_t buffer[1 + k_perf_counter_count];
+	ssize_t size = read(counters->group_fd, buffer, sizeof(buffer));
+	for (int i = 0; i < k_perf_counter_count; ++i)
+	{
+		int slot = counters->slots[i];
+		values[i] = slot >= 0 && size >= (ssize_t)((2 + slot) * sizeof(uint64_t)) ? buffer[1 + slot] : 0;
+	}
+}
+
+#else
+
+perf_counters_t* perf_counters_create(heap_t* heap)
+{
+	return NULL;
+}
+
+void perf_counters_destroy(perf_counters_t* counters)
+{
+}
+
+void perf_counters_read(perf_counters_t* counters, uint64_t values[k_perf_counter_count])
+{
+	memset(values, 0, k_perf_counter_count * sizeof(uint64_t));
+}
+
+#endif
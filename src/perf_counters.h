@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdint.h>
+
+// Hardware performance counters.
+// Counts events of the CPU running the calling thread, such as cycles and cache misses, to
+// tell memory bound code from compute bound code. Uses perf_event_open on Linux; not
+// available elsewhere, nor where the kernel hides the PMU, as in most virtual machines.
+
+typedef struct perf_counters_t perf_counters_t;
+
+typedef struct heap_t heap_t;
+
+typedef enum perf_counter_t
+{
+	k_perf_counter_cycles,
+	k_perf_counter_instructions,
+	// Level 1 data cache read misses.
+	k_perf_counter_l1d_misses,
+	// Last level cache misses.
+	k_perf_counter_llc_misses,
+	k_perf_counter_branch_misses,
+	k_perf_counter_count,
+} perf_counter_t;
+
+// Start counting on the calling thread, in user mode only.
+// Counters the CPU lacks read zero. Returns NULL if none could be opened.
+perf_counters_t* perf_counters_create(heap_t* heap);
+
+// Stop counting. May be called from any thread.
+void perf_counters_destroy(perf_counters_t* counters);
+
+// Read the counts since creation. Reads take a system call, a microsecond or so.
+void perf_counters_read(perf_counters_t* counters, uint64_t values[k_perf_counter_count]);
+
+// Short name of a counter, such as "cycles".
+const char* perf_counter_get_name(perf_counter_t counter);
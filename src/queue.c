@@ -74,3 +74,10 @@ void* queue_try_pop(queue_t* queue)
 	}
 	return NULL;
 }
+
+int queue_get_count(queue_t* queue)
+{
+	// A push claims its slot before storing the item, so the count may include one in flight.
+	int count = atomic_load_acquire(&queue->tail_index) - atomic_load_acquire(&queue->head_index);
+	return count < 0 ? 0 : count > queue->capacity ? queue->capacity : count;
+}
@@ -34,3 +34,7 @@ bool queue_try_push(queue_t* queue, void* item);
 // If the queue is empty, returns NULL.
 // Safe for multiple threads to pop at the same time.
 void* queue_try_pop(queue_t* queue);
+
+// Get the number of items in a queue.
+// Other threads may push and pop at the same time, so this is only a snapshot.
+int queue_get_count(queue_t* queue);
@@ -5,6 +5,7 @@
 #include "heap.h"
 #include "queue.h"
 #include "thread.h"
+#include "trace.h"
 #include "wm.h"
 
 #include <assert.h>
@@ -33,6 +34,8 @@ typedef struct model_command_t
 typedef struct frame_done_command_t
 {
 	command_type_t type;
+	// Ties the frame's handoff on the game thread to its drawing on the render thread in traces.
+	uint64_t frame_id;
 } frame_done_command_t;
 
 typedef struct draw_instance_t
@@ -65,6 +68,9 @@ typedef struct render_t
 	thread_t* thread;
 	gpu_t* gpu;
 	queue_t* queue;
+	trace_t* trace;
+	// Frames pushed by the game thread.
+	uint64_t frame_push_count;
 
 	int frame_counter;
 	int gpu_frame_count;
@@ -89,11 +95,14 @@ render_t* render_create(heap_t* heap, wm_window_t* window)
 	render->heap = heap;
 	render->window = window;
 	render->queue = queue_create(heap, 3);
+	render->trace = NULL;
+	render->frame_push_count = 0;
 	render->frame_counter = 0;
 	render->instance_count = 0;
 	render->mesh_count = 0;
 	render->shader_count = 0;
-	render->thread = thread_create(render_thread_func, render);
+	thread_desc_t desc = thread_desc_for_role(k_thread_role_render, "render");
+	render->thread = thread_create_ex(render_thread_func, render, &desc);
 	return render;
 }
 
@@ -105,6 +114,11 @@ void render_destroy(render_t* render)
 	heap_free(render->heap, render);
 }
 
+void render_set_trace(render_t* render, trace_t* trace)
+{
+	render->trace = trace;
+}
+
 void render_push_model(render_t* render, ecs_entity_ref_t* entity, gpu_mesh_info_t* mesh, gpu_shader_info_t* shader, gpu_uniform_buffer_info_t* uniform)
 {
 	model_command_t* command = heap_alloc(render->heap, sizeof(model_command_t), 8);
@@ -122,7 +136,15 @@ void render_push_done(render_t* render)
 {
 	frame_done_command_t* command = heap_alloc(render->heap, sizeof(frame_done_command_t), 8);
 	command->type = k_command_frame_done;
-	queue_push(render->queue, command);
+	command->frame_id = ++render->frame_push_count;
+
+	// The push blocks while the queue is full, so the duration shows the game waiting on rendering.
+	TRACE_COUNTER(render->trace, "render queue", queue_get_count(render->queue));
+	TRACE_SCOPE(render->trace, "render_push_done")
+	{
+		TRACE_FLOW_BEGIN(render->trace, "frame", command->frame_id);
+		queue_push(render->queue, command);
+	}
 }
 
 static int render_thread_func(void* user)
@@ -147,22 +169,35 @@ static int render_thread_func(void* user)
 
 		if (!cmdbuf)
 		{
-			cmdbuf = gpu_frame_begin(render->gpu);
+			TRACE_PUSH(render->trace, "render frame");
+			TRACE_SCOPE(render->trace, "gpu_frame_begin")
+			{
+				cmdbuf = gpu_frame_begin(render->gpu);
+			}
 		}
 
 		if (*type == k_command_frame_done)
 		{
-			gpu_frame_end(render->gpu);
+			TRACE_FLOW_END(render->trace, "frame", ((frame_done_command_t*)type)->frame_id);
+			TRACE_SCOPE(render->trace, "gpu_frame_end")
+			{
+				gpu_frame_end(render->gpu);
+			}
 			cmdbuf = NULL;
 			last_pipeline = NULL;
 			last_mesh = NULL;
 
-			destroy_stale_data(render);
+			TRACE_SCOPE(render->trace, "destroy_stale_data")
+			{
+				destroy_stale_data(render);
+			}
 			++render->frame_counter;
 			frame_index = render->frame_counter % render->gpu_frame_count;
+			TRACE_POP(render->trace);
 		}
 		else if (*type == k_command_model)
 		{
+			TRACE_PUSH(render->trace, "render model");
 			model_command_t* command = (model_command_t*)type;
 			draw_shader_t* shader = create_or_get_shader_for_model_command(render, command);
 			draw_mesh_t* mesh = create_or_get_mesh_for_model_command(render, command);
@@ -182,6 +217,7 @@ static int render_thread_func(void* user)
 			}
 			gpu_cmd_descriptor_bind(render->gpu, cmdbuf, instance->descriptors[frame_index]);
 			gpu_cmd_draw(render->gpu, cmdbuf);
+			TRACE_POP(render->trace);
 		}
 
 		heap_free(render->heap, type);
@@ -299,6 +335,7 @@ static draw_instance_t* create_or_get_instance_for_model_command(render_t* rende
 
 static void destroy_stale_data(render_t* render)
 {
+	int count = render->instance_count + render->mesh_count + render->shader_count;
 	for (int i = render->instance_count - 1; i >= 0; --i)
 	{
 		if (render->instances[i].frame_counter + render->gpu_frame_count <= render->frame_counter)
@@ -333,4 +370,10 @@ static void destroy_stale_data(render_t* render)
 			render->shader_count--;
 		}
 	}
+
+	// Marks the frames where GPU resources of despawned entities were released.
+	if (count != render->instance_count + render->mesh_count + render->shader_count)
+	{
+		TRACE_INSTANT(render->trace, "render released stale data");
+	}
 }
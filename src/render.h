@@ -9,6 +9,7 @@ typedef struct gpu_mesh_info_t gpu_mesh_info_t;
 typedef struct gpu_shader_info_t gpu_shader_info_t;
 typedef struct gpu_uniform_buffer_info_t gpu_uniform_buffer_info_t;
 typedef struct heap_t heap_t;
+typedef struct trace_t trace_t;
 typedef struct wm_window_t wm_window_t;
 
 // Create a render system.
@@ -17,6 +18,10 @@ render_t* render_create(heap_t* heap, wm_window_t* window);
 // Destroy a render system.
 void render_destroy(render_t* render);
 
+// Record render queue depth, frame handoffs and render thread frames into a trace.
+// Set before pushing frames; the trace must outlive the render system.
+void render_set_trace(render_t* render, trace_t* trace);
+
 // Push a model onto a queue of items to be rendered.
 void render_push_model(render_t* render, ecs_entity_ref_t* entity, gpu_mesh_info_t* mesh, gpu_shader_info_t* shader, gpu_uniform_buffer_info_t* uniform);
 
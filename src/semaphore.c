@@ -1,31 +1,111 @@
 #include "semaphore.h"
 
-#define WIN32_LEAN_AND_MEAN
-#include <windows.h>
+#include "atomic.h"
+#include "futex.h"
+
+#include <stdlib.h>
+
+// Futex semaphore.
+// The count lives in user space; the kernel is only entered when a thread
+// must sleep on a zero count, or when releasing while threads are asleep.
+typedef struct semaphore_t
+{
+	int count;
+	int sleepers;
+	int max_count;
+	semaphore_stats_t stats;
+} semaphore_t;
 
 semaphore_t* semaphore_create(int initial_count, int max_count)
 {
-	HANDLE semaphore = CreateSemaphore(NULL, initial_count, max_count, NULL);
-	return (semaphore_t*)semaphore;
+	semaphore_t* semaphore = calloc(1, sizeof(semaphore_t));
+	semaphore->count = initial_count;
+	semaphore->max_count = max_count;
+	return semaphore;
 }
 
 void semaphore_destroy(semaphore_t* semaphore)
 {
-	CloseHandle(semaphore);
+	free(semaphore);
 }
 
-void semaphore_acquire(semaphore_t* semaphore)
+bool semaphore_try_acquire(semaphore_t* semaphore)
 {
-	WaitForSingleObject(semaphore, INFINITE);
+	int count = atomic_load_relaxed(&semaphore->count);
+	while (count > 0)
+	{
+		int old = atomic_compare_and_exchange(&semaphore->count, count, count - 1);
+		if (old == count)
+		{
+			return true;
+		}
+		count = old;
+	}
+	return false;
 }
 
-bool semaphore_try_acquire(semaphore_t* semaphore)
+void semaphore_acquire(semaphore_t* semaphore)
 {
-	DWORD result = WaitForSingleObject(semaphore, 0);
-	return result == WAIT_OBJECT_0;
+	if (semaphore_try_acquire(semaphore))
+	{
+		return;
+	}
+
+	atomic_increment64((int64_t*)&semaphore->stats.contended_count);
+
+	for (int i = 0; i < k_futex_spin_count; ++i)
+	{
+		cpu_pause();
+		if (semaphore_try_acquire(semaphore))
+		{
+			return;
+		}
+	}
+
+	while (true)
+	{
+		// Publish ourselves as a sleeper before re-checking the count.
+		// Pairs with the release side, which bumps the count before reading sleepers.
+		atomic_increment(&semaphore->sleepers);
+		if (semaphore_try_acquire(semaphore))
+		{
+			atomic_decrement(&semaphore->sleepers);
+			return;
+		}
+		atomic_increment64((int64_t*)&semaphore->stats.sleep_count);
+		futex_wait(&semaphore->count, 0);
+		atomic_decrement(&semaphore->sleepers);
+	}
 }
 
 void semaphore_release(semaphore_t* semaphore)
 {
-	ReleaseSemaphore(semaphore, 1, NULL);
+	int count = atomic_load_relaxed(&semaphore->count);
+	while (true)
+	{
+		// Matches ReleaseSemaphore, which fails to raise the count past its maximum.
+		if (count >= semaphore->max_count)
+		{
+			return;
+		}
+		int old = atomic_compare_and_exchange(&semaphore->count, count, count + 1);
+		if (old == count)
+		{
+			break;
+		}
+		count = old;
+	}
+
+	// The full barrier of the exchange above keeps this load from moving ahead of it.
+	if (atomic_load_acquire(&semaphore->sleepers) > 0)
+	{
+		futex_wake(&semaphore->count, 1);
+	}
+}
+
+bool semaphore_get_stats(semaphore_t* semaphore, semaphore_stats_t* stats)
+{
+	stats->contended_count = (uint64_t)atomic_load64_relaxed((int64_t*)&semaphore->stats.contended_count);
+	stats->sleep_count = (uint64_t)atomic_load64_relaxed((int64_t*)&semaphore->stats.sleep_count);
+	return true;
 }
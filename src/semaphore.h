@@ -1,12 +1,22 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 
 // Counting semaphore thread synchronization
 
 // Handle to a semaphore.
 typedef struct semaphore_t semaphore_t;
 
+// Contention counters for a semaphore. See semaphore_get_stats().
+typedef struct semaphore_stats_t
+{
+	// Number of acquires that found the semaphore count at zero.
+	uint64_t contended_count;
+	// Number of times a thread went to sleep in the kernel waiting for the semaphore.
+	uint64_t sleep_count;
+} semaphore_stats_t;
+
 // Creates a new semaphore.
 semaphore_t* semaphore_create(int initial_count, int max_count);
 
@@ -23,3 +33,7 @@ bool semaphore_try_acquire(semaphore_t* semaphore);
 
 // Raises the semaphore count by one.
 void semaphore_release(semaphore_t* semaphore);
+
+// Reads the contention counters of a semaphore.
+// Returns false if the platform backend does not track contention.
+bool semaphore_get_stats(semaphore_t* semaphore, semaphore_stats_t* stats);
@@ -0,0 +1,288 @@
+#include "sync_bench.h"
+
+#include "debug.h"
+#include "event.h"
+#include "mutex.h"
+#include "semaphore.h"
+#include "thread.h"
+#include "timer.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#if !defined(_WIN32)
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdlib.h>
+#endif
+
+enum
+{
+	k_lock_iterations = 1000000,
+	k_ping_pong_iterations = 100000,
+	k_max_threads = 8,
+};
+
+// Lock operations under test; lets the engine mutex and native mutexes share a harness.
+typedef struct lock_ops_t
+{
+	const char* name;
+	void* (*create)();
+	void (*destroy)(void* lock);
+	void (*lock)(void* lock);
+	void (*unlock)(void* lock);
+} lock_ops_t;
+
+typedef struct lock_thread_data_t
+{
+	const lock_ops_t* ops;
+	void* lock;
+	event_t* start;
+	int iterations;
+	int* counter;
+} lock_thread_data_t;
+
+static void* engine_mutex_create() { return mutex_create(); }
+static void engine_mutex_destroy(void* lock) { mutex_destroy(lock); }
+static void engine_mutex_lock(void* lock) { mutex_lock(lock); }
+static void engine_mutex_unlock(void* lock) { mutex_unlock(lock); }
+
+#if !defined(_WIN32)
+static void* pthread_mutex_create()
+{
+	pthread_mutex_t* mutex = malloc(sizeof(pthread_mutex_t));
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+	return mutex;
+}
+static void pthread_mutex_destroy_op(void* lock) { pthread_mutex_destroy(lock); free(lock); }
+static void pthread_mutex_lock_op(void* lock) { pthread_mutex_lock(lock); }
+static void pthread_mutex_unlock_op(void* lock) { pthread_mutex_unlock(lock); }
+#endif
+
+static const lock_ops_t k_lock_ops[] =
+{
+	{ "mutex_t", engine_mutex_create, engine_mutex_destroy, engine_mutex_lock, engine_mutex_unlock },
+#if !defined(_WIN32)
+	{ "pthread_mutex_t (recursive)", pthread_mutex_create, pthread_mutex_destroy_op, pthread_mutex_lock_op, pthread_mutex_unlock_op },
+#endif
+};
+
+static int lock_thread_func(void* user)
+{
+	lock_thread_data_t* data = user;
+	event_wait(data->start);
+	for (int i = 0; i < data->iterations; ++i)
+	{
+		data->ops->lock(data->lock);
+		*data->counter = *data->counter + 1;
+		data->ops->unlock(data->lock);
+	}
+	return 0;
+}
+
+static void bench_lock(const lock_ops_t* ops, int thread_count)
+{
+	int counter = 0;
+	lock_thread_data_t data =
+	{
+		.ops = ops,
+		.lock = ops->create(),
+		.start = event_create(),
+		.iterations = k_lock_iterations / thread_count,
+		.counter = &counter,
+	};
+
+	thread_t* threads[k_max_threads];
+	for (int i = 0; i < thread_count; ++i)
+	{
+		threads[i] = thread_create(lock_thread_func, &data);
+	}
+
+	uint64_t t0 = timer_get_ticks();
+	event_signal(data.start);
+	for (int i = 0; i < thread_count; ++i)
+	{
+		thread_destroy(threads[i]);
+	}
+	uint64_t elapsed = timer_get_ticks() - t0;
+
+	ops->destroy(data.lock);
+	event_destroy(data.start);
+
+	double ns_per_op = (double)timer_ticks_to_us(elapsed) * 1000.0 / (data.iterations * thread_count);
+	debug_print(k_print_info, "  %-28s threads=%d %8.1f ns/op counter=%d\n", ops->name, thread_count, ns_per_op, counter);
+}
+
+// Two threads hand a token back and forth through a pair of binary semaphores.
+// Every hand-off forces a sleep and a wake, so this measures the contended path.
+typedef struct ping_pong_t
+{
+	void* ping;
+	void* pong;
+	void (*acquire)(void* sem);
+	void (*release)(void* sem);
+} ping_pong_t;
+
+static void engine_semaphore_acquire(void* sem) { semaphore_acquire(sem); }
+static void engine_semaphore_release(void* sem) { semaphore_release(sem); }
+
+#if !defined(_WIN32)
+static void posix_semaphore_acquire(void* sem) { sem_wait(sem); }
+static void posix_semaphore_release(void* sem) { sem_post(sem); }
+#endif
+
+static int pong_thread_func(void* user)
+{
+	ping_pong_t* pp = user;
+	for (int i = 0; i < k_ping_pong_iterations; ++i)
+	{
+		pp->acquire(pp->ping);
+		pp->release(pp->pong);
+	}
+	return 0;
+}
+
+static void bench_ping_pong(const char* name, ping_pong_t* pp)
+{
+	uint64_t t0 = timer_get_ticks();
+	thread_t* thread = thread_create(pong_thread_func, pp);
+	for (int i = 0; i < k_ping_pong_iterations; ++i)
+	{
+		pp->release(pp->ping);
+		pp->acquire(pp->pong);
+	}
+	thread_destroy(thread);
+	uint64_t elapsed = timer_get_ticks() - t0;
+
+	double ns_per_round_trip = (double)timer_ticks_to_us(elapsed) * 1000.0 / k_ping_pong_iterations;
+	debug_print(k_print_info, "  %-28s %8.1f ns/round-trip\n", name, ns_per_round_trip);
+}
+
+// Uncontended event_signal/event_wait cost. A flag behind a pthread mutex and condition
+// variable is timed alongside for scale only: it is not an equivalent primitive, since a
+// condition variable has no state of its own and every check takes the mutex.
+static void bench_event_uncontended()
+{
+	uint64_t t0 = timer_get_ticks();
+	for (int i = 0; i < k_lock_iterations; ++i)
+	{
+		event_t* event = event_create();
+		event_signal(event);
+		event_wait(event);
+		event_destroy(event);
+	}
+	uint64_t elapsed = timer_get_ticks() - t0;
+	debug_print(k_print_info, "  %-28s %8.1f ns/op\n", "event_t create+signal+wait",
+		(double)timer_ticks_to_us(elapsed) * 1000.0 / k_lock_iterations);
+
+#if !defined(_WIN32)
+	t0 = timer_get_ticks();
+	for (int i = 0; i < k_lock_iterations; ++i)
+	{
+		pthread_mutex_t mutex;
+		pthread_cond_t cond;
+		bool raised = false;
+		pthread_mutex_init(&mutex, NULL);
+		pthread_cond_init(&cond, NULL);
+		pthread_mutex_lock(&mutex);
+		raised = true;
+		pthread_cond_broadcast(&cond);
+		pthread_mutex_unlock(&mutex);
+		pthread_mutex_lock(&mutex);
+		while (!raised)
+		{
+			pthread_cond_wait(&cond, &mutex);
+		}
+		pthread_mutex_unlock(&mutex);
+		pthread_cond_destroy(&cond);
+		pthread_mutex_destroy(&mutex);
+	}
+	elapsed = timer_get_ticks() - t0;
+	debug_print(k_print_info, "  %-28s %8.1f ns/op (reference only, not an equivalent primitive)\n", "pthread mutex+cond+flag",
+		(double)timer_ticks_to_us(elapsed) * 1000.0 / k_lock_iterations);
+#endif
+}
+
+static void print_contention_stats()
+{
+	mutex_t* mutex = mutex_create();
+	int counter = 0;
+	lock_thread_data_t data =
+	{
+		.ops = &k_lock_ops[0],
+		.lock = mutex,
+		.start = event_create(),
+		.iterations = k_lock_iterations / 4,
+		.counter = &counter,
+	};
+	thread_t* threads[4];
+	for (int i = 0; i < 4; ++i)
+	{
+		threads[i] = thread_create(lock_thread_func, &data);
+	}
+	event_signal(data.start);
+	for (int i = 0; i < 4; ++i)
+	{
+		thread_destroy(threads[i]);
+	}
+
+	mutex_stats_t stats;
+	if (mutex_get_stats(mutex, &stats))
+	{
+		debug_print(k_print_info, "  mutex_t 4 threads: locks=%llu contended=%llu sleeps=%llu\n",
+			(unsigned long long)stats.lock_count, (unsigned long long)stats.contended_count, (unsigned long long)stats.sleep_count);
+	}
+	mutex_destroy(mutex);
+	event_destroy(data.start);
+}
+
+void sync_bench_run()
+{
+	debug_print(k_print_info, "Mutex lock/unlock:\n");
+	for (int i = 0; i < (int)(sizeof(k_lock_ops) / sizeof(k_lock_ops[0])); ++i)
+	{
+		for (int thread_count = 1; thread_count <= k_max_threads; thread_count *= 2)
+		{
+			bench_lock(&k_lock_ops[i], thread_count);
+		}
+	}
+
+	debug_print(k_print_info, "Semaphore ping-pong:\n");
+	ping_pong_t engine_pp =
+	{
+		.ping = semaphore_create(0, 1),
+		.pong = semaphore_create(0, 1),
+		.acquire = engine_semaphore_acquire,
+		.release = engine_semaphore_release,
+	};
+	bench_ping_pong("semaphore_t", &engine_pp);
+	semaphore_destroy(engine_pp.ping);
+	semaphore_destroy(engine_pp.pong);
+
+#if !defined(_WIN32)
+	sem_t ping;
+	sem_t pong;
+	sem_init(&ping, 0, 0);
+	sem_init(&pong, 0, 0);
+	ping_pong_t posix_pp =
+	{
+		.ping = &ping,
+		.pong = &pong,
+		.acquire = posix_semaphore_acquire,
+		.release = posix_semaphore_release,
+	};
+	bench_ping_pong("sem_t", &posix_pp);
+	sem_destroy(&ping);
+	sem_destroy(&pong);
+#endif
+
+	debug_print(k_print_info, "Event:\n");
+	bench_event_uncontended();
+
+	debug_print(k_print_info, "Contention counters:\n");
+	print_contention_stats();
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+// Synchronization primitive microbenchmark.
+// Measures mutex_t, event_t and semaphore_t against the platform's native
+// primitives, uncontended and under contention, and prints the results.
+
+// Run all synchronization benchmarks.
+void sync_bench_run();
@@ -1,18 +1,135 @@
+#if !defined(_WIN32)
+// For pthread_setname_np and pthread_setaffinity_np.
+#define _GNU_SOURCE
+#endif
+
 #include "thread.h"
 
 #include "debug.h"
 
+// Returns a mask with one bit set for each logical CPU.
+static uint64_t all_cpus_mask()
+{
+	int count = thread_get_cpu_count();
+	return count >= 64 ? ~0ull : (1ull << count) - 1;
+}
+
+// Fills masks with the logical CPUs of each physical core, SMT siblings together, in CPU order.
+// Returns the number of cores, or zero if the topology is unknown.
+static int get_core_masks(uint64_t* masks, int max_count);
+
+thread_desc_t thread_desc_for_role(thread_role_t role, const char* name)
+{
+	thread_desc_t desc = { .name = name, .affinity_mask = 0, .priority = k_thread_priority_normal };
+
+	// Split whole physical cores, so bulk threads never run on an SMT sibling of a frame thread.
+	// Without topology every logical CPU counts as a core.
+	int count = thread_get_cpu_count();
+	uint64_t core_masks[64];
+	int core_count = get_core_masks(core_masks, 64);
+	if (core_count == 0)
+	{
+		for (int i = 0; i < count; ++i)
+		{
+			core_masks[i] = 1ull << i;
+		}
+		core_count = count;
+	}
+
+	// Too few CPUs to split: pinning would only take cores away from everyone.
+	uint64_t latency_mask = 0;
+	uint64_t bulk_mask = 0;
+	if (count >= 4 && core_count >= 2)
+	{
+		for (int i = 0; i < core_count / 2; ++i)
+		{
+			latency_mask |= core_masks[i];
+		}
+		bulk_mask = all_cpus_mask() & ~latency_mask;
+	}
+
+	switch (role)
+	{
+	case k_thread_role_main:
+	case k_thread_role_render:
+		desc.affinity_mask = latency_mask;
+		desc.priority = k_thread_priority_high;
+		break;
+	case k_thread_role_io:
+	case k_thread_role_net:
+		desc.affinity_mask = bulk_mask;
+		break;
+	case k_thread_role_compression:
+		desc.affinity_mask = bulk_mask;
+		desc.priority = k_thread_priority_low;
+		break;
+	default:
+		break;
+	}
+	return desc;
+}
+
+int thread_get_role_cpu_count(thread_role_t role)
+{
+	uint64_t mask = thread_desc_for_role(role, NULL).affinity_mask;
+	if (mask == 0)
+	{
+		return thread_get_cpu_count();
+	}
+	int count = 0;
+	for (; mask; mask &= mask - 1)
+	{
+		count++;
+	}
+	return count;
+}
+
+thread_t* thread_create(int (*function)(void*), void* data)
+{
+	thread_desc_t desc = { 0 };
+	return thread_create_ex(function, data, &desc);
+}
+
+#if defined(_WIN32)
+
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 
-thread_t* thread_create(int (*function)(void*), void* data)
+#include <stdlib.h>
+
+static void apply_desc(HANDLE h, const thread_desc_t* desc)
+{
+	if (desc->name)
+	{
+		wchar_t wide_name[64];
+		if (MultiByteToWideChar(CP_UTF8, 0, desc->name, -1, wide_name, _countof(wide_name)) > 0)
+		{
+			SetThreadDescription(h, wide_name);
+		}
+	}
+
+	uint64_t mask = desc->affinity_mask & all_cpus_mask();
+	if (mask && SetThreadAffinityMask(h, (DWORD_PTR)mask) == 0)
+	{
+		debug_print(k_print_warning, "Thread affinity mask 0x%llx could not be set!\n", (unsigned long long)mask);
+	}
+
+	if (desc->priority != k_thread_priority_normal)
+	{
+		int priority = desc->priority == k_thread_priority_high ? THREAD_PRIORITY_ABOVE_NORMAL : THREAD_PRIORITY_BELOW_NORMAL;
+		SetThreadPriority(h, priority);
+	}
+}
+
+thread_t* thread_create_ex(int (*function)(void*), void* data, const thread_desc_t* desc)
 {
 	HANDLE h = CreateThread(NULL, 0, function, data, CREATE_SUSPENDED, NULL);
-	if (h == INVALID_HANDLE_VALUE)
+	if (h == NULL)
 	{
 		debug_print(k_print_warning, "Thread failed to create!\n");
 		return NULL;
 	}
+	apply_desc(h, desc);
 	ResumeThread(h);
 	return (thread_t*)h;
 }
@@ -30,3 +147,244 @@ void thread_sleep(uint32_t ms)
 {
 	Sleep(ms);
 }
+
+void thread_set_current(const thread_desc_t* desc)
+{
+	apply_desc(GetCurrentThread(), desc);
+}
+
+bool thread_get_current_name(char* buffer, size_t size)
+{
+	buffer[0] = '\0';
+	wchar_t* wide_name = NULL;
+	if (FAILED(GetThreadDescription(GetCurrentThread(), &wide_name)))
+	{
+		return false;
+	}
+	if (WideCharToMultiByte(CP_UTF8, 0, wide_name, -1, buffer, (int)size, NULL, NULL) == 0)
+	{
+		buffer[0] = '\0';
+	}
+	LocalFree(wide_name);
+	return buffer[0] != '\0';
+}
+
+static int get_core_masks(uint64_t* masks, int max_count)
+{
+	DWORD size = 0;
+	GetLogicalProcessorInformationEx(RelationProcessorCore, NULL, &size);
+	if (GetLastError() != ERROR_INSUFFICIENT_BUFFER)
+	{
+		return 0;
+	}
+	char* buffer = malloc(size);
+	if (!buffer || !GetLogicalProcessorInformationEx(RelationProcessorCore, (SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*)buffer, &size))
+	{
+		free(buffer);
+		return 0;
+	}
+
+	// Only the first processor group is covered, like the rest of the affinity masks.
+	int count = 0;
+	for (DWORD offset = 0; offset < size && count < max_count; )
+	{
+		SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX* info = (SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*)(buffer + offset);
+		uint64_t mask = info->Processor.GroupMask[0].Group == 0 ? (uint64_t)info->Processor.GroupMask[0].Mask : 0;
+		if (mask)
+		{
+			masks[count++] = mask;
+		}
+		offset += info->Size;
+	}
+	free(buffer);
+	return count;
+}
+
+int thread_get_cpu_count()
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors > 64 ? 64 : (int)info.dwNumberOfProcessors;
+}
+
+#else
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct thread_t
+{
+	pthread_t handle;
+	int (*function)(void*);
+	void* data;
+	int code;
+	thread_desc_t desc;
+	// Linux limits thread names to 16 bytes including the terminator.
+	char name[16];
+} thread_t;
+
+static void apply_desc(const thread_desc_t* desc)
+{
+	// Unnamed threads would otherwise inherit their creator's name; use the process name like a fresh thread.
+	char name[16];
+	snprintf(name, sizeof(name), "%s", desc->name ? desc->name : program_invocation_short_name);
+	pthread_setname_np(pthread_self(), name);
+
+	// New threads inherit their creator's affinity and nice value on Linux but not on Windows.
+	// Reset both so a zero mask and normal priority mean the same thing on both platforms.
+	uint64_t mask = desc->affinity_mask ? desc->affinity_mask & all_cpus_mask() : all_cpus_mask();
+	if (mask)
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (int i = 0; i < 64; ++i)
+		{
+			if (mask & (1ull << i))
+			{
+				CPU_SET(i, &set);
+			}
+		}
+		if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+		{
+			debug_print(k_print_warning, "Thread affinity mask 0x%llx could not be set!\n", (unsigned long long)mask);
+		}
+	}
+
+	// Per-thread nice value. Raising priority needs CAP_SYS_NICE; without it the thread stays at normal.
+	int nice = desc->priority == k_thread_priority_high ? -5 : desc->priority == k_thread_priority_low ? 10 : 0;
+	setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), nice);
+}
+
+static void* thread_entry(void* user)
+{
+	thread_t* thread = user;
+	apply_desc(&thread->desc);
+	thread->code = thread->function(thread->data);
+	return NULL;
+}
+
+thread_t* thread_create_ex(int (*function)(void*), void* data, const thread_desc_t* desc)
+{
+	thread_t* thread = calloc(1, sizeof(thread_t));
+	thread->function = function;
+	thread->data = data;
+	thread->desc = *desc;
+	if (desc->name)
+	{
+		// The caller's string need not outlive this call.
+		snprintf(thread->name, sizeof(thread->name), "%s", desc->name);
+		thread->desc.name = thread->name;
+	}
+	if (pthread_create(&thread->handle, NULL, thread_entry, thread) != 0)
+	{
+		debug_print(k_print_warning, "Thread failed to create!\n");
+		free(thread);
+		return NULL;
+	}
+	return thread;
+}
+
+int thread_destroy(thread_t* thread)
+{
+	pthread_join(thread->handle, NULL);
+	int code = thread->code;
+	free(thread);
+	return code;
+}
+
+void thread_sleep(uint32_t ms)
+{
+	struct timespec ts = { .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L };
+	nanosleep(&ts, NULL);
+}
+
+void thread_set_current(const thread_desc_t* desc)
+{
+	apply_desc(desc);
+}
+
+bool thread_get_current_name(char* buffer, size_t size)
+{
+	buffer[0] = '\0';
+	if (pthread_getname_np(pthread_self(), buffer, size) != 0)
+	{
+		buffer[0] = '\0';
+	}
+	return buffer[0] != '\0';
+}
+
+// Parses a sysfs CPU list like "0-3,8" into a mask.
+static uint64_t parse_cpu_list(const char* list)
+{
+	uint64_t mask = 0;
+	while (*list)
+	{
+		char* end;
+		long first = strtol(list, &end, 10);
+		if (end == list)
+		{
+			break;
+		}
+		long last = first;
+		if (*end == '-')
+		{
+			list = end + 1;
+			last = strtol(list, &end, 10);
+		}
+		for (long i = first; i <= last && i < 64; ++i)
+		{
+			mask |= 1ull << i;
+		}
+		list = *end == ',' ? end + 1 : end;
+		if (*list == '\n')
+		{
+			break;
+		}
+	}
+	return mask;
+}
+
+static int get_core_masks(uint64_t* masks, int max_count)
+{
+	int count = 0;
+	int cpu_count = thread_get_cpu_count();
+	for (int i = 0; i < cpu_count && count < max_count; ++i)
+	{
+		char path[128];
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", i);
+		FILE* file = fopen(path, "r");
+		if (!file)
+		{
+			return 0;
+		}
+		char list[256] = { 0 };
+		bool read = fgets(list, sizeof(list), file) != NULL;
+		fclose(file);
+		uint64_t mask = read ? parse_cpu_list(list) & all_cpus_mask() : 0;
+		if (!(mask & (1ull << i)))
+		{
+			return 0;
+		}
+		// A core is listed once, by its lowest numbered CPU.
+		if ((mask & ((1ull << i) - 1)) == 0)
+		{
+			masks[count++] = mask;
+		}
+	}
+	return count;
+}
+
+int thread_get_cpu_count()
+{
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count < 1 ? 1 : count > 64 ? 64 : (int)count;
+}
+
+#endif
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 // Threading support.
@@ -7,14 +9,72 @@
 // Handle to a thread.
 typedef struct thread_t thread_t;
 
+// Scheduling priority class of a thread.
+typedef enum thread_priority_t
+{
+	k_thread_priority_normal,
+	k_thread_priority_low,
+	k_thread_priority_high,
+} thread_priority_t;
+
+// What an engine thread is for.
+// Used to pick a default core placement and priority.
+typedef enum thread_role_t
+{
+	k_thread_role_default,
+	k_thread_role_main,
+	k_thread_role_render,
+	k_thread_role_io,
+	k_thread_role_compression,
+	k_thread_role_net,
+} thread_role_t;
+
+// Options for a new thread.
+typedef struct thread_desc_t
+{
+	// Shown in debuggers, trace captures and top. May be NULL.
+	// Linux truncates names to 15 characters.
+	const char* name;
+	// One bit per logical CPU the thread may run on. Zero leaves placement to the OS.
+	uint64_t affinity_mask;
+	thread_priority_t priority;
+} thread_desc_t;
+
 // Creates a new thread.
 // Thread begins running function with data on return.
 thread_t* thread_create(int (*function)(void*), void* data);
 
+// Creates a new thread with a name, affinity mask and priority.
+// Thread begins running function with data on return.
+thread_t* thread_create_ex(int (*function)(void*), void* data, const thread_desc_t* desc);
+
 // Waits for a thread to complete and destroys it.
 // Returns the thread's exit code.
-int thread_destroy(thread);
+int thread_destroy(thread_t* thread);
 
 // Puts the calling thread to sleep for the specified number of milliseconds.
 // Thread will sleep for *approximately* the specified time.
 void thread_sleep(uint32_t ms);
+
+// Returns the default topology policy for an engine thread role.
+// On machines with four or more logical CPUs, the main and render threads get the
+// lower half of the physical cores and the io, compression and net threads get the rest,
+// so bulk work never preempts frame work or shares a core with it through SMT. Compression runs at low priority and
+// main and render run at high priority.
+thread_desc_t thread_desc_for_role(thread_role_t role, const char* name);
+
+// Returns the number of logical CPUs the threads of a role may run on by default, which is
+// every CPU where thread_desc_for_role leaves placement to the OS.
+// Use it to size a pool of threads of that role.
+int thread_get_role_cpu_count(thread_role_t role);
+
+// Applies a name, affinity mask and priority to the calling thread.
+// Use this for threads the engine did not create, like the main thread.
+void thread_set_current(const thread_desc_t* desc);
+
+// Copies the calling thread's name into buffer.
+// Returns false and writes an empty string if the thread has no name.
+bool thread_get_current_name(char* buffer, size_t size);
+
+// Returns the number of logical CPUs, up to 64.
+int thread_get_cpu_count();
@@ -1,222 +1,2554 @@
+#if defined(__linux__)
+// For REG_RIP, pthread_getattr_np and dladdr, which the sampler uses.
+#define _GNU_SOURCE
+#endif
+
 #include "trace.h"
+#include "debug.h"
 #include "heap.h"
 #include "mutex.h"
 #include "fs.h"
+#include "thread.h"
 #include "timer.h"
 #include "atomic.h"
+#include "lz4/lz4.h"
 
+#include <stdarg.h>
 #include <stddef.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
 
+#if defined(_WIN32)
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
+#include <intrin.h>
+#define THREAD_LOCAL __declspec(thread)
+#else
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+#if defined(__linux__)
+#include <dlfcn.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <ucontext.h>
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+#endif
+#define THREAD_LOCAL __thread
+#endif
 
-typedef struct thread_stack_t
+enum
 {
-	struct thread_stack_t* next;
-	struct trace_event_t* durations;
-	int duration_count;
-	int tid;
-} thread_stack_t;
+	// Direct-mapped cache of name pointers to IDs in each thread, so events need no lock.
+	k_name_cache_size = 256,
+	k_initial_name_capacity = 256,
+	// How often the writer thread moves records from the rings to the capture file.
+	k_flush_interval_ms = 10,
+	k_capture_magic = 0x52544147, // "GATR"
+	k_capture_version = 1,
+	// How long the timestamp counter is measured against the OS timer to find its rate.
+	k_calibration_ms = 5,
+	k_crash_path_size = 260,
+	// Durations open at once that trace_scope_times can time, and hardware counters can
+	// count, on each thread.
+	k_scope_stack_size = 32,
+	// Deepest stack a sample keeps, in frames.
+	k_sample_max_frames = 32,
+	// Most records one event takes: a sample with a full stack. The end of a duration with its
+	// hardware counts takes fewer.
+	k_max_event_records = 1 + k_sample_max_frames,
+	k_initial_symbol_capacity = 1024,
+	// Name IDs past this in a capture mark it as invalid, rather than grow the converter's
+	// table without bound.
+	k_max_convert_names = 1 << 24,
+};
+
+// A capture file is this header followed by blocks. Each block is a trace_block_header_t and
+// an LZ4 block that decompresses to a sequence of chunks, each a trace_chunk_header_t
+// followed by its payload, padded to 8 bytes.
+typedef struct trace_file_header_t
+{
+	uint32_t magic;
+	uint32_t version;
+	uint64_t ticks_per_second;
+	int32_t pid;
+	uint32_t reserved;
+} trace_file_header_t;
+
+typedef struct trace_block_header_t
+{
+	uint32_t compressed_size;
+	uint32_t size;
+} trace_block_header_t;
+
+typedef enum trace_chunk_type_t
+{
+	// uint32_t ID, then the name's characters.
+	k_chunk_name,
+	// int32_t thread ID, then the thread's name.
+	k_chunk_thread,
+	// int32_t thread ID, uint32_t count of records lost to the ring wrapping, then records.
+	k_chunk_records,
+	// uint64_t address from a sample's stack, then the name of the function it is in.
+	k_chunk_symbol,
+} trace_chunk_type_t;
 
-typedef struct trace_event_t
+typedef struct trace_chunk_header_t
+{
+	uint32_t type;
+	uint32_t size;
+} trace_chunk_header_t;
+
+// Phases of trace records, as in the Chrome trace format.
+typedef enum trace_phase_t
+{
+	k_phase_begin = 'B',
+	k_phase_end = 'E',
+	k_phase_instant = 'i',
+	k_phase_counter = 'C',
+	k_phase_flow_begin = 's',
+	k_phase_flow_end = 'f',
+	// Second half of a counter or flow: ticks holds the counter's value or the flow's ID, and
+	// name the counter's series. Ends of durations are followed by one for each hardware
+	// counter, holding the count in the duration, named after the counter.
+	k_phase_value = 'V',
+	// A sample of the thread's stack: name holds the count of frames, which follow as values
+	// holding their addresses, innermost first.
+	k_phase_sample = 'P',
+} trace_phase_t;
+
+// One event as it is recorded. Names are interned to IDs so records stay 16 bytes.
+typedef struct trace_record_t
 {
 	uint64_t ticks;
-	const char* name;
-	int pid;
+	uint32_t name;
+	uint32_t phase;
+} trace_record_t;
+
+// A thread's ring of records. Only the owning thread writes to it; the oldest records are
+// overwritten once it wraps.
+typedef struct trace_thread_t
+{
+	struct trace_thread_t* next;
+	trace_record_t* records;
+	// Count of records ever written; published after the records it covers.
+	int64_t head;
+	// The thread is between reading and publishing head, so samples must not write.
+	volatile int writing;
+	// Records before this have been written to the capture file, or were there before it.
+	int64_t flushed;
+	// The thread's name has been written to the capture file.
+	bool announced;
+	const char* cache_names[k_name_cache_size];
+	uint32_t cache_ids[k_name_cache_size];
 	int tid;
-	char ph;
-} trace_event_t;
+	// Which thread owns the ring; see s_trace_serial.
+	int serial;
+	char name[64];
+	// State of trace_scope_times, which only the owning thread calls: where it read up to and
+	// the durations still open there.
+	int64_t scope_read;
+	int scope_depth;
+	uint64_t scope_begin_ticks[k_scope_stack_size];
+	uint32_t scope_begin_name[k_scope_stack_size];
+	// Hardware counters, opened on the thread's first duration once enabled, and their values
+	// where the durations still open began.
+	perf_counters_t* counters;
+	bool counters_opened;
+	int counter_depth;
+	uint64_t counter_begin[k_scope_stack_size][k_perf_counter_count];
+#if defined(__linux__)
+	// The thread's stack, which stack walks stay inside, and the clock of its CPU time, which
+	// the timer that samples it runs on.
+	uintptr_t stack_low;
+	uintptr_t stack_high;
+	clockid_t cpu_clock;
+	timer_t sample_timer;
+	bool sampled;
+#endif
+} trace_thread_t;
+
+// The name of the function at an address in a sample's stack.
+typedef struct trace_symbol_t
+{
+	// 0 in an empty slot.
+	uint64_t address;
+	char* name;
+	// The symbol is in the capture file being written.
+	bool written;
+} trace_symbol_t;
 
 typedef struct trace_t
 {
 	heap_t* heap;
 	fs_t* fs;
-	thread_stack_t* thread_stacks;
-	trace_event_t* trace_logs;
-	mutex_t* add_thread_mutex;
+	// Distinguishes this trace from earlier ones at the same address in threads' cached lookups.
+	int id;
+	trace_thread_t* threads;
+	// Guards the thread list and the name table.
+	mutex_t* mutex;
+	// Interned names by ID; ID 0 is unused. name_table maps name pointers to IDs.
+	const char** names;
+	int name_count;
+	int name_capacity;
+	uint32_t* name_table;
+	int name_table_capacity;
 	const char* path;
+	// Records per thread ring, a power of two.
 	int capacity;
-	int trace_logs_count;
+	// Events are recorded while capturing or running as a flight recorder.
 	bool enabled;
+	bool capturing;
+	bool flight_recorder;
+	// Events are stamped with the timestamp counter rather than the OS timer.
+	bool use_tsc;
+	uint64_t ticks_per_second;
+	// Durations count hardware events, recorded under these names.
+	bool hardware_counters;
+	uint32_t counter_names[k_perf_counter_count];
+	// Samples taken per second of each thread's CPU time, or 0 when not sampling.
+	int sample_hz;
+	// Symbols of the addresses in samples, resolved as samples are written out; a hash table
+	// guarded by the mutex.
+	trace_symbol_t* symbols;
+	int symbol_count;
+	int symbol_capacity;
+	// Capture state, used by the writer thread. Names before names_written are in the file.
+	thread_t* writer;
+	int stop_writer;
+	int names_written;
+	char* block;
+	size_t block_capacity;
+	// Compressed blocks alternate between two buffers, so one is built while the other is written.
+	char* compressed[2];
+	size_t compressed_capacity[2];
+	int compressed_index;
+	fs_work_t* pending_write;
+	// Dump state. One dump is built at a time, and each waits for the write of the one before.
+	mutex_t* dump_mutex;
+	char* dump_block;
+	size_t dump_block_capacity;
+	char* dump_output;
+	size_t dump_output_capacity;
+	fs_work_t* pending_dump;
+	// Crash dumps are built in buffers allocated up front, as a crash handler cannot allocate.
+	// Each thread's records go in a block of their own, so the buffers fit one ring.
+	char crash_path[k_crash_path_size];
+	uint64_t crash_window;
+	char* crash_block;
+	size_t crash_block_capacity;
+	char* crash_output;
+	size_t crash_output_capacity;
 } trace_t;
 
-thread_stack_t* get_thread_stack(trace_t* trace, thread_stack_t* head, int tid)
+// Series name of counters recorded without one.
+static const char k_counter_value[] = "value";
+
+static int s_trace_next_id = 1;
+static THREAD_LOCAL int s_trace_id;
+static THREAD_LOCAL trace_thread_t* s_trace_thread;
+// Numbers threads in the order they first record, never reused, unlike OS thread IDs.
+static int s_trace_next_serial = 1;
+static THREAD_LOCAL int s_trace_serial;
+
+static int get_process_id()
+{
+#if defined(_WIN32)
+	return (int)GetCurrentProcessId();
+#else
+	return (int)getpid();
+#endif
+}
+
+static int get_thread_id()
+{
+#if defined(_WIN32)
+	return (int)GetCurrentThreadId();
+#else
+	return (int)syscall(SYS_gettid);
+#endif
+}
+
+// Whether the timestamp counter runs at a constant rate through frequency changes and sleep
+// states, so it can stand in for the OS timer.
+static bool tsc_is_invariant()
+{
+#if defined(_M_X64) || defined(_M_IX86)
+	int info[4];
+	__cpuid(info, 0x80000000);
+	if ((unsigned)info[0] < 0x80000007)
+	{
+		return false;
+	}
+	__cpuid(info, 0x80000007);
+	return (info[3] & (1 << 8)) != 0;
+#elif defined(__x86_64__) || defined(__i386__)
+	unsigned eax, ebx, ecx, edx;
+	return __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) && (edx & (1 << 8)) != 0;
+#else
+	return false;
+#endif
+}
+
+static uint64_t read_tsc()
+{
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+// Choose the clock events are stamped with and find its rate.
+static void clock_calibrate(trace_t* trace)
 {
-	thread_stack_t* last = NULL;
-	thread_stack_t* this = head;
-	while (this != NULL)
+	trace->use_tsc = tsc_is_invariant();
+	trace->ticks_per_second = timer_get_ticks_per_second();
+	if (!trace->use_tsc)
 	{
-		if (this->tid == tid)
+		return;
+	}
+
+	// Count timestamp counter ticks across a few milliseconds of the OS timer.
+	uint64_t timer_begin = timer_get_ticks();
+	uint64_t tsc_begin = read_tsc();
+	uint64_t timer_end;
+	do
+	{
+		timer_end = timer_get_ticks();
+	} while (timer_end - timer_begin < trace->ticks_per_second * k_calibration_ms / 1000);
+	uint64_t tsc_end = read_tsc();
+	trace->ticks_per_second = (uint64_t)((double)(tsc_end - tsc_begin) * trace->ticks_per_second / (timer_end - timer_begin));
+}
+
+static uint64_t get_ticks(const trace_t* trace)
+{
+	return trace->use_tsc ? read_tsc() : timer_get_ticks();
+}
+
+static uint32_t hash_pointer(const void* pointer)
+{
+	uint64_t value = (uint64_t)(uintptr_t)pointer;
+	return (uint32_t)((value * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+static void name_table_insert(trace_t* trace, uint32_t id)
+{
+	uint32_t mask = trace->name_table_capacity - 1;
+	uint32_t i = hash_pointer(trace->names[id]) & mask;
+	while (trace->name_table[i] != 0)
+	{
+		i = (i + 1) & mask;
+	}
+	trace->name_table[i] = id;
+}
+
+// Find or assign the ID of a name. Called with the mutex held.
+static uint32_t intern_name(trace_t* trace, const char* name)
+{
+	uint32_t mask = trace->name_table_capacity - 1;
+	for (uint32_t i = hash_pointer(name) & mask; trace->name_table[i] != 0; i = (i + 1) & mask)
+	{
+		if (trace->names[trace->name_table[i]] == name)
 		{
-			break;
+			return trace->name_table[i];
 		}
-		last = this;
-		this = this->next;
 	}
 
-	if (this == NULL)
+	if (trace->name_count == trace->name_capacity)
 	{
-		this = heap_alloc(trace->heap, sizeof(thread_stack_t), 8);
-		this->next = NULL;
-		this->durations = heap_alloc(trace->heap, trace->capacity * sizeof(trace_event_t), 8);
-		this->duration_count = 0;
-		this->tid = tid;
+		trace->name_capacity *= 2;
+		const char** names = heap_alloc(trace->heap, trace->name_capacity * sizeof(const char*), 8);
+		memcpy(names, trace->names, trace->name_count * sizeof(const char*));
+		heap_free(trace->heap, trace->names);
+		trace->names = names;
+	}
+	uint32_t id = trace->name_count++;
+	trace->names[id] = name;
 
-		mutex_lock(trace->add_thread_mutex);
-		if (trace->thread_stacks == NULL)
+	if (trace->name_count * 2 > trace->name_table_capacity)
+	{
+		heap_free(trace->heap, trace->name_table);
+		trace->name_table_capacity *= 2;
+		trace->name_table = heap_alloc(trace->heap, trace->name_table_capacity * sizeof(uint32_t), 8);
+		memset(trace->name_table, 0, trace->name_table_capacity * sizeof(uint32_t));
+		for (uint32_t i = 1; i < (uint32_t)trace->name_count; ++i)
 		{
-			trace->thread_stacks = this;
+			name_table_insert(trace, i);
 		}
-		else
+	}
+	else
+	{
+		name_table_insert(trace, id);
+	}
+	return id;
+}
+
+static uint32_t get_name_id(trace_t* trace, trace_thread_t* thread, const char* name)
+{
+	uint32_t slot = hash_pointer(name) & (k_name_cache_size - 1);
+	if (thread->cache_names[slot] != name)
+	{
+		mutex_lock(trace->mutex);
+		thread->cache_ids[slot] = intern_name(trace, name);
+		mutex_unlock(trace->mutex);
+		thread->cache_names[slot] = name;
+	}
+	return thread->cache_ids[slot];
+}
+
+// Find the ID of a static name, interning it on its first use with this trace. Threads racing
+// to intern the same name get the same ID, so whichever key lands last is right.
+static uint32_t get_static_name_id(trace_t* trace, trace_thread_t* thread, trace_name_t* name)
+{
+	int64_t key = atomic_load64_acquire(&name->key);
+	if ((int)(key >> 32) == trace->id)
+	{
+		return (uint32_t)key;
+	}
+	uint32_t id = get_name_id(trace, thread, name->name);
+	atomic_store64_release(&name->key, ((int64_t)trace->id << 32) | id);
+	return id;
+}
+
+#if defined(__linux__)
+
+// Start sampling a thread with a timer on its CPU time clock that signals the thread itself.
+// Called with the mutex held.
+static void sampler_thread_start(trace_t* trace, trace_thread_t* thread)
+{
+	struct sigevent event;
+	memset(&event, 0, sizeof(event));
+	event.sigev_notify = SIGEV_THREAD_ID;
+	event.sigev_signo = SIGPROF;
+	event.sigev_notify_thread_id = thread->tid;
+	if (timer_create(thread->cpu_clock, &event, &thread->sample_timer) != 0)
+	{
+		// The thread has exited.
+		return;
+	}
+	long interval_ns = 1000000000L / trace->sample_hz;
+	struct itimerspec spec;
+	spec.it_interval.tv_sec = interval_ns / 1000000000L;
+	spec.it_interval.tv_nsec = interval_ns % 1000000000L;
+	spec.it_value = spec.it_interval;
+	timer_settime(thread->sample_timer, 0, &spec, NULL);
+	thread->sampled = true;
+}
+
+#endif
+
+// Find the calling thread's ring, registering it on its first event.
+static trace_thread_t* get_thread(trace_t* trace)
+{
+	if (s_trace_id == trace->id)
+	{
+		return s_trace_thread;
+	}
+
+	// Matched by serial rather than OS ID: a new thread that reuses the ID of an exited one must
+	// not inherit its ring, name, counters or sampling timer.
+	if (s_trace_serial == 0)
+	{
+		s_trace_serial = atomic_increment(&s_trace_next_serial);
+	}
+	mutex_lock(trace->mutex);
+	trace_thread_t* thread = trace->threads;
+	while (thread != NULL && thread->serial != s_trace_serial)
+	{
+		thread = thread->next;
+	}
+	if (thread == NULL)
+	{
+		thread = heap_alloc(trace->heap, sizeof(trace_thread_t), 8);
+		memset(thread, 0, sizeof(*thread));
+		thread->records = heap_alloc(trace->heap, trace->capacity * sizeof(trace_record_t), 64);
+		thread->tid = get_thread_id();
+		thread->serial = s_trace_serial;
+		thread_get_current_name(thread->name, sizeof(thread->name));
+#if defined(__linux__)
+		pthread_attr_t attr;
+		if (pthread_getattr_np(pthread_self(), &attr) == 0)
+		{
+			void* stack;
+			size_t stack_size;
+			pthread_attr_getstack(&attr, &stack, &stack_size);
+			thread->stack_low = (uintptr_t)stack;
+			thread->stack_high = (uintptr_t)stack + stack_size;
+			pthread_attr_destroy(&attr);
+		}
+		pthread_getcpuclockid(pthread_self(), &thread->cpu_clock);
+		if (trace->sample_hz > 0)
+		{
+			sampler_thread_start(trace, thread);
+		}
+#endif
+		thread->next = trace->threads;
+		trace->threads = thread;
+	}
+	mutex_unlock(trace->mutex);
+
+	// The sampler's signal handler takes the thread to be this trace's once the ID matches.
+	s_trace_thread = thread;
+	atomic_fence_signal();
+	s_trace_id = trace->id;
+	return thread;
+}
+
+static void write_record(trace_t* trace, trace_thread_t* thread, int64_t index, uint64_t ticks, uint32_t name, trace_phase_t phase)
+{
+	thread->records[index & (trace->capacity - 1)] = (trace_record_t) { ticks, name, phase };
+}
+
+// Start writing records to the calling thread's ring; returns the index of the first.
+// The sampler's signal handler writes to the same ring, so it drops samples taken meanwhile.
+static int64_t records_begin(trace_thread_t* thread)
+{
+	thread->writing = 1;
+	atomic_fence_signal();
+	return thread->head;
+}
+
+// Publish the records written since records_begin, up to head.
+static void records_publish(trace_thread_t* thread, int64_t head)
+{
+	atomic_store64_release(&thread->head, head);
+	atomic_fence_signal();
+	thread->writing = 0;
+}
+
+// Record an event that carries a value in a second record, published with the first.
+static void write_event(trace_t* trace, const char* name, trace_phase_t phase, const char* value_name, uint64_t value)
+{
+	if (trace == NULL || trace->enabled == false)
+	{
+		return;
+	}
+
+	trace_thread_t* thread = get_thread(trace);
+	uint32_t name_id = get_name_id(trace, thread, name);
+	uint32_t value_name_id = value_name ? get_name_id(trace, thread, value_name) : 0;
+	int64_t head = records_begin(thread);
+	write_record(trace, thread, head, get_ticks(trace), name_id, phase);
+	write_record(trace, thread, head + 1, value, value_name_id, k_phase_value);
+	records_publish(thread, head + 2);
+}
+
+// Begin a duration. Counters are read after the begin is stamped and before the end is, so
+// the duration's time takes in reading them but its counts do not.
+static void write_begin(trace_t* trace, trace_thread_t* thread, uint32_t name)
+{
+	int64_t head = records_begin(thread);
+	write_record(trace, thread, head, get_ticks(trace), name, k_phase_begin);
+	records_publish(thread, head + 1);
+
+	if (trace->hardware_counters && thread->counters_opened == false)
+	{
+		thread->counters = perf_counters_create(trace->heap);
+		thread->counters_opened = true;
+	}
+	if (thread->counters != NULL)
+	{
+		if (thread->counter_depth < k_scope_stack_size)
+		{
+			perf_counters_read(thread->counters, thread->counter_begin[thread->counter_depth]);
+		}
+		thread->counter_depth++;
+	}
+}
+
+// End the current duration, with the hardware events counted in it.
+// The viewer pairs ends with begins itself, so an end needs no name.
+static void write_end(trace_t* trace, trace_thread_t* thread)
+{
+	int64_t head = records_begin(thread);
+	int64_t size = 1;
+	if (thread->counters != NULL && thread->counter_depth > 0)
+	{
+		int depth = --thread->counter_depth;
+		if (depth < k_scope_stack_size)
 		{
-			thread_stack_t* itr = trace->thread_stacks;
-			while (itr->next != NULL)
+			uint64_t values[k_perf_counter_count];
+			perf_counters_read(thread->counters, values);
+			for (int i = 0; i < k_perf_counter_count; ++i)
 			{
-				itr = itr->next;
+				write_record(trace, thread, head + size++, values[i] - thread->counter_begin[depth][i], trace->counter_names[i], k_phase_value);
 			}
-			itr->next = this;
 		}
-		mutex_unlock(trace->add_thread_mutex);
 	}
-
-	return this;
+	write_record(trace, thread, head, get_ticks(trace), 0, k_phase_end);
+	records_publish(thread, head + size);
 }
 
 trace_t* trace_create(heap_t* heap, int event_capacity)
 {
 	trace_t* trace = heap_alloc(heap, sizeof(trace_t), 8);
 	trace->heap = heap;
-	trace->fs = fs_create(heap, 1);
-	trace->thread_stacks = NULL;
-	trace->trace_logs = heap_alloc(trace->heap, sizeof(trace_event_t) * event_capacity * 2, 8);
-	trace->add_thread_mutex = mutex_create();
+	// The trace only appends blocks it has already compressed, so one compression thread will do.
+	trace->fs = fs_create_ex(heap, 1, 1);
+	trace->id = atomic_increment(&s_trace_next_id);
+	trace->threads = NULL;
+	trace->mutex = mutex_create_named("trace");
+	trace->name_capacity = k_initial_name_capacity;
+	trace->names = heap_alloc(heap, trace->name_capacity * sizeof(const char*), 8);
+	trace->names[0] = NULL;
+	trace->name_count = 1;
+	trace->name_table_capacity = k_initial_name_capacity * 2;
+	trace->name_table = heap_alloc(heap, trace->name_table_capacity * sizeof(uint32_t), 8);
+	memset(trace->name_table, 0, trace->name_table_capacity * sizeof(uint32_t));
 	trace->path = NULL;
-	trace->capacity = event_capacity;
-	trace->trace_logs_count = 0;
+	trace->capacity = 1;
+	while (trace->capacity < event_capacity)
+	{
+		trace->capacity *= 2;
+	}
 	trace->enabled = false;
+	trace->capturing = false;
+	trace->flight_recorder = false;
+	clock_calibrate(trace);
+	trace->hardware_counters = false;
+	trace->sample_hz = 0;
+	trace->symbols = NULL;
+	trace->symbol_count = 0;
+	trace->symbol_capacity = 0;
+	trace->writer = NULL;
+	trace->stop_writer = 0;
+	trace->names_written = 1;
+	trace->block = NULL;
+	trace->block_capacity = 0;
+	trace->compressed[0] = trace->compressed[1] = NULL;
+	trace->compressed_capacity[0] = trace->compressed_capacity[1] = 0;
+	trace->compressed_index = 0;
+	trace->pending_write = NULL;
+	trace->dump_mutex = mutex_create_named("trace dump");
+	trace->dump_block = NULL;
+	trace->dump_block_capacity = 0;
+	trace->dump_output = NULL;
+	trace->dump_output_capacity = 0;
+	trace->pending_dump = NULL;
+	trace->crash_path[0] = 0;
+	trace->crash_window = 0;
+	trace->crash_block = NULL;
+	trace->crash_block_capacity = 0;
+	trace->crash_output = NULL;
+	trace->crash_output_capacity = 0;
 	return trace;
 }
 
 void trace_destroy(trace_t* trace)
 {
+	if (trace->crash_block != NULL)
+	{
+		debug_set_crash_callback(NULL, NULL);
+	}
+	trace_sampler_stop(trace);
+	trace_capture_stop(trace);
+	if (trace->pending_dump != NULL && fs_work_get_result(trace->pending_dump) != 0)
+	{
+		debug_print(k_print_error, "Unable to write trace dump\n");
+	}
+	fs_work_destroy(trace->pending_dump);
 	fs_destroy(trace->fs);
-	thread_stack_t* this = trace->thread_stacks;
-	while (this != NULL)
+	trace_thread_t* thread = trace->threads;
+	while (thread != NULL)
+	{
+		trace_thread_t* next = thread->next;
+		perf_counters_destroy(thread->counters);
+		heap_free(trace->heap, thread->records);
+		heap_free(trace->heap, thread);
+		thread = next;
+	}
+	mutex_destroy(trace->mutex);
+	mutex_destroy(trace->dump_mutex);
+	heap_free(trace->heap, trace->crash_output);
+	heap_free(trace->heap, trace->crash_block);
+	heap_free(trace->heap, trace->dump_output);
+	heap_free(trace->heap, trace->dump_block);
+	for (int i = 0; i < trace->symbol_capacity; ++i)
 	{
-		thread_stack_t* next = this->next;
-		heap_free(trace->heap, this->durations);
-		heap_free(trace->heap, this);
-		this = next;
+		if (trace->symbols[i].address != 0)
+		{
+			heap_free(trace->heap, trace->symbols[i].name);
+		}
 	}
-	mutex_destroy(trace->add_thread_mutex);
-	heap_free(trace->heap, trace->trace_logs);
+	heap_free(trace->heap, trace->symbols);
+	heap_free(trace->heap, trace->name_table);
+	heap_free(trace->heap, trace->names);
+	heap_free(trace->heap, trace->compressed[1]);
+	heap_free(trace->heap, trace->compressed[0]);
+	heap_free(trace->heap, trace->block);
 	heap_free(trace->heap, trace);
 }
 
 void trace_duration_push(trace_t* trace, const char* name)
 {
-	if (trace->enabled == false)
+	if (trace == NULL || trace->enabled == false)
 	{
 		return;
 	}
 
-	thread_stack_t* thread_stack = get_thread_stack(trace, trace->thread_stacks, GetCurrentThreadId());
+	trace_thread_t* thread = get_thread(trace);
+	write_begin(trace, thread, get_name_id(trace, thread, name));
+}
 
-	if (thread_stack->duration_count == trace->capacity)
+void trace_duration_pop(trace_t* trace)
+{
+	if (trace == NULL || trace->enabled == false)
 	{
 		return;
 	}
 
-	int dur_index = thread_stack->duration_count++;
-	trace_event_t* duration = (thread_stack->durations + dur_index * sizeof(trace_event_t*));
-	duration->name = name;
-	duration->ph = 'B';
-	duration->pid = GetCurrentProcessId();
-	duration->tid = GetCurrentThreadId();
-	duration->ticks = timer_get_ticks();
+	trace_thread_t* thread = get_thread(trace);
+	write_end(trace, thread);
+}
+
+void trace_counter(trace_t* trace, const char* name, int64_t value)
+{
+	trace_counter_series(trace, name, k_counter_value, value);
+}
+
+void trace_counter_series(trace_t* trace, const char* name, const char* series, int64_t value)
+{
+	write_event(trace, name, k_phase_counter, series, (uint64_t)value);
+}
 
-	int index = atomic_increment(&trace->trace_logs_count);
-	if (index < trace->capacity)
+void trace_instant(trace_t* trace, const char* name)
+{
+	if (trace == NULL || trace->enabled == false)
 	{
-		trace_event_t* trace_event_begin = (trace->trace_logs + index * sizeof(trace_event_t*));
-		trace_event_begin->name = name;
-		trace_event_begin->ph = 'B';
-		trace_event_begin->pid = GetCurrentProcessId();
-		trace_event_begin->tid = GetCurrentThreadId();
-		trace_event_begin->ticks = duration->ticks;
+		return;
 	}
+
+	trace_thread_t* thread = get_thread(trace);
+	uint32_t name_id = get_name_id(trace, thread, name);
+	int64_t head = records_begin(thread);
+	write_record(trace, thread, head, get_ticks(trace), name_id, k_phase_instant);
+	records_publish(thread, head + 1);
 }
 
-void trace_duration_pop(trace_t* trace)
+void trace_flow_begin(trace_t* trace, const char* name, uint64_t id)
+{
+	write_event(trace, name, k_phase_flow_begin, NULL, id);
+}
+
+void trace_flow_end(trace_t* trace, const char* name, uint64_t id)
+{
+	write_event(trace, name, k_phase_flow_end, NULL, id);
+}
+
+void trace_duration_push_static(trace_t* trace, trace_name_t* name)
 {
-	if (trace->enabled == false)
+	if (trace == NULL || trace->enabled == false)
 	{
 		return;
 	}
 
-	thread_stack_t* thread_stack = get_thread_stack(trace, trace->thread_stacks, GetCurrentThreadId());
-
-	int dur_index = --thread_stack->duration_count;
-	trace_event_t* trace_event_begin = (thread_stack->durations + dur_index * sizeof(trace_event_t*));
+	trace_thread_t* thread = get_thread(trace);
+	write_begin(trace, thread, get_static_name_id(trace, thread, name));
+}
 
-	int index = atomic_increment(&trace->trace_logs_count);
-	if (index < trace->capacity)
+void trace_instant_static(trace_t* trace, trace_name_t* name)
+{
+	if (trace == NULL || trace->enabled == false)
 	{
-		trace_event_t* trace_event_end = (trace->trace_logs + index * sizeof(trace_event_t*));
-		trace_event_end->name = trace_event_begin->name;
-		trace_event_end->ph = 'E';
-		trace_event_end->pid = trace_event_begin->pid;
-		trace_event_end->tid = trace_event_begin->tid;
-		trace_event_end->ticks = timer_get_ticks();
+		return;
 	}
+
+	trace_thread_t* thread = get_thread(trace);
+	uint32_t name_id = get_static_name_id(trace, thread, name);
+	int64_t head = records_begin(thread);
+	write_record(trace, thread, head, get_ticks(trace), name_id, k_phase_instant);
+	records_publish(thread, head + 1);
 }
 
-void trace_capture_start(trace_t* trace, const char* path)
+void trace_counter_static(trace_t* trace, trace_name_t* name, int64_t value)
 {
-	if (trace->enabled == true)
+	if (trace == NULL || trace->enabled == false)
 	{
 		return;
 	}
 
-	trace->enabled = true;
-	trace->path = path;
+	trace_thread_t* thread = get_thread(trace);
+	uint32_t name_id = get_static_name_id(trace, thread, name);
+	uint32_t value_name_id = get_name_id(trace, thread, k_counter_value);
+	int64_t head = records_begin(thread);
+	write_record(trace, thread, head, get_ticks(trace), name_id, k_phase_counter);
+	write_record(trace, thread, head + 1, (uint64_t)value, value_name_id, k_phase_value);
+	records_publish(thread, head + 2);
 }
 
-int format_output(trace_t* trace, char* dest, int size)
+bool trace_enable_hardware_counters(trace_t* trace)
 {
-	int len = snprintf(dest, size, "{\n\t\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
-	int num_logs = trace->trace_logs_count < trace->capacity * 2 ? trace->trace_logs_count : trace->capacity * 2;
-	for (int i = 0; i < num_logs; i++)
+	perf_counters_t* counters = perf_counters_create(trace->heap);
+	if (counters == NULL)
+	{
+		return false;
+	}
+
+	trace_thread_t* thread = get_thread(trace);
+	if (thread->counters_opened == false)
+	{
+		thread->counters = counters;
+		thread->counters_opened = true;
+	}
+	else
+	{
+		perf_counters_destroy(counters);
+	}
+	mutex_lock(trace->mutex);
+	for (int i = 0; i < k_perf_counter_count; ++i)
 	{
-		trace_event_t* trace_event = (trace->trace_logs + i * sizeof(trace_event_t*));
-		char* concat_dest = dest != NULL ? dest + len : dest;
-		int remaining_size = size > 0 ? size - len : size;
-		len += snprintf(concat_dest, remaining_size,
-			"\t\t{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":%d,\"tid\":\"%d\",\"ts\":\"%jd\"}%s",
-			trace_event->name, trace_event->ph, trace_event->pid, trace_event->tid, timer_ticks_to_us(trace_event->ticks),
-			i < trace->trace_logs_count - 1 ? ",\n" : "\n\t]\n}");
+		trace->counter_names[i] = intern_name(trace, perf_counter_get_name(i));
 	}
-	return len;
+	mutex_unlock(trace->mutex);
+	trace->hardware_counters = true;
+	return true;
 }
 
-void trace_capture_stop(trace_t* trace)
+int trace_scope_times(trace_t* trace, trace_scope_time_t* times, int capacity)
+{
+	if (trace == NULL || trace->enabled == false)
+	{
+		return 0;
+	}
+
+	// Only this thread writes its ring, so it can be read without checks for overwrites.
+	trace_thread_t* thread = get_thread(trace);
+	int64_t head = thread->head;
+	if (thread->scope_read < head - trace->capacity)
+	{
+		// Records were overwritten before being read; durations open in them are lost.
+		thread->scope_read = head - trace->capacity;
+		thread->scope_depth = 0;
+	}
+
+	int count = 0;
+	// Index in times of the last duration ended, whose hardware counts follow its end.
+	int ended = -1;
+	for (int64_t i = thread->scope_read; i < head; ++i)
+	{
+		const trace_record_t* record = &thread->records[i & (trace->capacity - 1)];
+		if (record->phase == k_phase_value && ended >= 0)
+		{
+			for (int c = 0; c < k_perf_counter_count; ++c)
+			{
+				if (record->name == trace->counter_names[c])
+				{
+					times[ended].counters[c] += record->ticks;
+				}
+			}
+			continue;
+		}
+		ended = -1;
+		if (record->phase == k_phase_begin)
+		{
+			if (thread->scope_depth < k_scope_stack_size)
+			{
+				thread->scope_begin_ticks[thread->scope_depth] = record->ticks;
+				thread->scope_begin_name[thread->scope_depth] = record->name;
+			}
+			thread->scope_depth++;
+		}
+		else if (record->phase == k_phase_end && thread->scope_depth > 0)
+		{
+			int depth = --thread->scope_depth;
+			if (depth >= k_scope_stack_size)
+			{
+				continue;
+			}
+			uint32_t name = thread->scope_begin_name[depth];
+			uint64_t ticks = record->ticks - thread->scope_begin_ticks[depth];
+			int t = 0;
+			while (t < count && times[t].name != name)
+			{
+				t++;
+			}
+			if (t == count)
+			{
+				if (count == capacity)
+				{
+					continue;
+				}
+				times[count++] = (trace_scope_time_t) { .name = name };
+			}
+			times[t].count++;
+			times[t].us += ticks * 1000000.0 / trace->ticks_per_second;
+			ended = t;
+		}
+	}
+	thread->scope_read = head;
+	return count;
+}
+
+const char* trace_get_name(trace_t* trace, uint32_t id)
+{
+	mutex_lock(trace->mutex);
+	const char* name = id < (uint32_t)trace->name_count ? trace->names[id] : NULL;
+	mutex_unlock(trace->mutex);
+	return name;
+}
+
+#if defined(__linux__)
+
+// The trace being sampled, and the count of signal handlers running, which stopping the
+// sampler waits out before the trace can go away.
+static trace_t* s_sampler_trace;
+static int s_sampler_active;
+
+// Walk the interrupted code's stack by its frame pointers, innermost frame first. Frames must
+// stay inside the thread's stack and move up it, so code built without frame pointers ends
+// the walk early rather than faulting.
+static int sampler_walk_stack(const trace_thread_t* thread, const ucontext_t* context, uint64_t* frames)
+{
+	uintptr_t pc = 0;
+	uintptr_t fp = 0;
+#if defined(__x86_64__)
+	pc = (uintptr_t)context->uc_mcontext.gregs[REG_RIP];
+	fp = (uintptr_t)context->uc_mcontext.gregs[REG_RBP];
+#elif defined(__aarch64__)
+	pc = (uintptr_t)context->uc_mcontext.pc;
+	fp = (uintptr_t)context->uc_mcontext.regs[29];
+#endif
+	if (pc == 0)
+	{
+		return 0;
+	}
+
+	int count = 0;
+	frames[count++] = pc;
+	while (count < k_sample_max_frames && fp >= thread->stack_low && fp + 2 * sizeof(uintptr_t) <= thread->stack_high &&
+		fp % sizeof(uintptr_t) == 0)
+	{
+		const uintptr_t* frame = (const uintptr_t*)fp;
+		if (frame[1] == 0)
+		{
+			break;
+		}
+		// Return addresses point past the call; step back into it so it resolves to the caller.
+		frames[count++] = frame[1] - 1;
+		if (frame[0] <= fp)
+		{
+			break;
+		}
+		fp = frame[0];
+	}
+	return count;
+}
+
+// SIGPROF handler. Runs on the sampled thread, between any two of its instructions, so it
+// takes no lock and allocates nothing; it writes the sample to the thread's ring like any
+// other event, unless it interrupted the thread writing one.
+static void sampler_signal(int signal_number, siginfo_t* info, void* context)
+{
+	(void)signal_number;
+	(void)info;
+	atomic_increment(&s_sampler_active);
+	trace_t* trace = s_sampler_trace;
+	trace_thread_t* thread = s_trace_thread;
+	if (trace != NULL && trace->enabled && s_trace_id == trace->id && thread->writing == 0)
+	{
+		uint64_t frames[k_sample_max_frames];
+		int count = sampler_walk_stack(thread, context, frames);
+		int64_t head = thread->head;
+		write_record(trace, thread, head, get_ticks(trace), (uint32_t)count, k_phase_sample);
+		for (int i = 0; i < count; ++i)
+		{
+			write_record(trace, thread, head + 1 + i, frames[i], 0, k_phase_value);
+		}
+		atomic_store64_release(&thread->head, head + 1 + count);
+	}
+	atomic_decrement(&s_sampler_active);
+}
+
+bool trace_sampler_start(trace_t* trace, int hz)
+{
+	if (hz <= 0 || s_sampler_trace != NULL)
+	{
+		return false;
+	}
+
+	static bool s_handler_installed;
+	if (!s_handler_installed)
+	{
+		// The handler stays installed, as a signal may still be on its way after the sampler stops.
+		struct sigaction action;
+		memset(&action, 0, sizeof(action));
+		action.sa_sigaction = sampler_signal;
+		action.sa_flags = SA_SIGINFO | SA_RESTART;
+		sigemptyset(&action.sa_mask);
+		if (sigaction(SIGPROF, &action, NULL) != 0)
+		{
+			return false;
+		}
+		s_handler_installed = true;
+	}
+
+	s_sampler_trace = trace;
+	mutex_lock(trace->mutex);
+	trace->sample_hz = hz;
+	for (trace_thread_t* thread = trace->threads; thread != NULL; thread = thread->next)
+	{
+		sampler_thread_start(trace, thread);
+	}
+	mutex_unlock(trace->mutex);
+	return true;
+}
+
+void trace_sampler_stop(trace_t* trace)
 {
-	if (trace->enabled == false)
+	if (s_sampler_trace != trace)
 	{
 		return;
 	}
 
-	trace->enabled = false;
+	mutex_lock(trace->mutex);
+	trace->sample_hz = 0;
+	for (trace_thread_t* thread = trace->threads; thread != NULL; thread = thread->next)
+	{
+		if (thread->sampled)
+		{
+			timer_delete(thread->sample_timer);
+			thread->sampled = false;
+		}
+	}
+	mutex_unlock(trace->mutex);
+
+	s_sampler_trace = NULL;
+	atomic_fence_seq_cst();
+	while (atomic_load(&s_sampler_active) != 0)
+	{
+		cpu_pause();
+	}
+}
+
+// The name of the function at an address, or of its module and offset where the function has
+// no dynamic symbol, as static functions and executables linked without -rdynamic do not.
+static void symbol_resolve(uint64_t address, char* name, size_t size)
+{
+	Dl_info info;
+	if (dladdr((void*)(uintptr_t)address, &info) != 0)
+	{
+		if (info.dli_sname != NULL)
+		{
+			snprintf(name, size, "%s", info.dli_sname);
+			return;
+		}
+		if (info.dli_fname != NULL)
+		{
+			const char* file = strrchr(info.dli_fname, '/');
+			snprintf(name, size, "%s+0x%llx", file ? file + 1 : info.dli_fname, (unsigned long long)(address - (uintptr_t)info.dli_fbase));
+			return;
+		}
+	}
+	snprintf(name, size, "0x%llx", (unsigned long long)address);
+}
 
-	int alloc_size = 1 + format_output(trace, NULL, 0); // extra space for null terminating byte
+#else
 
-	char* buffer = heap_alloc(trace->heap, alloc_size, 8);
-	int len = format_output(trace, buffer, alloc_size);
+bool trace_sampler_start(trace_t* trace, int hz)
+{
+	return false;
+}
+
+void trace_sampler_stop(trace_t* trace)
+{
+}
+
+static void symbol_resolve(uint64_t address, char* name, size_t size)
+{
+	snprintf(name, size, "0x%llx", (unsigned long long)address);
+}
+
+#endif
+
+// Make room for size bytes in a buffer, keeping its contents.
+static void buffer_reserve(heap_t* heap, char** buffer, size_t* capacity, size_t used, size_t size)
+{
+	if (used + size <= *capacity)
+	{
+		return;
+	}
+	size_t new_capacity = *capacity ? *capacity : 64 * 1024;
+	while (new_capacity < used + size)
+	{
+		new_capacity *= 2;
+	}
+	char* new_buffer = heap_alloc(heap, new_capacity, 8);
+	if (used)
+	{
+		memcpy(new_buffer, *buffer, used);
+	}
+	heap_free(heap, *buffer);
+	*buffer = new_buffer;
+	*capacity = new_capacity;
+}
+
+static size_t chunk_size(size_t payload_size)
+{
+	return sizeof(trace_chunk_header_t) + ((payload_size + 7) & ~(size_t)7);
+}
+
+// Append a chunk to a block. Callers reserve chunk_size() for it first.
+static char* chunk_begin(char* block, size_t* used, trace_chunk_type_t type, size_t payload_size)
+{
+	trace_chunk_header_t* header = (trace_chunk_header_t*)(block + *used);
+	header->type = type;
+	header->size = (uint32_t)payload_size;
+	char* payload = (char*)(header + 1);
+	memset(payload, 0, chunk_size(payload_size) - sizeof(trace_chunk_header_t));
+	*used += chunk_size(payload_size);
+	return payload;
+}
+
+// Copy a thread's records from begin up to head, then drop those the thread could have
+// overwritten while they were copied. Returns the index of the first record kept, which is
+// moved to the start of records.
+static int64_t copy_records(trace_t* trace, trace_thread_t* thread, int64_t begin, int64_t head, trace_record_t* records)
+{
+	for (int64_t i = begin; i < head; ++i)
+	{
+		records[i - begin] = thread->records[i & (trace->capacity - 1)];
+	}
+
+	// A writer may be filling up to one event's records past the head it last published.
+	atomic_fence_acquire();
+	int64_t oldest = atomic_load64_relaxed(&thread->head) + k_max_event_records - trace->capacity;
+	int64_t first = oldest > begin ? oldest : begin;
+	first = first < head ? first : head;
+	memmove(records, records + (first - begin), (size_t)(head - first) * sizeof(trace_record_t));
+	return first;
+}
+
+// Fill in a records chunk reserved for reserved records and shrink it to the count kept.
+static void records_chunk_finish(size_t* used, char* payload, int32_t tid, uint32_t lost, int64_t reserved, int64_t count)
+{
+	memcpy(payload, &tid, sizeof(tid));
+	memcpy(payload + 4, &lost, sizeof(lost));
+	size_t payload_size = 8 + (size_t)count * sizeof(trace_record_t);
+	*used -= chunk_size(8 + (size_t)reserved * sizeof(trace_record_t)) - chunk_size(payload_size);
+	((trace_chunk_header_t*)payload - 1)->size = (uint32_t)payload_size;
+}
+
+// Copy the records a thread wrote since the last flush into a chunk.
+// The thread may still be writing, so records it could have overwritten meanwhile count as lost.
+static void flush_thread(trace_t* trace, trace_thread_t* thread, size_t* used)
+{
+	int64_t head = atomic_load64_acquire(&thread->head);
+	int64_t begin = head - trace->capacity > thread->flushed ? head - trace->capacity : thread->flushed;
+	char* payload = chunk_begin(trace->block, used, k_chunk_records, 8 + (size_t)(head - begin) * sizeof(trace_record_t));
+	int64_t first = copy_records(trace, thread, begin, head, (trace_record_t*)(payload + 8));
+	records_chunk_finish(used, payload, thread->tid, (uint32_t)(first - thread->flushed), head - begin, head - first);
+	thread->flushed = head;
+}
+
+// Compress a block of chunks into output as a block header and LZ4 data.
+// Returns the size of both together.
+static size_t block_compress(const char* block, size_t size, char* output, size_t output_capacity)
+{
+	trace_block_header_t* header = (trace_block_header_t*)output;
+	header->size = (uint32_t)size;
+	header->compressed_size = LZ4_compress_default(block, (char*)(header + 1), (int)size, (int)(output_capacity - sizeof(*header)));
+	return sizeof(*header) + header->compressed_size;
+}
+
+static size_t block_bound(size_t size)
+{
+	return sizeof(trace_block_header_t) + LZ4_compressBound((int)size);
+}
+
+static uint32_t hash_address(uint64_t address)
+{
+	return (uint32_t)((address * 0x9e3779b97f4a7c15ull) >> 32);
+}
+
+// Find the symbol of an address, resolving it on first sight. Called with the mutex held.
+static trace_symbol_t* symbol_get(trace_t* trace, uint64_t address)
+{
+	if ((trace->symbol_count + 1) * 2 > trace->symbol_capacity)
+	{
+		trace_symbol_t* old_symbols = trace->symbols;
+		int old_capacity = trace->symbol_capacity;
+		trace->symbol_capacity = old_capacity ? old_capacity * 2 : k_initial_symbol_capacity;
+		trace->symbols = heap_alloc(trace->heap, trace->symbol_capacity * sizeof(trace_symbol_t), 8);
+		memset(trace->symbols, 0, trace->symbol_capacity * sizeof(trace_symbol_t));
+		uint32_t mask = trace->symbol_capacity - 1;
+		for (int i = 0; i < old_capacity; ++i)
+		{
+			if (old_symbols[i].address != 0)
+			{
+				uint32_t slot = hash_address(old_symbols[i].address) & mask;
+				while (trace->symbols[slot].address != 0)
+				{
+					slot = (slot + 1) & mask;
+				}
+				trace->symbols[slot] = old_symbols[i];
+			}
+		}
+		heap_free(trace->heap, old_symbols);
+	}
+
+	uint32_t mask = trace->symbol_capacity - 1;
+	uint32_t slot = hash_address(address) & mask;
+	while (trace->symbols[slot].address != 0 && trace->symbols[slot].address != address)
+	{
+		slot = (slot + 1) & mask;
+	}
+	trace_symbol_t* symbol = &trace->symbols[slot];
+	if (symbol->address == 0)
+	{
+		char name[256];
+		symbol_resolve(address, name, sizeof(name));
+		symbol->address = address;
+		symbol->name = heap_alloc(trace->heap, strlen(name) + 1, 8);
+		strcpy(symbol->name, name);
+		symbol->written = false;
+		trace->symbol_count++;
+	}
+	return symbol;
+}
+
+// Resolve the addresses in the samples of the records chunks in a block. Called with the mutex held.
+static void symbols_resolve(trace_t* trace, const char* block, size_t used)
+{
+	for (size_t offset = 0; offset < used; )
+	{
+		const trace_chunk_header_t* header = (const trace_chunk_header_t*)(block + offset);
+		offset += chunk_size(header->size);
+		if (header->type != k_chunk_records)
+		{
+			continue;
+		}
+		const trace_record_t* records = (const trace_record_t*)((const char*)(header + 1) + 8);
+		int64_t count = (header->size - 8) / sizeof(trace_record_t);
+		for (int64_t i = 0; i < count; ++i)
+		{
+			if (records[i].phase != k_phase_sample)
+			{
+				continue;
+			}
+			for (int64_t frame = i + 1; frame < count && frame <= i + records[i].name && records[frame].phase == k_phase_value; ++frame)
+			{
+				symbol_get(trace, records[frame].ticks);
+			}
+		}
+	}
+}
+
+// Append the symbols not yet in the capture file to a block, or all of them for a dump.
+// Called with the mutex held.
+static void symbols_write(trace_t* trace, char** block, size_t* block_capacity, size_t* used, bool all)
+{
+	size_t needed = 0;
+	for (int i = 0; i < trace->symbol_capacity; ++i)
+	{
+		trace_symbol_t* symbol = &trace->symbols[i];
+		if (symbol->address != 0 && (all || !symbol->written))
+		{
+			needed += chunk_size(8 + strlen(symbol->name));
+		}
+	}
+	if (needed == 0)
+	{
+		return;
+	}
+	buffer_reserve(trace->heap, block, block_capacity, *used, needed);
+
+	for (int i = 0; i < trace->symbol_capacity; ++i)
+	{
+		trace_symbol_t* symbol = &trace->symbols[i];
+		if (symbol->address != 0 && (all || !symbol->written))
+		{
+			size_t length = strlen(symbol->name);
+			char* payload = chunk_begin(*block, used, k_chunk_symbol, 8 + length);
+			memcpy(payload, &symbol->address, sizeof(symbol->address));
+			memcpy(payload + 8, symbol->name, length);
+			symbol->written |= !all;
+		}
+	}
+}
+
+// Move everything recorded since the last flush into a compressed block and queue its append.
+static void flush(trace_t* trace)
+{
+	mutex_lock(trace->mutex);
+	size_t needed = 0;
+	for (int i = trace->names_written; i < trace->name_count; ++i)
+	{
+		needed += chunk_size(4 + strlen(trace->names[i]));
+	}
+	for (trace_thread_t* thread = trace->threads; thread != NULL; thread = thread->next)
+	{
+		needed += chunk_size(4 + strlen(thread->name)) + chunk_size(8 + (size_t)trace->capacity * sizeof(trace_record_t));
+	}
+	buffer_reserve(trace->heap, &trace->block, &trace->block_capacity, 0, needed);
+
+	// Records are only published once their names are interned, and interning takes the
+	// mutex, so every record copied here refers to a name written with it or before.
+	size_t used = 0;
+	for (; trace->names_written < trace->name_count; ++trace->names_written)
+	{
+		const char* name = trace->names[trace->names_written];
+		uint32_t id = trace->names_written;
+		char* payload = chunk_begin(trace->block, &used, k_chunk_name, 4 + strlen(name));
+		memcpy(payload, &id, sizeof(id));
+		memcpy(payload + 4, name, strlen(name));
+	}
+	for (trace_thread_t* thread = trace->threads; thread != NULL; thread = thread->next)
+	{
+		if (!thread->announced)
+		{
+			int32_t tid = thread->tid;
+			char* payload = chunk_begin(trace->block, &used, k_chunk_thread, 4 + strlen(thread->name));
+			memcpy(payload, &tid, sizeof(tid));
+			memcpy(payload + 4, thread->name, strlen(thread->name));
+			thread->announced = true;
+		}
+		if (atomic_load64_acquire(&thread->head) != thread->flushed)
+		{
+			flush_thread(trace, thread, &used);
+		}
+	}
+	// Samples are converted once the whole capture is read, so their symbols can follow them.
+	symbols_resolve(trace, trace->block, used);
+	symbols_write(trace, &trace->block, &trace->block_capacity, &used, false);
+	mutex_unlock(trace->mutex);
+
+	if (used == 0)
+	{
+		return;
+	}
+
+	int index = trace->compressed_index;
+	buffer_reserve(trace->heap, &trace->compressed[index], &trace->compressed_capacity[index], 0, block_bound(used));
+	size_t size = block_compress(trace->block, used, trace->compressed[index], trace->compressed_capacity[index]);
+
+	// Appends must land in order, so each waits for the one before.
+	fs_work_destroy(trace->pending_write);
+	trace->pending_write = fs_append(trace->fs, trace->path, trace->compressed[index], size);
+	trace->compressed_index = index ^ 1;
+}
+
+static int writer_thread_func(void* user)
+{
+	trace_t* trace = user;
+	while (atomic_load(&trace->stop_writer) == 0)
+	{
+		thread_sleep(k_flush_interval_ms);
+		flush(trace);
+	}
+	flush(trace);
+
+	if (fs_work_get_result(trace->pending_write) != 0)
+	{
+		debug_print(k_print_error, "Unable to write trace capture %s\n", trace->path);
+	}
+	fs_work_destroy(trace->pending_write);
+	trace->pending_write = NULL;
+	return 0;
+}
+
+static trace_file_header_t file_header(trace_t* trace)
+{
+	trace_file_header_t header = { 0 };
+	header.magic = k_capture_magic;
+	header.version = k_capture_version;
+	header.ticks_per_second = trace->ticks_per_second;
+	header.pid = get_process_id();
+	return header;
+}
+
+void trace_capture_start(trace_t* trace, const char* path)
+{
+	if (trace->capturing == true)
+	{
+		return;
+	}
+
+	// Events recorded before the capture are left out of it.
+	mutex_lock(trace->mutex);
+	for (trace_thread_t* thread = trace->threads; thread != NULL; thread = thread->next)
+	{
+		thread->flushed = atomic_load64_acquire(&thread->head);
+		thread->announced = false;
+	}
+	trace->names_written = 1;
+	for (int i = 0; i < trace->symbol_capacity; ++i)
+	{
+		trace->symbols[i].written = false;
+	}
+	mutex_unlock(trace->mutex);
+
+	trace_file_header_t header = file_header(trace);
+	fs_work_t* header_work = fs_write(trace->fs, path, &header, sizeof(header), false);
+	int result = fs_work_get_result(header_work);
+	fs_work_destroy(header_work);
+	if (result != 0)
+	{
+		debug_print(k_print_error, "Unable to write trace capture %s\n", path);
+		return;
+	}
+
+	trace->path = path;
+	trace->stop_writer = 0;
+	trace->capturing = true;
+	trace->enabled = true;
+	thread_desc_t desc = thread_desc_for_role(k_thread_role_io, "trace writer");
+	trace->writer = thread_create_ex(writer_thread_func, trace, &desc);
+}
+
+void trace_capture_stop(trace_t* trace)
+{
+	if (trace->capturing == false)
+	{
+		return;
+	}
+
+	// The writer flushes what is left, at most one interval's worth, and exits.
+	trace->capturing = false;
+	trace->enabled = trace->flight_recorder;
+	atomic_store(&trace->stop_writer, 1);
+	thread_destroy(trace->writer);
+	trace->writer = NULL;
+}
+
+void trace_flight_recorder_start(trace_t* trace)
+{
+	trace->flight_recorder = true;
+	trace->enabled = true;
+}
+
+void trace_flight_recorder_stop(trace_t* trace)
+{
+	trace->flight_recorder = false;
+	trace->enabled = trace->capturing;
+}
+
+// Append a thread's name and the records it wrote from cutoff on to a block.
+static void dump_thread(trace_t* trace, trace_thread_t* thread, char* block, size_t* used, uint64_t cutoff)
+{
+	int32_t tid = thread->tid;
+	size_t name_length = strlen(thread->name);
+	char* payload = chunk_begin(block, used, k_chunk_thread, 4 + name_length);
+	memcpy(payload, &tid, sizeof(tid));
+	memcpy(payload + 4, thread->name, name_length);
+
+	int64_t head = atomic_load64_acquire(&thread->head);
+	int64_t begin = head > trace->capacity ? head - trace->capacity : 0;
+	payload = chunk_begin(block, used, k_chunk_records, 8 + (size_t)(head - begin) * sizeof(trace_record_t));
+	trace_record_t* records = (trace_record_t*)(payload + 8);
+	int64_t count = head - copy_records(trace, thread, begin, head, records);
+
+	// A thread's records are in time order. Values carry no time, so they go with the record
+	// before them.
+	int64_t skip = 0;
+	while (skip < count && (records[skip].phase == k_phase_value || records[skip].ticks < cutoff))
+	{
+		skip++;
+	}
+	memmove(records, records + skip, (size_t)(count - skip) * sizeof(trace_record_t));
+	records_chunk_finish(used, payload, tid, 0, head - begin, count - skip);
+}
+
+static void dump_name(trace_t* trace, uint32_t id, char* block, size_t* used)
+{
+	const char* name = trace->names[id];
+	char* payload = chunk_begin(block, used, k_chunk_name, 4 + strlen(name));
+	memcpy(payload, &id, sizeof(id));
+	memcpy(payload + 4, name, strlen(name));
+}
+
+static uint64_t dump_cutoff(trace_t* trace, uint64_t window)
+{
+	uint64_t now = get_ticks(trace);
+	return now > window ? now - window : 0;
+}
+
+void trace_dump(trace_t* trace, const char* path, int seconds)
+{
+	mutex_lock(trace->dump_mutex);
+
+	// The output buffer is reused, so the previous dump must be written first.
+	if (trace->pending_dump != NULL && fs_work_get_result(trace->pending_dump) != 0)
+	{
+		debug_print(k_print_error, "Unable to write trace dump\n");
+	}
+	fs_work_destroy(trace->pending_dump);
+	trace->pending_dump = NULL;
+
+	uint64_t cutoff = dump_cutoff(trace, trace->ticks_per_second * seconds);
+	mutex_lock(trace->mutex);
+	size_t needed = 0;
+	for (int i = 1; i < trace->name_count; ++i)
+	{
+		needed += chunk_size(4 + strlen(trace->names[i]));
+	}
+	for (trace_thread_t* thread = trace->threads; thread != NULL; thread = thread->next)
+	{
+		needed += chunk_size(4 + strlen(thread->name)) + chunk_size(8 + (size_t)trace->capacity * sizeof(trace_record_t));
+	}
+	buffer_reserve(trace->heap, &trace->dump_block, &trace->dump_block_capacity, 0, needed);
+
+	size_t used = 0;
+	for (uint32_t i = 1; i < (uint32_t)trace->name_count; ++i)
+	{
+		dump_name(trace, i, trace->dump_block, &used);
+	}
+	for (trace_thread_t* thread = trace->threads; thread != NULL; thread = thread->next)
+	{
+		dump_thread(trace, thread, trace->dump_block, &used, cutoff);
+	}
+	symbols_resolve(trace, trace->dump_block, used);
+	symbols_write(trace, &trace->dump_block, &trace->dump_block_capacity, &used, true);
+	mutex_unlock(trace->mutex);
+
+	// The dump is a whole capture file in one write: the header and a single block.
+	trace_file_header_t header = file_header(trace);
+	buffer_reserve(trace->heap, &trace->dump_output, &trace->dump_output_capacity, 0, sizeof(header) + block_bound(used));
+	memcpy(trace->dump_output, &header, sizeof(header));
+	size_t size = sizeof(header) + block_compress(trace->dump_block, used, trace->dump_output + sizeof(header), trace->dump_output_capacity - sizeof(header));
+	trace->pending_dump = fs_write(trace->fs, path, trace->dump_output, size, false);
+
+	mutex_unlock(trace->dump_mutex);
+}
+
+#if defined(_WIN32)
+
+static intptr_t crash_file_open(const char* path)
+{
+	HANDLE file = CreateFileA(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	return file == INVALID_HANDLE_VALUE ? -1 : (intptr_t)file;
+}
+
+static void crash_file_write(intptr_t file, const void* data, size_t size)
+{
+	DWORD written;
+	WriteFile((HANDLE)file, data, (DWORD)size, &written, NULL);
+}
+
+static void crash_file_close(intptr_t file)
+{
+	CloseHandle((HANDLE)file);
+}
+
+#else
+
+static intptr_t crash_file_open(const char* path)
+{
+	return open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+}
+
+static void crash_file_write(intptr_t file, const void* data, size_t size)
+{
+	const char* bytes = data;
+	while (size > 0)
+	{
+		ssize_t written = write((int)file, bytes, size);
+		if (written <= 0)
+		{
+			return;
+		}
+		bytes += written;
+		size -= (size_t)written;
+	}
+}
+
+static void crash_file_close(intptr_t file)
+{
+	close((int)file);
+}
+
+#endif
+
+static void crash_write_block(trace_t* trace, intptr_t file, size_t used)
+{
+	if (used > 0)
+	{
+		size_t size = block_compress(trace->crash_block, used, trace->crash_output, trace->crash_output_capacity);
+		crash_file_write(file, trace->crash_output, size);
+	}
+}
+
+// Dump from a crash handler. The process may have crashed anywhere, holding any lock, so this
+// takes none and allocates nothing: it reads the name table and thread list as they are and
+// writes with the OS directly, one block per thread.
+static void crash_dump(void* data)
+{
+	trace_t* trace = data;
+	intptr_t file = crash_file_open(trace->crash_path);
+	if (file < 0)
+	{
+		return;
+	}
+	trace_file_header_t header = file_header(trace);
+	crash_file_write(file, &header, sizeof(header));
+
+	size_t used = 0;
+	for (uint32_t i = 1; i < (uint32_t)trace->name_count; ++i)
+	{
+		size_t size = chunk_size(4 + strlen(trace->names[i]));
+		if (size > trace->crash_block_capacity)
+		{
+			continue;
+		}
+		if (used + size > trace->crash_block_capacity)
+		{
+			crash_write_block(trace, file, used);
+			used = 0;
+		}
+		dump_name(trace, i, trace->crash_block, &used);
+	}
+	crash_write_block(trace, file, used);
+
+	uint64_t cutoff = dump_cutoff(trace, trace->crash_window);
+	for (trace_thread_t* thread = trace->threads; thread != NULL; thread = thread->next)
+	{
+		used = 0;
+		dump_thread(trace, thread, trace->crash_block, &used, cutoff);
+		crash_write_block(trace, file, used);
+	}
+	crash_file_close(file);
+}
+
+void trace_dump_on_crash(trace_t* trace, const char* path, int seconds)
+{
+	if (trace->crash_block == NULL)
+	{
+		trace->crash_block_capacity = chunk_size(4 + sizeof(((trace_thread_t*)0)->name)) + chunk_size(8 + (size_t)trace->capacity * sizeof(trace_record_t));
+		trace->crash_block = heap_alloc(trace->heap, trace->crash_block_capacity, 8);
+		trace->crash_output_capacity = block_bound(trace->crash_block_capacity);
+		trace->crash_output = heap_alloc(trace->heap, trace->crash_output_capacity, 8);
+	}
+	snprintf(trace->crash_path, sizeof(trace->crash_path), "%s", path);
+	trace->crash_window = trace->ticks_per_second * seconds;
+	debug_set_crash_callback(crash_dump, trace);
+}
+
+// Growable output buffer for conversion.
+typedef struct trace_output_t
+{
+	heap_t* heap;
+	char* data;
+	size_t size;
+	size_t capacity;
+} trace_output_t;
+
+static void output_bytes(trace_output_t* output, const void* data, size_t size)
+{
+	if (size == 0)
+	{
+		return;
+	}
+	buffer_reserve(output->heap, &output->data, &output->capacity, output->size, size);
+	memcpy(output->data + output->size, data, size);
+	output->size += size;
+}
+
+static void output_printf(trace_output_t* output, const char* format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	int length = vsnprintf(NULL, 0, format, args);
+	va_end(args);
+
+	buffer_reserve(output->heap, &output->data, &output->capacity, output->size, (size_t)length + 1);
+	va_start(args, format);
+	vsnprintf(output->data + output->size, (size_t)length + 1, format, args);
+	va_end(args);
+	output->size += length;
+}
+
+static void output_json_string(trace_output_t* output, const char* string, size_t length)
+{
+	output_bytes(output, "\"", 1);
+	for (size_t i = 0; i < length; ++i)
+	{
+		char c = string[i];
+		if (c == '"' || c == '\\')
+		{
+			output_bytes(output, "\\", 1);
+		}
+		if ((unsigned char)c < 0x20)
+		{
+			output_printf(output, "\\u%04x", c);
+			continue;
+		}
+		output_bytes(output, &c, 1);
+	}
+	output_bytes(output, "\"", 1);
+}
+
+// Protocol buffer encoding, for the Perfetto format.
+typedef enum pb_wire_type_t
+{
+	k_pb_varint = 0,
+	k_pb_fixed64 = 1,
+	k_pb_length_delimited = 2,
+} pb_wire_type_t;
+
+static void pb_varint(trace_output_t* output, uint64_t value)
+{
+	uint8_t bytes[10];
+	int count = 0;
+	do
+	{
+		bytes[count++] = (uint8_t)(value & 0x7f) | (value > 0x7f ? 0x80 : 0);
+		value >>= 7;
+	} while (value);
+	output_bytes(output, bytes, count);
+}
+
+static void pb_uint(trace_output_t* output, int field, uint64_t value)
+{
+	pb_varint(output, ((uint64_t)field << 3) | k_pb_varint);
+	pb_varint(output, value);
+}
+
+static void pb_fixed64(trace_output_t* output, int field, uint64_t value)
+{
+	pb_varint(output, ((uint64_t)field << 3) | k_pb_fixed64);
+	uint8_t bytes[8];
+	for (int i = 0; i < 8; ++i)
+	{
+		bytes[i] = (uint8_t)(value >> (i * 8));
+	}
+	output_bytes(output, bytes, sizeof(bytes));
+}
+
+static void pb_bytes(trace_output_t* output, int field, const void* data, size_t size)
+{
+	pb_varint(output, ((uint64_t)field << 3) | k_pb_length_delimited);
+	pb_varint(output, size);
+	output_bytes(output, data, size);
+}
+
+// Field numbers from perfetto/trace/trace_packet.proto and the messages it refers to.
+enum
+{
+	k_pb_trace_packet = 1,
+	k_pb_packet_timestamp = 8,
+	k_pb_packet_sequence_id = 10,
+	k_pb_packet_track_event = 11,
+	k_pb_packet_track_descriptor = 60,
+	k_pb_track_uuid = 1,
+	k_pb_track_name = 2,
+	k_pb_track_thread = 4,
+	k_pb_track_counter = 8,
+	k_pb_thread_pid = 1,
+	k_pb_thread_tid = 2,
+	k_pb_thread_name = 5,
+	k_pb_event_debug_annotations = 4,
+	k_pb_event_type = 9,
+	k_pb_event_track_uuid = 11,
+	k_pb_event_name = 23,
+	k_pb_event_counter_value = 30,
+	k_pb_event_flow_ids = 47,
+	k_pb_event_terminating_flow_ids = 48,
+	k_pb_event_slice_begin = 1,
+	k_pb_event_slice_end = 2,
+	k_pb_event_instant = 3,
+	k_pb_event_counter = 4,
+	k_pb_annotation_uint_value = 3,
+	k_pb_annotation_string_value = 6,
+	k_pb_annotation_name = 10,
+};
+
+typedef struct convert_thread_t
+{
+	int32_t tid;
+	int depth;
+	// Names of the open durations, for the stacks of samples.
+	uint32_t scopes[k_scope_stack_size];
+	// Offset of the thread's name in names, or -1.
+	size_t name_offset;
+} convert_thread_t;
+
+typedef struct convert_counter_t
+{
+	uint32_t name;
+	uint32_t series;
+} convert_counter_t;
+
+typedef struct convert_symbol_t
+{
+	// 0 in an empty slot.
+	uint64_t address;
+	size_t name_offset;
+} convert_symbol_t;
+
+// A distinct stack of the collapsed format, as an offset into stack_strings.
+typedef struct convert_stack_t
+{
+	size_t offset;
+	size_t length;
+	// 0 in an empty slot.
+	uint64_t count;
+} convert_stack_t;
+
+typedef struct convert_t
+{
+	heap_t* heap;
+	trace_format_t format;
+	trace_output_t output;
+	// Scratch for nested Perfetto messages.
+	trace_output_t packet;
+	trace_output_t message;
+	trace_output_t inner;
+	const trace_file_header_t* header;
+	// Name strings by ID, as offsets into names.
+	trace_output_t names;
+	size_t* name_offsets;
+	int name_capacity;
+	convert_thread_t* threads;
+	int thread_count;
+	int thread_capacity;
+	convert_counter_t* counters;
+	int counter_count;
+	int counter_capacity;
+	// Symbols of sample addresses, a hash table with names in names.
+	convert_symbol_t* symbols;
+	int symbol_count;
+	int symbol_capacity;
+	char address_name[32];
+	// Samples are converted once the whole capture is read, as the symbols they need may come
+	// after them. Each is its ticks, thread ID, count of open durations and count of frames,
+	// then the durations' names and the frames' addresses, innermost first.
+	uint64_t* samples;
+	int sample_size;
+	int sample_capacity;
+	// A sample's stack as text, and for the collapsed format, a hash table of distinct stacks.
+	trace_output_t stack;
+	trace_output_t stack_strings;
+	convert_stack_t* stacks;
+	int stack_count;
+	int stack_capacity;
+	const char* separator;
+	uint64_t lost_count;
+} convert_t;
+
+static const char* convert_name(convert_t* convert, uint32_t id)
+{
+	if (id >= (uint32_t)convert->name_capacity || convert->name_offsets[id] == (size_t)-1)
+	{
+		return "?";
+	}
+	return convert->names.data + convert->name_offsets[id];
+}
+
+static uint64_t ticks_to_ns(const convert_t* convert, uint64_t ticks)
+{
+	uint64_t per_second = convert->header->ticks_per_second;
+	return ticks / per_second * 1000000000ull + ticks % per_second * 1000000000ull / per_second;
+}
+
+static void grow_array(heap_t* heap, void** array, int* capacity, int count, size_t element_size)
+{
+	if (count < *capacity)
+	{
+		return;
+	}
+	int new_capacity = *capacity ? *capacity * 2 : 64;
+	void* new_array = heap_alloc(heap, new_capacity * element_size, 8);
+	if (count)
+	{
+		memcpy(new_array, *array, count * element_size);
+	}
+	heap_free(heap, *array);
+	*array = new_array;
+	*capacity = new_capacity;
+}
+
+static convert_thread_t* convert_thread(convert_t* convert, int32_t tid)
+{
+	for (int i = 0; i < convert->thread_count; ++i)
+	{
+		if (convert->threads[i].tid == tid)
+		{
+			return &convert->threads[i];
+		}
+	}
+	grow_array(convert->heap, (void**)&convert->threads, &convert->thread_capacity, convert->thread_count, sizeof(convert_thread_t));
+	convert_thread_t* thread = &convert->threads[convert->thread_count++];
+	thread->tid = tid;
+	thread->depth = 0;
+	thread->name_offset = (size_t)-1;
+	return thread;
+}
+
+// Write the packet built in convert->packet as one entry of the Perfetto trace.
+static void perfetto_emit_packet(convert_t* convert)
+{
+	pb_bytes(&convert->output, k_pb_trace_packet, convert->packet.data, convert->packet.size);
+	convert->packet.size = 0;
+}
+
+static uint64_t thread_track_uuid(int32_t tid)
+{
+	return (1ull << 32) | (uint32_t)tid;
+}
+
+static uint64_t counter_track_uuid(int counter)
+{
+	return (2ull << 32) | (uint32_t)counter;
+}
+
+static void convert_thread_name(convert_t* convert, int32_t tid, const char* name, size_t length)
+{
+	convert_thread_t* thread = convert_thread(convert, tid);
+	if (convert->format == k_trace_format_collapsed)
+	{
+		if (length)
+		{
+			thread->name_offset = convert->names.size;
+			output_bytes(&convert->names, name, length);
+			output_bytes(&convert->names, "", 1);
+		}
+	}
+	else if (convert->format == k_trace_format_chrome_json)
+	{
+		if (length == 0)
+		{
+			return;
+		}
+		output_printf(&convert->output, "%s\t\t{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":",
+			convert->separator, convert->header->pid, tid);
+		output_json_string(&convert->output, name, length);
+		output_bytes(&convert->output, "}}", 2);
+		convert->separator = ",\n";
+	}
+	else
+	{
+		convert->inner.size = 0;
+		pb_uint(&convert->inner, k_pb_thread_pid, (uint64_t)convert->header->pid);
+		pb_uint(&convert->inner, k_pb_thread_tid, (uint64_t)tid);
+		if (length)
+		{
+			pb_bytes(&convert->inner, k_pb_thread_name, name, length);
+		}
+		convert->message.size = 0;
+		pb_uint(&convert->message, k_pb_track_uuid, thread_track_uuid(tid));
+		pb_bytes(&convert->message, k_pb_track_thread, convert->inner.data, convert->inner.size);
+		pb_bytes(&convert->packet, k_pb_packet_track_descriptor, convert->message.data, convert->message.size);
+		perfetto_emit_packet(convert);
+	}
+}
+
+static void convert_counter(convert_t* convert, convert_thread_t* thread, uint64_t ticks, uint32_t name, uint32_t series, int64_t value)
+{
+	if (convert->format == k_trace_format_collapsed)
+	{
+		return;
+	}
+	if (convert->format == k_trace_format_chrome_json)
+	{
+		output_printf(&convert->output, "%s\t\t{\"name\":", convert->separator);
+		const char* name_string = convert_name(convert, name);
+		output_json_string(&convert->output, name_string, strlen(name_string));
+		output_printf(&convert->output, ",\"ph\":\"C\",\"pid\":%d,\"ts\":%.3f,\"args\":{",
+			convert->header->pid, ticks_to_ns(convert, ticks) / 1000.0);
+		const char* series_string = convert_name(convert, series);
+		output_json_string(&convert->output, series_string, strlen(series_string));
+		output_printf(&convert->output, ":%lld}}", (long long)value);
+		convert->separator = ",\n";
+		return;
+	}
+
+	// Each counter series is its own track in Perfetto, described on first use.
+	int counter = 0;
+	while (counter < convert->counter_count &&
+		(convert->counters[counter].name != name || convert->counters[counter].series != series))
+	{
+		counter++;
+	}
+	if (counter == convert->counter_count)
+	{
+		grow_array(convert->heap, (void**)&convert->counters, &convert->counter_capacity, convert->counter_count, sizeof(convert_counter_t));
+		convert->counters[convert->counter_count++] = (convert_counter_t) { name, series };
+
+		convert->inner.size = 0;
+		const char* name_string = convert_name(convert, name);
+		const char* series_string = convert_name(convert, series);
+		output_bytes(&convert->inner, name_string, strlen(name_string));
+		if (strcmp(series_string, k_counter_value) != 0)
+		{
+			output_bytes(&convert->inner, " ", 1);
+			output_bytes(&convert->inner, series_string, strlen(series_string));
+		}
+		convert->message.size = 0;
+		pb_uint(&convert->message, k_pb_track_uuid, counter_track_uuid(counter));
+		pb_bytes(&convert->message, k_pb_track_name, convert->inner.data, convert->inner.size);
+		pb_bytes(&convert->message, k_pb_track_counter, NULL, 0);
+		pb_bytes(&convert->packet, k_pb_packet_track_descriptor, convert->message.data, convert->message.size);
+		perfetto_emit_packet(convert);
+	}
+
+	convert->message.size = 0;
+	pb_uint(&convert->message, k_pb_event_type, k_pb_event_counter);
+	pb_uint(&convert->message, k_pb_event_track_uuid, counter_track_uuid(counter));
+	pb_uint(&convert->message, k_pb_event_counter_value, (uint64_t)value);
+	pb_uint(&convert->packet, k_pb_packet_timestamp, ticks_to_ns(convert, ticks));
+	pb_uint(&convert->packet, k_pb_packet_sequence_id, (uint64_t)(thread - convert->threads) + 1);
+	pb_bytes(&convert->packet, k_pb_packet_track_event, convert->message.data, convert->message.size);
+	perfetto_emit_packet(convert);
+}
+
+// Write a slice begin or end, an instant or a flow event on a thread's track.
+// Flows carry their ID; in Perfetto they are instants the flow arrow attaches to. Ends carry
+// the values after them, the durations' hardware counts, as arguments of their slices.
+static void convert_event(convert_t* convert, convert_thread_t* thread, const trace_record_t* record, uint64_t flow_id,
+	const trace_record_t* args, int arg_count)
+{
+	if (convert->format == k_trace_format_collapsed)
+	{
+		return;
+	}
+	const char* name = convert_name(convert, record->name);
+	if (convert->format == k_trace_format_chrome_json)
+	{
+		output_printf(&convert->output, "%s\t\t{", convert->separator);
+		if (record->phase != k_phase_end)
+		{
+			output_bytes(&convert->output, "\"name\":", 7);
+			output_json_string(&convert->output, name, strlen(name));
+			output_bytes(&convert->output, ",", 1);
+		}
+		if (record->phase == k_phase_instant)
+		{
+			output_bytes(&convert->output, "\"s\":\"t\",", 8);
+		}
+		else if (record->phase == k_phase_flow_begin || record->phase == k_phase_flow_end)
+		{
+			// A flow end binds to the slice it is in rather than the next one.
+			output_printf(&convert->output, "\"cat\":\"flow\",\"id\":%llu,%s", (unsigned long long)flow_id,
+				record->phase == k_phase_flow_end ? "\"bp\":\"e\"," : "");
+		}
+		if (arg_count > 0)
+		{
+			output_bytes(&convert->output, "\"args\":{", 8);
+			for (int i = 0; i < arg_count; ++i)
+			{
+				const char* arg_name = convert_name(convert, args[i].name);
+				output_json_string(&convert->output, arg_name, strlen(arg_name));
+				output_printf(&convert->output, ":%llu%s", (unsigned long long)args[i].ticks, i + 1 < arg_count ? "," : "},");
+			}
+		}
+		output_printf(&convert->output, "\"ph\":\"%c\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f}",
+			(char)record->phase, convert->header->pid, thread->tid, ticks_to_ns(convert, record->ticks) / 1000.0);
+		convert->separator = ",\n";
+		return;
+	}
+
+	convert->message.size = 0;
+	int type = record->phase == k_phase_begin ? k_pb_event_slice_begin :
+		record->phase == k_phase_end ? k_pb_event_slice_end : k_pb_event_instant;
+	pb_uint(&convert->message, k_pb_event_type, type);
+	pb_uint(&convert->message, k_pb_event_track_uuid, thread_track_uuid(thread->tid));
+	if (record->phase != k_phase_end)
+	{
+		pb_bytes(&convert->message, k_pb_event_name, name, strlen(name));
+	}
+	if (record->phase == k_phase_flow_begin)
+	{
+		pb_fixed64(&convert->message, k_pb_event_flow_ids, flow_id);
+	}
+	else if (record->phase == k_phase_flow_end)
+	{
+		pb_fixed64(&convert->message, k_pb_event_terminating_flow_ids, flow_id);
+	}
+	for (int i = 0; i < arg_count; ++i)
+	{
+		const char* arg_name = convert_name(convert, args[i].name);
+		convert->inner.size = 0;
+		pb_bytes(&convert->inner, k_pb_annotation_name, arg_name, strlen(arg_name));
+		pb_uint(&convert->inner, k_pb_annotation_uint_value, args[i].ticks);
+		pb_bytes(&convert->message, k_pb_event_debug_annotations, convert->inner.data, convert->inner.size);
+	}
+	pb_uint(&convert->packet, k_pb_packet_timestamp, ticks_to_ns(convert, record->ticks));
+	pb_uint(&convert->packet, k_pb_packet_sequence_id, (uint64_t)(thread - convert->threads) + 1);
+	pb_bytes(&convert->packet, k_pb_packet_track_event, convert->message.data, convert->message.size);
+	perfetto_emit_packet(convert);
+}
+
+static void convert_symbol_add(convert_t* convert, uint64_t address, const char* name, size_t length)
+{
+	if (address == 0)
+	{
+		return;
+	}
+	if ((convert->symbol_count + 1) * 2 > convert->symbol_capacity)
+	{
+		convert_symbol_t* old_symbols = convert->symbols;
+		int old_capacity = convert->symbol_capacity;
+		convert->symbol_capacity = old_capacity ? old_capacity * 2 : k_initial_symbol_capacity;
+		convert->symbols = heap_alloc(convert->heap, convert->symbol_capacity * sizeof(convert_symbol_t), 8);
+		memset(convert->symbols, 0, convert->symbol_capacity * sizeof(convert_symbol_t));
+		convert->symbol_count = 0;
+		for (int i = 0; i < old_capacity; ++i)
+		{
+			if (old_symbols[i].address != 0)
+			{
+				uint32_t slot = hash_address(old_symbols[i].address) & (convert->symbol_capacity - 1);
+				while (convert->symbols[slot].address != 0)
+				{
+					slot = (slot + 1) & (convert->symbol_capacity - 1);
+				}
+				convert->symbols[slot] = old_symbols[i];
+				convert->symbol_count++;
+			}
+		}
+		heap_free(convert->heap, old_symbols);
+	}
+
+	// Captures write each symbol once, but dumps may repeat them; the first is kept.
+	uint32_t mask = convert->symbol_capacity - 1;
+	uint32_t slot = hash_address(address) & mask;
+	while (convert->symbols[slot].address != 0 && convert->symbols[slot].address != address)
+	{
+		slot = (slot + 1) & mask;
+	}
+	if (convert->symbols[slot].address == 0)
+	{
+		convert->symbols[slot].address = address;
+		convert->symbols[slot].name_offset = convert->names.size;
+		output_bytes(&convert->names, name, length);
+		output_bytes(&convert->names, "", 1);
+		convert->symbol_count++;
+	}
+}
+
+// The name of the function at an address, or the address itself where the capture has no
+// symbol for it, as in crash dumps. Valid until the next call.
+static const char* convert_symbol(convert_t* convert, uint64_t address)
+{
+	if (convert->symbol_capacity > 0)
+	{
+		uint32_t mask = convert->symbol_capacity - 1;
+		for (uint32_t slot = hash_address(address) & mask; convert->symbols[slot].address != 0; slot = (slot + 1) & mask)
+		{
+			if (convert->symbols[slot].address == address)
+			{
+				return convert->names.data + convert->symbols[slot].name_offset;
+			}
+		}
+	}
+	snprintf(convert->address_name, sizeof(convert->address_name), "0x%llx", (unsigned long long)address);
+	return convert->address_name;
+}
+
+static void convert_sample_add(convert_t* convert, convert_thread_t* thread, uint64_t ticks, const uint64_t* frames, int frame_count)
+{
+	int scope_count = thread->depth < k_scope_stack_size ? thread->depth : k_scope_stack_size;
+	int size = 4 + scope_count + frame_count;
+	while (convert->sample_size + size > convert->sample_capacity)
+	{
+		grow_array(convert->heap, (void**)&convert->samples, &convert->sample_capacity, convert->sample_capacity, sizeof(uint64_t));
+	}
+	uint64_t* sample = convert->samples + convert->sample_size;
+	sample[0] = ticks;
+	sample[1] = (uint32_t)thread->tid;
+	sample[2] = (uint64_t)scope_count;
+	sample[3] = (uint64_t)frame_count;
+	for (int i = 0; i < scope_count; ++i)
+	{
+		sample[4 + i] = thread->scopes[i];
+	}
+	memcpy(sample + 4 + scope_count, frames, frame_count * sizeof(uint64_t));
+	convert->sample_size += size;
+}
+
+static uint32_t hash_string(const char* string, size_t length)
+{
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < length; ++i)
+	{
+		hash = (hash ^ (uint8_t)string[i]) * 16777619u;
+	}
+	return hash;
+}
+
+// Count one sample of the stack built in convert->stack.
+static void convert_stack_count(convert_t* convert)
+{
+	if ((convert->stack_count + 1) * 2 > convert->stack_capacity)
+	{
+		convert_stack_t* old_stacks = convert->stacks;
+		int old_capacity = convert->stack_capacity;
+		convert->stack_capacity = old_capacity ? old_capacity * 2 : k_initial_symbol_capacity;
+		convert->stacks = heap_alloc(convert->heap, convert->stack_capacity * sizeof(convert_stack_t), 8);
+		memset(convert->stacks, 0, convert->stack_capacity * sizeof(convert_stack_t));
+		for (int i = 0; i < old_capacity; ++i)
+		{
+			if (old_stacks[i].count != 0)
+			{
+				uint32_t slot = hash_string(convert->stack_strings.data + old_stacks[i].offset, old_stacks[i].length) & (convert->stack_capacity - 1);
+				while (convert->stacks[slot].count != 0)
+				{
+					slot = (slot + 1) & (convert->stack_capacity - 1);
+				}
+				convert->stacks[slot] = old_stacks[i];
+			}
+		}
+		heap_free(convert->heap, old_stacks);
+	}
+
+	const char* string = convert->stack.data;
+	size_t length = convert->stack.size;
+	uint32_t mask = convert->stack_capacity - 1;
+	uint32_t slot = hash_string(string, length) & mask;
+	while (convert->stacks[slot].count != 0)
+	{
+		convert_stack_t* stack = &convert->stacks[slot];
+		if (stack->length == length && memcmp(convert->stack_strings.data + stack->offset, string, length) == 0)
+		{
+			stack->count++;
+			return;
+		}
+		slot = (slot + 1) & mask;
+	}
+	convert->stacks[slot].offset = convert->stack_strings.size;
+	convert->stacks[slot].length = length;
+	convert->stacks[slot].count = 1;
+	output_bytes(&convert->stack_strings, string, length);
+	convert->stack_count++;
+}
+
+// Write a sample as an instant event on its thread's track, with its stack as an argument.
+static void convert_sample_event(convert_t* convert, int32_t tid, uint64_t ticks, const char* name)
+{
+	if (convert->format == k_trace_format_chrome_json)
+	{
+		output_printf(&convert->output, "%s\t\t{\"name\":", convert->separator);
+		output_json_string(&convert->output, name, strlen(name));
+		output_printf(&convert->output, ",\"cat\":\"sample\",\"ph\":\"i\",\"s\":\"t\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"args\":{\"stack\":",
+			convert->header->pid, tid, ticks_to_ns(convert, ticks) / 1000.0);
+		output_json_string(&convert->output, convert->stack.data, convert->stack.size);
+		output_bytes(&convert->output, "}}", 2);
+		convert->separator = ",\n";
+		return;
+	}
+
+	convert_thread_t* thread = convert_thread(convert, tid);
+	convert->message.size = 0;
+	pb_uint(&convert->message, k_pb_event_type, k_pb_event_instant);
+	pb_uint(&convert->message, k_pb_event_track_uuid, thread_track_uuid(tid));
+	pb_bytes(&convert->message, k_pb_event_name, name, strlen(name));
+	convert->inner.size = 0;
+	pb_bytes(&convert->inner, k_pb_annotation_name, "stack", 5);
+	pb_bytes(&convert->inner, k_pb_annotation_string_value, convert->stack.data, convert->stack.size);
+	pb_bytes(&convert->message, k_pb_event_debug_annotations, convert->inner.data, convert->inner.size);
+	pb_uint(&convert->packet, k_pb_packet_timestamp, ticks_to_ns(convert, ticks));
+	pb_uint(&convert->packet, k_pb_packet_sequence_id, (uint64_t)(thread - convert->threads) + 1);
+	pb_bytes(&convert->packet, k_pb_packet_track_event, convert->message.data, convert->message.size);
+	perfetto_emit_packet(convert);
+}
+
+// Write the samples, with stacks from the outermost frame in, separated by semicolons.
+static void convert_samples(convert_t* convert)
+{
+	int size;
+	for (int i = 0; i < convert->sample_size; i += size)
+	{
+		const uint64_t* sample = convert->samples + i;
+		int32_t tid = (int32_t)sample[1];
+		int scope_count = (int)sample[2];
+		int frame_count = (int)sample[3];
+		const uint64_t* frames = sample + 4 + scope_count;
+		size = 4 + scope_count + frame_count;
+		if (frame_count == 0)
+		{
+			continue;
+		}
+
+		convert->stack.size = 0;
+		if (convert->format == k_trace_format_collapsed)
+		{
+			convert_thread_t* thread = convert_thread(convert, tid);
+			if (thread->name_offset != (size_t)-1)
+			{
+				const char* thread_name = convert->names.data + thread->name_offset;
+				output_bytes(&convert->stack, thread_name, strlen(thread_name));
+			}
+			else
+			{
+				output_printf(&convert->stack, "thread %d", tid);
+			}
+			for (int s = 0; s < scope_count; ++s)
+			{
+				const char* scope_name = convert_name(convert, (uint32_t)sample[4 + s]);
+				output_bytes(&convert->stack, ";", 1);
+				output_bytes(&convert->stack, scope_name, strlen(scope_name));
+			}
+			output_bytes(&convert->stack, ";", 1);
+		}
+		for (int f = frame_count - 1; f >= 0; --f)
+		{
+			const char* frame_name = convert_symbol(convert, frames[f]);
+			output_bytes(&convert->stack, frame_name, strlen(frame_name));
+			if (f > 0)
+			{
+				output_bytes(&convert->stack, ";", 1);
+			}
+		}
+
+		if (convert->format == k_trace_format_collapsed)
+		{
+			convert_stack_count(convert);
+		}
+		else
+		{
+			convert_sample_event(convert, tid, sample[0], convert_symbol(convert, frames[0]));
+		}
+	}
+
+	for (int i = 0; i < convert->stack_capacity; ++i)
+	{
+		const convert_stack_t* stack = &convert->stacks[i];
+		if (stack->count != 0)
+		{
+			output_bytes(&convert->output, convert->stack_strings.data + stack->offset, stack->length);
+			output_printf(&convert->output, " %llu\n", (unsigned long long)stack->count);
+		}
+	}
+}
+
+static void convert_records(convert_t* convert, const char* payload, size_t size)
+{
+	int32_t tid;
+	uint32_t lost;
+	memcpy(&tid, payload, sizeof(tid));
+	memcpy(&lost, payload + 4, sizeof(lost));
+	convert->lost_count += lost;
+	int count = (int)((size - 8) / sizeof(trace_record_t));
+
+	// Ends whose begin was lost, and values whose counter, flow or end was, are skipped.
+	trace_record_t args[k_perf_counter_count];
+	for (int i = 0; i < count; ++i)
+	{
+		// The thread array can grow while converting, so look the thread up each time.
+		convert_thread_t* thread = convert_thread(convert, tid);
+		trace_record_t record;
+		memcpy(&record, payload + 8 + i * sizeof(trace_record_t), sizeof(record));
+		bool has_value = record.phase == k_phase_counter || record.phase == k_phase_flow_begin || record.phase == k_phase_flow_end;
+		trace_record_t value = { 0 };
+		if (has_value)
+		{
+			if (i + 1 == count)
+			{
+				break;
+			}
+			memcpy(&value, payload + 8 + ++i * sizeof(trace_record_t), sizeof(value));
+		}
+
+		if (record.phase == k_phase_counter)
+		{
+			convert_counter(convert, thread, record.ticks, record.name, value.name, (int64_t)value.ticks);
+		}
+		else if (record.phase == k_phase_begin)
+		{
+			if (thread->depth < k_scope_stack_size)
+			{
+				thread->scopes[thread->depth] = record.name;
+			}
+			thread->depth++;
+			convert_event(convert, thread, &record, 0, NULL, 0);
+		}
+		else if (record.phase == k_phase_sample)
+		{
+			uint64_t frames[k_sample_max_frames];
+			int frame_count = 0;
+			while (i + 1 < count && frame_count < (int)record.name && frame_count < k_sample_max_frames)
+			{
+				trace_record_t frame;
+				memcpy(&frame, payload + 8 + (i + 1) * sizeof(trace_record_t), sizeof(frame));
+				if (frame.phase != k_phase_value)
+				{
+					break;
+				}
+				frames[frame_count++] = frame.ticks;
+				i++;
+			}
+			convert_sample_add(convert, thread, record.ticks, frames, frame_count);
+		}
+		else if (record.phase == k_phase_end)
+		{
+			int arg_count = 0;
+			while (i + 1 < count && arg_count < k_perf_counter_count)
+			{
+				memcpy(&args[arg_count], payload + 8 + (i + 1) * sizeof(trace_record_t), sizeof(trace_record_t));
+				if (args[arg_count].phase != k_phase_value)
+				{
+					break;
+				}
+				arg_count++;
+				i++;
+			}
+			if (thread->depth > 0)
+			{
+				thread->depth--;
+				convert_event(convert, thread, &record, 0, args, arg_count);
+			}
+		}
+		else if (record.phase == k_phase_instant || has_value)
+		{
+			convert_event(convert, thread, &record, value.ticks, NULL, 0);
+		}
+	}
+}
+
+static bool convert_block(convert_t* convert, const char* block, size_t size)
+{
+	size_t offset = 0;
+	while (offset + sizeof(trace_chunk_header_t) <= size)
+	{
+		trace_chunk_header_t header;
+		memcpy(&header, block + offset, sizeof(header));
+		const char* payload = block + offset + sizeof(header);
+		if (header.size < 4 || chunk_size(header.size) > size - offset)
+		{
+			return false;
+		}
+		offset += chunk_size(header.size);
+
+		int32_t value;
+		memcpy(&value, payload, sizeof(value));
+		if (header.type == k_chunk_name)
+		{
+			uint32_t id = (uint32_t)value;
+			if (id >= k_max_convert_names)
+			{
+				return false;
+			}
+			while (id >= (uint32_t)convert->name_capacity)
+			{
+				int old_capacity = convert->name_capacity;
+				grow_array(convert->heap, (void**)&convert->name_offsets, &convert->name_capacity, old_capacity, sizeof(size_t));
+				memset(convert->name_offsets + old_capacity, 0xff, (convert->name_capacity - old_capacity) * sizeof(size_t));
+			}
+			convert->name_offsets[id] = convert->names.size;
+			output_bytes(&convert->names, payload + 4, header.size - 4);
+			output_bytes(&convert->names, "", 1);
+		}
+		else if (header.type == k_chunk_thread)
+		{
+			convert_thread_name(convert, value, payload + 4, header.size - 4);
+		}
+		else if (header.type == k_chunk_records && header.size >= 8)
+		{
+			convert_records(convert, payload, header.size);
+		}
+		else if (header.type == k_chunk_symbol && header.size >= 8)
+		{
+			uint64_t address;
+			memcpy(&address, payload, sizeof(address));
+			convert_symbol_add(convert, address, payload + 8, header.size - 8);
+		}
+	}
+	return offset == size;
+}
+
+bool trace_convert(heap_t* heap, fs_t* fs, const char* capture_path, const char* output_path, trace_format_t format)
+{
+	fs_work_t* read = fs_read(fs, capture_path, heap, false, false);
+	if (fs_work_get_result(read) != 0)
+	{
+		debug_print(k_print_error, "Unable to read trace capture %s\n", capture_path);
+		fs_work_destroy(read);
+		return false;
+	}
+	const char* data = fs_work_get_buffer(read);
+	size_t size = fs_work_get_size(read);
+
+	convert_t convert = { 0 };
+	convert.heap = heap;
+	convert.format = format;
+	convert.output.heap = heap;
+	convert.packet.heap = heap;
+	convert.message.heap = heap;
+	convert.inner.heap = heap;
+	convert.names.heap = heap;
+	convert.stack.heap = heap;
+	convert.stack_strings.heap = heap;
+	convert.header = (const trace_file_header_t*)data;
+	convert.separator = "";
+
+	bool ok = size >= sizeof(trace_file_header_t) && convert.header->magic == k_capture_magic &&
+		convert.header->version == k_capture_version && convert.header->ticks_per_second != 0;
+	if (format == k_trace_format_chrome_json)
+	{
+		output_printf(&convert.output, "{\n\t\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+	}
+
+	char* block = NULL;
+	size_t block_capacity = 0;
+	size_t offset = sizeof(trace_file_header_t);
+	while (ok && offset + sizeof(trace_block_header_t) <= size)
+	{
+		trace_block_header_t header;
+		memcpy(&header, data + offset, sizeof(header));
+		offset += sizeof(header);
+		if (header.compressed_size > size - offset)
+		{
+			// The last block of a capture cut short by a crash; keep what came before it.
+			debug_print(k_print_warning, "Trace capture %s ends in a partial block\n", capture_path);
+			break;
+		}
+		buffer_reserve(heap, &block, &block_capacity, 0, header.size);
+		int decompressed = LZ4_decompress_safe(data + offset, block, (int)header.compressed_size, (int)header.size);
+		ok = decompressed == (int)header.size && convert_block(&convert, block, header.size);
+		offset += header.compressed_size;
+	}
+
+	if (ok)
+	{
+		convert_samples(&convert);
+	}
+	if (format == k_trace_format_chrome_json)
+	{
+		output_printf(&convert.output, "\n\t]\n}");
+	}
+
+	if (ok)
+	{
+		fs_work_t* write = fs_write(fs, output_path, convert.output.data, convert.output.size, false);
+		ok = fs_work_get_result(write) == 0;
+		fs_work_destroy(write);
+		if (!ok)
+		{
+			debug_print(k_print_error, "Unable to write %s\n", output_path);
+		}
+	}
+	else
+	{
+		debug_print(k_print_error, "Trace capture %s is invalid\n", capture_path);
+	}
+	if (convert.lost_count)
+	{
+		debug_print(k_print_warning, "Trace capture %s lost %llu events to full thread buffers\n",
+			capture_path, (unsigned long long)convert.lost_count);
+	}
 
-	fs_work_t* write_work = fs_write(trace->fs, trace->path, buffer, len, false);
-	fs_work_wait(write_work);
-	heap_free(trace->heap, buffer);
-	heap_free(trace->heap, write_work);
+	heap_free(heap, block);
+	heap_free(heap, convert.stacks);
+	heap_free(heap, convert.stack_strings.data);
+	heap_free(heap, convert.stack.data);
+	heap_free(heap, convert.samples);
+	heap_free(heap, convert.symbols);
+	heap_free(heap, convert.counters);
+	heap_free(heap, convert.threads);
+	heap_free(heap, convert.name_offsets);
+	heap_free(heap, convert.names.data);
+	heap_free(heap, convert.inner.data);
+	heap_free(heap, convert.message.data);
+	heap_free(heap, convert.packet.data);
+	heap_free(heap, convert.output.data);
+	heap_free(heap, fs_work_get_buffer(read));
+	fs_work_destroy(read);
+	return ok;
 }
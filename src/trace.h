@@ -1,11 +1,23 @@
 #pragma once
 
+#include "perf_counters.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct fs_t fs_t;
 typedef struct heap_t heap_t;
 
 typedef struct trace_t trace_t;
 
 // Creates a CPU performance tracing system.
-// Event capacity is the maximum number of durations that can be traced.
+// Each thread records into its own ring of event_capacity events (rounded up to a power of
+// two), registered on its first event; recording takes no lock and touches no shared data.
+// When a ring wraps, the oldest events are overwritten, so a capture keeps the latest events
+// of every thread. Counters take two events, as do the ends of durations with hardware
+// counters, which take one more per counter.
+// Events are stamped with the CPU's timestamp counter where it runs at a constant rate, which
+// is calibrated against the OS timer here over a few milliseconds; elsewhere with the OS timer.
 trace_t* trace_create(heap_t* heap, int event_capacity);
 
 // Destroys a CPU performance tracing system.
@@ -16,11 +28,187 @@ void trace_destroy(trace_t* trace);
 void trace_duration_push(trace_t* trace, const char* name);
 
 // End tracing the currently active duration on the current thread.
+// A NULL trace records nothing, as with the static name variants below.
 void trace_duration_pop(trace_t* trace);
 
+// Record the current value of a named counter.
+// Counters are drawn as graphs in the trace viewer.
+void trace_counter(trace_t* trace, const char* name, int64_t value);
+
+// Record the current value of one series of a named counter.
+// All series recorded under the same counter name are stacked in one graph.
+void trace_counter_series(trace_t* trace, const char* name, const char* series, int64_t value);
+
+// Record a point in time on the current thread, such as a hitch or a state change.
+void trace_instant(trace_t* trace, const char* name);
+
+// Start a flow: an arrow from the current duration on this thread to wherever the flow with
+// the same name and ID ends, for example from producing a frame to consuming it on another
+// thread. IDs only need to be unique among flows in flight.
+void trace_flow_begin(trace_t* trace, const char* name, uint64_t id);
+
+// End a flow started with trace_flow_begin, binding it to the current duration on this thread.
+void trace_flow_end(trace_t* trace, const char* name, uint64_t id);
+
+// A name at one place in the code, kept in static storage by the TRACE_ macros below.
+// The name's ID is cached in it on first use, so recording skips looking the name up.
+typedef struct trace_name_t
+{
+	const char* name;
+	// The ID of the trace the name was last recorded into in the high bits, and the name's ID
+	// in that trace in the low bits.
+	int64_t key;
+} trace_name_t;
+
+// Variants of trace_duration_push, trace_instant and trace_counter for static names.
+// A NULL trace records nothing, so systems can be instrumented whether or not they were
+// given a trace.
+void trace_duration_push_static(trace_t* trace, trace_name_t* name);
+void trace_instant_static(trace_t* trace, trace_name_t* name);
+void trace_counter_static(trace_t* trace, trace_name_t* name, int64_t value);
+
+// Instrumentation macros. The name must be a string literal.
+// Define TRACE_DISABLED to compile them out entirely; the functions above stay available to
+// code that records traces on purpose, such as tools.
+//
+// TRACE_SCOPE traces the statement or block after it:
+//   TRACE_SCOPE(trace, "update")
+//   {
+//     ...
+//   }
+// It declares a static, so it cannot directly follow a case label, and it evaluates trace
+// twice. Leaving the block with break, return or goto skips the end of the duration.
+#if defined(TRACE_DISABLED)
+
+#define TRACE_PUSH(trace, name) ((void)0)
+#define TRACE_POP(trace) ((void)0)
+#define TRACE_SCOPE(trace, name)
+#define TRACE_INSTANT(trace, name) ((void)0)
+#define TRACE_COUNTER(trace, name, value) ((void)0)
+#define TRACE_FLOW_BEGIN(trace, name, id) ((void)0)
+#define TRACE_FLOW_END(trace, name, id) ((void)0)
+
+#else
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+
+#define TRACE_PUSH(trace, name) \
+	do { static trace_name_t s_trace_name = { name, 0 }; trace_duration_push_static((trace), &s_trace_name); } while (0)
+
+#define TRACE_POP(trace) trace_duration_pop(trace)
+
+#define TRACE_SCOPE(trace, name) \
+	static trace_name_t TRACE_CONCAT(s_trace_scope_name_, __LINE__) = { name, 0 }; \
+	for (int TRACE_CONCAT(trace_scope_, __LINE__) = (trace_duration_push_static((trace), &TRACE_CONCAT(s_trace_scope_name_, __LINE__)), 1); \
+		TRACE_CONCAT(trace_scope_, __LINE__); \
+		trace_duration_pop(trace), TRACE_CONCAT(trace_scope_, __LINE__) = 0)
+
+#define TRACE_INSTANT(trace, name) \
+	do { static trace_name_t s_trace_name = { name, 0 }; trace_instant_static((trace), &s_trace_name); } while (0)
+
+#define TRACE_COUNTER(trace, name, value) \
+	do { static trace_name_t s_trace_name = { name, 0 }; trace_counter_static((trace), &s_trace_name, (value)); } while (0)
+
+#define TRACE_FLOW_BEGIN(trace, name, id) \
+	do { trace_t* trace_flow_ = (trace); if (trace_flow_) trace_flow_begin(trace_flow_, name, (id)); } while (0)
+
+#define TRACE_FLOW_END(trace, name, id) \
+	do { trace_t* trace_flow_ = (trace); if (trace_flow_) trace_flow_end(trace_flow_, name, (id)); } while (0)
+
+#endif
+
 // Start recording trace events.
-// A Chrome trace file will be written to path.
+// Events are streamed to a capture file at path as they are recorded: a writer thread moves
+// them out of the threads' rings every few milliseconds and appends them as LZ4 blocks, so
+// a capture can run for as long as the disk allows. Convert it with trace_convert.
 void trace_capture_start(trace_t* trace, const char* path);
 
 // Stop recording trace events.
+// Only what was recorded since the writer's last pass is left to write, so this never stalls
+// for long.
 void trace_capture_stop(trace_t* trace);
+
+// Record continuously as a flight recorder, with no capture file.
+// Each thread's ring keeps its latest events, ready for trace_dump; how far back that reaches
+// depends on how many events the thread records. Captures can be started and stopped while
+// the flight recorder runs.
+void trace_flight_recorder_start(trace_t* trace);
+
+// Stop recording, unless a capture is running.
+void trace_flight_recorder_stop(trace_t* trace);
+
+// Write the events of the last seconds still in the threads' rings to a capture file at path,
+// for trace_convert. Recording carries on meanwhile. The rings are copied and compressed on
+// the calling thread; the file is written in the background, and a dump waits for the write
+// of the one before it.
+void trace_dump(trace_t* trace, const char* path, int seconds);
+
+// Dump the events of the last seconds to a capture file at path if the process crashes.
+// Buffers for the dump are allocated here, as nothing may be allocated once crashed.
+// Replaces any crash callback set with debug_set_crash_callback.
+void trace_dump_on_crash(trace_t* trace, const char* path, int seconds);
+
+// Count hardware events in every duration: cycles, instructions and cache and branch misses,
+// from perf_counters. Each thread opens its counters on its first duration, and reads them
+// when a duration begins and ends, which costs a system call each. The counts in a duration
+// go with its end event, as arguments in the trace viewer, and to trace_scope_times.
+// Returns false, leaving durations as they are, if the calling thread could not open any
+// counter, as where the platform or a virtual machine offers none.
+bool trace_enable_hardware_counters(trace_t* trace);
+
+// Sample the stacks of the threads that record events, hz times a second of each thread's
+// CPU time, to see where time goes outside instrumented durations; the kernel holds rates to
+// its timer tick, often 250 Hz. Threads that record their first event later are sampled from
+// then on. A SIGPROF timer interrupts each thread, which
+// walks its own stack by frame pointers and records the sample in its ring, so build with
+// frame pointers (-fno-omit-frame-pointer); stacks end at code built without them. Each
+// sample takes one event per frame, so sampling shortens how far back rings reach.
+// Addresses are named as samples are written to captures and dumps, from dynamic symbols, so
+// link with -rdynamic to name the executable's own functions; crash dumps keep addresses.
+// Only one trace can be sampled at a time. Returns false where sampling is not available,
+// which is everywhere but Linux.
+bool trace_sampler_start(trace_t* trace, int hz);
+
+// Stop sampling. Waits for samples being taken to finish.
+void trace_sampler_stop(trace_t* trace);
+
+// Time spent in durations of one name, from trace_scope_times.
+typedef struct trace_scope_time_t
+{
+	// Resolve with trace_get_name.
+	uint32_t name;
+	int count;
+	double us;
+	// Hardware events counted in the durations, if enabled with trace_enable_hardware_counters.
+	uint64_t counters[k_perf_counter_count];
+} trace_scope_time_t;
+
+// Add up the time of the durations the calling thread ended since its last call, by name.
+// Nested durations count in full in their own name and in the ones around them. Reads the
+// thread's ring, so it sees only what is recorded, and nothing older than the ring holds.
+// Returns the count of names written to times; names past capacity are left out.
+int trace_scope_times(trace_t* trace, trace_scope_time_t* times, int capacity);
+
+// The name recorded under an ID, or NULL for an unknown ID.
+const char* trace_get_name(trace_t* trace, uint32_t id);
+
+// Output formats of trace_convert.
+typedef enum trace_format_t
+{
+	// JSON for chrome://tracing and ui.perfetto.dev.
+	k_trace_format_chrome_json,
+	// Perfetto's protobuf trace format, for ui.perfetto.dev and trace_processor.
+	k_trace_format_perfetto,
+	// Collapsed stacks of the samples, one line per distinct stack with its count, for flame
+	// graph tools such as flamegraph.pl and speedscope. Each stack starts with the thread's
+	// name and the durations open when it was sampled.
+	k_trace_format_collapsed,
+} trace_format_t;
+
+// Convert a capture file written by trace_capture_start for a trace viewer.
+// In JSON and Perfetto, samples are instant events on their threads, named after the function
+// they were in, with the whole stack as an argument.
+// A capture cut short by a crash converts up to its last complete block.
+// Returns false if the capture could not be read or is invalid, or the output not written.
+bool trace_convert(heap_t* heap, fs_t* fs, const char* capture_path, const char* output_path, trace_format_t format);
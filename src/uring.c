@@ -0,0 +1,201 @@
+#include "uring.h"
+
+#if defined(__linux__)
+
+#include "atomic.h"
+#include "debug.h"
+#include "heap.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#if !defined(SYS_io_uring_setup)
+#define SYS_io_uring_setup 425
+#define SYS_io_uring_enter 426
+#define SYS_io_uring_register 427
+#endif
+
+enum
+{
+	k_uring_probe_ops = 256,
+};
+
+typedef struct uring_t
+{
+	heap_t* heap;
+	int fd;
+
+	void* sq_ring;
+	size_t sq_ring_size;
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned* sq_array;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	struct io_uring_sqe* sqes;
+	size_t sqes_size;
+	// Entries handed out by uring_get_sqe but not yet published to the kernel.
+	unsigned sqe_tail;
+
+	void* cq_ring;
+	size_t cq_ring_size;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe* cqes;
+} uring_t;
+
+uring_t* uring_create(heap_t* heap, unsigned entries)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	int fd = (int)syscall(SYS_io_uring_setup, entries, &params);
+	if (fd < 0)
+	{
+		debug_print(k_print_info, "io_uring unavailable (errno %d)\n", errno);
+		return NULL;
+	}
+
+	uring_t* ring = heap_alloc(heap, sizeof(uring_t), 8);
+	memset(ring, 0, sizeof(*ring));
+	ring->heap = heap;
+	ring->fd = fd;
+
+	ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (single_mmap && ring->cq_ring_size > ring->sq_ring_size)
+	{
+		ring->sq_ring_size = ring->cq_ring_size;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	ring->cq_ring = single_mmap ? ring->sq_ring :
+		mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED)
+	{
+		debug_print(k_print_warning, "io_uring ring mapping failed (errno %d)\n", errno);
+		if (ring->sqes != MAP_FAILED)
+		{
+			munmap(ring->sqes, ring->sqes_size);
+		}
+		if (!single_mmap && ring->cq_ring != MAP_FAILED)
+		{
+			munmap(ring->cq_ring, ring->cq_ring_size);
+		}
+		if (ring->sq_ring != MAP_FAILED)
+		{
+			munmap(ring->sq_ring, ring->sq_ring_size);
+		}
+		close(fd);
+		heap_free(heap, ring);
+		return NULL;
+	}
+
+	char* sq = ring->sq_ring;
+	ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+	ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+	ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+	ring->sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+	ring->sq_entries = *(unsigned*)(sq + params.sq_off.ring_entries);
+	ring->sqe_tail = *ring->sq_tail;
+
+	char* cq = ring->cq_ring;
+	ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+	ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+	ring->cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+	return ring;
+}
+
+void uring_destroy(uring_t* ring)
+{
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring != ring->sq_ring)
+	{
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	}
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+	heap_free(ring->heap, ring);
+}
+
+bool uring_supports_ops(uring_t* ring, const uint8_t* ops, int count)
+{
+	size_t probe_size = sizeof(struct io_uring_probe) + k_uring_probe_ops * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe* probe = heap_alloc(ring->heap, probe_size, 8);
+	memset(probe, 0, probe_size);
+
+	// Kernels before 5.6 have no probe, and also lack the file ops we would ask about.
+	bool supported = syscall(SYS_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, k_uring_probe_ops) >= 0;
+	for (int i = 0; supported && i < count; ++i)
+	{
+		supported = ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+	}
+
+	heap_free(ring->heap, probe);
+	return supported;
+}
+
+unsigned uring_get_capacity(uring_t* ring)
+{
+	return ring->sq_entries;
+}
+
+struct io_uring_sqe* uring_get_sqe(uring_t* ring)
+{
+	unsigned head = (unsigned)atomic_load_acquire((int*)ring->sq_head);
+	if (ring->sqe_tail - head >= ring->sq_entries)
+	{
+		return NULL;
+	}
+	struct io_uring_sqe* sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+	ring->sqe_tail++;
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+int uring_submit(uring_t* ring, unsigned wait_count)
+{
+	// Entries are handed out in ring order, so the index array is the identity mapping.
+	unsigned tail = *ring->sq_tail;
+	unsigned to_submit = ring->sqe_tail - tail;
+	for (; tail != ring->sqe_tail; ++tail)
+	{
+		ring->sq_array[tail & ring->sq_mask] = tail & ring->sq_mask;
+	}
+	atomic_store_release((int*)ring->sq_tail, (int)tail);
+
+	if (to_submit == 0 && wait_count == 0)
+	{
+		return 0;
+	}
+
+	unsigned flags = wait_count ? IORING_ENTER_GETEVENTS : 0;
+	int result;
+	do
+	{
+		result = (int)syscall(SYS_io_uring_enter, ring->fd, to_submit, wait_count, flags, NULL, 0);
+	} while (result < 0 && errno == EINTR);
+	return result < 0 ? -errno : result;
+}
+
+struct io_uring_cqe* uring_peek_cqe(uring_t* ring)
+{
+	unsigned head = *ring->cq_head;
+	unsigned tail = (unsigned)atomic_load_acquire((int*)ring->cq_tail);
+	return head != tail ? &ring->cqes[head & ring->cq_mask] : NULL;
+}
+
+void uring_cqe_seen(uring_t* ring)
+{
+	atomic_store_release((int*)ring->cq_head, (int)(*ring->cq_head + 1));
+}
+
+#endif
@@ -0,0 +1,45 @@
+#pragma once
+
+// Minimal io_uring wrapper over the raw system calls (Linux only).
+// One thread owns a ring: it fills submission entries, submits them in a batch,
+// and reaps completions straight from the shared completion ring.
+
+#if defined(__linux__)
+
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct heap_t heap_t;
+
+// Handle to an io_uring instance.
+typedef struct uring_t uring_t;
+
+// Creates a ring with room for at least entries submissions.
+// Returns NULL if the kernel does not support io_uring or it is disabled.
+uring_t* uring_create(heap_t* heap, unsigned entries);
+
+// Destroys a ring. Operations still in flight are cancelled.
+void uring_destroy(uring_t* ring);
+
+// Returns true if the kernel supports every opcode in ops.
+bool uring_supports_ops(uring_t* ring, const uint8_t* ops, int count);
+
+// Returns the number of submission entries in the ring.
+unsigned uring_get_capacity(uring_t* ring);
+
+// Returns a zeroed submission entry to fill in, or NULL if the submission ring is full.
+// The entry is sent to the kernel by the next uring_submit().
+struct io_uring_sqe* uring_get_sqe(uring_t* ring);
+
+// Submits all filled entries and waits until at least wait_count completions are available.
+// Returns the number of entries submitted, or a negative errno.
+int uring_submit(uring_t* ring, unsigned wait_count);
+
+// Returns the oldest unconsumed completion, or NULL if there is none.
+struct io_uring_cqe* uring_peek_cqe(uring_t* ring);
+
+// Marks the completion returned by uring_peek_cqe() as consumed.
+void uring_cqe_seen(uring_t* ring);
+
+#endif